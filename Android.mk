@@ -30,7 +30,10 @@ include $(BUILD_SHARED_LIBRARY)
 
 include $(CLEAR_VARS)
 LOCAL_MODULE := mflinger
-LOCAL_SRC_FILES := src/mflinger/mflinger.cpp
+LOCAL_SRC_FILES := \
+    src/mflinger/mflinger.cpp \
+    src/mflinger/mqueue.c \
+    src/mflinger/mreceiver.c
 LOCAL_C_INCLUDES := $(LOCAL_PATH)/include
 LOCAL_CFLAGS := -DLOG_TAG=\"mflinger\"
 LOCAL_SHARED_LIBRARIES := \
@@ -0,0 +1,202 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "mlog.h"
+
+#define MAX_RESULTS (128)
+#define MAX_BATCH (1u << 24)
+#define MAX_NOTES (4)
+
+struct bench_result {
+    char name[64];
+    char params[64];
+    uint32_t reps;
+    uint32_t batch;
+    double min_ns;
+    double median_ns;
+    double p99_ns;
+    uint64_t bytes_per_iter;
+    int nnotes;
+    struct {
+        char key[32];
+        double value;
+    } notes[MAX_NOTES];
+};
+
+static struct bench_opts opts;
+static struct bench_result results[MAX_RESULTS];
+static int nresults;
+static char governor[32] = "unknown";
+
+volatile uint32_t bench_sink;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void read_governor(void) {
+    FILE *f = fopen("/sys/devices/system/cpu/cpu0/cpufreq/scaling_governor",
+        "r");
+    if (f == NULL) {
+        return;
+    }
+    if (fgets(governor, sizeof(governor), f) != NULL) {
+        governor[strcspn(governor, "\n")] = '\0';
+    }
+    fclose(f);
+}
+
+void bench_init(const struct bench_opts *o) {
+    opts = *o;
+    if (opts.reps == 0) {
+        opts.reps = 51;
+    }
+    if (opts.sample_us == 0) {
+        opts.sample_us = 200;
+    }
+
+    read_governor();
+
+    /*
+     * Frequency scaling and turbo make numbers drift between runs on
+     * anything but the performance governor, so say so up front.
+     */
+    if (strcmp(governor, "performance") != 0) {
+        MLOGW("cpufreq governor is '%s', not 'performance': expect noise "
+              "from frequency scaling\n", governor);
+    }
+}
+
+int bench_run(const char *name, const char *params,
+        bench_fn fn, void *arg, uint64_t bytes_per_iter) {
+    if (opts.filter != NULL && strstr(name, opts.filter) == NULL) {
+        return 1;
+    }
+    if (nresults >= MAX_RESULTS) {
+        MLOGE("too many benchmarks\n");
+        return -1;
+    }
+
+    /* warm caches and clocks while growing the batch to the sample size */
+    uint32_t batch = 1;
+    uint64_t warmup_end = now_ns() + opts.warmup_ms * 1000000ull;
+    for (;;) {
+        uint64_t start = now_ns();
+        fn(arg, batch);
+        uint64_t elapsed = now_ns() - start;
+
+        if (elapsed < opts.sample_us * 1000ull && batch < MAX_BATCH) {
+            batch *= 2;
+        } else if (now_ns() >= warmup_end) {
+            break;
+        }
+    }
+
+    double *samples = malloc(opts.reps * sizeof(*samples));
+    if (samples == NULL) {
+        return -1;
+    }
+
+    uint32_t i;
+    for (i = 0; i < opts.reps; ++i) {
+        uint64_t start = now_ns();
+        fn(arg, batch);
+        samples[i] = (double)(now_ns() - start) / batch;
+    }
+    qsort(samples, opts.reps, sizeof(*samples), compare_double);
+
+    struct bench_result *r = &results[nresults++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    snprintf(r->params, sizeof(r->params), "%s", params);
+    r->reps = opts.reps;
+    r->batch = batch;
+    r->min_ns = samples[0];
+    r->median_ns = samples[opts.reps / 2];
+    r->p99_ns = samples[(opts.reps * 99 + 99) / 100 - 1];
+    r->bytes_per_iter = bytes_per_iter;
+    r->nnotes = 0;
+    free(samples);
+
+    fprintf(stderr, "%-24s %-24s median %12.1f ns  p99 %12.1f ns",
+        r->name, r->params, r->median_ns, r->p99_ns);
+    if (bytes_per_iter > 0) {
+        fprintf(stderr, "  %8.1f MB/s", bytes_per_iter / r->median_ns * 1e3);
+    }
+    fprintf(stderr, "\n");
+
+    return 0;
+}
+
+void bench_note(const char *key, double value) {
+    if (nresults == 0) {
+        return;
+    }
+
+    struct bench_result *r = &results[nresults - 1];
+    if (r->nnotes < MAX_NOTES) {
+        snprintf(r->notes[r->nnotes].key, sizeof(r->notes[0].key), "%s", key);
+        r->notes[r->nnotes].value = value;
+        r->nnotes++;
+    }
+    fprintf(stderr, "%-24s %-24s %s = %.2f\n", r->name, r->params, key, value);
+}
+
+int bench_write_json(FILE *out) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"label\": \"%s\",\n", opts.label ? opts.label : "");
+    fprintf(out, "  \"cpus\": %ld,\n", sysconf(_SC_NPROCESSORS_ONLN));
+    fprintf(out, "  \"governor\": \"%s\",\n", governor);
+    fprintf(out, "  \"reps\": %u,\n", opts.reps);
+    fprintf(out, "  \"results\": [\n");
+
+    int i;
+    for (i = 0; i < nresults; ++i) {
+        const struct bench_result *r = &results[i];
+        fprintf(out, "    { \"name\": \"%s\", \"params\": \"%s\", "
+                "\"batch\": %u, \"min_ns\": %.1f, \"median_ns\": %.1f, "
+                "\"p99_ns\": %.1f",
+            r->name, r->params, r->batch,
+            r->min_ns, r->median_ns, r->p99_ns);
+        if (r->bytes_per_iter > 0) {
+            fprintf(out, ", \"mb_per_s\": %.1f",
+                r->bytes_per_iter / r->median_ns * 1e3);
+        }
+        int j;
+        for (j = 0; j < r->nnotes; ++j) {
+            fprintf(out, ", \"%s\": %.2f", r->notes[j].key, r->notes[j].value);
+        }
+        fprintf(out, " }%s\n", i + 1 < nresults ? "," : "");
+    }
+
+    fprintf(out, "  ]\n");
+    fprintf(out, "}\n");
+    return ferror(out) ? -1 : 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_BENCH_H
+#define M_BENCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Tiny timing harness for micro-benchmarks.
+ *
+ * Every benchmark is warmed up while the harness picks a batch size
+ * that makes one sample take long enough to time reliably, then timed
+ * for a number of samples. Each sample is the average time of one
+ * iteration within its batch; median and p99 are taken over samples.
+ */
+
+/**
+ * Run @param iters iterations of the thing being measured.
+ */
+typedef void (*bench_fn)(void *arg, uint32_t iters);
+
+struct bench_opts {
+    uint32_t reps;              /* samples per benchmark */
+    uint32_t warmup_ms;
+    uint32_t sample_us;         /* target duration of one sample */
+    const char *filter;         /* only run names containing this */
+    const char *label;          /* free-form run label, e.g. git describe */
+};
+
+void bench_init(const struct bench_opts *opts);
+
+/**
+ * Time @param fn and record the result.
+ *
+ * @param bytes_per_iter data touched by one iteration, for
+ * throughput, or 0 if that makes no sense
+ *
+ * @return 0 on success, 1 if filtered out, -1 on error
+ */
+int bench_run(const char *name, const char *params,
+        bench_fn fn, void *arg, uint64_t bytes_per_iter);
+
+/**
+ * Attach an extra metric (e.g. syscalls per request) to the
+ * result of the last bench_run().
+ */
+void bench_note(const char *key, double value);
+
+/**
+ * Write all recorded results as JSON.
+ */
+int bench_write_json(FILE *out);
+
+/* keep the compiler from optimizing measured work away */
+extern volatile uint32_t bench_sink;
+
+#endif // M_BENCH_H
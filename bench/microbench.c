@@ -0,0 +1,634 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <X11/Xlib.h>
+#include <X11/extensions/Xfixes.h>
+
+#include "mlib.h"
+#include "mlib-protocol.h"
+#include "mlog.h"
+
+#include "../src/mclient/mcursor_cache.h"
+#include "../src/mclient/pixel.h"
+#include "../src/mclient/ximage.h"
+#include "../src/mflinger/mreceiver.h"
+
+#include "bench.h"
+
+/*
+ * Micro-benchmarks for mclient hot paths.
+ *
+ * None of these talk to an X server or mflinger: images and buffers are
+ * plain heap memory and the protocol runs over a local socketpair.
+ *
+ *   ./bench/microbench [-r reps] [-w warmup_ms] [-f filter] [-o out.json]
+ */
+
+//
+// XImage -> MBuffer row copies
+//
+struct copy_args {
+    XImage ximg;
+    MBuffer buf;
+};
+
+static void bench_copy_rows(void *arg, uint32_t iters) {
+    struct copy_args *a = arg;
+    while (iters--) {
+        copy_ximg_to_buffer_mlocked(&a->buf, &a->ximg);
+    }
+    bench_sink += ((uint32_t *)a->buf.bits)[0];
+}
+
+static void bench_copy_rows_opaque(void *arg, uint32_t iters) {
+    struct copy_args *a = arg;
+    while (iters--) {
+        copy_ximg_to_buffer_opaque_mlocked(&a->buf, &a->ximg);
+    }
+    bench_sink += ((uint32_t *)a->buf.bits)[0];
+}
+
+/*
+ * The copy half of a banded capture: the band image is reused for
+ * every band, so unlike a full-frame copy its source stays in cache.
+ */
+#define BENCH_BAND_ROWS (64)
+
+static void bench_copy_bands(void *arg, uint32_t iters) {
+    struct copy_args *a = arg;
+    XImage band = a->ximg;
+    band.height = BENCH_BAND_ROWS;
+
+    while (iters--) {
+        uint32_t y;
+        for (y = 0; y < a->buf.height; y += BENCH_BAND_ROWS) {
+            uint32_t rows = a->buf.height - y;
+            copy_ximg_band_to_buffer_mlocked(&a->buf, &band, 0, y,
+                rows < BENCH_BAND_ROWS ? rows : BENCH_BAND_ROWS, 1);
+        }
+    }
+    bench_sink += ((uint32_t *)a->buf.bits)[0];
+}
+
+static void run_copy_benchmarks(void) {
+    static const uint32_t sizes[][2] = {
+        { 1280, 720 }, { 1920, 1080 }, { 2560, 1440 },
+    };
+    /* gralloc usually pads the stride, XShm images usually don't */
+    static const uint32_t stride_pads[] = { 0, 64 };
+
+    int i, j;
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        for (j = 0; j < sizeof(stride_pads) / sizeof(stride_pads[0]); ++j) {
+            struct copy_args a;
+            memset(&a, 0, sizeof(a));
+
+            a.ximg.width = sizes[i][0];
+            a.ximg.height = sizes[i][1];
+            a.ximg.bits_per_pixel = 32;
+            a.ximg.red_mask = 0xff0000;
+            a.ximg.green_mask = 0x00ff00;
+            a.ximg.blue_mask = 0x0000ff;
+            a.ximg.bytes_per_line = sizes[i][0] * 4;
+            a.ximg.data = malloc(a.ximg.bytes_per_line * a.ximg.height);
+
+            a.buf.width = sizes[i][0];
+            a.buf.height = sizes[i][1];
+            a.buf.stride = sizes[i][0] + stride_pads[j];
+            a.buf.bits = malloc(a.buf.stride * a.buf.height * 4);
+
+            if (a.ximg.data == NULL || a.buf.bits == NULL) {
+                MLOGE("out of memory\n");
+                free(a.ximg.data);
+                free(a.buf.bits);
+                return;
+            }
+            memset(a.ximg.data, 0x5a, a.ximg.bytes_per_line * a.ximg.height);
+
+            char params[64];
+            snprintf(params, sizeof(params), "%ux%u stride=%u",
+                a.buf.width, a.buf.height, a.buf.stride);
+
+            uint64_t bytes = (uint64_t)a.ximg.width * a.ximg.height * 4;
+            bench_run("copy_ximg_rows", params, bench_copy_rows, &a, bytes);
+            bench_run("copy_ximg_opaque", params,
+                bench_copy_rows_opaque, &a, bytes);
+            bench_run("copy_ximg_bands", params, bench_copy_bands, &a, bytes);
+
+            free(a.ximg.data);
+            free(a.buf.bits);
+        }
+    }
+}
+
+//
+// X visual -> surface format row conversion
+//
+struct convert_args {
+    struct PixelConverter conv;
+    void *src;
+    uint32_t *dst;
+    uint32_t width;
+    uint32_t height;
+};
+
+static void bench_convert(void *arg, uint32_t iters) {
+    struct convert_args *a = arg;
+    uint32_t src_stride = a->width * a->conv.bytes_per_pixel;
+    while (iters--) {
+        uint32_t y;
+        for (y = 0; y < a->height; ++y) {
+            pixel_convert(&a->conv, a->dst + y * a->width,
+                (uint8_t *)a->src + y * src_stride, a->width);
+        }
+    }
+    bench_sink += a->dst[0];
+}
+
+static void run_convert_benchmarks(void) {
+    static const uint32_t layouts[][4] = {
+        { 32, 0xff0000, 0x00ff00, 0x0000ff },
+        { 32, 0x0000ff, 0x00ff00, 0xff0000 },
+        { 24, 0xff0000, 0x00ff00, 0x0000ff },
+        { 16, 0xf800, 0x07e0, 0x001f },
+        { 32, 0x3ff00000, 0x000ffc00, 0x000003ff },
+    };
+
+    struct convert_args a;
+    a.width = 1920;
+    a.height = 1080;
+    a.src = malloc(a.width * a.height * 4);
+    a.dst = malloc(a.width * a.height * 4);
+    if (a.src == NULL || a.dst == NULL) {
+        MLOGE("out of memory\n");
+        free(a.src);
+        free(a.dst);
+        return;
+    }
+    memset(a.src, 0x5a, a.width * a.height * 4);
+
+    int i;
+    for (i = 0; i < sizeof(layouts) / sizeof(layouts[0]); ++i) {
+        if (pixel_converter_init(&a.conv, layouts[i][0],
+                layouts[i][1], layouts[i][2], layouts[i][3]) < 0) {
+            continue;
+        }
+
+        char params[64];
+        snprintf(params, sizeof(params), "%s %ux%u",
+            a.conv.name, a.width, a.height);
+        bench_run("convert_rows", params, bench_convert, &a,
+            (uint64_t)a.width * a.height * 4);
+    }
+
+    free(a.src);
+    free(a.dst);
+}
+
+//
+// XFixes cursor -> MBuffer conversion
+//
+struct cursor_args {
+    unsigned long *pixels;
+    uint32_t size;
+    uint8_t *bits;
+    uint32_t stride;
+};
+
+static void bench_copy_cursor(void *arg, uint32_t iters) {
+    struct cursor_args *a = arg;
+    while (iters--) {
+        copy_cursor_32(a->bits, a->stride, a->size, a->size,
+            a->pixels, a->size, a->size);
+    }
+    bench_sink += a->bits[0];
+}
+
+static void run_cursor_benchmarks(void) {
+    static const uint32_t sizes[] = { 24, 32, 64, 128 };
+
+    int i;
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        struct cursor_args a;
+        a.size = sizes[i];
+        a.stride = a.size * 4;
+        a.pixels = malloc(a.size * a.size * sizeof(*a.pixels));
+        a.bits = malloc(a.size * a.stride);
+        if (a.pixels == NULL || a.bits == NULL) {
+            MLOGE("out of memory\n");
+            free(a.pixels);
+            free(a.bits);
+            return;
+        }
+
+        /* roughly the mix of a pointer: a solid shape in a clear box */
+        uint32_t p;
+        for (p = 0; p < a.size * a.size; ++p) {
+            a.pixels[p] = (p % a.size) < a.size / 2 ? 0xff202020 : 0x00000000;
+        }
+
+        char params[64];
+        snprintf(params, sizeof(params), "%ux%u", a.size, a.size);
+        bench_run("copy_cursor", params, bench_copy_cursor, &a,
+            (uint64_t)a.size * a.size * 4);
+
+        free(a.pixels);
+        free(a.bits);
+    }
+}
+
+//
+// Cursor cache lookups
+//
+
+/* mirrors CURSOR_CACHE_SIZE in mcursor_cache.c */
+#define BENCH_CURSORS (36)
+
+static XFixesCursorImage cursors[BENCH_CURSORS];
+
+static void bench_cache_get(void *arg, uint32_t iters) {
+    unsigned long serial = *(unsigned long *)arg;
+    while (iters--) {
+        bench_sink += cursor_cache_get(serial) != NULL;
+    }
+}
+
+/* what the motion thread pays per event to read the current cursor */
+static void bench_cursor_state(void *arg, uint32_t iters) {
+    struct CursorState state;
+    while (iters--) {
+        cursor_cache_get_state(&state);
+        bench_sink += state.x;
+    }
+}
+
+static void run_cache_benchmarks(void) {
+    int i;
+    for (i = 0; i < BENCH_CURSORS; ++i) {
+        cursors[i].cursor_serial = 1000 + i;
+        cursor_cache_add(&cursors[i]);
+    }
+
+    unsigned long first = cursors[0].cursor_serial;
+    unsigned long last = cursors[BENCH_CURSORS - 1].cursor_serial;
+    unsigned long missing = 1;
+
+    bench_run("cursor_cache_get", "hit first", bench_cache_get, &first, 0);
+    bench_run("cursor_cache_get", "hit last", bench_cache_get, &last, 0);
+    bench_run("cursor_cache_get", "miss", bench_cache_get, &missing, 0);
+
+    cursor_cache_set_cur(&cursors[0]);
+    bench_run("cursor_cache_get_state", "uncontended", bench_cursor_state,
+        NULL, 0);
+    cursor_cache_set_cur(NULL);
+
+    /* the cache never owned these, so no cursor_cache_free() */
+}
+
+//
+// Protocol encode/decode over a socketpair
+//
+struct proto_args {
+    MDisplay dpy;
+    MBuffer buf;
+    int server_fd;
+    int buffer_fd;              /* stands in for the gralloc buffer */
+    uint32_t generation;        /* last buffer registration sent */
+    int register_every_frame;   /* 1 = send the fd with every lock */
+};
+
+/* a cursor-sized buffer keeps the mmap cost in proportion */
+#define PROTO_BUFFER_DIM (64)
+
+/**
+ * Queue up a reply the way mflinger sends it, with @param fd
+ * attached unless it is -1.
+ */
+static void queue_reply(struct proto_args *a, const void *data, int len,
+        int fd) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } u;
+    MMessageHeader header = { M_REPLY };
+    struct iovec iov[2] = {
+        { &header, sizeof(header) },
+        { (void *)data, len },
+    };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    if (fd >= 0) {
+        msg.msg_control = u.buf;
+        msg.msg_controllen = sizeof(u.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    sendmsg(a->server_fd, &msg, 0);
+}
+
+/**
+ * Client sends MUpdateBuffer, server side reads it the way mflinger does.
+ */
+static void bench_update_buffer(void *arg, uint32_t iters) {
+    struct proto_args *a = arg;
+    while (iters--) {
+        MUpdateBuffer(&a->dpy, &a->buf, 10, 20);
+
+        MRequestHeader header;
+        MUpdateBufferRequest request;
+        read(a->server_fd, &header, sizeof(header));
+        read(a->server_fd, &request, sizeof(request));
+        bench_sink += request.xpos;
+    }
+}
+
+/**
+ * Full request/response round trip. The response is queued up
+ * front so this measures encode/decode, not the scheduler.
+ */
+static void bench_scale_buffer(void *arg, uint32_t iters) {
+    struct proto_args *a = arg;
+    while (iters--) {
+        MScaleBufferResponse response = { 0 };
+        queue_reply(a, &response, sizeof(response), -1);
+
+        MScaleBuffer(&a->dpy, &a->buf, 1920, 1080);
+
+        MRequestHeader header;
+        MScaleBufferRequest request;
+        read(a->server_fd, &header, sizeof(header));
+        read(a->server_fd, &request, sizeof(request));
+        bench_sink += request.width;
+    }
+}
+
+/**
+ * Queue up a lock response for slot 0, as mflinger sends it for
+ * M_LOCK_BUFFER and M_SWAP_BUFFER. The buffer fd only goes along
+ * the first time unless register_every_frame is set, which is what
+ * every lock cost before slots were registered once.
+ */
+static void queue_locked_buffer(struct proto_args *a) {
+    MLockBufferResponse response;
+    memset(&response, 0, sizeof(response));
+    response.width = response.stride = PROTO_BUFFER_DIM;
+    response.height = PROTO_BUFFER_DIM;
+    response.slot = 0;
+
+    if (a->generation != 0 && !a->register_every_frame) {
+        response.generation = a->generation;
+        queue_reply(a, &response, sizeof(response), -1);
+        return;
+    }
+    response.generation = ++a->generation;
+    response.has_fd = 1;
+    queue_reply(a, &response, sizeof(response), a->buffer_fd);
+}
+
+/**
+ * Read one request with a @param size byte payload off the server end.
+ */
+static void drain_request(struct proto_args *a, size_t size) {
+    uint8_t bytes[64];
+    read(a->server_fd, bytes, sizeof(MRequestHeader) + size);
+}
+
+/**
+ * A frame the old way: post with MUnlockBuffer, lock with MLockBuffer.
+ */
+static void bench_unlock_lock(void *arg, uint32_t iters) {
+    struct proto_args *a = arg;
+    while (iters--) {
+        MUnlockBuffer(&a->dpy, &a->buf);
+        queue_locked_buffer(a);
+        MLockBuffer(&a->dpy, &a->buf);
+        drain_request(a, sizeof(MUnlockBufferRequest));
+        drain_request(a, sizeof(MLockBufferRequest));
+
+        /* a frame touches the buffer, which faults in fresh mappings */
+        memset(a->buf.bits, 0, PROTO_BUFFER_DIM * PROTO_BUFFER_DIM * 4);
+    }
+}
+
+static void bench_swap(void *arg, uint32_t iters) {
+    struct proto_args *a = arg;
+    while (iters--) {
+        queue_locked_buffer(a);
+        MSwapBuffer(&a->dpy, &a->buf);
+        drain_request(a, sizeof(MSwapBufferRequest));
+        memset(a->buf.bits, 0, PROTO_BUFFER_DIM * PROTO_BUFFER_DIM * 4);
+    }
+}
+
+static void run_protocol_benchmarks(void) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        MLOGE("error creating socketpair\n");
+        return;
+    }
+
+    struct proto_args a;
+    memset(&a, 0, sizeof(a));
+    a.dpy.sock_fd = sv[0];
+    a.buf.__id = 1;
+    a.server_fd = sv[1];
+
+    bench_run("protocol", "update_buffer", bench_update_buffer, &a, 0);
+    bench_run("protocol", "scale_buffer", bench_scale_buffer, &a, 0);
+
+    a.buffer_fd = memfd_create("microbench", MFD_CLOEXEC);
+    if (a.buffer_fd < 0 || ftruncate(a.buffer_fd,
+            PROTO_BUFFER_DIM * PROTO_BUFFER_DIM * 4) < 0) {
+        MLOGE("error creating buffer memfd\n");
+    } else {
+        /* both frame loops start with a locked buffer */
+        a.buf.width = a.buf.height = PROTO_BUFFER_DIM;
+        queue_locked_buffer(&a);
+        MLockBuffer(&a.dpy, &a.buf);
+        drain_request(&a, sizeof(MLockBufferRequest));
+
+        bench_run("protocol", "unlock+lock", bench_unlock_lock, &a, 0);
+        bench_run("protocol", "swap_buffer", bench_swap, &a, 0);
+
+        a.register_every_frame = 1;
+        bench_run("protocol", "swap_buffer fd/frame", bench_swap, &a, 0);
+
+        MUnlockBuffer(&a.dpy, &a.buf);
+        MDestroyBuffer(&a.dpy, &a.buf);
+        drain_request(&a, sizeof(MUnlockBufferRequest));
+        drain_request(&a, sizeof(MDestroyBufferRequest));
+        close(a.buffer_fd);
+    }
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+//
+// Server-side request intake during a cursor flood
+//
+
+/* cursor updates queued up while the server was busy compositing */
+#define FLOOD_REQUESTS (64)
+
+struct receive_args {
+    MDisplay dpy;
+    MBuffer buf;
+    int server_fd;
+    struct MReceiver receiver;
+    uint64_t syscalls;
+    uint64_t requests;
+};
+
+static void send_flood(struct receive_args *a) {
+    int i;
+    for (i = 0; i < FLOOD_REQUESTS; ++i) {
+        MUpdateBuffer(&a->dpy, &a->buf, i, i);
+    }
+}
+
+/**
+ * One read() for the opcode and one for the payload, like serve()
+ * used to do.
+ */
+static void bench_receive_legacy(void *arg, uint32_t iters) {
+    struct receive_args *a = arg;
+    while (iters--) {
+        send_flood(a);
+
+        int i;
+        for (i = 0; i < FLOOD_REQUESTS; ++i) {
+            MRequestHeader header;
+            MUpdateBufferRequest request;
+            read(a->server_fd, &header, sizeof(header));
+            read(a->server_fd, &request, sizeof(request));
+            bench_sink += request.xpos;
+        }
+        a->syscalls += 2 * FLOOD_REQUESTS;
+        a->requests += FLOOD_REQUESTS;
+    }
+}
+
+static void bench_receive_buffered(void *arg, uint32_t iters) {
+    struct receive_args *a = arg;
+    while (iters--) {
+        send_flood(a);
+
+        uint64_t syscalls = a->receiver.syscalls;
+        int received = 0;
+        while (received < FLOOD_REQUESTS) {
+            mreceiver_fill(&a->receiver);
+
+            uint32_t op;
+            const void *payload;
+            while (mreceiver_next(&a->receiver, &op, &payload) > 0) {
+                bench_sink += ((const MUpdateBufferRequest *)payload)->xpos;
+                received++;
+            }
+        }
+        a->syscalls += a->receiver.syscalls - syscalls;
+        a->requests += received;
+    }
+}
+
+static void run_receive_benchmarks(void) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        MLOGE("error creating socketpair\n");
+        return;
+    }
+
+    static struct receive_args a;
+    memset(&a, 0, sizeof(a));
+    a.dpy.sock_fd = sv[0];
+    a.buf.__id = 1;
+    a.server_fd = sv[1];
+    mreceiver_init(&a.receiver, sv[1]);
+
+    char params[64];
+    snprintf(params, sizeof(params), "legacy x%d", FLOOD_REQUESTS);
+    if (bench_run("server_receive", params, bench_receive_legacy, &a, 0) == 0) {
+        bench_note("syscalls_per_request", (double)a.syscalls / a.requests);
+    }
+
+    a.syscalls = a.requests = 0;
+    snprintf(params, sizeof(params), "buffered x%d", FLOOD_REQUESTS);
+    if (bench_run("server_receive", params,
+            bench_receive_buffered, &a, 0) == 0) {
+        bench_note("syscalls_per_request", (double)a.syscalls / a.requests);
+    }
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+int main(int argc, char **argv) {
+    struct bench_opts opts = { 0 };
+    opts.warmup_ms = 100;
+    const char *out_path = NULL;
+
+    int c;
+    while ((c = getopt(argc, argv, "r:w:f:l:o:")) != -1) {
+        switch (c) {
+            case 'r': opts.reps = strtoul(optarg, NULL, 10); break;
+            case 'w': opts.warmup_ms = strtoul(optarg, NULL, 10); break;
+            case 'f': opts.filter = optarg; break;
+            case 'l': opts.label = optarg; break;
+            case 'o': out_path = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-r reps] [-w warmup_ms] "
+                    "[-f filter] [-l label] [-o out.json]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    bench_init(&opts);
+
+    run_copy_benchmarks();
+    run_convert_benchmarks();
+    run_cursor_benchmarks();
+    run_cache_benchmarks();
+    run_protocol_benchmarks();
+    run_receive_benchmarks();
+
+    FILE *out = stdout;
+    if (out_path != NULL && (out = fopen(out_path, "w")) == NULL) {
+        MLOGE("error opening %s\n", out_path);
+        return 1;
+    }
+    int err = bench_write_json(out);
+    if (out != stdout) {
+        fclose(out);
+    }
+    return err ? 1 : 0;
+}
@@ -0,0 +1,772 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "mlib.h"
+#include "mlib-protocol.h"
+#include "mlog.h"
+
+#include "../src/mflinger/mreceiver.h"
+
+/*
+ * Stand-in for mflinger on a plain Linux box.
+ *
+ * Speaks the same protocol on the same abstract socket, but buffers
+ * are memfds and "posting" one only bumps a counter. This is enough
+ * to run mclient (or bench/replay) under Xvfb and measure the client
+ * side of the pipeline without an Android device.
+ *
+ *   ./bench/mockflinger [-w width] [-h height] [-o orientation]
+ *                       [-d displays] [-r hz] [-1]
+ *
+ * -d lists that many identical displays (1 by default) for clients
+ * that put buffers on more than one.
+ *
+ * -o pretends the panel is rotated by M_ORIENTATION_* (0-3), which
+ * only swaps the reported size since nothing is composited here.
+ * SIGUSR1 turns every display another quarter turn and sends
+ * M_DISPLAY_CHANGED to a client that selected it.
+ *
+ * -1 exits after the first client disconnects, which is what the
+ * benchmark scripts want.
+ *
+ * The surfaces of a client that disconnects without ending its session
+ * are kept for the next client to resume, without a time limit.
+ *
+ * M_FRAME_PRESENTED events come from a simulated -r Hz vsync clock
+ * (60 by default): a post is "on screen" one vsync after the first
+ * vsync that follows it, same as mflinger's estimate.
+ *
+ * Server-side blits (M_BLIT_BUFFER) really copy the rects from the
+ * shared capture into the surface's memfd, since that copy is what
+ * moved from the client to the server. There is one buffer per
+ * surface, so unlike mflinger there are no missed frames to catch up.
+ */
+
+#define MAX_SURFACES (64)
+#define MAX_PENDING_FRAMES (16)
+
+struct mock_surface {
+    int fd;                 /* -1 while the slot is free */
+    uint8_t *bits;          /* mapped for blits, NULL until the first */
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t generation;    /* of the current memfd, 0 = not sent yet */
+    uint32_t next_generation;
+    uint32_t event_mask;
+};
+
+struct mock_pending_frame {
+    int32_t id;
+    uint64_t present_ns;
+};
+
+struct mock_state {
+    uint32_t display_width;
+    uint32_t display_height;
+    uint32_t orientation;       /* M_ORIENTATION_* */
+    uint32_t num_displays;
+    uint32_t display_event_mask;
+    struct mock_surface surfaces[MAX_SURFACES];
+    uint64_t session_token;     /* 0 = client has no session */
+    int session_kept;           /* surfaces are left from the last client */
+
+    uint64_t vsync_epoch;       /* ns, time of some vsync */
+    uint64_t refresh_ns;
+    struct mock_pending_frame pending[MAX_PENDING_FRAMES];
+    int num_pending;
+
+    /* shared for server-side blits, NULL = none */
+    const uint8_t *capture;
+    size_t capture_size;
+    uint32_t capture_width;
+    uint32_t capture_height;
+    uint32_t capture_stride;    /* in bytes */
+
+    /* per-client counters */
+    uint64_t requests;
+    uint64_t posts;
+    uint64_t bytes_posted;
+    uint64_t blits;
+    uint64_t bytes_blitted;
+};
+
+static struct mock_surface *lookup_surface(struct mock_state *state,
+        int32_t id) {
+    if (id <= 0 || id > MAX_SURFACES || state->surfaces[id - 1].fd < 0) {
+        return NULL;
+    }
+    return &state->surfaces[id - 1];
+}
+
+static void free_backing(struct mock_surface *ms) {
+    if (ms->bits != NULL) {
+        munmap(ms->bits, (size_t)ms->stride * ms->height * 4);
+        ms->bits = NULL;
+    }
+    if (ms->fd >= 0) {
+        close(ms->fd);
+        ms->fd = -1;
+    }
+}
+
+static void destroy_surfaces(struct mock_state *state) {
+    int i;
+    for (i = 0; i < MAX_SURFACES; ++i) {
+        free_backing(&state->surfaces[i]);
+    }
+}
+
+static void unshare_capture(struct mock_state *state) {
+    if (state->capture != NULL) {
+        munmap((void *)state->capture, state->capture_size);
+        state->capture = NULL;
+    }
+}
+
+/**
+ * (Re)allocate the memfd backing @param ms. gralloc pads rows
+ * to 64 px, so do the same to keep clients honest about stride.
+ */
+static int alloc_backing(struct mock_surface *ms,
+        uint32_t width, uint32_t height) {
+    uint32_t stride = (width + 63) & ~63u;
+
+    int fd = memfd_create("mockflinger", MFD_CLOEXEC);
+    if (fd < 0) {
+        MLOGE("memfd_create failed: %s\n", strerror(errno));
+        return -1;
+    }
+    if (ftruncate(fd, (off_t)stride * height * 4) < 0) {
+        MLOGE("ftruncate failed: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    free_backing(ms);
+    ms->fd = fd;
+    ms->generation = 0;
+    ms->width = width;
+    ms->height = height;
+    ms->stride = stride;
+    return 0;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Send a reply with its message header, and @param fd unless it is -1.
+ */
+static int send_reply(const int sockfd, const void *data, const int data_len,
+        const int fd) {
+    struct msghdr msg = {0};
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } u;
+
+    MMessageHeader header = { M_REPLY };
+    struct iovec iov[2];
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = data_len;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    if (fd >= 0) {
+        msg.msg_control = u.buf;
+        msg.msg_controllen = sizeof(u.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    if (sendmsg(sockfd, &msg, 0) < 0) {
+        MLOGE("sendmsg failed: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int send_locked_buffer(const int cfd, struct mock_surface *ms) {
+    MLockBufferResponse response;
+    memset(&response, 0, sizeof(response));
+    response.result = -1;
+
+    if (ms != NULL) {
+        /* a single buffer per surface, always in slot 0 */
+        response.width = ms->width;
+        response.height = ms->height;
+        response.stride = ms->stride;
+        response.slot = 0;
+        response.result = 0;
+
+        if (ms->generation == 0) {
+            ms->generation = ++ms->next_generation;
+            response.generation = ms->generation;
+            response.has_fd = 1;
+            return send_reply(cfd, &response, sizeof(response), ms->fd);
+        }
+        response.generation = ms->generation;
+    }
+    return send_reply(cfd, &response, sizeof(response), -1);
+}
+
+static int share_capture(const int cfd, struct mock_state *state,
+        const MShareCaptureRequest *request, int fd) {
+    MShareCaptureResponse response = { -1 };
+    unshare_capture(state);
+
+    size_t needed = (size_t)request->stride * request->height +
+        M_BLIT_MAX_RECTS * sizeof(MBlitRect);
+    struct stat st;
+    int seals = fd < 0 ? -1 : fcntl(fd, F_GET_SEALS);
+    if (fd < 0 || request->stride < request->width * 4 ||
+            needed > request->size ||
+            fstat(fd, &st) < 0 || (size_t)st.st_size < needed ||
+            seals < 0 || !(seals & F_SEAL_SHRINK)) {
+        MLOGE("bad capture shared\n");
+    } else {
+        void *capture = mmap(NULL, needed, PROT_READ, MAP_SHARED, fd, 0);
+        if (capture == MAP_FAILED) {
+            MLOGE("mmap failed: %s\n", strerror(errno));
+        } else {
+            state->capture = capture;
+            state->capture_size = needed;
+            state->capture_width = request->width;
+            state->capture_height = request->height;
+            state->capture_stride = request->stride;
+            response.result = 0;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return send_reply(cfd, &response, sizeof(response), -1);
+}
+
+/**
+ * Copy the rects in the capture's table into @param ms, clipped to
+ * both.
+ */
+static int blit_capture(struct mock_state *state, struct mock_surface *ms,
+        uint32_t count) {
+    if (ms == NULL || state->capture == NULL || count > M_BLIT_MAX_RECTS) {
+        return -1;
+    }
+    if (ms->bits == NULL) {
+        void *bits = mmap(NULL, (size_t)ms->stride * ms->height * 4,
+            PROT_READ|PROT_WRITE, MAP_SHARED, ms->fd, 0);
+        if (bits == MAP_FAILED) {
+            MLOGE("mmap failed: %s\n", strerror(errno));
+            return -1;
+        }
+        ms->bits = bits;
+    }
+
+    const MBlitRect *rects = (const MBlitRect *)(state->capture +
+        (size_t)state->capture_stride * state->capture_height);
+    uint32_t width = ms->width < state->capture_width ?
+        ms->width : state->capture_width;
+    uint32_t height = ms->height < state->capture_height ?
+        ms->height : state->capture_height;
+
+    uint32_t i;
+    for (i = 0; i < count; ++i) {
+        int64_t left = rects[i].x < 0 ? 0 : rects[i].x;
+        int64_t top = rects[i].y < 0 ? 0 : rects[i].y;
+        int64_t right = (int64_t)rects[i].x + rects[i].width;
+        int64_t bottom = (int64_t)rects[i].y + rects[i].height;
+        right = right > width ? width : right;
+        bottom = bottom > height ? height : bottom;
+        if (left >= right || top >= bottom) {
+            continue;
+        }
+
+        int64_t y;
+        for (y = top; y < bottom; ++y) {
+            memcpy(ms->bits + ((size_t)y * ms->stride + left) * 4,
+                state->capture + y * state->capture_stride + left * 4,
+                (right - left) * 4);
+        }
+        state->bytes_blitted += (uint64_t)(right - left) * (bottom - top) * 4;
+    }
+    state->blits++;
+    return 0;
+}
+
+static void post_buffer(struct mock_state *state, struct mock_surface *ms,
+        int32_t id) {
+    if (ms == NULL) {
+        return;
+    }
+    state->posts++;
+    state->bytes_posted += (uint64_t)ms->stride * ms->height * 4;
+
+    if ((ms->event_mask & M_FRAME_PRESENTED_MASK) &&
+            state->num_pending < MAX_PENDING_FRAMES) {
+        uint64_t since = now_ns() - state->vsync_epoch;
+        uint64_t next_vsync = state->vsync_epoch +
+            (since / state->refresh_ns + 1) * state->refresh_ns;
+
+        struct mock_pending_frame *frame = &state->pending[state->num_pending++];
+        frame->id = id;
+        frame->present_ns = next_vsync + state->refresh_ns;
+    }
+}
+
+/**
+ * Send M_FRAME_PRESENTED for every frame whose vsync has passed.
+ *
+ * @return ms until the next pending frame is due, -1 if there is none
+ */
+static int send_presented(const int cfd, struct mock_state *state) {
+    uint64_t now = now_ns();
+    int timeout_ms = -1;
+
+    int i = 0;
+    while (i < state->num_pending) {
+        struct mock_pending_frame *frame = &state->pending[i];
+        if (frame->present_ns > now) {
+            int due_ms = (frame->present_ns - now) / 1000000 + 1;
+            if (timeout_ms < 0 || due_ms < timeout_ms) {
+                timeout_ms = due_ms;
+            }
+            ++i;
+            continue;
+        }
+
+        MEvent ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.frame.type = M_FRAME_PRESENTED;
+        ev.frame.__id = frame->id;
+        ev.frame.present_ns = frame->present_ns;
+        ev.frame.refresh_ns = state->refresh_ns;
+        ev.frame.estimated = 1;
+        if (write(cfd, &ev, sizeof(ev.frame)) < 0) {
+            MLOGE("error sending event: %s\n", strerror(errno));
+        }
+
+        *frame = state->pending[--state->num_pending];
+    }
+    return timeout_ms;
+}
+
+static void fill_display_info(const struct mock_state *state,
+        MGetDisplayInfoResponse *info) {
+    /* report the size the way a rotated panel would */
+    int sideways = state->orientation == M_ORIENTATION_90 ||
+                   state->orientation == M_ORIENTATION_270;
+    info->width = sideways ? state->display_height : state->display_width;
+    info->height = sideways ? state->display_width : state->display_height;
+    info->orientation = state->orientation;
+}
+
+static volatile sig_atomic_t rotate_requested;
+
+static void on_sigusr1(int sig) {
+    (void)sig;
+    rotate_requested = 1;
+}
+
+/**
+ * Turn the panel a quarter turn clockwise, as if the device was.
+ */
+static void rotate_displays(const int cfd, struct mock_state *state) {
+    state->orientation = (state->orientation + 1) & 3;
+    MLOGI("displays turned to orientation %u\n", state->orientation);
+    if (!(state->display_event_mask & M_DISPLAY_CHANGED_MASK)) {
+        return;
+    }
+
+    uint32_t i;
+    for (i = 0; i < state->num_displays; ++i) {
+        MGetDisplayInfoResponse info;
+        fill_display_info(state, &info);
+
+        MEvent ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.display.type = M_DISPLAY_CHANGED;
+        ev.display.display = i;
+        ev.display.connected = 1;
+        ev.display.width = info.width;
+        ev.display.height = info.height;
+        ev.display.orientation = info.orientation;
+        ev.display.refresh_ns = state->refresh_ns;
+        if (write(cfd, &ev, sizeof(ev.display)) < 0) {
+            MLOGE("error sending event: %s\n", strerror(errno));
+        }
+    }
+}
+
+static int handle_request(const int cfd, struct mock_state *state,
+        struct MReceiver *receiver, uint32_t op, const void *payload) {
+    switch (op) {
+        case M_GET_DISPLAY_INFO: {
+            MGetDisplayInfoResponse response;
+            fill_display_info(state, &response);
+            return send_reply(cfd, &response, sizeof(response), -1);
+        }
+
+        case M_LIST_DISPLAYS: {
+            /* every display looks the same */
+            MListDisplaysResponse response;
+            memset(&response, 0, sizeof(response));
+            for (response.count = 0; response.count < state->num_displays;
+                    ++response.count) {
+                fill_display_info(state, &response.displays[response.count]);
+            }
+            return send_reply(cfd, &response, sizeof(response), -1);
+        }
+
+        case M_CREATE_BUFFER: {
+            const MCreateBufferRequest *request = payload;
+            MCreateBufferResponse response = { -1, -1 };
+            int i;
+            for (i = 0; request->display < state->num_displays &&
+                    i < MAX_SURFACES; ++i) {
+                if (state->surfaces[i].fd < 0) {
+                    state->surfaces[i].event_mask = 0;
+                    if (alloc_backing(&state->surfaces[i],
+                            request->width, request->height) == 0) {
+                        response.id = i + 1;
+                        response.result = 0;
+                    }
+                    break;
+                }
+            }
+            return send_reply(cfd, &response, sizeof(response), -1);
+        }
+
+        case M_RESIZE_BUFFER: {
+            const MResizeBufferRequest *request = payload;
+            MResizeBufferResponse response = { -1 };
+            struct mock_surface *ms = lookup_surface(state, request->id);
+            if (ms != NULL && alloc_backing(ms,
+                    request->width, request->height) == 0) {
+                response.result = 0;
+            }
+            return send_reply(cfd, &response, sizeof(response), -1);
+        }
+
+        case M_SCALE_BUFFER: {
+            const MScaleBufferRequest *request = payload;
+            MScaleBufferResponse response;
+            response.result = lookup_surface(state, request->id) ? 0 : -1;
+            return send_reply(cfd, &response, sizeof(response), -1);
+        }
+
+        case M_UPDATE_BUFFER:
+        case M_RESTACK_BUFFER:
+        case M_SHOW_BUFFER:
+            /* nothing on screen to move around */
+            return 0;
+
+        case M_DESTROY_BUFFER: {
+            const MDestroyBufferRequest *request = payload;
+            struct mock_surface *ms = lookup_surface(state, request->id);
+            if (ms != NULL) {
+                free_backing(ms);
+            }
+            return 0;
+        }
+
+        case M_LOCK_BUFFER: {
+            const MLockBufferRequest *request = payload;
+            struct mock_surface *ms = lookup_surface(state, request->id);
+            if (ms != NULL && (request->unmapped & 1)) {
+                /* the client lost its mapping, send the fd again */
+                ms->generation = 0;
+            }
+            return send_locked_buffer(cfd, ms);
+        }
+
+        case M_UNLOCK_AND_POST_BUFFER: {
+            const MUnlockBufferRequest *request = payload;
+            post_buffer(state, lookup_surface(state, request->id), request->id);
+            return 0;
+        }
+
+        case M_SWAP_BUFFER: {
+            const MSwapBufferRequest *request = payload;
+            struct mock_surface *ms = lookup_surface(state, request->id);
+            post_buffer(state, ms, request->id);
+            return send_locked_buffer(cfd, ms);
+        }
+
+        case M_SELECT_EVENTS: {
+            const MSelectEventsRequest *request = payload;
+            struct mock_surface *ms = lookup_surface(state, request->id);
+            if (ms == NULL) {
+                return -1;
+            }
+            ms->event_mask = request->mask;
+            return 0;
+        }
+
+        case M_SELECT_DISPLAY_EVENTS: {
+            const MSelectDisplayEventsRequest *request = payload;
+            state->display_event_mask = request->mask;
+            return 0;
+        }
+
+        case M_RESUME_SESSION: {
+            const MResumeSessionRequest *request = payload;
+            uint64_t token = ((uint64_t)request->token_hi << 32) |
+                request->token_lo;
+            uint32_t count = request->count < M_SESSION_MAX_BUFFERS ?
+                request->count : M_SESSION_MAX_BUFFERS;
+            int resumed = token != 0 && token == state->session_token;
+
+            MResumeSessionResponse response;
+            memset(&response, 0, sizeof(response));
+            uint32_t i;
+            int j;
+            for (j = 0; state->session_kept && j < MAX_SURFACES; ++j) {
+                for (i = 0; resumed && i < count &&
+                        request->ids[i] != j + 1; ++i) {
+                }
+                if (!resumed || i == count) {
+                    free_backing(&state->surfaces[j]);
+                }
+            }
+            for (i = 0; resumed && i < count; ++i) {
+                struct mock_surface *ms = lookup_surface(state, request->ids[i]);
+                if (ms != NULL) {
+                    response.resumed |= 1u << i;
+                    response.buffers[i].width = ms->width;
+                    response.buffers[i].height = ms->height;
+                }
+            }
+            if (!resumed) {
+                /* predictable is fine for a mock */
+                state->session_token = now_ns() | 1;
+            }
+            state->session_kept = 0;
+
+            response.token = state->session_token;
+            MLOGI("%s session\n", resumed ? "resumed" : "new");
+            return send_reply(cfd, &response, sizeof(response), -1);
+        }
+
+        case M_END_SESSION:
+            state->session_token = 0;
+            return 0;
+
+        case M_SHARE_CAPTURE:
+            return share_capture(cfd, state, payload,
+                mreceiver_take_fd(receiver));
+
+        case M_BLIT_BUFFER: {
+            const MBlitBufferRequest *request = payload;
+            struct mock_surface *ms = lookup_surface(state, request->id);
+            MBlitBufferResponse response;
+            response.result = blit_capture(state, ms, request->count);
+            send_reply(cfd, &response, sizeof(response), -1);
+            if (response.result == 0) {
+                post_buffer(state, ms, request->id);
+            }
+            return response.result;
+        }
+
+        default:
+            MLOGW("unrecognized request %u\n", op);
+            return -1;
+    }
+}
+
+static void serve(const int sockfd, struct mock_state *state) {
+    int cfd = accept(sockfd, NULL, NULL);
+    if (cfd < 0) {
+        MLOGE("accept failed: %s\n", strerror(errno));
+        return;
+    }
+
+    state->requests = state->posts = state->bytes_posted = 0;
+    state->blits = state->bytes_blitted = 0;
+    MLOGI("client connected\n");
+
+    static struct MReceiver receiver;
+    mreceiver_init(&receiver, cfd);
+
+    state->num_pending = 0;
+    state->display_event_mask = 0;
+
+    int ret = 0;
+    while (ret >= 0) {
+        /* sleep until the next request, frame to present or SIGUSR1 */
+        struct pollfd pfd = { cfd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, send_presented(cfd, state));
+        if (rotate_requested) {
+            rotate_requested = 0;
+            rotate_displays(cfd, state);
+        }
+        if (ready <= 0) {
+            continue;
+        }
+        if (mreceiver_fill(&receiver) <= 0) {
+            break;
+        }
+
+        uint32_t op;
+        const void *payload;
+        while ((ret = mreceiver_next(&receiver, &op, &payload)) > 0) {
+            state->requests++;
+            if (state->session_kept && op != M_RESUME_SESSION) {
+                destroy_surfaces(state);
+                state->session_kept = 0;
+                state->session_token = 0;
+            }
+            if (handle_request(cfd, state, &receiver, op, payload) < 0) {
+                MLOGW("request %u failed\n", op);
+            }
+        }
+        if (ret < 0) {
+            MLOGE("unrecognized request %u, dropping client\n", op);
+        }
+    }
+
+    MLOGI("client gone: %llu requests in %llu reads, %llu posts, "
+          "%llu MB posted, %llu blits, %llu MB blitted\n",
+        (unsigned long long)state->requests,
+        (unsigned long long)receiver.syscalls,
+        (unsigned long long)state->posts,
+        (unsigned long long)(state->bytes_posted >> 20),
+        (unsigned long long)state->blits,
+        (unsigned long long)(state->bytes_blitted >> 20));
+    mreceiver_release(&receiver);
+    unshare_capture(state);
+
+    int i, kept = 0;
+    for (i = 0; state->session_token != 0 && i < MAX_SURFACES; ++i) {
+        if (state->surfaces[i].fd >= 0) {
+            /* the next client has to be sent the fd again */
+            state->surfaces[i].generation = 0;
+            state->surfaces[i].event_mask = 0;
+            ++kept;
+        }
+    }
+    if (kept > 0) {
+        MLOGI("keeping %d surfaces for the next client\n", kept);
+        state->session_kept = 1;
+    } else {
+        destroy_surfaces(state);
+        state->session_token = 0;
+    }
+    close(cfd);
+}
+
+int main(int argc, char **argv) {
+    struct mock_state state;
+    memset(&state, 0, sizeof(state));
+    state.display_width = 1280;
+    state.display_height = 720;
+    state.num_displays = 1;
+    state.refresh_ns = 1000000000 / 60;
+
+    int once = 0;
+    int c;
+    while ((c = getopt(argc, argv, "w:h:o:d:r:1")) != -1) {
+        switch (c) {
+            case 'w': state.display_width = strtoul(optarg, NULL, 10); break;
+            case 'h': state.display_height = strtoul(optarg, NULL, 10); break;
+            case 'o': state.orientation = strtoul(optarg, NULL, 10) & 3; break;
+            case 'd': {
+                unsigned long n = strtoul(optarg, NULL, 10);
+                state.num_displays = n < 1 ? 1 :
+                    n > M_MAX_DISPLAYS ? M_MAX_DISPLAYS : n;
+                break;
+            }
+            case 'r': {
+                unsigned long hz = strtoul(optarg, NULL, 10);
+                if (hz > 0) {
+                    state.refresh_ns = 1000000000 / hz;
+                }
+                break;
+            }
+            case '1': once = 1; break;
+            default:
+                fprintf(stderr, "usage: %s [-w width] [-h height] "
+                    "[-o orientation] [-d displays] [-r hz] [-1]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    int i;
+    for (i = 0; i < MAX_SURFACES; ++i) {
+        state.surfaces[i].fd = -1;
+    }
+    state.vsync_epoch = now_ns();
+
+    /* no SA_RESTART, poll() has to wake up */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigusr1;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        MLOGE("socket failed: %s\n", strerror(errno));
+        return 1;
+    }
+
+    /* same abstract name as mflinger, see MOpenDisplay() */
+    struct sockaddr_un local;
+    memset(&local, 0, sizeof(local));
+    local.sun_family = AF_UNIX;
+    strcpy(local.sun_path + 1, M_SOCK_PATH);
+    int len = 1 + strlen(local.sun_path + 1) + sizeof(local.sun_family);
+
+    if (bind(sockfd, (struct sockaddr *)&local, len) < 0 ||
+            listen(sockfd, 1) < 0) {
+        MLOGE("bind/listen failed: %s\n", strerror(errno));
+        return 1;
+    }
+
+    MLOGI("mockflinger serving a %ux%u display\n",
+        state.display_width, state.display_height);
+    do {
+        serve(sockfd, &state);
+    } while (!once);
+
+    close(sockfd);
+    return 0;
+}
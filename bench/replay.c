@@ -0,0 +1,436 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+
+#include "mlib.h"
+#include "mlog.h"
+
+#include "../src/mclient/capture_xcb.h"
+#include "../src/mclient/mcursor.h"
+#include "../src/mclient/mtrace.h"
+#include "../src/mclient/pixel.h"
+#include "../src/mclient/ximage.h"
+
+/*
+ * Replay a damage trace recorded with MCLIENT_TRACE through the
+ * capture -> copy -> post pipeline and report what each step cost.
+ *
+ * Meant to run against Xvfb and bench/mockflinger (see run-replay.sh)
+ * so a trace recorded in the field becomes a repeatable benchmark:
+ *
+ *   ./bench/replay [-p] [-d] [-b rows] [-x [-s]] [-l label] [-o out.json] trace
+ *
+ * -p  keep the original timing between events instead of replaying
+ *     back-to-back
+ * -d  draw every damage rect on the X server before capturing it, so
+ *     the server does the same work it did when the trace was recorded
+ * -b  capture through a band of this many rows instead of a full
+ *     screen image, like MCLIENT_CAPTURE_BAND
+ * -x  capture only the damage through XCB, like MCLIENT_CAPTURE=xcb
+ * -s  capture into a segment shared with mflinger and have it copy the
+ *     damage into the buffer, like MCLIENT_SERVER_BLIT (needs -x)
+ */
+
+struct samples {
+    const char *name;
+    uint64_t *ns;
+    uint32_t count;
+    uint32_t capacity;
+    uint64_t bytes;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t deadline) {
+    uint64_t now = now_ns();
+    if (deadline > now) {
+        struct timespec ts;
+        ts.tv_sec = (deadline - now) / 1000000000ull;
+        ts.tv_nsec = (deadline - now) % 1000000000ull;
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void add_sample(struct samples *s, uint64_t ns, uint64_t bytes) {
+    if (s->count == s->capacity) {
+        uint32_t capacity = s->capacity ? s->capacity * 2 : 1024;
+        uint64_t *ns_new = realloc(s->ns, capacity * sizeof(*ns_new));
+        if (ns_new == NULL) {
+            return;
+        }
+        s->ns = ns_new;
+        s->capacity = capacity;
+    }
+    s->ns[s->count++] = ns;
+    s->bytes += bytes;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void write_samples_json(FILE *out, struct samples *s, int last) {
+    uint64_t total = 0;
+    uint32_t i;
+    for (i = 0; i < s->count; ++i) {
+        total += s->ns[i];
+    }
+    qsort(s->ns, s->count, sizeof(*s->ns), compare_u64);
+
+    fprintf(out, "    \"%s\": { \"count\": %u", s->name, s->count);
+    if (s->count > 0) {
+        fprintf(out, ", \"median_us\": %.1f, \"p99_us\": %.1f, "
+                "\"max_us\": %.1f, \"mean_us\": %.1f",
+            s->ns[s->count / 2] / 1e3,
+            s->ns[(s->count * 99 + 99) / 100 - 1] / 1e3,
+            s->ns[s->count - 1] / 1e3,
+            (double)total / s->count / 1e3);
+        if (s->bytes > 0 && total > 0) {
+            fprintf(out, ", \"per_s\": %.1f, \"mb_per_s\": %.1f",
+                s->count * 1e9 / total, s->bytes * 1e3 / total);
+        }
+    }
+    fprintf(out, " }%s\n", last ? "" : ",");
+}
+
+/**
+ * The same steps as blit_root() in mclient.
+ */
+static int blit_root(MDisplay *mdpy, MBuffer *buf, XImage *shadow,
+        MCapture *capture, struct CaptureXcb *xcb) {
+    MBlitRect rects[CAPTURE_XCB_MAX_RECTS];
+    int i, n;
+    if (xcb->full) {
+        rects[0].x = rects[0].y = 0;
+        rects[0].width = capture->width;
+        rects[0].height = capture->height;
+        n = 1;
+    } else {
+        for (i = 0; i < xcb->nrects; ++i) {
+            rects[i].x = xcb->rects[i].x;
+            rects[i].y = xcb->rects[i].y;
+            rects[i].width = xcb->rects[i].width;
+            rects[i].height = xcb->rects[i].height;
+        }
+        n = xcb->nrects;
+    }
+    if (n == 0) {
+        /* no damage since the last blit, the buffer is up to date */
+        return 0;
+    }
+
+    if (capture_xcb_update(xcb, shadow) < 0) {
+        MLOGE("error capturing through xcb\n");
+        return -1;
+    }
+    if (MBlitBuffer(mdpy, buf, capture, rects, n) < 0) {
+        MLOGE("MBlitBuffer failed!\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * The same steps as render_root() in mclient.
+ */
+static int render_root(Display *dpy, MDisplay *mdpy,
+        MBuffer *buf, XImage *ximg, struct CaptureXcb *xcb) {
+    if (buf->bits == NULL && MLockBuffer(mdpy, buf) < 0) {
+        MLOGE("MLockBuffer failed!\n");
+        return -1;
+    }
+
+    if (ximg->height < buf->height) {
+        capture_banded_mlocked(dpy, DefaultRootWindow(dpy), buf, ximg,
+            buf->height, 1);
+    } else if (xcb != NULL) {
+        if (capture_xcb_update(xcb, ximg) < 0) {
+            MLOGE("error capturing through xcb\n");
+        }
+        copy_ximg_to_buffer_mlocked(buf, ximg);
+    } else {
+        if (!XShmGetImage(dpy, DefaultRootWindow(dpy), ximg, 0, 0,
+                AllPlanes)) {
+            MLOGE("error calling XShmGetImage\n");
+        }
+        copy_ximg_to_buffer_mlocked(buf, ximg);
+    }
+
+    if (MSwapBuffer(mdpy, buf) < 0) {
+        MLOGE("MSwapBuffer failed!\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int render_cursor(MDisplay *mdpy, MBuffer *buf,
+        const unsigned long *pixels, uint32_t width, uint32_t height) {
+    if (MLockBuffer(mdpy, buf) < 0) {
+        MLOGE("MLockBuffer failed!\n");
+        return -1;
+    }
+    copy_cursor_32(buf->bits, buf->stride * 4, buf->width, buf->height,
+        pixels, width, height);
+    return MUnlockBuffer(mdpy, buf);
+}
+
+int main(int argc, char **argv) {
+    int pace = 0, draw = 0, use_xcb = 0, blit = 0;
+    uint32_t band = 0;
+    const char *label = "", *out_path = NULL;
+
+    int c;
+    while ((c = getopt(argc, argv, "pdb:xsl:o:")) != -1) {
+        switch (c) {
+            case 'p': pace = 1; break;
+            case 'd': draw = 1; break;
+            case 'b': band = strtoul(optarg, NULL, 10); break;
+            case 'x': use_xcb = 1; break;
+            case 's': blit = 1; break;
+            case 'l': label = optarg; break;
+            case 'o': out_path = optarg; break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+    if (optind != argc - 1 || (blit && !use_xcb)) {
+        fprintf(stderr, "usage: %s [-p] [-d] [-b rows] [-x [-s]] [-l label] "
+            "[-o out.json] trace\n", argv[0]);
+        return 1;
+    }
+    const char *trace_path = argv[optind];
+
+    struct MTraceHeader header;
+    FILE *trace = mtrace_open(trace_path, &header);
+    if (trace == NULL) {
+        return 1;
+    }
+
+    Display *dpy = XOpenDisplay(NULL);
+    if (dpy == NULL || !XShmQueryExtension(dpy)) {
+        MLOGE("need an X server with XShm (try Xvfb)\n");
+        return 1;
+    }
+    int screen = DefaultScreen(dpy);
+    Window root = DefaultRootWindow(dpy);
+
+    if (XDisplayWidth(dpy, screen) != header.screen_width ||
+            XDisplayHeight(dpy, screen) != header.screen_height) {
+        MLOGW("trace was recorded at %ux%u but the screen is %dx%d\n",
+            header.screen_width, header.screen_height,
+            XDisplayWidth(dpy, screen), XDisplayHeight(dpy, screen));
+    }
+
+    MDisplay mdpy;
+    if (MOpenDisplay(&mdpy) < 0) {
+        MLOGE("can't reach mflinger (try bench/mockflinger)\n");
+        return 1;
+    }
+
+    MBuffer root_buf = { 0 };
+    root_buf.width = XDisplayWidth(dpy, screen);
+    root_buf.height = XDisplayHeight(dpy, screen);
+    MBuffer cursor_buf = { 0 };
+    cursor_buf.width = CURSOR_WIDTH;
+    cursor_buf.height = CURSOR_HEIGHT;
+    if (MCreateBuffer(&mdpy, &root_buf) < 0 ||
+            MCreateBuffer(&mdpy, &cursor_buf) < 0) {
+        MLOGE("error creating buffers\n");
+        return 1;
+    }
+
+    XShmSegmentInfo shminfo;
+    uint32_t capture_rows = band > 0 ?
+        band_image_rows(band, root_buf.height, 1) : root_buf.height;
+    XImage *ximg = xshm_create(dpy, &shminfo, DefaultVisual(dpy, screen),
+        DefaultDepth(dpy, screen), root_buf.width, capture_rows);
+    if (ximg == NULL) {
+        MLOGE("failed to create xshm\n");
+        return 1;
+    }
+
+    struct CaptureXcb capture_xcb;
+    struct CaptureXcb *xcb = NULL;
+    if (use_xcb) {
+        if (band > 0 || capture_xcb_init(&capture_xcb, dpy) < 0) {
+            MLOGE("xcb capture needs MIT-SHM and a full screen image\n");
+            return 1;
+        }
+        xcb = &capture_xcb;
+    }
+
+    MCapture capture;
+    XImage *shadow = NULL;
+    if (blit) {
+        capture.width = root_buf.width;
+        capture.height = root_buf.height;
+        if (MShareCapture(&mdpy, &capture) < 0) {
+            MLOGE("error sharing a capture with mflinger\n");
+            return 1;
+        }
+        shadow = capture_xcb_attach(xcb, &capture);
+        if (shadow == NULL) {
+            return 1;
+        }
+    }
+
+    /* a stand-in cursor image, only the size matters */
+    static unsigned long cursor_pixels[64 * 64];
+    uint32_t i;
+    for (i = 0; i < 64 * 64; ++i) {
+        cursor_pixels[i] = (i & 1) ? 0xff000000 : 0x00000000;
+    }
+
+    GC gc = XCreateGC(dpy, root, 0, NULL);
+    unsigned long colors[2] = {
+        BlackPixel(dpy, screen), WhitePixel(dpy, screen)
+    };
+
+    struct samples frames = { "frames" };
+    struct samples cursor_moves = { "cursor_moves" };
+    struct samples cursor_images = { "cursor_images" };
+    uint32_t screen_changes = 0;
+
+    uint64_t replay_start = now_ns();
+    struct MTraceRecord rec;
+    while (mtrace_next(trace, &rec)) {
+        if (pace) {
+            sleep_until_ns(replay_start + rec.time_ms * 1000000ull);
+        }
+
+        uint64_t start;
+        switch (rec.type) {
+            case MTRACE_DAMAGE:
+                if (draw) {
+                    XSetForeground(dpy, gc, colors[frames.count & 1]);
+                    XFillRectangle(dpy, root, gc, rec.x, rec.y,
+                        rec.width, rec.height);
+                    XSync(dpy, False);
+                }
+
+                start = now_ns();
+                if (xcb != NULL) {
+                    struct MRect damage = {
+                        rec.x, rec.y, rec.width, rec.height
+                    };
+                    capture_xcb_damage(xcb, &damage, 1);
+                }
+                if (shadow != NULL) {
+                    blit_root(&mdpy, &root_buf, shadow, &capture, xcb);
+                } else {
+                    render_root(dpy, &mdpy, &root_buf, ximg, xcb);
+                }
+                add_sample(&frames, now_ns() - start,
+                    (uint64_t)root_buf.width * root_buf.height * 4);
+                break;
+
+            case MTRACE_CURSOR_POS:
+                start = now_ns();
+                MUpdateBuffer(&mdpy, &cursor_buf,
+                    rec.x < 0 ? 0 : rec.x, rec.y < 0 ? 0 : rec.y);
+                add_sample(&cursor_moves, now_ns() - start, 0);
+                break;
+
+            case MTRACE_CURSOR_IMAGE:
+                start = now_ns();
+                render_cursor(&mdpy, &cursor_buf, cursor_pixels,
+                    rec.width < 64 ? rec.width : 64,
+                    rec.height < 64 ? rec.height : 64);
+                add_sample(&cursor_images, now_ns() - start,
+                    (uint64_t)cursor_buf.width * cursor_buf.height * 4);
+                break;
+
+            case MTRACE_SCREEN:
+                /* the replay keeps the current screen size */
+                screen_changes++;
+                break;
+
+            default:
+                MLOGW("skipping unknown record type %u\n", rec.type);
+                break;
+        }
+    }
+    uint64_t replay_ns = now_ns() - replay_start;
+
+    /* the attached capture shm counts towards RSS once it is touched */
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    FILE *out = stdout;
+    if (out_path != NULL && (out = fopen(out_path, "w")) == NULL) {
+        MLOGE("error opening %s\n", out_path);
+        return 1;
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"label\": \"%s\",\n", label);
+    fprintf(out, "  \"trace\": \"%s\",\n", trace_path);
+    fprintf(out, "  \"screen\": \"%ux%u\",\n", root_buf.width, root_buf.height);
+    fprintf(out, "  \"paced\": %s,\n", pace ? "true" : "false");
+    fprintf(out, "  \"drawn\": %s,\n", draw ? "true" : "false");
+    fprintf(out, "  \"wall_ms\": %.1f,\n", replay_ns / 1e6);
+    fprintf(out, "  \"screen_changes\": %u,\n", screen_changes);
+    fprintf(out, "  \"capture\": \"%s\",\n", xcb != NULL ? "xcb" : "xlib");
+    fprintf(out, "  \"blit\": %s,\n", shadow != NULL ? "true" : "false");
+    fprintf(out, "  \"capture_rows\": %u,\n", capture_rows);
+    fprintf(out, "  \"capture_shm_kb\": %u,\n",
+        ximg->bytes_per_line * capture_rows / 1024);
+    fprintf(out, "  \"max_rss_kb\": %ld,\n", usage.ru_maxrss);
+    fprintf(out, "  \"results\": {\n");
+    write_samples_json(out, &frames, 0);
+    write_samples_json(out, &cursor_moves, 0);
+    write_samples_json(out, &cursor_images, 1);
+    fprintf(out, "  }\n");
+    fprintf(out, "}\n");
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    XFreeGC(dpy, gc);
+    if (shadow != NULL) {
+        capture_xcb_detach(xcb, shadow);
+        MFreeCapture(&capture);
+    }
+    if (xcb != NULL) {
+        capture_xcb_cleanup(xcb);
+    }
+    xshm_cleanup(dpy, &shminfo, ximg);
+    MDestroyBuffer(&mdpy, &cursor_buf);
+    MDestroyBuffer(&mdpy, &root_buf);
+    MCloseDisplay(&mdpy);
+    XCloseDisplay(dpy);
+    fclose(trace);
+
+    return 0;
+}
@@ -0,0 +1,65 @@
+#!/bin/sh
+#
+# Copyright 2016 The Maru OS Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+#
+# Replay every trace in bench/traces against a private Xvfb and
+# mockflinger, writing one JSON report per trace.
+#
+# usage: run-replay.sh <out dir> [label]
+#
+# Set REPLAY_FLAGS to pass extra flags to bench/replay (e.g. -p -d).
+#
+
+set -e
+
+OUT_DIR="${1:?usage: $0 <out dir> [label]}"
+LABEL="$2"
+BENCH_DIR="$(dirname "$0")"
+XVFB_DISPLAY="${XVFB_DISPLAY:-:99}"
+SCREEN="${REPLAY_SCREEN:-1920x1080}"
+
+mkdir -p "$OUT_DIR"
+
+found=0
+for trace in "$BENCH_DIR"/traces/*.mtrace; do
+    [ -e "$trace" ] || continue
+    found=1
+    name="$(basename "$trace" .mtrace)"
+
+    Xvfb "$XVFB_DISPLAY" -screen 0 "${SCREEN}x24" -nolisten tcp &
+    xvfb_pid=$!
+    "$BENCH_DIR"/mockflinger -1 &
+    mock_pid=$!
+    trap 'kill $xvfb_pid $mock_pid 2>/dev/null' EXIT
+
+    # give both servers a moment to start listening
+    sleep 1
+
+    DISPLAY="$XVFB_DISPLAY" "$BENCH_DIR"/replay $REPLAY_FLAGS \
+        -l "$LABEL" -o "$OUT_DIR/$name.json" "$trace"
+
+    wait $mock_pid || true
+    kill $xvfb_pid 2>/dev/null || true
+    wait $xvfb_pid 2>/dev/null || true
+    trap - EXIT
+
+    echo "$name: $OUT_DIR/$name.json"
+done
+
+if [ "$found" = 0 ]; then
+    echo "no traces in $BENCH_DIR/traces, record one with MCLIENT_TRACE=<file>"
+fi
@@ -42,6 +42,18 @@
 #define M_LOCK_BUFFER               (1 << 7)
 #define M_UNLOCK_AND_POST_BUFFER    (1 << 8)
 #define M_RESIZE_BUFFER             (1 << 9)
+#define M_SCALE_BUFFER              (1 << 10)
+#define M_RESTACK_BUFFER            (1 << 11)
+#define M_SHOW_BUFFER               (1 << 12)
+#define M_DESTROY_BUFFER            (1 << 13)
+#define M_SWAP_BUFFER               (1 << 14)
+#define M_SELECT_EVENTS             (1 << 15)
+#define M_LIST_DISPLAYS             (1 << 16)
+#define M_SELECT_DISPLAY_EVENTS     (1 << 17)
+#define M_RESUME_SESSION            (1 << 18)
+#define M_END_SESSION               (1 << 19)
+#define M_SHARE_CAPTURE             (1 << 20)
+#define M_BLIT_BUFFER               (1 << 21)
 
 struct MRequestHeader {
     /* 
@@ -58,6 +70,19 @@ struct MRequestHeader {
 };
 typedef struct MRequestHeader MRequestHeader;
 
+/*
+ * Everything the server sends starts with a message header. Replies
+ * come back in request order. Events (see mlib.h) can show up between
+ * them once selected, and their type field doubles as the header.
+ * Buffer fds are attached to the header of the reply they belong to.
+ */
+#define M_REPLY (0)
+
+struct MMessageHeader {
+    uint32_t type;      /* M_REPLY or an event type */
+};
+typedef struct MMessageHeader MMessageHeader;
+
 struct MGetDisplayInfoRequest {
     // empty
 };
@@ -66,12 +91,25 @@ typedef struct MGetDisplayInfoRequest MGetDisplayInfoRequest;
 struct MGetDisplayInfoResponse {
     uint32_t width;
     uint32_t height;
+    uint32_t orientation;
 };
 typedef struct MGetDisplayInfoResponse MGetDisplayInfoResponse;
 
+struct MListDisplaysRequest {
+    // empty
+};
+typedef struct MListDisplaysRequest MListDisplaysRequest;
+
+struct MListDisplaysResponse {
+    uint32_t count;
+    MGetDisplayInfoResponse displays[M_MAX_DISPLAYS];   /* id = index */
+};
+typedef struct MListDisplaysResponse MListDisplaysResponse;
+
 struct MCreateBufferRequest {
     uint32_t width;
     uint32_t height;
+    uint32_t display;   /* M_DEFAULT_DISPLAY or an MListDisplays() id */
 };
 typedef struct MCreateBufferRequest MCreateBufferRequest;
 
@@ -105,13 +143,62 @@ struct MResizeBufferResponse {
 };
 typedef struct MResizeBufferResponse MResizeBufferResponse;
 
+struct MScaleBufferRequest {
+    int32_t id;
+    uint32_t width;     /* on-screen size, 0 = unscaled */
+    uint32_t height;
+};
+typedef struct MScaleBufferRequest MScaleBufferRequest;
+
+struct MScaleBufferResponse {
+    int32_t result;
+};
+typedef struct MScaleBufferResponse MScaleBufferResponse;
+
+struct MRestackBufferRequest {
+    int32_t id;
+    int32_t z;          /* [0, M_MAX_Z], higher is on top */
+};
+typedef struct MRestackBufferRequest MRestackBufferRequest;
+
+struct MShowBufferRequest {
+    int32_t id;
+    uint32_t shown;     /* 0 = hide, otherwise show */
+};
+typedef struct MShowBufferRequest MShowBufferRequest;
+
+struct MDestroyBufferRequest {
+    int32_t id;
+};
+typedef struct MDestroyBufferRequest MDestroyBufferRequest;
+
+/*
+ * unmapped has a bit set for every slot the client holds no mapping
+ * for, e.g. because mapping the fd it was sent failed. The server
+ * forgets those registrations, so their buffers come with an fd again.
+ */
 struct MLockBufferRequest {
     int32_t id;
+    uint32_t unmapped;      /* 1 << slot */
 };
 typedef struct MLockBufferRequest MLockBufferRequest;
 
+/*
+ * Buffers are registered with the client once per queue slot. The
+ * first lock of a slot, and the first lock after the slot's buffer
+ * was reallocated, carries the buffer fd (has_fd = 1) and a new
+ * generation. Later locks of the same slot only name the slot and
+ * generation, and the client reuses its mapping.
+ *
+ * A successful resize invalidates every slot of the buffer.
+ */
 struct MLockBufferResponse {
-    MBuffer buffer;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    int32_t slot;           /* [0, M_BUFFER_SLOTS) */
+    uint32_t generation;
+    uint32_t has_fd;        /* 1 = fd attached, (re)map the slot */
     int32_t result;
 };
 typedef struct MLockBufferResponse MLockBufferResponse;
@@ -121,4 +208,102 @@ struct MUnlockBufferRequest {
 };
 typedef struct MUnlockBufferRequest MUnlockBufferRequest;
 
+/*
+ * Unlock and post, then lock again. The response is an
+ * MLockBufferResponse for the next buffer.
+ */
+struct MSwapBufferRequest {
+    int32_t id;
+};
+typedef struct MSwapBufferRequest MSwapBufferRequest;
+
+/*
+ * No response.
+ */
+struct MSelectEventsRequest {
+    int32_t id;
+    uint32_t mask;
+};
+typedef struct MSelectEventsRequest MSelectEventsRequest;
+
+/*
+ * Same as MSelectEventsRequest for events that aren't about a buffer.
+ * No response.
+ */
+struct MSelectDisplayEventsRequest {
+    uint32_t mask;
+};
+typedef struct MSelectDisplayEventsRequest MSelectDisplayEventsRequest;
+
+/*
+ * Requests follow a 4-byte header, so the token is split in two
+ * rather than have the compiler pad in front of a uint64_t.
+ */
+struct MResumeSessionRequest {
+    uint32_t token_lo;      /* 0 = start a new session */
+    uint32_t token_hi;
+    uint32_t count;
+    int32_t ids[M_SESSION_MAX_BUFFERS];     /* buffers to take back */
+};
+typedef struct MResumeSessionRequest MResumeSessionRequest;
+
+struct MResumedBuffer {
+    uint32_t width;
+    uint32_t height;
+    uint32_t display;
+};
+typedef struct MResumedBuffer MResumedBuffer;
+
+struct MResumeSessionResponse {
+    uint64_t token;         /* of the session now active, 0 = failure */
+    uint32_t resumed;       /* bit i set if ids[i] was taken back */
+    uint32_t __pad;
+    MResumedBuffer buffers[M_SESSION_MAX_BUFFERS];
+};
+typedef struct MResumeSessionResponse MResumeSessionResponse;
+
+/*
+ * No response.
+ */
+struct MEndSessionRequest {
+    // empty
+};
+typedef struct MEndSessionRequest MEndSessionRequest;
+
+/*
+ * The memory of the capture comes along as an fd on the request. It
+ * holds height rows of stride bytes of pixels, then a table of
+ * M_BLIT_MAX_RECTS MBlitRects for MBlitBuffer() to fill in.
+ *
+ * The fd has to be a memfd sealed with F_SEAL_SHRINK, so the memory
+ * can't be cut short under the server while it copies from it.
+ */
+struct MShareCaptureRequest {
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;        /* in bytes */
+    uint32_t size;          /* of the whole memory, table included */
+};
+typedef struct MShareCaptureRequest MShareCaptureRequest;
+
+struct MShareCaptureResponse {
+    int32_t result;
+};
+typedef struct MShareCaptureResponse MShareCaptureResponse;
+
+/*
+ * The rects are in the table of the shared capture, not the request.
+ * The response goes out once the server is done reading the capture.
+ */
+struct MBlitBufferRequest {
+    int32_t id;
+    uint32_t count;         /* rects in the table, <= M_BLIT_MAX_RECTS */
+};
+typedef struct MBlitBufferRequest MBlitBufferRequest;
+
+struct MBlitBufferResponse {
+    int32_t result;
+};
+typedef struct MBlitBufferResponse MBlitBufferResponse;
+
 #endif // MLIB_PROTOCOL_H
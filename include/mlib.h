@@ -18,46 +18,321 @@
 #ifndef MLIB_H
 #define MLIB_H
 
+//
+// Events
+//
+#define M_FRAME_PRESENTED       (1)
+#define M_DISPLAY_CHANGED       (2)
+
+#define M_FRAME_PRESENTED_MASK  (1 << M_FRAME_PRESENTED)
+#define M_DISPLAY_CHANGED_MASK  (1 << M_DISPLAY_CHANGED)
+
+/*
+ * A posted buffer reached the display. Times are CLOCK_MONOTONIC.
+ */
+struct MFramePresentedEvent {
+    uint32_t type;          /* M_FRAME_PRESENTED */
+    int32_t __id;           /* buffer that was posted */
+    uint64_t present_ns;    /* when the frame was first on screen */
+    uint64_t refresh_ns;    /* refresh period of the display */
+    uint32_t estimated;     /* 1 = present_ns is a vsync estimate */
+    uint32_t __pad;
+};
+typedef struct MFramePresentedEvent MFramePresentedEvent;
+
+/*
+ * A display was plugged in or out, or changed size, orientation or
+ * refresh rate. The size is reported the same way as MGetDisplayInfo().
+ */
+struct MDisplayChangedEvent {
+    uint32_t type;          /* M_DISPLAY_CHANGED */
+    uint32_t display;       /* MListDisplays() id */
+    uint32_t connected;     /* 0 = unplugged, the rest is stale */
+    uint32_t width;
+    uint32_t height;
+    uint32_t orientation;   /* M_ORIENTATION_* */
+    uint64_t refresh_ns;
+};
+typedef struct MDisplayChangedEvent MDisplayChangedEvent;
+
+union MEvent {
+    uint32_t type;
+    MFramePresentedEvent frame;
+    MDisplayChangedEvent display;
+};
+typedef union MEvent MEvent;
+
+/* events not yet picked up with MNextEvent(), the oldest are dropped */
+#define M_EVENT_QUEUE_SIZE (16)
+
 struct MDisplay {
     int sock_fd;        /* server socket */
+
+    MEvent __events[M_EVENT_QUEUE_SIZE];
+    uint32_t __head;
+    uint32_t __count;
 };
 typedef struct MDisplay MDisplay;
 
+/*
+ * How the server rotates surfaces onto the panel, clockwise. Sizes and
+ * positions are always in the rotated space, so a client renders
+ * upright and never has to rotate pixels itself.
+ */
+#define M_ORIENTATION_0     (0)
+#define M_ORIENTATION_90    (1)
+#define M_ORIENTATION_180   (2)
+#define M_ORIENTATION_270   (3)
+
 struct MDisplayInfo {
-    uint32_t width;     /* width in px */
-    uint32_t height;    /* height in px */
+    uint32_t width;         /* width in px, after rotation */
+    uint32_t height;        /* height in px, after rotation */
+    uint32_t orientation;   /* M_ORIENTATION_* */
+    uint32_t id;            /* for MBuffer.display */
 };
 typedef struct MDisplayInfo MDisplayInfo;
 
+/*
+ * Client-side mapping of one server buffer queue slot, kept across
+ * lock/unlock cycles until the server reallocates the slot.
+ */
+#define M_BUFFER_SLOTS (8)
+
+struct MBufferSlot {
+    void *bits;         /* mapping, NULL = slot not registered */
+    uint32_t size;      /* mapping size in bytes */
+    uint32_t generation;
+};
+
+/*
+ * Displays the server can put buffers on. Display 0 is the external
+ * display mflinger has always used, the rest come from MListDisplays().
+ */
+#define M_MAX_DISPLAYS (4)
+#define M_DEFAULT_DISPLAY (0)
+
 struct MBuffer {
     uint32_t width;     /* width in px */
     uint32_t height;    /* height in px */
     uint32_t stride;    /* stride in px, may be >= width */
     void *bits;         /* raw buffer bytes in BGRA8888 format */
+    uint32_t display;   /* display to create the buffer on */
 
-    int __fd;
     int32_t __id;
+    struct MBufferSlot __slots[M_BUFFER_SLOTS];
 };
 typedef struct MBuffer MBuffer;
 
+/*
+ * A session lets a client that restarts or crashes take its buffers
+ * back, still on screen with their last content, instead of creating
+ * them from scratch and flashing the screen black in between.
+ *
+ * When a client that started a session disconnects without ending it,
+ * the server keeps its buffers for M_SESSION_GRACE_MS. The next client
+ * can resume the session with its token as its first request, and
+ * take back the buffers it names; the rest are destroyed. Any other
+ * first request, or a wrong token, destroys them all.
+ *
+ * The token and buffer ids are for the client to keep somewhere that
+ * outlives the process.
+ */
+#define M_SESSION_MAX_BUFFERS   (4)
+#define M_SESSION_GRACE_MS      (10000)
+
+struct MSession {
+    uint64_t token;         /* 0 = none */
+    uint32_t count;
+    int32_t ids[M_SESSION_MAX_BUFFERS];
+};
+typedef struct MSession MSession;
+
+/*
+ * Server-side blits: instead of locking buffers and copying into them,
+ * a client shares one capture of what it draws with the server up
+ * front, then only tells it which rects changed. The server copies
+ * those into the next buffer itself and posts it, so buffers are never
+ * mapped by the client and a frame is a single small round trip.
+ */
+#define M_BLIT_MAX_RECTS (32)
+
+struct MBlitRect {
+    int32_t x;
+    int32_t y;
+    uint32_t width;
+    uint32_t height;
+};
+typedef struct MBlitRect MBlitRect;
+
+struct MCapture {
+    uint32_t width;     /* width in px */
+    uint32_t height;    /* height in px */
+    uint32_t stride;    /* stride in px */
+    void *bits;         /* BGRA8888, NULL = not shared */
+    int fd;             /* of the shared memory, -1 = not shared */
+
+    uint32_t __size;    /* of the mapping, rect table included */
+};
+typedef struct MCapture MCapture;
+
+/*
+ * Buffers are stacked by z, higher is on top. Each new buffer starts
+ * out one z above the one created before it, from 0 again once no
+ * buffers are left, so no two new buffers share a z until M_MAX_Z.
+ */
+#define M_MAX_Z (0xffff)
+
 int     MOpenDisplay    (MDisplay *dpy);
 int     MCloseDisplay   (MDisplay *dpy);
 
+/*
+ * The socket to poll for server messages, same as Xlib's
+ * ConnectionNumber().
+ */
+int     MConnectionNumber(MDisplay *dpy);
+
 int     MGetDisplayInfo (MDisplay *dpy, MDisplayInfo *dpy_info);
 
+/*
+ * Fill in up to @param max displays that are connected right now.
+ * Returns how many there are, M_DEFAULT_DISPLAY always comes first.
+ */
+int     MListDisplays   (MDisplay *dpy, MDisplayInfo *dpy_info, int max);
+
 //
 // Buffer management
 //
 int     MCreateBuffer   (MDisplay *dpy, MBuffer *buf);
+int     MDestroyBuffer  (MDisplay *dpy, MBuffer *buf);
 int     MUpdateBuffer   (MDisplay *dpy, MBuffer *buf,
                          uint32_t xpos, uint32_t ypos);
 int     MResizeBuffer   (MDisplay *dpy, MBuffer *buf,
                          uint32_t width, uint32_t height);
 
+/*
+ * Stretch the buffer to width x height on screen, independent of its
+ * size in memory. Pass 0 x 0 to go back to 1:1.
+ */
+int     MScaleBuffer    (MDisplay *dpy, MBuffer *buf,
+                         uint32_t width, uint32_t height);
+int     MRestackBuffer  (MDisplay *dpy, MBuffer *buf, int32_t z);
+int     MShowBuffer     (MDisplay *dpy, MBuffer *buf, int shown);
+
 //
 // Buffer rendering
 //
 int     MLockBuffer     (MDisplay *dpy, MBuffer *buf);
 int     MUnlockBuffer   (MDisplay *dpy, MBuffer *buf);
 
+/*
+ * Post a locked buffer and lock the next one in a single round trip,
+ * same as MUnlockBuffer + MLockBuffer. bits is NULL whenever the buffer
+ * is not locked, including after a failed swap.
+ */
+int     MSwapBuffer     (MDisplay *dpy, MBuffer *buf);
+
+/*
+ * The queue slot buf->bits points into and that slot's generation. The
+ * pair names the memory behind a locked buffer across lock cycles, e.g.
+ * to remember what was drawn into it the last time it was posted.
+ *
+ * @return the slot, -1 if buf is not locked
+ */
+int     MLockedSlot     (const MBuffer *buf, uint32_t *generation);
+
+/*
+ * Allocate a capture of capture->width x capture->height and share it
+ * with the server, which forgets any capture shared before. The
+ * memory is a memfd, capture->fd stays open for the client to hand
+ * the same memory to whatever fills it.
+ */
+int     MShareCapture   (MDisplay *dpy, MCapture *capture);
+
+/*
+ * Unmap and close a capture locally. The server lets go of it when
+ * another capture is shared or the connection closes.
+ */
+void    MFreeCapture    (MCapture *capture);
+
+/*
+ * Have the server copy @param rects of @param capture into the next
+ * buffer of @param buf, which must not be locked, and post it. Rects
+ * past M_BLIT_MAX_RECTS are merged into their bounding box. Returns
+ * once the server is done reading the capture, so it can be drawn into
+ * again right away. There has to be at least one rect.
+ */
+int     MBlitBuffer     (MDisplay *dpy, MBuffer *buf, MCapture *capture,
+                         const MBlitRect *rects, int count);
+
+//
+// Sessions
+//
+
+/*
+ * Resume session->token, or start a new session if it is 0 or the
+ * server doesn't know it anymore, and update session->token either way.
+ *
+ * Only the first @param count ids are asked for, so @param bufs
+ * needs no more entries than that whatever the session holds.
+ *
+ * Every bufs[i] taken back from session->ids[i] is set up as if
+ * MCreateBuffer() had just returned it, and comes back at its old size
+ * and position and with its last content. Buffers not taken back are
+ * left alone. A buffer left locked comes back locked, MLockBuffer()
+ * hands out the same buffer again.
+ *
+ * @return bit i set for each bufs[i] taken back, -1 on failure
+ */
+int     MResumeSession  (MDisplay *dpy, MSession *session, MBuffer **bufs,
+                         int count);
+
+/*
+ * Remember the ids of @param count buffers for the next MResumeSession().
+ */
+void    MUpdateSession  (MSession *session, MBuffer **bufs, int count);
+
+/*
+ * Stop keeping the session's buffers around, they go away with the
+ * connection same as without a session.
+ */
+int     MEndSession     (MDisplay *dpy);
+
+//
+// Events
+//
+
+/*
+ * Ask for events about buf, like XSelectInput(). mask is a combination
+ * of M_*_MASK bits, 0 stops all events for the buffer.
+ */
+int     MSelectEvents   (MDisplay *dpy, MBuffer *buf, uint32_t mask);
+
+/*
+ * Ask for events about the displays rather than a buffer, currently
+ * just M_DISPLAY_CHANGED_MASK. Each change is sent once, so a client
+ * that selects before MGetDisplayInfo() never misses one.
+ */
+int     MSelectDisplayEvents(MDisplay *dpy, uint32_t mask);
+
+/*
+ * Read whatever the server has sent without blocking.
+ *
+ * @return number of queued events, or -1 if the connection is gone
+ */
+int     MPending        (MDisplay *dpy);
+
+/*
+ * Like XEventsQueued(QueuedAlready): replies can come in behind events,
+ * so any request may leave events queued that the socket no longer
+ * shows. Never reads or blocks.
+ *
+ * @return number of queued events
+ */
+int     MEventsQueued   (MDisplay *dpy);
+
+/*
+ * Dequeue the oldest event, blocking until one arrives.
+ */
+int     MNextEvent      (MDisplay *dpy, MEvent *ev);
+
 #endif // MLIB_H
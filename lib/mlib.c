@@ -19,9 +19,12 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <poll.h>
 
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -38,16 +41,44 @@ static int buffer_size(MBuffer *buf) {
     return buf->stride * buf->height * 4;
 }
 
-static int recvfd(const int sock_fd, void *data, const int data_len) {
+static int event_size(uint32_t type) {
+    switch (type) {
+        case M_FRAME_PRESENTED:     return sizeof(MFramePresentedEvent);
+        case M_DISPLAY_CHANGED:     return sizeof(MDisplayChangedEvent);
+    }
+    return -1;
+}
+
+static void queue_event(MDisplay *dpy, const MEvent *ev) {
+    if (dpy->__count == M_EVENT_QUEUE_SIZE) {
+        /* nobody is listening, a newer event supersedes the oldest */
+        dpy->__head = (dpy->__head + 1) % M_EVENT_QUEUE_SIZE;
+        --dpy->__count;
+    }
+    dpy->__events[(dpy->__head + dpy->__count) % M_EVENT_QUEUE_SIZE] = *ev;
+    ++dpy->__count;
+}
+
+/**
+ * Read one message from the server. Events are queued up, a reply is
+ * read into @param reply (NULL = no reply expected) along with the fd
+ * attached to it, if any, into @param fd_ret.
+ *
+ * @return 1 if a reply was read, 0 if an event was queued,
+ * -1 on error or if the server hung up
+ */
+static int read_message(MDisplay *dpy, void *reply, int reply_len,
+        int *fd_ret) {
     struct msghdr msgh = {0};
     struct cmsghdr *cmsg;
     struct iovec iov;
     char control[CMSG_SPACE(sizeof(int))];      /* single int fd */
-    int n, buf_fd;
+    MMessageHeader header;
+    int n, fd = -1;
 
-    /* we read data_len bytes from the socket into data */
-    iov.iov_base = data;
-    iov.iov_len = data_len;
+    /* any fd comes along with the header */
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
     msgh.msg_iov = &iov;
     msgh.msg_iovlen = 1;
 
@@ -55,19 +86,13 @@ static int recvfd(const int sock_fd, void *data, const int data_len) {
     msgh.msg_control = control;
     msgh.msg_controllen = sizeof(control);
 
-    n = recvmsg(sock_fd, &msgh, MSG_WAITALL);
+    n = recvmsg(dpy->sock_fd, &msgh, MSG_WAITALL);
     if (n < 0) {
         MLOGE("recvmsg error: %s\n", strerror(errno));
         return -1;
-    }
-
-    /* TODO check n to ensure proper response!!! */
-
-    if (msgh.msg_flags) {
-        if (msgh.msg_flags & MSG_CTRUNC) {
-            MLOGE("insufficient buffer space for ancillary data\n");
-            return -1;
-        }
+    } else if (n == 0) {
+        MLOGE("server closed connection\n");
+        return -1;
     }
 
     /* 
@@ -78,12 +103,239 @@ static int recvfd(const int sock_fd, void *data, const int data_len) {
             cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
         if (cmsg->cmsg_level == SOL_SOCKET &&
                 cmsg->cmsg_type == SCM_RIGHTS) {
-            buf_fd = *(int *) CMSG_DATA(cmsg);
-            return buf_fd;
+            fd = *(int *) CMSG_DATA(cmsg);
+            break;
         }
     }
 
+    int ret = -1;
+    if (msgh.msg_flags & MSG_CTRUNC) {
+        MLOGE("insufficient buffer space for ancillary data\n");
+    } else if (n != sizeof(header)) {
+        MLOGE("short message header: %d bytes\n", n);
+    } else if (header.type == M_REPLY) {
+        if (reply == NULL) {
+            MLOGE("unexpected reply from server\n");
+        } else if (recv(dpy->sock_fd, reply, reply_len, MSG_WAITALL) !=
+                reply_len) {
+            MLOGE("error receiving reply: %s\n", strerror(errno));
+        } else {
+            ret = 1;
+        }
+    } else {
+        int size = event_size(header.type);
+        MEvent ev;
+        ev.type = header.type;
+        if (size < 0) {
+            /* no telling where the next message starts */
+            MLOGE("unknown event %u\n", header.type);
+        } else if (recv(dpy->sock_fd, (char *)&ev + sizeof(header),
+                size - sizeof(header), MSG_WAITALL) !=
+                (ssize_t)(size - sizeof(header))) {
+            MLOGE("error receiving event: %s\n", strerror(errno));
+        } else {
+            queue_event(dpy, &ev);
+            ret = 0;
+        }
+    }
+
+    if (ret == 1 && fd_ret != NULL) {
+        *fd_ret = fd;
+    } else if (fd >= 0) {
+        close(fd);
+    }
+    return ret;
+}
+
+/**
+ * Read the reply to the request that was just sent, queueing up any
+ * events that arrive first.
+ */
+static int read_reply(MDisplay *dpy, void *reply, int reply_len,
+        int *fd_ret) {
+    if (fd_ret != NULL) {
+        *fd_ret = -1;
+    }
+
+    int ret;
+    while ((ret = read_message(dpy, reply, reply_len, fd_ret)) == 0) {
+        /* an event, keep going */
+    }
+    return ret < 0 ? -1 : 0;
+}
+
+static void unmap_slot(struct MBufferSlot *slot) {
+    if (slot->bits != NULL && munmap(slot->bits, slot->size) < 0) {
+        MLOGE("error munmapping buffer: %s\n", strerror(errno));
+    }
+    slot->bits = NULL;
+}
+
+/**
+ * Drop every slot mapping, the server reallocated or freed them.
+ */
+static void unmap_slots(MBuffer *buf) {
+    int i;
+    for (i = 0; i < M_BUFFER_SLOTS; ++i) {
+        unmap_slot(&buf->__slots[i]);
+    }
+    buf->bits = NULL;
+}
+
+/**
+ * Map a newly registered slot from @param buf_fd.
+ */
+static int map_slot(MBuffer *buf, struct MBufferSlot *slot,
+        int buf_fd, uint32_t generation) {
+    unmap_slot(slot);
+
+    /*
+     * mmap into client memory for software r/w
+     * 
+     * NOTE: we need to be careful since we do not know
+     * the offset for sure...let's cross our fingers and
+     * guess no offset!
+     */
+    int offset = 0;
+    void *vaddr = mmap(0, buffer_size(buf), PROT_READ|PROT_WRITE,
+                 MAP_SHARED, buf_fd, offset);
+
+    /* the mapping holds its own reference, no need to keep the fd */
+    close(buf_fd);
+
+    if (vaddr == MAP_FAILED) {
+        MLOGE("error mmaping buffer: %s\n", strerror(errno));
+        return -1;
+    }
+
+    slot->bits = vaddr;
+    slot->size = buffer_size(buf);
+    slot->generation = generation;
+    return 0;
+}
+
+/**
+ * Receive an MLockBufferResponse and point @param buf at the mapping
+ * of the locked slot, mapping it first if it came with an fd.
+ */
+static int receive_locked_buffer(MDisplay *dpy, MBuffer *buf) {
+    int buf_fd;
+    MLockBufferResponse response;
+    if (read_reply(dpy, &response, sizeof(response), &buf_fd) < 0) {
+        MLOGE("error receiving lock buffer response\n");
+        return -1;
+    }
+
+    if (response.result != 0 ||
+            response.slot < 0 || response.slot >= M_BUFFER_SLOTS) {
+        MLOGE("server failed to lock buffer\n");
+        if (buf_fd >= 0) {
+            close(buf_fd);
+        }
+        return -1;
+    }
+
+    if (buf->width != response.width ||
+        buf->height != response.height) {
+        MLOGW("locked buffer dim mismatch...watch out!\n");
+    }
+    buf->stride = response.stride;
+
+    struct MBufferSlot *slot = &buf->__slots[response.slot];
+    if (response.has_fd) {
+        if (buf_fd < 0) {
+            MLOGE("missing fd for buffer slot %d\n", response.slot);
+            unmap_slot(slot);
+            return -1;
+        }
+        if (map_slot(buf, slot, buf_fd, response.generation) < 0) {
+            return -1;
+        }
+    } else if (slot->bits == NULL ||
+            slot->generation != response.generation) {
+        MLOGE("no mapping for buffer slot %d generation %u\n",
+            response.slot, response.generation);
+
+        /* out of date, have the next lock send it again */
+        unmap_slot(slot);
+        if (buf_fd >= 0) {
+            close(buf_fd);
+        }
+        return -1;
+    }
+
+    buf->bits = slot->bits;
+    return 0;
+}
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC (0x0001U)
+#endif
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING (0x0002U)
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS (1033)
+#define F_SEAL_SHRINK (0x0002)
+#define F_SEAL_GROW (0x0004)
+#endif
+
+/**
+ * @return an fd for @param size bytes of anonymous shared memory,
+ * or -1 on failure
+ */
+static int create_shared_memory(const char *name, size_t size) {
+#ifdef __NR_memfd_create
+    /* through syscall() since older libcs have no wrapper */
+    int fd = syscall(__NR_memfd_create, name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        MLOGE("memfd_create error: %s\n", strerror(errno));
+        return -1;
+    }
+    if (ftruncate(fd, size) < 0) {
+        MLOGE("error sizing shared memory: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    /* the server only maps memory that can't shrink under it */
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0) {
+        MLOGE("error sealing shared memory: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    MLOGE("no memfd_create on this system\n");
     return -1;
+#endif
+}
+
+/**
+ * Send a request with @param fd attached.
+ */
+static int send_with_fd(MDisplay *dpy, const void *data, int len, int fd) {
+    struct msghdr msgh = {0};
+    struct iovec iov;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } u;
+
+    iov.iov_base = (void *)data;
+    iov.iov_len = len;
+    msgh.msg_iov = &iov;
+    msgh.msg_iovlen = 1;
+    msgh.msg_control = u.buf;
+    msgh.msg_controllen = sizeof(u.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(dpy->sock_fd, &msgh, 0) == len ? 0 : -1;
 }
 
 //
@@ -114,6 +366,7 @@ int MOpenDisplay(MDisplay *dpy) {
     }
 
     dpy->sock_fd = sock_fd;
+    dpy->__head = dpy->__count = 0;
     return 0;
 }
 
@@ -127,6 +380,10 @@ int MCloseDisplay(MDisplay *dpy) {
     return 0;
 }
 
+int MConnectionNumber(MDisplay *dpy) {
+    return dpy->sock_fd;
+}
+
 int MGetDisplayInfo(MDisplay *dpy, MDisplayInfo *dpy_info) {
     struct {
         MRequestHeader header;
@@ -141,17 +398,49 @@ int MGetDisplayInfo(MDisplay *dpy, MDisplayInfo *dpy_info) {
     }
 
     MGetDisplayInfoResponse response;
-    if (read(dpy->sock_fd, &response, sizeof(response)) < 0) {
-        MLOGE("error receiving get display info response: %s\n",
-            strerror(errno));
+    if (read_reply(dpy, &response, sizeof(response), NULL) < 0) {
+        MLOGE("error receiving get display info response\n");
         return -1;
     }
 
     dpy_info->width = response.width;
     dpy_info->height = response.height;
+    dpy_info->orientation = response.orientation;
+    dpy_info->id = M_DEFAULT_DISPLAY;
     return 0;
 }
 
+int MListDisplays(MDisplay *dpy, MDisplayInfo *dpy_info, int max) {
+    struct {
+        MRequestHeader header;
+        MListDisplaysRequest request;
+    } packet;
+    packet.header.op = M_LIST_DISPLAYS;
+
+    if (write(dpy->sock_fd, &packet, sizeof(packet)) < 0) {
+        MLOGE("error sending list displays request: %s\n",
+            strerror(errno));
+        return -1;
+    }
+
+    MListDisplaysResponse response;
+    if (read_reply(dpy, &response, sizeof(response), NULL) < 0) {
+        MLOGE("error receiving list displays response\n");
+        return -1;
+    }
+
+    int count = response.count < M_MAX_DISPLAYS ?
+        response.count : M_MAX_DISPLAYS;
+    int i;
+    for (i = 0; i < count && i < max; ++i) {
+        dpy_info[i].width = response.displays[i].width;
+        dpy_info[i].height = response.displays[i].height;
+        dpy_info[i].orientation = response.displays[i].orientation;
+        dpy_info[i].id = i;
+    }
+    return count;
+}
+
 int MCreateBuffer(MDisplay *dpy, MBuffer *buf) {
     struct {
         MRequestHeader header;
@@ -160,6 +449,7 @@ int MCreateBuffer(MDisplay *dpy, MBuffer *buf) {
     packet.header.op = M_CREATE_BUFFER;
     packet.request.width = buf->width;
     packet.request.height = buf->height;
+    packet.request.display = buf->display;
 
     /* send create buffer request to server */
     if (write(dpy->sock_fd, &packet, sizeof(packet)) < 0) {
@@ -170,15 +460,40 @@ int MCreateBuffer(MDisplay *dpy, MBuffer *buf) {
 
     /* wait for response... */
     MCreateBufferResponse response;
-    if (read(dpy->sock_fd, &response, sizeof(response)) < 0) {
-        MLOGE("error receiving create buffer response: %s\n", 
-            strerror(errno));
+    if (read_reply(dpy, &response, sizeof(response), NULL) < 0) {
+        MLOGE("error receiving create buffer response\n");
+        return -1;
     }
 
     buf->__id = response.id;
+    buf->bits = NULL;
+    memset(buf->__slots, 0, sizeof(buf->__slots));
     return response.result ? -1 : 0;
 }
 
+int MDestroyBuffer(MDisplay *dpy, MBuffer *buf) {
+    struct {
+        MRequestHeader header;
+        MDestroyBufferRequest request;
+    } packet;
+    packet.header.op = M_DESTROY_BUFFER;
+    packet.request.id = buf->__id;
+
+    if (write(dpy->sock_fd, &packet, sizeof(packet)) < 0) {
+        MLOGE("error sending destroy buffer request: %s\n",
+            strerror(errno));
+        return -1;
+    }
+
+    /*
+     * No response: the server ignores stale or unknown ids,
+     * so a failed destroy only leaks the surface.
+     */
+    buf->__id = -1;
+    unmap_slots(buf);
+    return 0;
+}
+
 int MUpdateBuffer(MDisplay *dpy, MBuffer *buf,
         uint32_t xpos, uint32_t ypos) {
     struct {
@@ -219,9 +534,8 @@ int MResizeBuffer(MDisplay *dpy, MBuffer *buf,
     }
 
     MResizeBufferResponse response;
-    if (read(dpy->sock_fd, &response, sizeof(response)) < 0) {
-        MLOGE("error receiving resize buffer response: %s\n",
-            strerror(errno));
+    if (read_reply(dpy, &response, sizeof(response), NULL) < 0) {
+        MLOGE("error receiving resize buffer response\n");
         return -1;
     }
 
@@ -229,63 +543,105 @@ int MResizeBuffer(MDisplay *dpy, MBuffer *buf,
         /* success, update buffer size for client */
         buf->width = width;
         buf->height = height;
+
+        /* the server reallocates every slot at the new size */
+        unmap_slots(buf);
     }
     return response.result ? -1 : 0;
 }
 
-int MLockBuffer(MDisplay *dpy, MBuffer *buf) {
-    int buf_fd;
+int MScaleBuffer(MDisplay *dpy, MBuffer *buf,
+        uint32_t width, uint32_t height) {
     struct {
         MRequestHeader header;
-        MLockBufferRequest request;
+        MScaleBufferRequest request;
     } packet;
-    packet.header.op = M_LOCK_BUFFER;
+    packet.header.op = M_SCALE_BUFFER;
     packet.request.id = buf->__id;
+    packet.request.width = width;
+    packet.request.height = height;
 
-    /* send lock buffer request to server */
     if (write(dpy->sock_fd, &packet, sizeof(packet)) < 0) {
-        MLOGE("error sending lock buffer request: %s\n",
-             strerror(errno));
+        MLOGE("error sending scale buffer request: %s\n",
+            strerror(errno));
         return -1;
     }
 
-    /* receive the buffer */
-    MLockBufferResponse response;
-    buf_fd = recvfd(dpy->sock_fd, &response, sizeof(response));
-    if (buf_fd < 0) {
-        MLOGE("error receiving buffer fd: %s\n",
-             strerror(errno));
+    MScaleBufferResponse response;
+    if (read_reply(dpy, &response, sizeof(response), NULL) < 0) {
+        MLOGE("error receiving scale buffer response\n");
         return -1;
     }
 
-    if (buf->width != response.buffer.width ||
-        buf->height != response.buffer.height) {
-        MLOGW("locked buffer dim mismatch...watch out!\n");
+    return response.result ? -1 : 0;
+}
+
+int MRestackBuffer(MDisplay *dpy, MBuffer *buf, int32_t z) {
+    struct {
+        MRequestHeader header;
+        MRestackBufferRequest request;
+    } packet;
+    packet.header.op = M_RESTACK_BUFFER;
+    packet.request.id = buf->__id;
+    packet.request.z = z;
+
+    if (write(dpy->sock_fd, &packet, sizeof(packet)) < 0) {
+        MLOGE("error sending restack buffer request: %s\n",
+            strerror(errno));
+        return -1;
     }
-    buf->stride = response.buffer.stride;
-    buf->__fd = buf_fd;
 
-    /*
-     * mmap into client memory for software r/w
-     * 
-     * NOTE: we need to be careful since we do not know
-     * the offset for sure...let's cross our fingers and
-     * guess no offset!
-     */
-    int offset = 0;
-    void *vaddr = mmap(0, buffer_size(buf), PROT_READ|PROT_WRITE,
-                 MAP_SHARED, buf_fd, offset);
-    if (vaddr == MAP_FAILED) {
-        MLOGE("error mmaping buffer: %s\n", strerror(errno));
-        close(buf->__fd);
-        buf->__fd = -1;
+    /* no response, same as MUpdateBuffer */
+
+    return 0;
+}
+
+int MShowBuffer(MDisplay *dpy, MBuffer *buf, int shown) {
+    struct {
+        MRequestHeader header;
+        MShowBufferRequest request;
+    } packet;
+    packet.header.op = M_SHOW_BUFFER;
+    packet.request.id = buf->__id;
+    packet.request.shown = shown ? 1 : 0;
+
+    if (write(dpy->sock_fd, &packet, sizeof(packet)) < 0) {
+        MLOGE("error sending show buffer request: %s\n",
+            strerror(errno));
         return -1;
     }
-    buf->bits = vaddr;
+
+    /* no response, same as MUpdateBuffer */
 
     return 0;
 }
 
+int MLockBuffer(MDisplay *dpy, MBuffer *buf) {
+    struct {
+        MRequestHeader header;
+        MLockBufferRequest request;
+    } packet;
+    packet.header.op = M_LOCK_BUFFER;
+    packet.request.id = buf->__id;
+    packet.request.unmapped = 0;
+
+    int i;
+    for (i = 0; i < M_BUFFER_SLOTS; ++i) {
+        if (buf->__slots[i].bits == NULL) {
+            packet.request.unmapped |= 1u << i;
+        }
+    }
+
+    /* send lock buffer request to server */
+    if (write(dpy->sock_fd, &packet, sizeof(packet)) < 0) {
+        MLOGE("error sending lock buffer request: %s\n",
+             strerror(errno));
+        return -1;
+    }
+
+    return receive_locked_buffer(dpy, buf);
+}
+
 int MUnlockBuffer(MDisplay *dpy, MBuffer *buf) {
     int err;
     struct {
@@ -302,16 +658,296 @@ int MUnlockBuffer(MDisplay *dpy, MBuffer *buf) {
              strerror(errno));
     }
 
-    /* munmap the stale buffer */
-    if (munmap(buf->bits, buffer_size(buf)) < 0) {
-        MLOGE("error munmapping buffer: %s\n", strerror(errno));
+    /* the slot stays mapped for the next time it is locked */
+    buf->bits = NULL;
+    return err;
+}
+
+int MSwapBuffer(MDisplay *dpy, MBuffer *buf) {
+    struct {
+        MRequestHeader header;
+        MSwapBufferRequest request;
+    } packet;
+    packet.header.op = M_SWAP_BUFFER;
+    packet.request.id = buf->__id;
+
+    if (write(dpy->sock_fd, &packet, sizeof(packet)) < 0) {
+        MLOGE("error sending swap buffer request: %s\n",
+             strerror(errno));
+        return -1;
     }
 
-    /*
-     * close the buffer fd or risk flooding the
-     * system with new fds on each lock/unlock cycle! 
-     */
-    close(buf->__fd);
-    buf->__fd= -1;
-    return err;
+    /* the posted buffer is the server's now */
+    buf->bits = NULL;
+
+    return receive_locked_buffer(dpy, buf);
+}
+
+int MLockedSlot(const MBuffer *buf, uint32_t *generation) {
+    int i;
+    for (i = 0; buf->bits != NULL && i < M_BUFFER_SLOTS; ++i) {
+        if (buf->__slots[i].bits == buf->bits) {
+            *generation = buf->__slots[i].generation;
+            return i;
+        }
+    }
+    return -1;
+}
+
+int MShareCapture(MDisplay *dpy, MCapture *capture) {
+    struct {
+        MRequestHeader header;
+        MShareCaptureRequest request;
+    } packet;
+    packet.header.op = M_SHARE_CAPTURE;
+    packet.request.width = capture->width;
+    packet.request.height = capture->height;
+    packet.request.stride = capture->width * 4;
+    packet.request.size = packet.request.stride * capture->height +
+        M_BLIT_MAX_RECTS * sizeof(MBlitRect);
+
+    capture->bits = NULL;
+    capture->fd = create_shared_memory("mlib-capture", packet.request.size);
+    if (capture->fd < 0) {
+        return -1;
+    }
+    void *vaddr = mmap(0, packet.request.size, PROT_READ|PROT_WRITE,
+        MAP_SHARED, capture->fd, 0);
+    if (vaddr == MAP_FAILED) {
+        MLOGE("error mmaping capture: %s\n", strerror(errno));
+        close(capture->fd);
+        capture->fd = -1;
+        return -1;
+    }
+    capture->bits = vaddr;
+    capture->stride = capture->width;
+    capture->__size = packet.request.size;
+
+    if (send_with_fd(dpy, &packet, sizeof(packet), capture->fd) < 0) {
+        MLOGE("error sending share capture request: %s\n", strerror(errno));
+        MFreeCapture(capture);
+        return -1;
+    }
+
+    MShareCaptureResponse response;
+    if (read_reply(dpy, &response, sizeof(response), NULL) < 0) {
+        MLOGE("error receiving share capture response\n");
+        MFreeCapture(capture);
+        return -1;
+    }
+    if (response.result != 0) {
+        MFreeCapture(capture);
+        return -1;
+    }
+    return 0;
+}
+
+void MFreeCapture(MCapture *capture) {
+    if (capture->bits != NULL && munmap(capture->bits, capture->__size) < 0) {
+        MLOGE("error munmapping capture: %s\n", strerror(errno));
+    }
+    if (capture->fd >= 0) {
+        close(capture->fd);
+    }
+    capture->bits = NULL;
+    capture->fd = -1;
+}
+
+int MBlitBuffer(MDisplay *dpy, MBuffer *buf, MCapture *capture,
+        const MBlitRect *rects, int count) {
+    if (buf->bits != NULL || capture->bits == NULL) {
+        MLOGE("can't blit into a locked buffer or from an unshared capture\n");
+        return -1;
+    }
+    if (count <= 0) {
+        MLOGE("nothing to blit\n");
+        return -1;
+    }
+
+    /* the table sits right behind the pixels */
+    MBlitRect *table = (MBlitRect *)((uint8_t *)capture->bits +
+        (size_t)capture->stride * 4 * capture->height);
+    if (count <= M_BLIT_MAX_RECTS) {
+        memcpy(table, rects, count * sizeof(*rects));
+    } else {
+        int64_t left = rects[0].x, top = rects[0].y;
+        int64_t right = left + rects[0].width, bottom = top + rects[0].height;
+        int i;
+        for (i = 1; i < count; ++i) {
+            int64_t r = (int64_t)rects[i].x + rects[i].width;
+            int64_t b = (int64_t)rects[i].y + rects[i].height;
+            left = rects[i].x < left ? rects[i].x : left;
+            top = rects[i].y < top ? rects[i].y : top;
+            right = r > right ? r : right;
+            bottom = b > bottom ? b : bottom;
+        }
+        table[0].x = left;
+        table[0].y = top;
+        table[0].width = right - left;
+        table[0].height = bottom - top;
+        count = 1;
+    }
+
+    struct {
+        MRequestHeader header;
+        MBlitBufferRequest request;
+    } packet;
+    packet.header.op = M_BLIT_BUFFER;
+    packet.request.id = buf->__id;
+    packet.request.count = count;
+
+    if (write(dpy->sock_fd, &packet, sizeof(packet)) < 0) {
+        MLOGE("error sending blit buffer request: %s\n", strerror(errno));
+        return -1;
+    }
+
+    MBlitBufferResponse response;
+    if (read_reply(dpy, &response, sizeof(response), NULL) < 0) {
+        MLOGE("error receiving blit buffer response\n");
+        return -1;
+    }
+    return response.result ? -1 : 0;
+}
+
+int MSelectEvents(MDisplay *dpy, MBuffer *buf, uint32_t mask) {
+    struct {
+        MRequestHeader header;
+        MSelectEventsRequest request;
+    } packet;
+    packet.header.op = M_SELECT_EVENTS;
+    packet.request.id = buf->__id;
+    packet.request.mask = mask;
+
+    if (write(dpy->sock_fd, &packet, sizeof(packet)) < 0) {
+        MLOGE("error sending select events request: %s\n",
+             strerror(errno));
+        return -1;
+    }
+
+    /* no response, same as MUpdateBuffer */
+
+    return 0;
+}
+
+int MSelectDisplayEvents(MDisplay *dpy, uint32_t mask) {
+    struct {
+        MRequestHeader header;
+        MSelectDisplayEventsRequest request;
+    } packet;
+    packet.header.op = M_SELECT_DISPLAY_EVENTS;
+    packet.request.mask = mask;
+
+    if (write(dpy->sock_fd, &packet, sizeof(packet)) < 0) {
+        MLOGE("error sending select display events request: %s\n",
+             strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int MResumeSession(MDisplay *dpy, MSession *session, MBuffer **bufs,
+        int count) {
+    struct {
+        MRequestHeader header;
+        MResumeSessionRequest request;
+    } packet;
+    memset(&packet, 0, sizeof(packet));
+    packet.header.op = M_RESUME_SESSION;
+    packet.request.token_lo = (uint32_t)session->token;
+    packet.request.token_hi = (uint32_t)(session->token >> 32);
+    packet.request.count = session->count < M_SESSION_MAX_BUFFERS ?
+        session->count : M_SESSION_MAX_BUFFERS;
+    if (count < 0) {
+        count = 0;
+    }
+    if (packet.request.count > (uint32_t)count) {
+        packet.request.count = count;
+    }
+    memcpy(packet.request.ids, session->ids,
+        packet.request.count * sizeof(packet.request.ids[0]));
+
+    if (write(dpy->sock_fd, &packet, sizeof(packet)) < 0) {
+        MLOGE("error sending resume session request: %s\n",
+            strerror(errno));
+        return -1;
+    }
+
+    MResumeSessionResponse response;
+    if (read_reply(dpy, &response, sizeof(response), NULL) < 0) {
+        MLOGE("error receiving resume session response\n");
+        return -1;
+    }
+    if (response.token == 0) {
+        return -1;
+    }
+
+    session->token = response.token;
+
+    uint32_t i;
+    int resumed = 0;
+    for (i = 0; i < packet.request.count; ++i) {
+        if (!(response.resumed & (1u << i))) {
+            continue;
+        }
+
+        MBuffer *buf = bufs[i];
+        buf->width = response.buffers[i].width;
+        buf->height = response.buffers[i].height;
+        buf->display = response.buffers[i].display;
+        buf->__id = session->ids[i];
+        buf->bits = NULL;
+        memset(buf->__slots, 0, sizeof(buf->__slots));
+        resumed |= 1 << i;
+    }
+    return resumed;
+}
+
+void MUpdateSession(MSession *session, MBuffer **bufs, int count) {
+    int i;
+    session->count = count < M_SESSION_MAX_BUFFERS ?
+        count : M_SESSION_MAX_BUFFERS;
+    for (i = 0; i < (int)session->count; ++i) {
+        session->ids[i] = bufs[i]->__id;
+    }
+}
+
+int MEndSession(MDisplay *dpy) {
+    MRequestHeader header;
+    header.op = M_END_SESSION;
+
+    if (write(dpy->sock_fd, &header, sizeof(header)) < 0) {
+        MLOGE("error sending end session request: %s\n",
+            strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int MPending(MDisplay *dpy) {
+    struct pollfd pfd = { dpy->sock_fd, POLLIN, 0 };
+    while (poll(&pfd, 1, 0) > 0) {
+        if (read_message(dpy, NULL, 0, NULL) < 0) {
+            return -1;
+        }
+    }
+    return dpy->__count;
+}
+
+int MEventsQueued(MDisplay *dpy) {
+    return dpy->__count;
+}
+
+int MNextEvent(MDisplay *dpy, MEvent *ev) {
+    while (dpy->__count == 0) {
+        if (read_message(dpy, NULL, 0, NULL) < 0) {
+            return -1;
+        }
+    }
+
+    *ev = dpy->__events[dpy->__head];
+    dpy->__head = (dpy->__head + 1) % M_EVENT_QUEUE_SIZE;
+    --dpy->__count;
+    return 0;
 }
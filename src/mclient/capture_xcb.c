@@ -0,0 +1,316 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xlib-xcb.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <xcb/xcb.h>
+#include <xcb/shm.h>
+
+#include "capture_xcb.h"
+#include "mlog.h"
+#include "pixel.h"
+#include "ximage.h"
+
+/* a rect on its way from the staging segment to the shadow */
+struct pending_rect {
+    xcb_shm_get_image_cookie_t cookie;
+    uint32_t x, y, width, height;
+    uint32_t offset;
+    uint32_t stride;
+};
+
+int capture_xcb_init(struct CaptureXcb *c, Display *dpy) {
+    memset(c, 0, sizeof(*c));
+    c->dpy = dpy;
+    c->conn = XGetXCBConnection(dpy);
+
+    const xcb_query_extension_reply_t *shm =
+        xcb_get_extension_data(c->conn, &xcb_shm_id);
+    if (shm == NULL || !shm->present) {
+        MLOGE("MIT-SHM unavailable through XCB\n");
+        return -1;
+    }
+
+    /* nothing captured yet */
+    c->full = 1;
+    return 0;
+}
+
+void capture_xcb_cleanup(struct CaptureXcb *c) {
+    if (c->staging != NULL) {
+        xshm_cleanup(c->dpy, &c->staging_info, c->staging);
+        c->staging = NULL;
+    }
+}
+
+void capture_xcb_damage(struct CaptureXcb *c, const struct MRect *rects,
+        int nrects) {
+    if (c->full) {
+        return;
+    }
+    if (c->nrects + nrects > CAPTURE_XCB_MAX_RECTS) {
+        capture_xcb_invalidate(c);
+        return;
+    }
+
+    memcpy(&c->rects[c->nrects], rects, nrects * sizeof(*rects));
+    c->nrects += nrects;
+}
+
+void capture_xcb_invalidate(struct CaptureXcb *c) {
+    c->full = 1;
+    c->nrects = 0;
+}
+
+/**
+ * @return a staging image as big as @param shadow, so any rect fits
+ */
+static XImage *get_staging(struct CaptureXcb *c, const XImage *shadow) {
+    if (c->staging != NULL &&
+            c->staging->width == shadow->width &&
+            c->staging->height == shadow->height &&
+            c->staging->depth == shadow->depth) {
+        return c->staging;
+    }
+
+    capture_xcb_cleanup(c);
+    c->staging = xshm_create(c->dpy, &c->staging_info,
+        DefaultVisual(c->dpy, DefaultScreen(c->dpy)), shadow->depth,
+        shadow->width, shadow->height);
+    return c->staging;
+}
+
+/**
+ * Wait for the image that @param cookie asked for.
+ *
+ * @return 0 if @param size bytes of it landed in shm
+ */
+static int wait_image(struct CaptureXcb *c, xcb_shm_get_image_cookie_t cookie,
+        uint32_t size) {
+    xcb_generic_error_t *error = NULL;
+    xcb_shm_get_image_reply_t *reply =
+        xcb_shm_get_image_reply(c->conn, cookie, &error);
+    if (reply == NULL) {
+        MLOGE("error %d capturing through xcb\n",
+            error != NULL ? error->error_code : 0);
+        free(error);
+        return -1;
+    }
+
+    int err = 0;
+    if (reply->size != size) {
+        MLOGE("xcb capture returned %u bytes, expected %u\n",
+            reply->size, size);
+        err = -1;
+    }
+    free(reply);
+    return err;
+}
+
+static int capture_full(struct CaptureXcb *c, XImage *shadow) {
+    const XShmSegmentInfo *info = (const XShmSegmentInfo *)shadow->obdata;
+    xcb_shm_get_image_cookie_t cookie = xcb_shm_get_image(c->conn,
+        DefaultRootWindow(c->dpy), 0, 0, shadow->width, shadow->height,
+        ~0u, XCB_IMAGE_FORMAT_Z_PIXMAP, info->shmseg, 0);
+    return wait_image(c, cookie,
+        (uint32_t)shadow->bytes_per_line * shadow->height);
+}
+
+static void copy_to_shadow(XImage *shadow, const XImage *staging,
+        const struct pending_rect *p) {
+    uint32_t bytes = p->width * shadow->bits_per_pixel / 8;
+    const uint8_t *src = (const uint8_t *)staging->data + p->offset;
+    uint8_t *dst = (uint8_t *)shadow->data +
+        (size_t)p->y * shadow->bytes_per_line +
+        p->x * shadow->bits_per_pixel / 8;
+
+    uint32_t y;
+    for (y = 0; y < p->height; ++y) {
+        memcpy(dst, src, bytes);
+        src += p->stride;
+        dst += shadow->bytes_per_line;
+    }
+}
+
+/**
+ * Clip @param r to @param shadow and lay it out in staging at
+ * @param offset, padded like the server pads ZPixmap rows.
+ *
+ * @return 0 if nothing is left
+ */
+static int layout_rect(const XImage *shadow, const struct MRect *r,
+        uint32_t offset, struct pending_rect *p) {
+    int64_t left = r->x < 0 ? 0 : r->x;
+    int64_t top = r->y < 0 ? 0 : r->y;
+    int64_t right = (int64_t)r->x + r->width;
+    int64_t bottom = (int64_t)r->y + r->height;
+    if (right > shadow->width) {
+        right = shadow->width;
+    }
+    if (bottom > shadow->height) {
+        bottom = shadow->height;
+    }
+    if (left >= right || top >= bottom) {
+        return 0;
+    }
+
+    uint32_t pad = shadow->bitmap_pad;
+    p->x = left;
+    p->y = top;
+    p->width = right - left;
+    p->height = bottom - top;
+    p->offset = offset;
+    p->stride = (p->width * shadow->bits_per_pixel + pad - 1) / pad * pad / 8;
+    return 1;
+}
+
+/**
+ * Send a GetImage for every damaged rect that fits in staging, then
+ * copy each into the shadow as its reply comes in.
+ */
+static int capture_rects(struct CaptureXcb *c, XImage *shadow) {
+    XImage *staging = get_staging(c, shadow);
+    if (staging == NULL) {
+        return -1;
+    }
+    const XShmSegmentInfo *info = (const XShmSegmentInfo *)staging->obdata;
+    uint32_t staging_size = (uint32_t)staging->bytes_per_line * staging->height;
+
+    struct pending_rect batch[CAPTURE_XCB_MAX_RECTS];
+    int i = 0, err = 0;
+    while (i < c->nrects) {
+        /* damage rects don't overlap, so a batch is usually all of them */
+        int j, n = 0;
+        uint32_t offset = 0;
+        for (; i < c->nrects; ++i) {
+            struct pending_rect *p = &batch[n];
+            if (!layout_rect(shadow, &c->rects[i], offset, p)) {
+                continue;
+            }
+            if (offset + p->stride * p->height > staging_size) {
+                break;
+            }
+
+            p->cookie = xcb_shm_get_image(c->conn, DefaultRootWindow(c->dpy),
+                p->x, p->y, p->width, p->height, ~0u,
+                XCB_IMAGE_FORMAT_Z_PIXMAP, info->shmseg, p->offset);
+            offset += p->stride * p->height;
+            ++n;
+        }
+        xcb_flush(c->conn);
+
+        for (j = 0; j < n; ++j) {
+            struct pending_rect *p = &batch[j];
+            if (err) {
+                xcb_discard_reply(c->conn, p->cookie.sequence);
+            } else if (wait_image(c, p->cookie, p->stride * p->height) < 0) {
+                err = -1;
+            } else {
+                copy_to_shadow(shadow, staging, p);
+                c->rects_captured++;
+                c->px_captured += (uint64_t)p->width * p->height;
+            }
+        }
+        if (err) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int capture_xcb_update(struct CaptureXcb *c, XImage *shadow) {
+    if (c->full) {
+        if (capture_full(c, shadow) < 0) {
+            return -1;
+        }
+        c->full_captures++;
+        c->px_captured += (uint64_t)shadow->width * shadow->height;
+    } else if (c->nrects > 0) {
+        if (capture_rects(c, shadow) < 0) {
+            return -1;
+        }
+    } else {
+        return 0;
+    }
+
+    c->captures++;
+    c->full = 0;
+    c->nrects = 0;
+    return 0;
+}
+
+XImage *capture_xcb_attach(struct CaptureXcb *c, const MCapture *capture) {
+    int screen = DefaultScreen(c->dpy);
+    XImage *shadow = XCreateImage(c->dpy, DefaultVisual(c->dpy, screen),
+        DefaultDepth(c->dpy, screen), ZPixmap, 0, capture->bits,
+        capture->width, capture->height, 32, capture->stride * 4);
+    if (shadow == NULL) {
+        MLOGE("error creating an image for the shared capture\n");
+        return NULL;
+    }
+
+    struct PixelConverter converter;
+    XShmSegmentInfo *info = calloc(1, sizeof(*info));
+    if (pixel_converter_init(&converter, shadow->bits_per_pixel,
+            shadow->red_mask, shadow->green_mask, shadow->blue_mask) < 0 ||
+            !converter.identity) {
+        MLOGE("server blits need BGRA pixels, X has %d bpp\n",
+            shadow->bits_per_pixel);
+    } else if (info == NULL) {
+        MLOGE("error allocating segment info\n");
+    } else {
+        /* XCB closes the fd once it is sent, the capture keeps its own */
+        int fd = dup(capture->fd);
+        info->shmseg = xcb_generate_id(c->conn);
+        info->shmid = -1;
+        info->shmaddr = capture->bits;
+        info->readOnly = False;
+
+        xcb_generic_error_t *error = fd < 0 ? NULL :
+            xcb_request_check(c->conn,
+                xcb_shm_attach_fd_checked(c->conn, info->shmseg, fd, 0));
+        if (fd >= 0 && error == NULL) {
+            shadow->obdata = (char *)info;
+            return shadow;
+        }
+        MLOGE("error %d attaching the shared capture to X\n",
+            error != NULL ? error->error_code : 0);
+        free(error);
+    }
+
+    free(info);
+    shadow->data = NULL;
+    XDestroyImage(shadow);
+    return NULL;
+}
+
+void capture_xcb_detach(struct CaptureXcb *c, XImage *shadow) {
+    XShmSegmentInfo *info = (XShmSegmentInfo *)shadow->obdata;
+    xcb_shm_detach(c->conn, info->shmseg);
+    xcb_flush(c->conn);
+    free(info);
+
+    /* the capture owns the pixels */
+    shadow->obdata = NULL;
+    shadow->data = NULL;
+    XDestroyImage(shadow);
+}
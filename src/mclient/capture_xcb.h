@@ -0,0 +1,108 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_CAPTURE_XCB_H
+#define M_CAPTURE_XCB_H
+
+#include <stdint.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/XShm.h>
+#include <xcb/xcb.h>
+
+#include "mlib.h"
+#include "rect.h"
+
+/*
+ * Root capture through XCB, selected with MCLIENT_CAPTURE=xcb.
+ *
+ * XShmGetImage() is a round trip, so capturing damage rect by rect
+ * through Xlib would cost one round trip each. Here every damaged rect
+ * gets its own shm GetImage, all sent back to back, and each rect is
+ * copied out while the server is still filling in the ones after it.
+ *
+ * The full-screen XShm image stays a shadow of the root window: rects
+ * land packed in a staging segment and are copied to their place in
+ * the shadow, which is then copied to the buffer same as a full
+ * capture. Locked buffers rotate, so only the shadow can be patched.
+ *
+ * Requests go out on the Xlib connection through XGetXCBConnection(),
+ * so they are ordered with everything else mclient sends, including
+ * the XDamageSubtract() that reported the rects.
+ *
+ * For server-side blits the shadow is the capture shared with
+ * mflinger instead, see capture_xcb_attach().
+ */
+#define CAPTURE_XCB_MAX_RECTS (64)
+
+struct CaptureXcb {
+    Display *dpy;
+    xcb_connection_t *conn;
+
+    /* rects are packed here on their way to the shadow */
+    XImage *staging;
+    XShmSegmentInfo staging_info;
+
+    /* damage the shadow hasn't seen yet */
+    struct MRect rects[CAPTURE_XCB_MAX_RECTS];
+    int nrects;
+    int full;                   /* the whole shadow is stale */
+
+    uint64_t captures;
+    uint64_t full_captures;
+    uint64_t rects_captured;
+    uint64_t px_captured;
+};
+
+/**
+ * @return 0 on success, -1 if the X server has no MIT-SHM for XCB
+ */
+int capture_xcb_init(struct CaptureXcb *c, Display *dpy);
+
+void capture_xcb_cleanup(struct CaptureXcb *c);
+
+/**
+ * Remember @param rects for the next capture. Too many rects to keep
+ * make it a full capture.
+ */
+void capture_xcb_damage(struct CaptureXcb *c, const struct MRect *rects,
+        int nrects);
+
+/**
+ * The shadow missed damage or is a new image, capture all of it next.
+ */
+void capture_xcb_invalidate(struct CaptureXcb *c);
+
+/**
+ * Bring the screen-sized XShm image @param shadow up to date with the
+ * damage since the last call. The damage is kept for the next call if
+ * anything fails.
+ *
+ * @return 0 on success, -1 on failure
+ */
+int capture_xcb_update(struct CaptureXcb *c, XImage *shadow);
+
+/**
+ * Attach @param capture to the X server through its fd and wrap it in
+ * a shadow image for capture_xcb_update(). mflinger copies the pixels
+ * as they are, so this fails unless X hands out BGRA already.
+ *
+ * @return the shadow, or NULL on failure
+ */
+XImage *capture_xcb_attach(struct CaptureXcb *c, const MCapture *capture);
+
+void capture_xcb_detach(struct CaptureXcb *c, XImage *shadow);
+
+#endif // M_CAPTURE_XCB_H
@@ -0,0 +1,132 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "cursor_predictor.h"
+
+void cursor_predictor_init(struct CursorPredictor *p) {
+    memset(p, 0, sizeof(*p));
+}
+
+static int opposite(int a, int b) {
+    return (a < 0 && b > 0) || (a > 0 && b < 0);
+}
+
+void cursor_predictor_add(struct CursorPredictor *p, uint32_t t, int x, int y) {
+    if (p->count > 0) {
+        struct CursorSample *last = &p->history[p->count - 1];
+
+        /* unsigned, so a timestamp going backwards is a huge gap too */
+        if (t - last->t > CURSOR_PREDICTOR_MAX_GAP_MS) {
+            p->count = 0;
+        } else if (t == last->t) {
+            /* fast mice report several events per ms, keep the newest */
+            --p->count;
+        }
+    }
+
+    if (p->count > 1) {
+        struct CursorSample *last = &p->history[p->count - 1];
+        struct CursorSample *prev = &p->history[p->count - 2];
+        if (opposite(x - last->x, last->x - prev->x) ||
+                opposite(y - last->y, last->y - prev->y)) {
+            /* turned around, the old motion says nothing anymore */
+            p->history[0] = *last;
+            p->count = 1;
+        }
+    }
+
+    if (p->count == CURSOR_PREDICTOR_HISTORY) {
+        memmove(&p->history[0], &p->history[1],
+            (CURSOR_PREDICTOR_HISTORY - 1) * sizeof(p->history[0]));
+        --p->count;
+    }
+
+    struct CursorSample *sample = &p->history[p->count++];
+    sample->t = t;
+    sample->x = x;
+    sample->y = y;
+}
+
+static float coord(const struct CursorSample *s, int axis) {
+    return axis == 0 ? s->x : s->y;
+}
+
+/**
+ * @return how far the pointer will have moved along @param axis
+ * (0 = x, 1 = y) @param lead ms after the newest sample
+ */
+static float predict_axis(const struct CursorPredictor *p, int axis,
+        float lead) {
+    const struct CursorSample *h = p->history;
+    int n = p->count - 1;
+
+    /* velocity over the newer half, in px/ms */
+    int m = n / 2;
+    float dt_new = h[n].t - h[m].t;
+    float v = (coord(&h[n], axis) - coord(&h[m], axis)) / dt_new;
+    float delta = v * lead;
+
+    if (m > 0) {
+        /* and how it changed since the older half */
+        float dt_old = h[m].t - h[0].t;
+        float v_old = (coord(&h[m], axis) - coord(&h[0], axis)) / dt_old;
+        float a = (v - v_old) / ((dt_new + dt_old) / 2);
+
+        /* v is the mean over the newer half, bring it up to date */
+        float predicted = (v + a * dt_new / 2) * lead + a * lead * lead / 2;
+
+        /*
+         * Slowing down can stop the cursor, not turn it around, and
+         * speeding up at most doubles the lead.
+         */
+        if (predicted * delta <= 0) {
+            delta = 0;
+        } else if (predicted / delta > 2) {
+            delta = 2 * delta;
+        } else {
+            delta = predicted;
+        }
+    }
+
+    if (delta > CURSOR_PREDICTOR_MAX_PX) {
+        delta = CURSOR_PREDICTOR_MAX_PX;
+    } else if (delta < -CURSOR_PREDICTOR_MAX_PX) {
+        delta = -CURSOR_PREDICTOR_MAX_PX;
+    }
+    return delta;
+}
+
+void cursor_predictor_predict(const struct CursorPredictor *p,
+        uint32_t lead_ms, int *x_ret, int *y_ret) {
+    if (p->count == 0) {
+        return;
+    }
+
+    const struct CursorSample *last = &p->history[p->count - 1];
+    *x_ret = last->x;
+    *y_ret = last->y;
+    if (p->count < 2 || lead_ms == 0) {
+        return;
+    }
+
+    /* round half away from zero */
+    float dx = predict_axis(p, 0, lead_ms);
+    float dy = predict_axis(p, 1, lead_ms);
+    *x_ret += (int)(dx < 0 ? dx - 0.5f : dx + 0.5f);
+    *y_ret += (int)(dy < 0 ? dy - 0.5f : dy + 0.5f);
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_CURSOR_PREDICTOR_H
+#define M_CURSOR_PREDICTOR_H
+
+#include <stdint.h>
+
+/*
+ * Guesses where the pointer will be when the cursor surface we are
+ * about to move is actually on screen, from the last few motion
+ * events.
+ *
+ * The newest velocity and acceleration are extrapolated lead_ms ahead.
+ * The guess never leads the last real position by more than
+ * CURSOR_PREDICTOR_MAX_PX per axis, or by more than twice what the
+ * measured velocity alone says, and deceleration never makes it point
+ * back. A direction change drops the history, as does a gap of more
+ * than CURSOR_PREDICTOR_MAX_GAP_MS between events (the pointer had
+ * stopped).
+ *
+ * Times are X server timestamps in ms, they may wrap.
+ */
+#define CURSOR_PREDICTOR_HISTORY    (4)
+#define CURSOR_PREDICTOR_MAX_GAP_MS (50)
+#define CURSOR_PREDICTOR_MAX_PX     (64)
+
+struct CursorSample {
+    uint32_t t;
+    int x;
+    int y;
+};
+
+struct CursorPredictor {
+    struct CursorSample history[CURSOR_PREDICTOR_HISTORY];   /* oldest first */
+    int count;
+};
+
+void cursor_predictor_init(struct CursorPredictor *p);
+
+/**
+ * The pointer was at (@param x, @param y) at @param t.
+ */
+void cursor_predictor_add(struct CursorPredictor *p, uint32_t t, int x, int y);
+
+/**
+ * Extrapolate the last sample @param lead_ms ahead. Without enough
+ * history, or with @param lead_ms 0, that is the last sample itself.
+ */
+void cursor_predictor_predict(const struct CursorPredictor *p,
+        uint32_t lead_ms, int *x_ret, int *y_ret);
+
+#endif // M_CURSOR_PREDICTOR_H
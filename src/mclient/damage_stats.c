@@ -0,0 +1,247 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "damage_stats.h"
+#include "mlog.h"
+
+int damage_stats_init(struct DamageStats *s,
+        uint32_t screen_width, uint32_t screen_height) {
+    memset(s, 0, sizeof(*s));
+    s->screen_width = screen_width;
+    s->screen_height = screen_height;
+    s->cols = (screen_width + DAMAGE_STATS_TILE_PX - 1) / DAMAGE_STATS_TILE_PX;
+    s->rows = (screen_height + DAMAGE_STATS_TILE_PX - 1) / DAMAGE_STATS_TILE_PX;
+
+    size_t tiles = (size_t)s->cols * s->rows;
+    s->tile_frames = calloc(tiles, sizeof(*s->tile_frames));
+    s->tile_area = calloc(tiles, sizeof(*s->tile_area));
+    s->tile_last_frame = calloc(tiles, sizeof(*s->tile_last_frame));
+    if (tiles > 0 && (s->tile_frames == NULL || s->tile_area == NULL ||
+            s->tile_last_frame == NULL)) {
+        MLOGE("error allocating damage stats\n");
+        damage_stats_free(s);
+        return -1;
+    }
+    return 0;
+}
+
+void damage_stats_free(struct DamageStats *s) {
+    free(s->tile_frames);
+    free(s->tile_area);
+    free(s->tile_last_frame);
+    s->tile_frames = NULL;
+    s->tile_area = NULL;
+    s->tile_last_frame = NULL;
+    s->cols = s->rows = 0;
+}
+
+static int log2_bucket(uint64_t v) {
+    int bucket = v > 0 ? 63 - __builtin_clzll(v) : 0;
+    return bucket < DAMAGE_STATS_LOG2_BUCKETS ?
+        bucket : DAMAGE_STATS_LOG2_BUCKETS - 1;
+}
+
+/**
+ * Clip @param r to the screen.
+ *
+ * @return 0 if nothing is left
+ */
+static int clip(const struct DamageStats *s, const struct MRect *r,
+        uint32_t *x0, uint32_t *y0, uint32_t *x1, uint32_t *y1) {
+    int64_t left = r->x < 0 ? 0 : r->x;
+    int64_t top = r->y < 0 ? 0 : r->y;
+    int64_t right = (int64_t)r->x + r->width;
+    int64_t bottom = (int64_t)r->y + r->height;
+    if (right > s->screen_width) {
+        right = s->screen_width;
+    }
+    if (bottom > s->screen_height) {
+        bottom = s->screen_height;
+    }
+    if (left >= right || top >= bottom) {
+        return 0;
+    }
+
+    *x0 = left;
+    *y0 = top;
+    *x1 = right;
+    *y1 = bottom;
+    return 1;
+}
+
+void damage_stats_add(struct DamageStats *s, const struct MRect *rects,
+        int nrects, int total) {
+    /* frame numbers start at 1 so 0 means "not this frame" */
+    uint32_t frame = s->frames + 1;
+
+    int i;
+    for (i = 0; i < nrects; ++i) {
+        uint32_t x0, y0, x1, y1;
+        if (!clip(s, &rects[i], &x0, &y0, &x1, &y1)) {
+            continue;
+        }
+
+        uint64_t area = (uint64_t)(x1 - x0) * (y1 - y0);
+        s->rect_area[log2_bucket(area)]++;
+        s->frame_area_px += area;
+
+        uint32_t tx, ty;
+        for (ty = y0 / DAMAGE_STATS_TILE_PX;
+                ty <= (y1 - 1) / DAMAGE_STATS_TILE_PX; ++ty) {
+            uint32_t top = ty * DAMAGE_STATS_TILE_PX;
+            uint32_t bottom = top + DAMAGE_STATS_TILE_PX;
+            uint32_t h = (y1 < bottom ? y1 : bottom) - (y0 > top ? y0 : top);
+
+            for (tx = x0 / DAMAGE_STATS_TILE_PX;
+                    tx <= (x1 - 1) / DAMAGE_STATS_TILE_PX; ++tx) {
+                uint32_t left = tx * DAMAGE_STATS_TILE_PX;
+                uint32_t right = left + DAMAGE_STATS_TILE_PX;
+                uint32_t w = (x1 < right ? x1 : right) -
+                             (x0 > left ? x0 : left);
+
+                size_t tile = (size_t)ty * s->cols + tx;
+                s->tile_area[tile] += (uint64_t)w * h;
+                if (s->tile_last_frame[tile] != frame) {
+                    s->tile_last_frame[tile] = frame;
+                    s->tile_frames[tile]++;
+                }
+            }
+        }
+    }
+
+    s->frame_rects += total;
+}
+
+void damage_stats_end_frame(struct DamageStats *s) {
+    if (s->frame_rects == 0) {
+        return;
+    }
+
+    uint64_t screen = (uint64_t)s->screen_width * s->screen_height;
+    uint64_t percent = screen > 0 ? s->frame_area_px * 100 / screen : 0;
+    int bucket = percent / (100 / DAMAGE_STATS_AREA_BUCKETS);
+
+    s->frames++;
+    s->rects += s->frame_rects;
+    s->rects_per_frame[log2_bucket(s->frame_rects)]++;
+    s->frame_area[bucket < DAMAGE_STATS_AREA_BUCKETS ?
+        bucket : DAMAGE_STATS_AREA_BUCKETS - 1]++;
+    if (percent < DAMAGE_STATS_SMALL_PERCENT) {
+        s->small_frames++;
+    }
+
+    s->frame_rects = 0;
+    s->frame_area_px = 0;
+}
+
+static int write_heatmap(const struct DamageStats *s, const char *path) {
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        MLOGE("error opening %s\n", path);
+        return -1;
+    }
+
+    size_t i, tiles = (size_t)s->cols * s->rows;
+    uint32_t max = 0;
+    for (i = 0; i < tiles; ++i) {
+        if (s->tile_frames[i] > max) {
+            max = s->tile_frames[i];
+        }
+    }
+
+    fprintf(f, "P5\n%u %u\n255\n", s->cols, s->rows);
+    for (i = 0; i < tiles; ++i) {
+        fputc(max > 0 ? (int)((uint64_t)s->tile_frames[i] * 255 / max) : 0, f);
+    }
+
+    if (fclose(f) != 0) {
+        MLOGE("error writing %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static void write_array(FILE *f, const char *name, const uint64_t *v,
+        size_t n, int last) {
+    size_t i;
+    fprintf(f, "  \"%s\": [", name);
+    for (i = 0; i < n; ++i) {
+        fprintf(f, "%s%llu", i ? ", " : "", (unsigned long long)v[i]);
+    }
+    fprintf(f, "]%s\n", last ? "" : ",");
+}
+
+static int write_json(const struct DamageStats *s, const char *path) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        MLOGE("error opening %s\n", path);
+        return -1;
+    }
+
+    size_t i, tiles = (size_t)s->cols * s->rows;
+    fprintf(f, "{\n");
+    fprintf(f, "  \"screen\": [%u, %u],\n", s->screen_width, s->screen_height);
+    fprintf(f, "  \"tile_px\": %d,\n", DAMAGE_STATS_TILE_PX);
+    fprintf(f, "  \"tiles\": [%u, %u],\n", s->cols, s->rows);
+    fprintf(f, "  \"frames\": %llu,\n", (unsigned long long)s->frames);
+    fprintf(f, "  \"rects\": %llu,\n", (unsigned long long)s->rects);
+    fprintf(f, "  \"small_percent\": %d,\n", DAMAGE_STATS_SMALL_PERCENT);
+    fprintf(f, "  \"small_fraction\": %.4f,\n", s->frames > 0 ?
+        (double)s->small_frames / s->frames : 0.0);
+    write_array(f, "rects_per_frame_log2", s->rects_per_frame,
+        DAMAGE_STATS_LOG2_BUCKETS, 0);
+    write_array(f, "rect_area_log2", s->rect_area,
+        DAMAGE_STATS_LOG2_BUCKETS, 0);
+    write_array(f, "frame_area_percent", s->frame_area,
+        DAMAGE_STATS_AREA_BUCKETS, 0);
+
+    /* row-major, same layout as the heatmap */
+    fprintf(f, "  \"tile_frames\": [");
+    for (i = 0; i < tiles; ++i) {
+        fprintf(f, "%s%u", i ? ", " : "", s->tile_frames[i]);
+    }
+    fprintf(f, "],\n");
+    write_array(f, "tile_area", s->tile_area, tiles, 1);
+    fprintf(f, "}\n");
+
+    if (fclose(f) != 0) {
+        MLOGE("error writing %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+int damage_stats_write(const struct DamageStats *s, const char *prefix) {
+    char path[4096];
+
+    snprintf(path, sizeof(path), "%s.pgm", prefix);
+    if (write_heatmap(s, path) < 0) {
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s.json", prefix);
+    if (write_json(s, path) < 0) {
+        return -1;
+    }
+
+    MLOGI("wrote damage stats for %llu frames to %s.{pgm,json}\n",
+        (unsigned long long)s->frames, prefix);
+    return 0;
+}
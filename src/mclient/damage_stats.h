@@ -0,0 +1,97 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_DAMAGE_STATS_H
+#define M_DAMAGE_STATS_H
+
+#include <stdint.h>
+
+#include "rect.h"
+
+/*
+ * What root window damage looks like over a session, to tune capture
+ * strategies against real desktops rather than guesses.
+ *
+ * Set MCLIENT_DAMAGE_STATS=<prefix> and send mclient SIGUSR1 to write
+ * <prefix>.pgm, a heatmap of how often each DAMAGE_STATS_TILE_PX tile
+ * was damaged (one pixel per tile, brightest = most often), and
+ * <prefix>.json with the per-tile counts and damaged areas plus:
+ *
+ *  - rects_per_frame_log2: frames by number of damage rects,
+ *    bucket i counts frames with [2^i, 2^(i+1)) rects
+ *  - rect_area_log2: damage rects by area in px, same buckets
+ *  - frame_area_percent: frames by damaged share of the screen,
+ *    bucket i counts [10i, 10(i+1)) percent
+ *  - small_fraction: share of frames that damaged less than
+ *    DAMAGE_STATS_SMALL_PERCENT of the screen
+ *
+ * A frame is everything damaged between two root renders. Its area is
+ * the sum of its rects, so damage hit twice in one frame counts twice.
+ * They are written again on exit. Nothing is collected, and no extra
+ * X requests are made, unless the variable is set.
+ */
+#define DAMAGE_STATS_TILE_PX        (64)
+#define DAMAGE_STATS_LOG2_BUCKETS   (32)
+#define DAMAGE_STATS_AREA_BUCKETS   (10)
+#define DAMAGE_STATS_SMALL_PERCENT  (10)
+
+struct DamageStats {
+    uint32_t screen_width;
+    uint32_t screen_height;
+    uint32_t cols;              /* tiles across */
+    uint32_t rows;
+    uint32_t *tile_frames;      /* frames that damaged each tile */
+    uint64_t *tile_area;        /* damaged px in each tile */
+    uint32_t *tile_last_frame;  /* to count a tile once per frame */
+
+    uint64_t frames;
+    uint64_t small_frames;
+    uint64_t rects;
+    uint64_t rects_per_frame[DAMAGE_STATS_LOG2_BUCKETS];
+    uint64_t rect_area[DAMAGE_STATS_LOG2_BUCKETS];
+    uint64_t frame_area[DAMAGE_STATS_AREA_BUCKETS];
+
+    /* the frame being collected */
+    uint32_t frame_rects;
+    uint64_t frame_area_px;
+};
+
+/**
+ * @return 0 on success, -1 if the tile maps can't be allocated
+ */
+int damage_stats_init(struct DamageStats *s,
+        uint32_t screen_width, uint32_t screen_height);
+
+void damage_stats_free(struct DamageStats *s);
+
+/**
+ * Add damage to the current frame. @param rects may have been merged
+ * down from @param total rects, which is what gets counted.
+ */
+void damage_stats_add(struct DamageStats *s, const struct MRect *rects,
+        int nrects, int total);
+
+/**
+ * The current frame was rendered, start a new one.
+ */
+void damage_stats_end_frame(struct DamageStats *s);
+
+/**
+ * Write <@param prefix>.pgm and <@param prefix>.json.
+ */
+int damage_stats_write(const struct DamageStats *s, const char *prefix);
+
+#endif // M_DAMAGE_STATS_H
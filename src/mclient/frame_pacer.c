@@ -0,0 +1,75 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "frame_pacer.h"
+
+void frame_pacer_init(struct FramePacer *p) {
+    memset(p, 0, sizeof(*p));
+}
+
+uint64_t frame_pacer_next_render(const struct FramePacer *p, uint64_t now) {
+    if (p->refresh == 0) {
+        return now;
+    }
+
+    if (p->in_flight_since != 0) {
+        uint64_t give_up = p->in_flight_since +
+            FRAME_PACER_LOST_PERIODS * p->refresh;
+        if (now < give_up) {
+            return give_up;
+        }
+    }
+
+    /* find the first vsync the capture can still make */
+    uint64_t lead = p->render_cost + FRAME_PACER_SLACK_NS;
+    uint64_t earliest_post = now + lead;
+    uint64_t vsync = p->last_present;
+    if (earliest_post > vsync) {
+        uint64_t periods = (earliest_post - vsync + p->refresh - 1) /
+            p->refresh;
+        vsync += periods * p->refresh;
+    }
+
+    return vsync - lead;
+}
+
+void frame_pacer_on_render(struct FramePacer *p, uint64_t start,
+        uint64_t end) {
+    uint64_t cost = end > start ? end - start : 0;
+
+    /* 1/8 weight smooths out the odd slow frame */
+    if (p->render_cost == 0) {
+        p->render_cost = cost;
+    } else {
+        p->render_cost = p->render_cost - p->render_cost / 8 + cost / 8;
+    }
+
+    if (p->in_flight_since != 0 && p->refresh != 0) {
+        /* rendered anyway, so the previous frame timed out */
+        ++p->lost;
+    }
+    p->in_flight_since = end;
+    ++p->frames;
+}
+
+void frame_pacer_on_present(struct FramePacer *p, uint64_t present,
+        uint64_t refresh) {
+    p->last_present = present;
+    p->refresh = refresh;
+    p->in_flight_since = 0;
+}
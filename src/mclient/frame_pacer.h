@@ -0,0 +1,71 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_FRAME_PACER_H
+#define M_FRAME_PACER_H
+
+#include <stdint.h>
+
+/*
+ * Decides when to capture the root window from mflinger's
+ * M_FRAME_PRESENTED feedback.
+ *
+ * A capture is started just early enough to be posted
+ * FRAME_PACER_SLACK_NS before the next vsync, so it shows the newest
+ * content that can still make that vsync. Nothing is rendered while a
+ * posted frame has not been presented yet, since SurfaceFlinger would
+ * only drop one of them. A frame still not presented after
+ * FRAME_PACER_LOST_PERIODS is given up on.
+ *
+ * Without feedback (old server, or pacing disabled) every capture
+ * starts right away, as before.
+ *
+ * All times are CLOCK_MONOTONIC ns.
+ */
+#define FRAME_PACER_SLACK_NS        (1000000)
+#define FRAME_PACER_LOST_PERIODS    (3)
+
+struct FramePacer {
+    uint64_t last_present;      /* 0 = no feedback yet */
+    uint64_t refresh;
+    uint64_t render_cost;       /* moving average, capture to post */
+    uint64_t in_flight_since;   /* 0 = nothing waiting to be presented */
+
+    /* stats */
+    uint64_t frames;
+    uint64_t lost;              /* frames never reported presented */
+};
+
+void frame_pacer_init(struct FramePacer *p);
+
+/**
+ * @return when the next capture should start, <= @param now if it
+ * can start right away
+ */
+uint64_t frame_pacer_next_render(const struct FramePacer *p, uint64_t now);
+
+/**
+ * A capture ran from @param start to @param end and was posted.
+ */
+void frame_pacer_on_render(struct FramePacer *p, uint64_t start, uint64_t end);
+
+/**
+ * The server reported a posted frame on screen at @param present.
+ */
+void frame_pacer_on_present(struct FramePacer *p, uint64_t present,
+        uint64_t refresh);
+
+#endif // M_FRAME_PACER_H
@@ -24,6 +24,7 @@
 #include <fcntl.h>
 #include <poll.h>
 #include <pthread.h>
+#include <signal.h>
 
 #include <sys/ipc.h>
 #include <sys/shm.h>
@@ -33,17 +34,63 @@
 #include <X11/Xresource.h>
 #include <X11/extensions/XShm.h>
 #include <X11/extensions/Xdamage.h>
+#include <X11/extensions/Xfixes.h>
 #include <X11/extensions/Xrandr.h>
 
 #include <linux/input.h>
 
 #include "mlib.h"
+#include "capture_xcb.h"
+#include "damage_stats.h"
+#include "frame_pacer.h"
+#include "mconfig.h"
 #include "mcursor.h"
 #include "mcursor_cache.h"
 #include "mlog.h"
+#include "mloop.h"
+#include "moutput.h"
+#include "moverlay.h"
+#include "mrootless.h"
+#include "msession.h"
+#include "mtrace.h"
+#include "rate_controller.h"
+#include "rect.h"
+#include "scroll_tracker.h"
+#include "util.h"
+#include "ximage.h"
 
 #define BUF_SIZE (1 << 8)
 
+/* back-off before trying a failed root render again */
+#define RENDER_RETRY_MS (100)
+
+/* downscale factor the root buffer is currently set up for */
+static int render_scale = 1;
+
+/* root capture through XCB with MCLIENT_CAPTURE=xcb, NULL for Xlib */
+static struct CaptureXcb *xcb_capture = NULL;
+
+/* set while MCONFIG_SCROLL_DETECT is on */
+static struct ScrollTracker *scroll_tracker = NULL;
+
+/*
+ * The capture shared with mflinger while MCONFIG_SERVER_BLIT is on,
+ * and the shadow XCB captures into it through. NULL otherwise.
+ */
+static MCapture *blit_capture = NULL;
+static XImage *blit_shadow = NULL;
+
+/* the last root frame went through blit_root() */
+static int blitted = 0;
+
+/* buffers taken back from the last mclient, see msession.h */
+enum {
+    SESSION_ROOT,
+    SESSION_CURSOR,
+
+    SESSION_NUM_BUFFERS
+};
+
 /**
  * We use a custom error handler here for flexibility over the default handler
  * that just kills the process.
@@ -63,135 +110,202 @@ int x_error_handler(Display *dpy, XErrorEvent *ev) {
     return 0;
 }
 
-int copy_ximg_rows_to_buffer_mlocked(MBuffer *buf, XImage *ximg,
-         uint32_t row_start, uint32_t row_end) {
-    /* TODO ximg->xoffset? */
-    uint32_t buf_bytes_per_line = buf->stride * 4;
-    uint32_t ximg_bytes_per_pixel = ximg->bits_per_pixel / 8;
-    uint32_t y;
-
-    /* row-by-row copy to adjust for differing strides */
-    uint32_t *buf_row, *ximg_row;
-    for (y = row_start; y < row_end; ++y) {
-        buf_row = buf->bits + (y * buf_bytes_per_line);
-        ximg_row = (void *)ximg->data + (y * ximg->bytes_per_line);
-
-        /*
-         * we don't want to copy any extra XImage row padding
-         * so we just copy up to image width instead of bytes_per_line
-         */
-        memcpy(buf_row, ximg_row, ximg->width * ximg_bytes_per_pixel);
+/**
+ * The root was rendered, or is about to be, without its damage being
+ * tracked, so an XCB capture has to start over from the full screen
+ * and scrolls can't be told from the damage.
+ */
+static void invalidate_capture(void) {
+    if (xcb_capture != NULL) {
+        capture_xcb_invalidate(xcb_capture);
+    }
+    if (scroll_tracker != NULL) {
+        scroll_tracker_reset(scroll_tracker);
     }
-
-    return 0;
 }
 
-int copy_ximg_to_buffer_mlocked(MBuffer *buf, XImage *ximg) {
-    return copy_ximg_rows_to_buffer_mlocked(buf, ximg, 0, ximg->height);
+/**
+ * Post the root buffer if render_root() left it locked, e.g. before
+ * resizing it.
+ */
+static void release_root(MDisplay *mdpy, MBuffer *buf) {
+    if (buf->bits != NULL && MUnlockBuffer(mdpy, buf) < 0) {
+        MLOGE("MUnlockBuffer failed!\n");
+    }
 }
 
-int render_root(Display *dpy, MDisplay *mdpy,
-        MBuffer *buf, XImage *ximg) {
-    int err;
-
-    err = MLockBuffer(mdpy, buf);
-    if (err < 0) {
-        MLOGE("MLockBuffer failed!\n");
-        return -1;
+/**
+ * Copy a full-screen capture to the locked root buffer, moving what
+ * scrolled since the buffer was last filled rather than copying it
+ * again, see scroll_tracker.h.
+ */
+static void copy_scrolled_mlocked(MBuffer *buf, XImage *ximg) {
+    struct ScrollTracker *t = scroll_tracker;
+    if (t->width != (uint32_t)ximg->width ||
+            t->height != (uint32_t)ximg->height) {
+        scroll_tracker_free(t);
+        if (scroll_tracker_init(t, ximg->width, ximg->height) < 0) {
+            MLOGW("scroll detection off\n");
+            scroll_tracker = NULL;
+            copy_ximg_to_buffer_mlocked(buf, ximg);
+            return;
+        }
     }
 
-    Status status;
-    status = XShmGetImage(dpy,
-        DefaultRootWindow(dpy),
-        ximg,
-        0, 0,
-        AllPlanes);
-    if(!status) {
-        MLOGE("error calling XShmGetImage\n");
+    scroll_tracker_on_capture(t, (const uint8_t *)ximg->data,
+        ximg->bytes_per_line, ximg->bits_per_pixel);
+
+    uint32_t generation = 0;
+    int slot = MLockedSlot(buf, &generation);
+    if (scroll_tracker_update_buffer(t, slot, generation,
+            (uint8_t *)buf->bits, buf->stride) < 0) {
+        copy_ximg_to_buffer_mlocked(buf, ximg);
+    } else {
+        /* one copy per run of dirty cells in a row */
+        uint32_t y, c, start;
+        for (y = 0; y < t->height; ++y) {
+            const uint8_t *dirty = &t->dirty[(size_t)y * t->cols];
+            for (c = 0; c < t->cols; ++c) {
+                if (!dirty[c]) {
+                    continue;
+                }
+                for (start = c; c < t->cols && dirty[c]; ++c) {
+                }
+                copy_ximg_rect_to_buffer_mlocked(buf, ximg,
+                    start * SCROLL_TRACKER_TILE_PX, y,
+                    (c - start) * SCROLL_TRACKER_TILE_PX, 1);
+            }
+        }
     }
+    scroll_tracker_filled(t, slot, generation);
+}
 
-    copy_ximg_to_buffer_mlocked(buf, ximg);
-
-    err = MUnlockBuffer(mdpy, buf);
-    if (err < 0) {
-        MLOGE("MUnlockBuffer failed!\n");
-        return -1;
+/**
+ * Capture the damage into the capture shared with mflinger, and have
+ * mflinger copy the same rects into the root buffer and post it. The
+ * root buffer is never locked or mapped here.
+ */
+static int blit_root(MDisplay *mdpy, MBuffer *buf) {
+    /* the rects are gone from xcb_capture once they are captured */
+    MBlitRect rects[CAPTURE_XCB_MAX_RECTS];
+    int i, n;
+    if (xcb_capture->full) {
+        rects[0].x = rects[0].y = 0;
+        rects[0].width = blit_capture->width;
+        rects[0].height = blit_capture->height;
+        n = 1;
+    } else {
+        for (i = 0; i < xcb_capture->nrects; ++i) {
+            rects[i].x = xcb_capture->rects[i].x;
+            rects[i].y = xcb_capture->rects[i].y;
+            rects[i].width = xcb_capture->rects[i].width;
+            rects[i].height = xcb_capture->rects[i].height;
+        }
+        n = xcb_capture->nrects;
+    }
+    if (n == 0) {
+        /* no damage since the last blit, the buffer is up to date */
+        return 0;
     }
 
-    return 0;
-}
-
-int cleanup_shm(const void *shmaddr, const int shmid) {
-    if (shmdt(shmaddr) < 0) {
-        MLOGE("error detaching shm: %s\n", strerror(errno));
+    if (capture_xcb_update(xcb_capture, blit_shadow) < 0) {
+        MLOGE("error capturing through xcb\n");
         return -1;
     }
 
-    if (shmctl(shmid, IPC_RMID, 0) < 0) {
-        MLOGE("error destroying shm: %s\n", strerror(errno));
+    if (MBlitBuffer(mdpy, buf, blit_capture, rects, n) < 0) {
+        MLOGE("MBlitBuffer failed!\n");
+
+        /* the damage went with the capture, the retry has to be full */
+        invalidate_capture();
         return -1;
     }
     return 0;
 }
 
-int xshm_cleanup(Display *dpy, XShmSegmentInfo *shminfo, XImage *ximg) {
-    int err = 0;
-    if (!XShmDetach(dpy, shminfo)) {
-        MLOGE("error detaching shm from X server\n");
-        err = -1;
-    }
-    XDestroyImage(ximg);
-
-    /* try to clean up shm even if X fails to detach to avoid leaks */
-    err |= cleanup_shm(shminfo->shmaddr, shminfo->shmid);
-
-    return err;
-}
+/**
+ * The root buffer stays locked between frames: each frame is captured
+ * straight into the locked buffer and MSwapBuffer posts it and locks
+ * the next one in the same round trip.
+ *
+ * With server-side blits the buffer isn't locked at all, see
+ * blit_root().
+ */
+int render_root(Display *dpy, MDisplay *mdpy,
+        MBuffer *buf, XImage *ximg) {
+    int err;
 
-XImage *xshm_init(Display *dpy, XShmSegmentInfo *shminfo, int screen) {
-    /* create shared memory XImage structure */
-    XImage *ximg = XShmCreateImage(dpy,
-                    DefaultVisual(dpy, screen),
-                    DefaultDepth(dpy, screen),
-                    ZPixmap,
-                    NULL,
-                    shminfo,
-                    XDisplayWidth(dpy, screen),
-                    XDisplayHeight(dpy, screen));
-    if (ximg == NULL) {
-        MLOGE("error creating XShm Ximage\n");
-        return NULL;
+    /* server-side blits copy the capture 1:1 */
+    int blit = blit_capture != NULL && render_scale == 1 &&
+               buf->width == blit_capture->width &&
+               buf->height == blit_capture->height;
+    if (blit != blitted) {
+        /* the other shadow missed every frame since the last switch */
+        invalidate_capture();
+        blitted = blit;
+    }
+    if (blit) {
+        /* left locked by a frame that couldn't be blitted */
+        release_root(mdpy, buf);
+        return blit_root(mdpy, buf);
     }
 
-    //
-    // create a shared memory segment to store actual image data
-    //
-    shminfo->shmid = shmget(IPC_PRIVATE,
-             ximg->bytes_per_line * ximg->height, IPC_CREAT|0777);
-    if (shminfo->shmid < 0) {
-        MLOGE("error creating shm segment: %s\n", strerror(errno));
-        return NULL;
+    if (buf->bits == NULL) {
+        err = MLockBuffer(mdpy, buf);
+        if (err < 0) {
+            MLOGE("MLockBuffer failed!\n");
+            return -1;
+        }
     }
 
-    shminfo->shmaddr = ximg->data = shmat(shminfo->shmid, NULL, 0);
-    if (shminfo->shmaddr < 0) {
-        MLOGE("error attaching shm segment: %s\n", strerror(errno));
-        cleanup_shm(shminfo->shmaddr, shminfo->shmid);
-        return NULL;
+    /* a short image is a band, see resize_shm() */
+    uint32_t screen_height = XDisplayHeight(dpy, DefaultScreen(dpy));
+    /* scroll detection needs the whole screen at full size */
+    int scroll = scroll_tracker != NULL && render_scale == 1 &&
+                 ximg->height >= screen_height &&
+                 buf->width == (uint32_t)ximg->width &&
+                 buf->height == (uint32_t)ximg->height;
+    if (scroll_tracker != NULL && !scroll) {
+        scroll_tracker_reset(scroll_tracker);
     }
 
-    shminfo->readOnly = False;
+    if (ximg->height < screen_height) {
+        capture_banded_mlocked(dpy, DefaultRootWindow(dpy), buf, ximg,
+            screen_height, render_scale);
+    } else {
+        if (xcb_capture != NULL) {
+            /* only the damage since the last frame, see capture_xcb.h */
+            if (capture_xcb_update(xcb_capture, ximg) < 0) {
+                MLOGE("error capturing through xcb\n");
+            }
+        } else {
+            Status status;
+            status = XShmGetImage(dpy,
+                DefaultRootWindow(dpy),
+                ximg,
+                0, 0,
+                AllPlanes);
+            if(!status) {
+                MLOGE("error calling XShmGetImage\n");
+            }
+        }
 
-    //
-    // inform server of shm
-    //
-    if (!XShmAttach(dpy, shminfo)) {
-        MLOGE("error calling XShmAttach\n");
-        cleanup_shm(shminfo->shmaddr, shminfo->shmid);
-        return NULL;
+        if (render_scale > 1) {
+            downsample_ximg_to_buffer_mlocked(buf, ximg, render_scale);
+        } else if (scroll) {
+            copy_scrolled_mlocked(buf, ximg);
+        } else {
+            copy_ximg_to_buffer_mlocked(buf, ximg);
+        }
+    }
+
+    err = MSwapBuffer(mdpy, buf);
+    if (err < 0) {
+        MLOGE("MSwapBuffer failed!\n");
+        return -1;
     }
 
-    return ximg;
+    return 0;
 }
 
 /**
@@ -311,36 +425,32 @@ static int x_sync_mode(Display *dpy, XRRScreenResources *screenr,
 }
 
 /**
- * Try to sync up MDisplay with XDisplay.
+ * Try to sync up XDisplay with @param dinfo, the last known state of
+ * the default MDisplay. mflinger keeps us posted with M_DISPLAY_CHANGED
+ * so this needs no round trip to it, and none to XRandR either if the
+ * screen already has the right size.
  */
-static int sync_displays(Display *dpy, MDisplay *mdpy,
+static int sync_displays(Display *dpy, const MDisplayInfo *dinfo,
         const int xrandr_event_base)
 {
-    if (dpy == NULL || mdpy == NULL) {
+    if (dpy == NULL || dinfo == NULL) {
         return -2;
     }
 
     uint32_t target_width, target_height;
     target_width = target_height = 0;
 
-    /*
-     * If we can get the real display size, set that as our target size.
-     */
-    MDisplayInfo dinfo = { 0 };
-    if (MGetDisplayInfo(mdpy, &dinfo) < 0) {
-        MLOGW("failed to get mdisplay info, using current mode\n");
-        return -1;
-    }
-
-    MLOGD("mwidth = %d, mheight = %d\n", dinfo.width, dinfo.height);
-    int valid_display = dinfo.width > 0 && dinfo.height > 0;
+    /* a rotated panel reports its rotated size, mflinger turns our buffers */
+    MLOGD("mwidth = %d, mheight = %d, orientation = %d\n",
+        dinfo->width, dinfo->height, dinfo->orientation);
+    int valid_display = dinfo->width > 0 && dinfo->height > 0;
     if (!valid_display) {
         MLOGW("invalid mdisplay size, using current mode\n");
         return -1;
     }
 
-    target_width = dinfo.width;
-    target_height = dinfo.height;
+    target_width = dinfo->width;
+    target_height = dinfo->height;
 
     /*
      * Re-sync before our service grab in case the screen
@@ -358,6 +468,19 @@ static int sync_displays(Display *dpy, MDisplay *mdpy,
         }
     }
 
+    int screen = DefaultScreen(dpy);
+    if ((uint32_t)XDisplayWidth(dpy, screen) == target_width &&
+            (uint32_t)XDisplayHeight(dpy, screen) == target_height) {
+        return 0;
+    }
+
+    /* a multi-monitor layout is left alone, each CRTC gets a display */
+    struct MRect crtcs[2];
+    if (moutputs_list_crtcs(dpy, crtcs, 2) > 1) {
+        MLOGI("more than one CRTC is active, keeping the current modes\n");
+        return 0;
+    }
+
     /*
      * Prevent any other client from changing the screen
      * config under our feet by "pausing" their X connections.
@@ -368,7 +491,6 @@ static int sync_displays(Display *dpy, MDisplay *mdpy,
     XGrabServer(dpy);
 
     int err = 0;
-    int screen = DefaultScreen(dpy);
     uint32_t xwidth = XDisplayWidth(dpy, screen);
     uint32_t xheight = XDisplayHeight(dpy, screen);
 
@@ -409,32 +531,336 @@ static int sync_displays(Display *dpy, MDisplay *mdpy,
     return err;
 }
 
-static int resize_shm(Display *dpy, XImage *ximg, XShmSegmentInfo *shminfo) {
+/**
+ * (Re)create the root capture image if the screen or the band size
+ * changed. With MCONFIG_CAPTURE_BAND set the image is a screen-wide
+ * band rather than the full screen, so it must be called again after
+ * the render scale changes to keep bands whole blocks high.
+ */
+static int resize_shm(Display *dpy, XImage **ximg, XShmSegmentInfo *shminfo) {
     int screen = DefaultScreen(dpy);
-    int xwidth = XDisplayWidth(dpy, screen);
-    int xheight = XDisplayHeight(dpy, screen);
-    int shm_resize_needed = ximg->width != xwidth ||
-                            ximg->height != xheight;
-    if (shm_resize_needed) {
-        xshm_cleanup(dpy, shminfo, ximg);
-        ximg = xshm_init(dpy, shminfo, screen);
+    uint32_t xwidth = XDisplayWidth(dpy, screen);
+    uint32_t xheight = XDisplayHeight(dpy, screen);
+
+    uint32_t band = mconfig_get(MCONFIG_CAPTURE_BAND);
+    uint32_t height = band > 0 ?
+        band_image_rows(band, xheight, render_scale) : xheight;
+
+    int shm_resize_needed = *ximg == NULL ||
+                            (*ximg)->width != xwidth ||
+                            (*ximg)->height != height;
+    if (!shm_resize_needed) {
+        return 0;
+    }
+
+    if (*ximg != NULL) {
+        xshm_cleanup(dpy, shminfo, *ximg);
+    }
+    invalidate_capture();
+    *ximg = xshm_create(dpy, shminfo, DefaultVisual(dpy, screen),
+        DefaultDepth(dpy, screen), xwidth, height);
+    if (*ximg == NULL) {
+        return -1;
     }
 
-    return ximg == NULL ? -1 : 0;
+    if (height < xheight) {
+        uint32_t full = (*ximg)->bytes_per_line * xheight;
+        uint32_t used = (*ximg)->bytes_per_line * height;
+        MLOGI("capturing in bands of %u rows, shm %u KB instead of %u KB\n",
+            height, used / 1024, full / 1024);
+    }
+    return 0;
+}
+
+/**
+ * Root buffer size for the current screen and render scale.
+ */
+static void get_root_buffer_dims(Display *dpy, int scale,
+        uint32_t *width_ret, uint32_t *height_ret) {
+    int screen = DefaultScreen(dpy);
+    uint32_t width = XDisplayWidth(dpy, screen) / scale;
+    uint32_t height = XDisplayHeight(dpy, screen) / scale;
+
+    *width_ret = width > 0 ? width : 1;
+    *height_ret = height > 0 ? height : 1;
 }
 
 static int resize_mbuffer(Display *dpy, MDisplay *mdpy, MBuffer *root) {
     int screen = DefaultScreen(dpy);
-    int xwidth = XDisplayWidth(dpy, screen);
-    int xheight = XDisplayHeight(dpy, screen);
-    int buffer_resize_needed = root->width != xwidth ||
-                               root->height != xheight;
+    int scale = mconfig_get(MCONFIG_RENDER_SCALE);
+
+    uint32_t width, height;
+    get_root_buffer_dims(dpy, scale, &width, &height);
+
+    int buffer_resize_needed = root->width != width ||
+                               root->height != height;
     if (buffer_resize_needed) {
-        if (MResizeBuffer(mdpy, root, xwidth, xheight) < 0) {
+        /* the locked buffer is the old size */
+        release_root(mdpy, root);
+
+        if (MResizeBuffer(mdpy, root, width, height) < 0) {
+            return -1;
+        }
+    }
+
+    /*
+     * Let the compositor stretch a downscaled buffer back up
+     * to the full screen size so the panel stays filled.
+     */
+    if (buffer_resize_needed || scale != render_scale) {
+        /* the buffer is this size now, even if the compositor balks */
+        render_scale = scale;
+
+        uint32_t scaled_width = scale > 1 ? XDisplayWidth(dpy, screen) : 0;
+        uint32_t scaled_height = scale > 1 ? XDisplayHeight(dpy, screen) : 0;
+        if (MScaleBuffer(mdpy, root, scaled_width, scaled_height) < 0) {
+            MLOGE("error scaling root buffer\n");
             return -1;
         }
+        MLOGI("render scale set to 1/%d (%ux%u)\n", scale, width, height);
+    }
+
+    return 0;
+}
+
+/**
+ * Convert the damage in @param region to at most OVERLAY_MAX_RECTS rects.
+ * Anything past that is folded into one bounding rect.
+ */
+static int fetch_damage_rects(Display *dpy, XserverRegion region,
+        struct MRect *rects, int *total_ret) {
+    int nxrects = 0;
+    XRectangle *xrects = XFixesFetchRegion(dpy, region, &nxrects);
+    *total_ret = xrects != NULL ? nxrects : 0;
+    if (xrects == NULL) {
+        return 0;
+    }
+
+    int i, n = 0;
+    for (i = 0; i < nxrects; ++i) {
+        struct MRect r = {
+            xrects[i].x, xrects[i].y, xrects[i].width, xrects[i].height
+        };
+
+        if (n < OVERLAY_MAX_RECTS) {
+            rects[n++] = r;
+            continue;
+        }
+
+        struct MRect *last = &rects[n - 1];
+        int32_t x1 = r.x < last->x ? r.x : last->x;
+        int32_t y1 = r.y < last->y ? r.y : last->y;
+        int64_t x2 = (int64_t)r.x + r.width > (int64_t)last->x + last->width ?
+            (int64_t)r.x + r.width : (int64_t)last->x + last->width;
+        int64_t y2 = (int64_t)r.y + r.height > (int64_t)last->y + last->height ?
+            (int64_t)r.y + r.height : (int64_t)last->y + last->height;
+        last->x = x1;
+        last->y = y1;
+        last->width = x2 - x1;
+        last->height = y2 - y1;
+    }
+
+    XFree(xrects);
+    return n;
+}
+
+/**
+ * Switch between mirroring the root window and mirroring
+ * each top-level window to its own surface.
+ */
+static void set_rootless(Display *dpy, MDisplay *mdpy, MBuffer *root,
+        XImage *ximg, struct MRootless *rootless, struct MOverlay *overlay,
+        int enable) {
+    if (enable) {
+        /* windows get their own surfaces, an overlay would only be in the way */
+        moverlay_stop(overlay);
+
+        /* root damage is ignored until rootless mode stops */
+        invalidate_capture();
+
+        if (mrootless_start(rootless) == 0) {
+            MShowBuffer(mdpy, root, 0);
+        } else {
+            MLOGW("couldn't start rootless mode\n");
+        }
+    } else if (rootless->mActive) {
+        mrootless_stop(rootless);
+        MShowBuffer(mdpy, root, 1);
+
+        /* the root buffer went stale while hidden */
+        render_root(dpy, mdpy, root, ximg);
+    }
+}
+
+/**
+ * Switch between mirroring the root window to the default display and
+ * mirroring each CRTC to a display of its own, whichever the current
+ * CRTC layout calls for.
+ *
+ * @return 1 if the outputs are in use
+ */
+static int set_outputs(MDisplay *mdpy, MBuffer *root,
+        struct MOutputs *outputs, struct MOverlay *overlay) {
+    int was_active = outputs->mCount > 0;
+    int active = moutputs_sync(outputs) > 0;
+
+    if (active && !was_active) {
+        /* overlays are cut out of the root buffer */
+        moverlay_stop(overlay);
+        MShowBuffer(mdpy, root, 0);
+    } else if (!active && was_active) {
+        MShowBuffer(mdpy, root, 1);
+    }
+    return active;
+}
+
+static void stop_outputs(MDisplay *mdpy, MBuffer *root,
+        struct MOutputs *outputs) {
+    if (outputs->mCount > 0) {
+        moutputs_stop(outputs);
+        MShowBuffer(mdpy, root, 1);
+    }
+}
+
+static void set_frame_pacing(MDisplay *mdpy, MBuffer *root,
+        struct FramePacer *pacer, int enable) {
+    if (MSelectEvents(mdpy, root, enable ? M_FRAME_PRESENTED_MASK : 0) < 0) {
+        MLOGE("error selecting frame events\n");
+    }
+
+    /* stale feedback would hold back the next capture */
+    frame_pacer_init(pacer);
+}
+
+static void set_scroll_detect(Display *dpy, struct ScrollTracker *t,
+        int enable) {
+    int screen = DefaultScreen(dpy);
+    if (enable && scroll_tracker == NULL) {
+        if (scroll_tracker_init(t, XDisplayWidth(dpy, screen),
+                XDisplayHeight(dpy, screen)) < 0) {
+            MLOGW("scroll detection unavailable\n");
+            return;
+        }
+        scroll_tracker = t;
+        MLOGI("moving scrolled rows instead of copying them\n");
+    } else if (!enable && scroll_tracker != NULL) {
+        scroll_tracker_free(scroll_tracker);
+        scroll_tracker = NULL;
+    }
+}
+
+/**
+ * Share a screen-sized capture with mflinger for server-side blits, or
+ * stop. A capture that is shared already is replaced, e.g. after the
+ * screen changed size.
+ */
+static void set_server_blit(Display *dpy, MDisplay *mdpy, MCapture *capture,
+        int enable) {
+    if (blit_capture != NULL) {
+        capture_xcb_detach(xcb_capture, blit_shadow);
+        MFreeCapture(blit_capture);
+        blit_capture = NULL;
+        blit_shadow = NULL;
     }
+    if (!enable) {
+        return;
+    }
+    if (xcb_capture == NULL) {
+        MLOGW("server blits need MCLIENT_CAPTURE=xcb\n");
+        return;
+    }
+
+    int screen = DefaultScreen(dpy);
+    capture->width = XDisplayWidth(dpy, screen);
+    capture->height = XDisplayHeight(dpy, screen);
+    if (MShareCapture(mdpy, capture) < 0) {
+        MLOGW("server blits unavailable\n");
+        return;
+    }
+    blit_shadow = capture_xcb_attach(xcb_capture, capture);
+    if (blit_shadow == NULL) {
+        MLOGW("server blits unavailable\n");
+        MFreeCapture(capture);
+        return;
+    }
+    blit_capture = capture;
+
+    /* the new capture is empty */
+    invalidate_capture();
+    MLOGI("blitting %ux%u captures on the server\n",
+        capture->width, capture->height);
+}
 
+static void set_cpu_budget(struct RateController *rate, int budget) {
+    rate_controller_init(rate, budget, monotonic_ns(), process_cpu_ns());
+    if (budget > 0) {
+        MLOGI("keeping mclient under %d%% of a core\n", budget);
+    }
+}
+
+static void log_capture_rate(const struct RateController *rate) {
+    MLOGI("capture rate: %llu frames, %llu us each, cpu %u%% of %u%%, "
+        "%llu throttles, %llu recoveries, cap %llu fps\n",
+        (unsigned long long)rate->frames,
+        (unsigned long long)rate->render_cost / 1000,
+        rate->cpu_percent, rate->budget,
+        (unsigned long long)rate->throttles,
+        (unsigned long long)rate->recoveries,
+        rate->interval ? 1000000000ull / rate->interval : 0ull);
+}
+
+/* queued checks for the main loop, see mloop_set_queued() */
+static int x_events_queued(void *dpy) {
+    return XEventsQueued((Display *)dpy, QueuedAlready);
+}
+
+static int server_events_queued(void *mdpy) {
+    return MEventsQueued((MDisplay *)mdpy);
+}
+
+/**
+ * Handle everything the server sent, including events that came in
+ * while waiting on replies. Display changes update @param display if
+ * they are about the default display, and set the display's bit in
+ * @param changed.
+ *
+ * @return 0 if the connection can still be used
+ */
+static int handle_server_events(MDisplay *mdpy, struct FramePacer *pacer,
+        MDisplayInfo *display, uint32_t *changed) {
+    int pending = MPending(mdpy);
+    if (pending < 0) {
+        MLOGC("lost connection to mflinger\n");
+        return -1;
+    }
+
+    MEvent ev;
+    while (pending-- > 0 && MNextEvent(mdpy, &ev) == 0) {
+        switch (ev.type) {
+            case M_FRAME_PRESENTED:
+                if (mconfig_get(MCONFIG_FRAME_PACING)) {
+                    frame_pacer_on_present(pacer, ev.frame.present_ns,
+                        ev.frame.refresh_ns);
+                }
+                break;
+
+            case M_DISPLAY_CHANGED:
+                MLOGI("display %u changed to %ux%u orientation %u%s\n",
+                    ev.display.display, ev.display.width, ev.display.height,
+                    ev.display.orientation,
+                    ev.display.connected ? "" : ", disconnected");
+                if (ev.display.display == M_DEFAULT_DISPLAY &&
+                        ev.display.connected) {
+                    display->width = ev.display.width;
+                    display->height = ev.display.height;
+                    display->orientation = ev.display.orientation;
+                }
+                if (ev.display.display < 32) {
+                    *changed |= 1u << ev.display.display;
+                }
+                break;
+        }
+    }
     return 0;
 }
 
@@ -443,7 +869,16 @@ int main(void) {
     MDisplay mdpy;
     int err = 0;
 
-    /* TODO Ctrl-C handler to cleanup shm */
+    /*
+     * SIGINT and SIGTERM come in through the main loop so the shm
+     * segments are cleaned up. This has to happen before the cursor
+     * thread starts so it inherits the blocked signals.
+     */
+    struct MLoop loop;
+    if (mloop_init(&loop) < 0) {
+        MLOGE("error setting up the main loop\n");
+        return -1;
+    }
 
     /* must be first Xlib call for multi-threaded programs */
     if (!XInitThreads()) {
@@ -488,6 +923,27 @@ int main(void) {
         return -1;
     }
 
+    /*
+     * The buffers of an mclient that went away moments ago are still
+     * on screen with its last frames. Taking them back has to be the
+     * first request.
+     */
+    MBuffer root = { 0 };
+    struct MCursor mcursor = { 0 };
+    MBuffer *session_buffers[SESSION_NUM_BUFFERS] = { &root, &mcursor.mBuffer };
+    MSession session;
+    int session_active = msession_load(&session) == 0;
+    int resumed = 0;
+    if (session_active) {
+        resumed = MResumeSession(&mdpy, &session, session_buffers,
+            SESSION_NUM_BUFFERS);
+        if (resumed < 0) {
+            MLOGW("failed to start a session, restarts will flicker\n");
+            session_active = 0;
+            resumed = 0;
+        }
+    }
+
     if (XSetErrorHandler(x_error_handler) < 0) {
         MLOGE("error setting error handler\n");
     }
@@ -498,114 +954,494 @@ int main(void) {
          XDisplayWidth(dpy, screen), XDisplayHeight(dpy, screen),
          XDisplayWidthMM(dpy, screen), XDisplayHeightMM(dpy, screen));
 
+    mconfig_init(dpy);
+
+    const char *trace_path = getenv("MCLIENT_TRACE");
+    if (trace_path != NULL) {
+        mtrace_start(trace_path,
+            XDisplayWidth(dpy, screen), XDisplayHeight(dpy, screen));
+    }
+
+    /* select first so no change slips in after the query */
+    MDisplayInfo display_info = { 0 };
+    if (MSelectDisplayEvents(&mdpy, M_DISPLAY_CHANGED_MASK) < 0 ||
+            MGetDisplayInfo(&mdpy, &display_info) < 0) {
+        MLOGW("failed to get mdisplay info\n");
+    }
+
     XRRSelectInput(dpy, DefaultRootWindow(dpy), RRScreenChangeNotifyMask);
-    if (sync_displays(dpy, &mdpy, xrandr_event_base) < 0) {
+    if (sync_displays(dpy, &display_info, xrandr_event_base) < 0) {
         MLOGW("couldn't sync resolution, using default mode\n");
     }
 
     //
     // Create necessary buffers
     //
-    MBuffer root = { 0 };
-    root.width = XDisplayWidth(dpy, screen);
-    root.height = XDisplayHeight(dpy, screen);
-    if (MCreateBuffer(&mdpy, &root) < 0) {
-        MLOGE("error creating root buffer\n");
-        err = -1;
-        goto cleanup_1;
+    if (resumed & (1 << SESSION_ROOT)) {
+        /* it was hidden if the last mclient ran rootless */
+        MLOGI("took back the root buffer\n");
+        MShowBuffer(&mdpy, &root, 1);
+    } else {
+        get_root_buffer_dims(dpy, 1, &root.width, &root.height);
+        if (MCreateBuffer(&mdpy, &root) < 0) {
+            MLOGE("error creating root buffer\n");
+            err = -1;
+            goto cleanup_1;
+        }
     }
 
-    struct MCursor mcursor = { 0 };
-    if (mcursor_init(&mcursor, dpy, &mdpy) < 0) {
+    /* apply any startup render scale */
+    if (resize_mbuffer(dpy, &mdpy, &root) < 0) {
+        MLOGW("failed to set render scale, rendering at native size\n");
+    }
+
+    if (mcursor_init(&mcursor, dpy, &mdpy,
+            (resumed & (1 << SESSION_CURSOR)) != 0) < 0) {
         MLOGE("error creating cursor client\n");
         err = -1;
         goto cleanup_1;
     }
 
+    if (session_active) {
+        MUpdateSession(&session, session_buffers, SESSION_NUM_BUFFERS);
+        msession_save(&session);
+    }
+
     /* set up XShm */
     XShmSegmentInfo shminfo;
-    XImage *ximg = xshm_init(dpy, &shminfo, screen);
-    if (ximg == NULL) {
+    XImage *ximg = NULL;
+    if (resize_shm(dpy, &ximg, &shminfo) < 0) {
         MLOGC("failed to create xshm\n");
         err = -1;
         goto cleanup_1;
     }
 
+    /* captures only go through XCB when asked to, see capture_xcb.h */
+    struct CaptureXcb capture_xcb;
+    const char *capture_backend = getenv("MCLIENT_CAPTURE");
+    if (capture_backend != NULL && strcmp(capture_backend, "xcb") == 0) {
+        if (capture_xcb_init(&capture_xcb, dpy) == 0) {
+            MLOGI("capturing the root window through xcb\n");
+            xcb_capture = &capture_xcb;
+        } else {
+            MLOGW("xcb capture unavailable, capturing through xlib\n");
+        }
+    } else if (capture_backend != NULL && strcmp(capture_backend, "xlib") != 0) {
+        MLOGW("unknown capture backend %s, capturing through xlib\n",
+            capture_backend);
+    }
+
     /* report a single damage event if the damage region is non-empty */
     Damage damage = XDamageCreate(dpy, DefaultRootWindow(dpy),
         XDamageReportNonEmpty);
 
+    /* damage rects are only needed to look for video overlays */
+    XserverRegion damage_region = XFixesCreateRegion(dpy, NULL, 0);
+    struct MRect damage_rects[OVERLAY_MAX_RECTS];
+
+    /* and to collect damage stats, see damage_stats.h */
+    const char *stats_prefix = getenv("MCLIENT_DAMAGE_STATS");
+    struct DamageStats stats;
+    int stats_enabled = stats_prefix != NULL &&
+        damage_stats_init(&stats, XDisplayWidth(dpy, screen),
+            XDisplayHeight(dpy, screen)) == 0;
+
+    struct MOverlay overlay;
+    moverlay_init(&overlay, dpy, &mdpy);
+
+    struct FramePacer pacer;
+    set_frame_pacing(&mdpy, &root, &pacer, mconfig_get(MCONFIG_FRAME_PACING));
+
+    struct RateController rate;
+    set_cpu_budget(&rate, mconfig_get(MCONFIG_CPU_BUDGET));
+
+    struct ScrollTracker scroll;
+    set_scroll_detect(dpy, &scroll, mconfig_get(MCONFIG_SCROLL_DETECT));
+
+    MCapture blit;
+    set_server_blit(dpy, &mdpy, &blit, mconfig_get(MCONFIG_SERVER_BLIT));
+
+    struct MRootless rootless;
+    if (mrootless_init(&rootless, dpy, &mdpy, xdamage_event_base) < 0) {
+        MLOGW("rootless mode unavailable\n");
+    } else if (mconfig_get(MCONFIG_ROOTLESS)) {
+        set_rootless(dpy, &mdpy, &root, ximg, &rootless, &overlay, 1);
+    }
+
+    /* rootless mode has all windows on the default display */
+    struct MOutputs outputs;
+    moutputs_init(&outputs, dpy, &mdpy);
+    if (!rootless.mActive) {
+        set_outputs(&mdpy, &root, &outputs, &overlay);
+    }
+
+    mloop_watch(&loop, MLOOP_X, ConnectionNumber(dpy));
+    mloop_set_queued(&loop, MLOOP_X, x_events_queued, dpy);
+    mloop_watch(&loop, MLOOP_SERVER, MConnectionNumber(&mdpy));
+    mloop_set_queued(&loop, MLOOP_SERVER, server_events_queued, &mdpy);
+
+    /*
+     * Damage only marks the root dirty. It is rendered once the
+     * queued X events are drained, so a burst of damage events
+     * costs a single frame, and no earlier than the frame pacer
+     * and the retry back-off allow.
+     */
+    int root_dirty = 0;
+    int screen_changed = 0;
+    uint64_t retry_at = 0;
+    int running = 1;
     XEvent ev;
-    do {
-        XNextEvent(dpy, &ev);
-        if (ev.type == xdamage_event_base + XDamageNotify) {
-            XDamageNotifyEvent *dmg = (XDamageNotifyEvent *)&ev;
+    while (running) {
+        /*
+         * XPending() flushes the output buffer and reads whatever
+         * arrived, so the X fd can look idle with events queued up.
+         * Rendering below reads ahead the same way while it waits for
+         * replies, so the loop checks the queue again before poll().
+         */
+        while (running && XPending(dpy)) {
+            XNextEvent(dpy, &ev);
+            if (mrootless_on_event(&rootless, &ev)) {
+                /* per-window damage and top-level window changes */
+            } else if (ev.type == xdamage_event_base + XDamageNotify) {
+                XDamageNotifyEvent *dmg = (XDamageNotifyEvent *)&ev;
+
+                int overlay_enabled = mconfig_get(MCONFIG_VIDEO_OVERLAY) &&
+                                      !rootless.mActive && !outputs.mCount;
+                int stats_wanted = stats_enabled && !rootless.mActive;
+                int rects_wanted = overlay_enabled || stats_wanted ||
+                                   ((xcb_capture != NULL ||
+                                     scroll_tracker != NULL ||
+                                     outputs.mCount) &&
+                                    !rootless.mActive);
 
-            /*
-             * clear out all the damage first so we
-             * don't miss a DamageNotify while rendering
-             */
-            XDamageSubtract(dpy, dmg->damage, None, None);
+                /*
+                 * clear out all the damage first so we
+                 * don't miss a DamageNotify while rendering
+                 */
+                XDamageSubtract(dpy, dmg->damage, None,
+                    rects_wanted ? damage_region : None);
+
+                mtrace_record(MTRACE_DAMAGE, dmg->area.x, dmg->area.y,
+                    dmg->area.width, dmg->area.height);
+
+                MLOGD("dmg>more = %d\n", dmg->more);
+                MLOGD("dmg->area pos (%d, %d)\n", dmg->area.x, dmg->area.y);
+                MLOGD("dmg->area dims %dx%d\n", dmg->area.width, dmg->area.height);
+
+                /* window surfaces take care of themselves in rootless mode */
+                int root_damaged = !rootless.mActive;
+                int n = 0, total = 0;
+                if (rects_wanted) {
+                    n = fetch_damage_rects(dpy, damage_region, damage_rects,
+                        &total);
+                }
+                if (stats_wanted) {
+                    damage_stats_add(&stats, damage_rects, n, total);
+                }
+                if (overlay_enabled) {
+                    root_damaged = moverlay_on_damage(&overlay, damage_rects, n,
+                        (uint64_t)root.width * root.height * 4);
+                }
 
-            MLOGD("dmg>more = %d\n", dmg->more);
-            MLOGD("dmg->area pos (%d, %d)\n", dmg->area.x, dmg->area.y);
-            MLOGD("dmg->area dims %dx%d\n", dmg->area.width, dmg->area.height);
+                if (root_damaged) {
+                    /* TODO opt: only render damaged areas */
+                    if (outputs.mCount) {
+                        moutputs_damage(&outputs, damage_rects, n);
+                    }
+                    if (n > 0) {
+                        if (xcb_capture != NULL) {
+                            capture_xcb_damage(xcb_capture, damage_rects, n);
+                        }
+                        if (scroll_tracker != NULL) {
+                            scroll_tracker_damage(scroll_tracker,
+                                damage_rects, n);
+                        }
+                    } else {
+                        invalidate_capture();
+                    }
+                    root_dirty = 1;
+                }
+            } else if (ev.type == xrandr_event_base + RRScreenChangeNotify) {
+                /*
+                 * Someone changed the screen configuration.
+                 *
+                 * Common reasons:
+                 *
+                 * (1) xfsettingsd applies xrandr config on startup based
+                 * on the last setting selected in Settings > Display.
+                 *
+                 * (2) The user changed the display settings manually.
+                 */
+                XRRScreenChangeNotifyEvent *rev = (XRRScreenChangeNotifyEvent *)&ev;
+                MLOGW("[t=%lu] screen size changed to %dx%d %dmmx%dmm in main evloop\n",
+                    rev->timestamp,
+                    rev->width, rev->height,
+                    rev->mwidth, rev->mheight);
+                mtrace_record(MTRACE_SCREEN, 0, 0, rev->width, rev->height);
 
-            /* TODO opt: only render damaged areas */
-            render_root(dpy, &mdpy, &root, ximg);
-        } else if (ev.type == xrandr_event_base + RRScreenChangeNotify) {
-            /*
-             * Someone changed the screen configuration.
-             *
-             * Common reasons:
-             *
-             * (1) xfsettingsd applies xrandr config on startup based
-             * on the last setting selected in Settings > Display.
-             *
-             * (2) The user changed the display settings manually.
-             */
-            XRRScreenChangeNotifyEvent *rev = (XRRScreenChangeNotifyEvent *)&ev;
-            MLOGW("[t=%lu] screen size changed to %dx%d %dmmx%dmm in main evloop\n",
-                rev->timestamp,
-                rev->width, rev->height,
-                rev->mwidth, rev->mheight);
-
-            if (XRRUpdateConfiguration(&ev) == 0) {
-                MLOGE("error updating xrandr configuration\n");
+                if (XRRUpdateConfiguration(&ev) == 0) {
+                    MLOGE("error updating xrandr configuration\n");
+                }
+
+                /* handled with display changes once the queue is drained */
+                screen_changed = 1;
+            } else if (ev.type == PropertyNotify) {
+                switch (mconfig_on_event(dpy, &ev)) {
+                    case MCONFIG_RENDER_SCALE:
+                        if (resize_mbuffer(dpy, &mdpy, &root) < 0) {
+                            MLOGE("failed to apply render scale\n");
+                        }
+                        if (resize_shm(dpy, &ximg, &shminfo) < 0) {
+                            MLOGC("failed to resize shm\n");
+                            running = 0;
+                            break;
+                        }
+
+                        /* fill the new buffer right away */
+                        if (!rootless.mActive) {
+                            root_dirty = 1;
+                        }
+                        break;
+
+                    case MCONFIG_ROOTLESS:
+                        if (mconfig_get(MCONFIG_ROOTLESS)) {
+                            stop_outputs(&mdpy, &root, &outputs);
+                        }
+                        set_rootless(dpy, &mdpy, &root, ximg, &rootless, &overlay,
+                            mconfig_get(MCONFIG_ROOTLESS));
+                        if (!rootless.mActive &&
+                                set_outputs(&mdpy, &root, &outputs, &overlay)) {
+                            root_dirty = 1;
+                        }
+                        break;
+
+                    case MCONFIG_VIDEO_OVERLAY:
+                        if (!mconfig_get(MCONFIG_VIDEO_OVERLAY) &&
+                                moverlay_stop(&overlay) && !rootless.mActive) {
+                            /* damage under the overlay never hit the root */
+                            invalidate_capture();
+                            root_dirty = 1;
+                        }
+                        break;
+
+                    case MCONFIG_CAPTURE_BAND:
+                        if (resize_shm(dpy, &ximg, &shminfo) < 0) {
+                            MLOGC("failed to resize shm\n");
+                            running = 0;
+                        }
+                        break;
+
+                    case MCONFIG_FRAME_PACING:
+                        set_frame_pacing(&mdpy, &root, &pacer,
+                            mconfig_get(MCONFIG_FRAME_PACING));
+                        break;
+
+                    case MCONFIG_CPU_BUDGET:
+                        set_cpu_budget(&rate, mconfig_get(MCONFIG_CPU_BUDGET));
+                        break;
+
+                    case MCONFIG_SCROLL_DETECT:
+                        set_scroll_detect(dpy, &scroll,
+                            mconfig_get(MCONFIG_SCROLL_DETECT));
+                        break;
+
+                    case MCONFIG_SERVER_BLIT:
+                        set_server_blit(dpy, &mdpy, &blit,
+                            mconfig_get(MCONFIG_SERVER_BLIT));
+                        break;
+                }
+            } else {
+                mcursor_on_event(&mcursor, &ev);
             }
+        }
+
+        uint32_t displays_changed = 0;
+        if (running && handle_server_events(&mdpy, &pacer,
+                &display_info, &displays_changed) < 0) {
+            err = -1;
+            break;
+        }
+        if (displays_changed) {
+            screen_changed = 1;
+        }
+
+        if (running && screen_changed) {
+            screen_changed = 0;
 
             /*
              * Attempt to sync XDisplay and MDisplay up again if possible.
              *
-             * If we can determine the size of the real attached display, and
-             * it doesn't match this change, it will be overriden to correctly
-             * match. Otherwise, we just accept this change.
+             * If we know the size of the real attached display, and the
+             * screen doesn't match it, it will be overriden to correctly
+             * match. Otherwise, we just accept the screen as it is.
              */
-            if (sync_displays(dpy, &mdpy, xrandr_event_base) < 0) {
+            if (sync_displays(dpy, &display_info, xrandr_event_base) < 0) {
                 MLOGW("failed to sync X with mdisplay, re-configuring to match new size\n");
             }
 
             /*
              * Make sure our buffer sizes match up with the display size.
              */
-            if (resize_shm(dpy, ximg, &shminfo) < 0) {
-                MLOGC("failed to resize shm\n");
-                break;
-            }
             if (resize_mbuffer(dpy, &mdpy, &root) < 0) {
                 MLOGC("failed to resize mbuffer\n");
                 break;
             }
-        } else {
-            mcursor_on_event(&mcursor, &ev);
+            if (resize_shm(dpy, &ximg, &shminfo) < 0) {
+                MLOGC("failed to resize shm\n");
+                break;
+            }
+            if (blit_capture != NULL &&
+                    (blit_capture->width != (uint32_t)XDisplayWidth(dpy, screen) ||
+                    blit_capture->height != (uint32_t)XDisplayHeight(dpy, screen))) {
+                set_server_blit(dpy, &mdpy, &blit, 1);
+            }
+
+            /* the overlay rect is meaningless on a different screen */
+            if (moverlay_stop(&overlay) && !rootless.mActive) {
+                invalidate_capture();
+                root_dirty = 1;
+            }
+
+            /* so are the damage tiles, save what was collected so far */
+            if (stats_enabled &&
+                    (stats.screen_width != (uint32_t)XDisplayWidth(dpy, screen) ||
+                    stats.screen_height != (uint32_t)XDisplayHeight(dpy, screen))) {
+                damage_stats_write(&stats, stats_prefix);
+                damage_stats_free(&stats);
+                stats_enabled = damage_stats_init(&stats,
+                    XDisplayWidth(dpy, screen), XDisplayHeight(dpy, screen)) == 0;
+            }
+
+            /* CRTCs or displays may have come, gone or moved */
+            if (!rootless.mActive &&
+                    set_outputs(&mdpy, &root, &outputs, &overlay)) {
+                root_dirty = 1;
+            }
         }
-    } while (1);
 
+        if (running && root_dirty && !rootless.mActive) {
+            /* presentation feedback only comes for the root buffer */
+            uint64_t now = monotonic_ns();
+            uint64_t render_at = outputs.mCount ?
+                now : frame_pacer_next_render(&pacer, now);
+            uint64_t rate_at = rate_controller_next_render(&rate, now);
+            if (render_at < rate_at) {
+                render_at = rate_at;
+            }
+            if (render_at < retry_at) {
+                render_at = retry_at;
+            }
+
+            if (render_at > now) {
+                if (loop.mDeadline != render_at) {
+                    mloop_set_deadline(&loop, render_at);
+                }
+            } else if ((outputs.mCount ? moutputs_render(&outputs) :
+                    render_root(dpy, &mdpy, &root, ximg)) < 0) {
+                retry_at = now + RENDER_RETRY_MS * 1000000ull;
+                mloop_set_deadline(&loop, retry_at);
+            } else {
+                uint64_t end = monotonic_ns();
+                if (!outputs.mCount) {
+                    frame_pacer_on_render(&pacer, now, end);
+                } else {
+                    /* the outputs took the damage, the root didn't */
+                    invalidate_capture();
+                }
+                rate_controller_on_render(&rate, now, end);
+                if (stats_enabled) {
+                    damage_stats_end_frame(&stats);
+                }
+                root_dirty = 0;
+                retry_at = 0;
+            }
+        }
+        if (!running) {
+            break;
+        }
 
+        /* reading the process CPU time is a syscall, only do it when due */
+        uint64_t now = monotonic_ns();
+        if (rate.budget > 0 &&
+                now - rate.window_start >= RATE_CONTROLLER_WINDOW_NS &&
+                rate_controller_update(&rate, now, process_cpu_ns())) {
+            if (rate.interval > 0) {
+                MLOGI("cpu at %u%% of %u%%, capping captures at %llu fps\n",
+                    rate.cpu_percent, rate.budget,
+                    1000000000ull / rate.interval);
+            } else {
+                MLOGI("cpu at %u%% of %u%%, captures uncapped\n",
+                    rate.cpu_percent, rate.budget);
+            }
+        }
+
+        /* requests made while rendering may still be buffered */
+        XFlush(dpy);
+        int ready = mloop_wait(&loop);
+        if (ready < 0) {
+            break;
+        }
+        if ((ready & MLOOP_READY(MLOOP_SIGNAL)) && loop.mSignal == SIGUSR1) {
+            log_capture_rate(&rate);
+            if (stats_enabled) {
+                damage_stats_write(&stats, stats_prefix);
+            }
+        } else if (ready & MLOOP_READY(MLOOP_SIGNAL)) {
+            MLOGI("caught signal %d, shutting down\n", loop.mSignal);
+
+            /* told to quit, don't keep the desktop up for a restart */
+            if (session_active) {
+                MEndSession(&mdpy);
+                msession_clear();
+            }
+            break;
+        }
+
+        /*
+         * Server events are handled after the X events above and
+         * the timer only has to wake us up for a render.
+         */
+    }
+
+    MLOGI("frame pacing: %llu frames, %llu never presented\n",
+        (unsigned long long)pacer.frames, (unsigned long long)pacer.lost);
+    log_capture_rate(&rate);
+    if (xcb_capture != NULL) {
+        MLOGI("xcb capture: %llu frames, %llu full, %llu rects, %llu Mpx\n",
+            (unsigned long long)capture_xcb.captures,
+            (unsigned long long)capture_xcb.full_captures,
+            (unsigned long long)capture_xcb.rects_captured,
+            (unsigned long long)capture_xcb.px_captured / 1000000);
+    }
+    if (scroll_tracker != NULL) {
+        MLOGI("scroll detection: %llu scrolls, %llu rows moved, "
+            "%llu partial copies, %llu full copies\n",
+            (unsigned long long)scroll.scrolls,
+            (unsigned long long)scroll.rows_moved,
+            (unsigned long long)scroll.partial_copies,
+            (unsigned long long)scroll.full_copies);
+    }
+
+    moutputs_stop(&outputs);
+    moverlay_stop(&overlay);
+    mrootless_stop(&rootless);
+    if (stats_enabled) {
+        damage_stats_write(&stats, stats_prefix);
+        damage_stats_free(&stats);
+    }
+    XFixesDestroyRegion(dpy, damage_region);
     XDamageDestroy(dpy, damage);
+    set_server_blit(dpy, &mdpy, &blit, 0);
+    if (xcb_capture != NULL) {
+        capture_xcb_cleanup(xcb_capture);
+        xcb_capture = NULL;
+    }
+    set_scroll_detect(dpy, &scroll, 0);
     xshm_cleanup(dpy, &shminfo, ximg);
 
 cleanup_1:
+    mloop_cleanup(&loop);
+    mtrace_stop();
     cursor_cache_free();
     MCloseDisplay(&mdpy);
     XCloseDisplay(dpy);
@@ -0,0 +1,160 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+
+#include "mconfig.h"
+#include "mlog.h"
+
+static struct mconfig_entry {
+    const char *env;        /* startup override */
+    const char *prop;       /* runtime override on the root window */
+    int min;
+    int max;
+    int value;              /* starts out as the default */
+    Atom atom;
+} options[MCONFIG_NUM_OPTIONS] = {
+    [MCONFIG_RENDER_SCALE] = {
+        "MCLIENT_RENDER_SCALE", "_MARU_RENDER_SCALE", 1, 4, 1
+    },
+    [MCONFIG_ROOTLESS] = {
+        "MCLIENT_ROOTLESS", "_MARU_ROOTLESS", 0, 1, 0
+    },
+    [MCONFIG_VIDEO_OVERLAY] = {
+        "MCLIENT_VIDEO_OVERLAY", "_MARU_VIDEO_OVERLAY", 0, 1, 0
+    },
+    [MCONFIG_FRAME_PACING] = {
+        "MCLIENT_FRAME_PACING", "_MARU_FRAME_PACING", 0, 1, 1
+    },
+    [MCONFIG_CAPTURE_BAND] = {
+        "MCLIENT_CAPTURE_BAND", "_MARU_CAPTURE_BAND", 0, 4096, 0
+    },
+    [MCONFIG_CURSOR_PREDICT] = {
+        "MCLIENT_CURSOR_PREDICT", "_MARU_CURSOR_PREDICT", 0, 50, 0
+    },
+    [MCONFIG_CPU_BUDGET] = {
+        "MCLIENT_CPU_BUDGET", "_MARU_CPU_BUDGET", 0, 100, 0
+    },
+    [MCONFIG_SCROLL_DETECT] = {
+        "MCLIENT_SCROLL_DETECT", "_MARU_SCROLL_DETECT", 0, 1, 0
+    },
+    [MCONFIG_SERVER_BLIT] = {
+        "MCLIENT_SERVER_BLIT", "_MARU_SERVER_BLIT", 0, 1, 0
+    },
+};
+
+static int clamp(const struct mconfig_entry *entry, long value) {
+    if (value < entry->min) {
+        return entry->min;
+    }
+    if (value > entry->max) {
+        return entry->max;
+    }
+    return value;
+}
+
+/**
+ * @return 0 if the root window property exists and was read into @param ret
+ */
+static int read_prop(Display *dpy, const struct mconfig_entry *entry,
+        long *ret) {
+    Atom type;
+    int format;
+    unsigned long nitems, bytes_after;
+    unsigned char *data = NULL;
+
+    if (XGetWindowProperty(dpy, DefaultRootWindow(dpy), entry->atom,
+            0, 1, False, AnyPropertyType, &type, &format,
+            &nitems, &bytes_after, &data) != Success) {
+        return -1;
+    }
+
+    int err = -1;
+    if (data != NULL && format == 32 && nitems == 1) {
+        /* Xlib hands back 32-bit properties as longs */
+        *ret = *(long *)data;
+        err = 0;
+    }
+
+    if (data != NULL) {
+        XFree(data);
+    }
+    return err;
+}
+
+int mconfig_init(Display *dpy) {
+    int i;
+    for (i = 0; i < MCONFIG_NUM_OPTIONS; ++i) {
+        struct mconfig_entry *entry = &options[i];
+
+        const char *env = getenv(entry->env);
+        if (env != NULL) {
+            entry->value = clamp(entry, strtol(env, NULL, 10));
+        }
+
+        /* a property left over from a previous session wins */
+        long value;
+        entry->atom = XInternAtom(dpy, entry->prop, False);
+        if (read_prop(dpy, entry, &value) == 0) {
+            entry->value = clamp(entry, value);
+        }
+
+        MLOGI("config %s = %d\n", entry->prop, entry->value);
+    }
+
+    XSelectInput(dpy, DefaultRootWindow(dpy), PropertyChangeMask);
+    return 0;
+}
+
+int mconfig_get(enum MConfigOption opt) {
+    return __atomic_load_n(&options[opt].value, __ATOMIC_RELAXED);
+}
+
+int mconfig_on_event(Display *dpy, XEvent *ev) {
+    if (ev->type != PropertyNotify) {
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < MCONFIG_NUM_OPTIONS; ++i) {
+        struct mconfig_entry *entry = &options[i];
+        if (entry->atom != ev->xproperty.atom) {
+            continue;
+        }
+
+        long value;
+        if (ev->xproperty.state == PropertyDelete ||
+                read_prop(dpy, entry, &value) < 0) {
+            /* keep the current value rather than guess */
+            return -1;
+        }
+
+        value = clamp(entry, value);
+        if (value == entry->value) {
+            return -1;
+        }
+
+        MLOGI("config %s changed %d -> %ld\n",
+            entry->prop, entry->value, value);
+        __atomic_store_n(&entry->value, (int)value, __ATOMIC_RELAXED);
+        return i;
+    }
+
+    return -1;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_CONFIG_H
+#define M_CONFIG_H
+
+#include <X11/Xlib.h>
+
+/*
+ * Integer tunables for mclient.
+ *
+ * Each option starts out with the value of the MCLIENT_<NAME> environment
+ * variable (or its default) and can be changed on a live session by
+ * setting the matching _MARU_<NAME> property on the root window:
+ *
+ *   xprop -root -f _MARU_RENDER_SCALE 32i -set _MARU_RENDER_SCALE 2
+ *
+ * Out-of-range values are clamped.
+ */
+enum MConfigOption {
+    MCONFIG_RENDER_SCALE,       /* capture downscale factor, 1 = native */
+    MCONFIG_ROOTLESS,           /* 1 = one surface per top-level window */
+    MCONFIG_VIDEO_OVERLAY,      /* 1 = move video-like damage to an overlay */
+    MCONFIG_FRAME_PACING,       /* 1 = time captures off present feedback */
+    MCONFIG_CAPTURE_BAND,       /* rows per capture band, 0 = full frame */
+    MCONFIG_CURSOR_PREDICT,     /* ms to place the cursor ahead, 0 = off */
+    MCONFIG_CPU_BUDGET,         /* % of a core for mclient, 0 = no limit */
+    MCONFIG_SCROLL_DETECT,      /* 1 = move scrolled rows instead of copying */
+    MCONFIG_SERVER_BLIT,        /* 1 = mflinger copies captures into buffers */
+
+    MCONFIG_NUM_OPTIONS
+};
+
+/**
+ * Load startup values and select for property changes on the root window.
+ */
+int mconfig_init(Display *dpy);
+
+int mconfig_get(enum MConfigOption opt);
+
+/**
+ * @return the option changed by @param ev, or -1 if @param ev
+ * did not change any option
+ */
+int mconfig_on_event(Display *dpy, XEvent *ev);
+
+#endif // M_CONFIG_H
@@ -16,6 +16,7 @@
 
 #include <stdint.h>
 #include <string.h>
+#include <poll.h>
 #include <pthread.h>
 
 #include <X11/Xlib.h>
@@ -23,10 +24,13 @@
 #include <X11/extensions/XInput2.h>
 
 
+#include "cursor_predictor.h"
+#include "mconfig.h"
 #include "mcursor.h"
 #include "mcursor_cache.h"
 #include "mlog.h"
-#include "util.h"
+#include "mtrace.h"
+#include "pixel.h"
 
 /*
  * All cursor-related logic belongs here.
@@ -47,6 +51,12 @@
  *
  * NOTE: For some reason, moving XISelectEvents to the main thread causes no
  * motion events to be delivered unless XIAllDevices is used...no idea why.
+ *
+ * The cursor surface is on screen a compositor frame or so after the motion
+ * event that moved it. With MCONFIG_CURSOR_PREDICT set, the motion thread
+ * places it that many ms ahead along the pointer's path instead (see
+ * cursor_predictor.h), around 25 makes up for the lag on a 60 Hz panel.
+ * Once the pointer stops, the cursor is put back where it really is.
  */
 
 static int copy_xcursor_to_buffer(MDisplay *mdpy, MBuffer *buf,
@@ -59,31 +69,8 @@ static int copy_xcursor_to_buffer(MDisplay *mdpy, MBuffer *buf,
         return -1;
     }
 
-    /* clear out stale pixels */
-    memset(buf->bits, 0, buf->height * buf->stride * 4);
-
-    int x, y;
-    for (y = 0; y < cursor->height; ++y) {
-        for (x = 0; x < cursor->width; ++x) {
-            /* bounds check! */
-            if (y >= buf->height || x >= buf->width) {
-                break;
-            }
-
-            int pixel_row_offset = y * cursor->width;
-            int pixel_col_offset = x;
-            unsigned long *pixel = cursor->pixels +
-                pixel_row_offset + pixel_col_offset;
-
-            /*
-             * Copy only if opaque pixel to avoid weird artifacts.
-             */
-            if (argb8888_get_alpha(*pixel) == 255) {
-                uint32_t *buf_pixel = buf->bits + (y * buf->stride + x) * 4;
-                memcpy(buf_pixel, pixel, 4);
-            }
-        }
-    }
+    copy_cursor_32(buf->bits, buf->stride * 4, buf->width, buf->height,
+        cursor->pixels, cursor->width, cursor->height);
 
     err = MUnlockBuffer(mdpy, buf);
     if (err < 0) {
@@ -98,14 +85,13 @@ static int update_cursor(Display *dpy,
         MDisplay *mdpy, MBuffer *cursor,
         int root_x, int root_y)
 {
-    int last_x, last_y;
-    cursor_cache_get_last_pos(&last_x, &last_y);
-    if (root_x != last_x || root_y != last_y) {
-        XFixesCursorImage *xcursor = cursor_cache_get_cur();
-
+    /* one consistent snapshot, the main thread may be swapping images */
+    struct CursorState state;
+    cursor_cache_get_state(&state);
+    if (root_x != state.x || root_y != state.y) {
         /* adjust so that hotspot is top-left */
-        int32_t xpos = root_x - xcursor->xhot;
-        int32_t ypos = root_y - xcursor->yhot;
+        int32_t xpos = root_x - state.xhot;
+        int32_t ypos = root_y - state.yhot;
 
         /* enforce lower bound or surfaceflinger freaks out */
         if (xpos < 0) {
@@ -118,6 +104,7 @@ static int update_cursor(Display *dpy,
         if (MUpdateBuffer(mdpy, cursor, xpos, ypos) < 0) {
             MLOGE("error calling MUpdateBuffer\n");
         }
+        mtrace_record(MTRACE_CURSOR_POS, root_x, root_y, 0, 0);
 
         cursor_cache_set_last_pos(root_x, root_y);
     }
@@ -202,6 +189,11 @@ void *cursor_motion_thread(void *targs) {
     /* select for XI2 events */
     select_events(dpy, DefaultRootWindow(dpy));
 
+    struct CursorPredictor predictor;
+    cursor_predictor_init(&predictor);
+    int real_x = -1, real_y = -1;
+    int lead_ms = 0;        /* > 0 while the cursor is ahead of the pointer */
+
     while(1) 
     {
     	XGenericEventCookie *cookie = &ev.xcookie;
@@ -210,13 +202,36 @@ void *cursor_motion_thread(void *targs) {
     	int         	win_x, win_y;
     	unsigned int    mask;
 
+        /* no motion for as long as we predicted ahead, the pointer stopped */
+        if (lead_ms > 0 && !XPending(dpy)) {
+            struct pollfd pfd = { ConnectionNumber(dpy), POLLIN, 0 };
+            if (poll(&pfd, 1, lead_ms) == 0) {
+                update_cursor(dpy, this->mMdpy, &this->mBuffer, real_x, real_y);
+                cursor_predictor_init(&predictor);
+                lead_ms = 0;
+                continue;
+            }
+        }
+
     	XNextEvent(dpy, &ev);
 
     	if (cookie->type == GenericEvent && cookie->extension == xi_opcode && XGetEventData(dpy, cookie)){
             
             if (cookie->evtype == XI_RawMotion) {
                 XQueryPointer(dpy, DefaultRootWindow(dpy), &root_ret, &child_ret, &root_x, &root_y, &win_x, &win_y, &mask);
-                update_cursor(dpy, this->mMdpy, &this->mBuffer, root_x, root_y);
+
+                int x = root_x, y = root_y;
+                int lead = mconfig_get(MCONFIG_CURSOR_PREDICT);
+                if (lead > 0) {
+                    XIRawEvent *raw = (XIRawEvent *)cookie->data;
+                    cursor_predictor_add(&predictor, raw->time, root_x, root_y);
+                    cursor_predictor_predict(&predictor, lead, &x, &y);
+                }
+                real_x = root_x;
+                real_y = root_y;
+                lead_ms = x != root_x || y != root_y ? lead : 0;
+
+                update_cursor(dpy, this->mMdpy, &this->mBuffer, x, y);
             }
 
             XFreeEventData(dpy, cookie);
@@ -234,7 +249,8 @@ static void spawn_motion_thread(struct MCursor *this) {
         &cursor_motion_thread, (void *)this);
 }
 
-int mcursor_init(struct MCursor *this, Display *xdpy, MDisplay *mdpy) {
+int mcursor_init(struct MCursor *this, Display *xdpy, MDisplay *mdpy,
+        int resumed) {
     this->mXdpy = xdpy;
     this->mMdpy = mdpy;
 
@@ -248,11 +264,17 @@ int mcursor_init(struct MCursor *this, Display *xdpy, MDisplay *mdpy) {
     cursor_cache_add(xcursor);
     cursor_cache_set_cur(xcursor);
 
-    this->mBuffer.width = CURSOR_WIDTH;
-    this->mBuffer.height = CURSOR_HEIGHT;
-    if (MCreateBuffer(this->mMdpy, &this->mBuffer) < 0) {
-        MLOGE("error creating cursor buffer\n");
-        return -1;
+    if (!resumed) {
+        this->mBuffer.width = CURSOR_WIDTH;
+        this->mBuffer.height = CURSOR_HEIGHT;
+        if (MCreateBuffer(this->mMdpy, &this->mBuffer) < 0) {
+            MLOGE("error creating cursor buffer\n");
+            return -1;
+        }
+    }
+
+    if (MRestackBuffer(this->mMdpy, &this->mBuffer, CURSOR_Z) < 0) {
+        MLOGE("error raising cursor buffer\n");
     }
 
     if (copy_xcursor_to_buffer(this->mMdpy, &this->mBuffer, xcursor) < 0) {
@@ -288,6 +310,8 @@ void mcursor_on_event(struct MCursor *this, XEvent *ev) {
         if (copy_xcursor_to_buffer(this->mMdpy, &this->mBuffer, xcursor) < 0) {
             MLOGE("failed to render cursor sprite\n");
         }
+        mtrace_record(MTRACE_CURSOR_IMAGE, 0, 0,
+            xcursor->width, xcursor->height);
 
         cursor_cache_set_cur(xcursor);
     } else {
@@ -28,6 +28,9 @@
 #define CURSOR_WIDTH  (24)
 #define CURSOR_HEIGHT (24)
 
+/* the cursor always stays on top */
+#define CURSOR_Z      (M_MAX_Z)
+
 struct MCursor {
     Display *mXdpy;
     MDisplay *mMdpy;
@@ -36,7 +39,12 @@ struct MCursor {
     int mXFixesEventBase;
 };
 
-int mcursor_init(struct MCursor *this, Display *xdpy, MDisplay *mdpy);
+/**
+ * @param resumed 1 if mBuffer was taken back from the last session
+ * rather than having to be created
+ */
+int mcursor_init(struct MCursor *this, Display *xdpy, MDisplay *mdpy,
+        int resumed);
 void mcursor_on_event(struct MCursor *this, XEvent *ev);
 
 #endif // M_CURSOR_H
@@ -18,7 +18,9 @@
 #include <X11/Xlib.h>
 #include <X11/extensions/Xfixes.h>
 
+#include "mcursor_cache.h"
 #include "mlog.h"
+#include "seqlock.h"
 
 /*
  * A "singleton" cache for dealing with the XFixes cursor API.
@@ -38,9 +40,15 @@ static struct cursor_cache_entry {
     XFixesCursorImage *xcursor;
 } cursor_cache[CURSOR_CACHE_SIZE];
 
-static XFixesCursorImage *cur_cursor;
-static int last_x = -1;
-static int last_y = -1;
+/*
+ * The main thread swaps the cursor image while the motion thread reads
+ * the hotspot and moves the cursor on every motion event. All of it is
+ * published under one seqlock so the motion thread never blocks and
+ * never pairs one cursor's hotspot with another's image, or x with a
+ * stale y.
+ */
+static struct SeqLock cur_lock = SEQLOCK_INITIALIZER;
+static struct CursorState cur_state = { NULL, 0, 0, 0, -1, -1 };
 
 int cursor_cache_add(XFixesCursorImage *xcursor) {
     if (xcursor == NULL) {
@@ -89,20 +97,46 @@ void cursor_cache_free() {
     }
 }
 
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#define STORE(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+
 void cursor_cache_set_cur(XFixesCursorImage *xcursor) {
-    cur_cursor = xcursor;
+    seqlock_write_begin(&cur_lock);
+    STORE(cur_state.image, xcursor);
+    STORE(cur_state.serial, xcursor ? xcursor->cursor_serial : 0);
+    STORE(cur_state.xhot, xcursor ? xcursor->xhot : 0);
+    STORE(cur_state.yhot, xcursor ? xcursor->yhot : 0);
+    seqlock_write_end(&cur_lock);
 }
 
 XFixesCursorImage *cursor_cache_get_cur() {
-    return cur_cursor;
+    /* a single pointer can't tear */
+    return LOAD(cur_state.image);
 }
 
 void cursor_cache_set_last_pos(int x, int y) {
-    last_x = x;
-    last_y = y;
+    seqlock_write_begin(&cur_lock);
+    STORE(cur_state.x, x);
+    STORE(cur_state.y, y);
+    seqlock_write_end(&cur_lock);
 }
 
 void cursor_cache_get_last_pos(int *x_ret, int *y_ret) {
-    *x_ret = last_x;
-    *y_ret = last_y;
+    struct CursorState state;
+    cursor_cache_get_state(&state);
+    *x_ret = state.x;
+    *y_ret = state.y;
+}
+
+void cursor_cache_get_state(struct CursorState *ret) {
+    uint32_t seq;
+    do {
+        seq = seqlock_read_begin(&cur_lock);
+        ret->image = LOAD(cur_state.image);
+        ret->serial = LOAD(cur_state.serial);
+        ret->xhot = LOAD(cur_state.xhot);
+        ret->yhot = LOAD(cur_state.yhot);
+        ret->x = LOAD(cur_state.x);
+        ret->y = LOAD(cur_state.y);
+    } while (seqlock_read_retry(&cur_lock, seq));
 }
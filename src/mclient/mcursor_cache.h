@@ -18,6 +18,23 @@
 #ifndef M_CURSOR_CACHE_H
 #define M_CURSOR_CACHE_H
 
+#include <X11/Xlib.h>
+#include <X11/extensions/Xfixes.h>
+
+/*
+ * What the motion thread needs to place the cursor. The image is set
+ * on the main thread and the position on the motion thread, and either
+ * side always sees the two as a consistent whole.
+ */
+struct CursorState {
+    XFixesCursorImage *image;   /* current cursor, NULL = none yet */
+    unsigned long serial;       /* of image */
+    int xhot;                   /* hotspot of image */
+    int yhot;
+    int x;                      /* last position placed at, -1 = never */
+    int y;
+};
+
 int cursor_cache_add(XFixesCursorImage *xcursor);
 
 XFixesCursorImage *
@@ -31,6 +48,12 @@ cursor_cache_get_cur();
 void cursor_cache_set_last_pos(int x, int y);
 void cursor_cache_get_last_pos(int *x_ret, int *y_ret);
 
+/**
+ * Snapshot the current cursor and position without ever waiting on a
+ * writer, safe to call from any thread.
+ */
+void cursor_cache_get_state(struct CursorState *ret);
+
 void cursor_cache_free();
 
 #endif // M_CURSOR_CACHE_H
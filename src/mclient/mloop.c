@@ -0,0 +1,155 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "mloop.h"
+#include "mlog.h"
+
+int mloop_init(struct MLoop *this) {
+    int i;
+    for (i = 0; i < MLOOP_NUM_SOURCES; ++i) {
+        this->mFds[i].fd = -1;
+        this->mFds[i].events = POLLIN;
+        this->mFds[i].revents = 0;
+        this->mQueued[i] = NULL;
+        this->mQueuedArg[i] = NULL;
+    }
+    this->mDeadline = 0;
+    this->mSignal = 0;
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0) {
+        MLOGE("error blocking signals\n");
+        return -1;
+    }
+
+    int sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sfd < 0) {
+        MLOGE("error creating signalfd: %s\n", strerror(errno));
+        return -1;
+    }
+    mloop_watch(this, MLOOP_SIGNAL, sfd);
+
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd < 0) {
+        MLOGE("error creating timerfd: %s\n", strerror(errno));
+        mloop_cleanup(this);
+        return -1;
+    }
+    mloop_watch(this, MLOOP_TIMER, tfd);
+
+    return 0;
+}
+
+void mloop_watch(struct MLoop *this, enum MLoopSource source, int fd) {
+    this->mFds[source].fd = fd;
+}
+
+void mloop_set_queued(struct MLoop *this, enum MLoopSource source,
+        MLoopQueued queued, void *arg) {
+    this->mQueued[source] = queued;
+    this->mQueuedArg[source] = arg;
+}
+
+void mloop_set_deadline(struct MLoop *this, uint64_t deadline_ns) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+
+    /* an all-zero it_value disarms the timer */
+    its.it_value.tv_sec = deadline_ns / 1000000000;
+    its.it_value.tv_nsec = deadline_ns % 1000000000;
+
+    if (timerfd_settime(this->mFds[MLOOP_TIMER].fd, TFD_TIMER_ABSTIME,
+            &its, NULL) < 0) {
+        MLOGE("error arming timer: %s\n", strerror(errno));
+        return;
+    }
+    this->mDeadline = deadline_ns;
+}
+
+int mloop_wait(struct MLoop *this) {
+    int ready = 0;
+    int i;
+    for (i = 0; i < MLOOP_NUM_SOURCES; ++i) {
+        if (this->mQueued[i] != NULL &&
+                this->mQueued[i](this->mQueuedArg[i]) > 0) {
+            ready |= MLOOP_READY(i);
+        }
+    }
+
+    /* queued events are handled right away, the rest only if ready too */
+    if (poll(this->mFds, MLOOP_NUM_SOURCES, ready ? 0 : -1) < 0) {
+        if (errno == EINTR) {
+            return ready;
+        }
+        MLOGE("poll error: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < MLOOP_NUM_SOURCES; ++i) {
+        if (this->mFds[i].revents) {
+            ready |= MLOOP_READY(i);
+        }
+    }
+
+    if (ready & MLOOP_READY(MLOOP_TIMER)) {
+        uint64_t expirations;
+        if (read(this->mFds[MLOOP_TIMER].fd, &expirations,
+                sizeof(expirations)) < 0) {
+            /* already re-armed or disarmed in the meantime */
+            ready &= ~MLOOP_READY(MLOOP_TIMER);
+        } else {
+            this->mDeadline = 0;
+        }
+    }
+
+    if (ready & MLOOP_READY(MLOOP_SIGNAL)) {
+        struct signalfd_siginfo info;
+        if (read(this->mFds[MLOOP_SIGNAL].fd, &info, sizeof(info)) ==
+                sizeof(info)) {
+            this->mSignal = info.ssi_signo;
+        } else {
+            ready &= ~MLOOP_READY(MLOOP_SIGNAL);
+        }
+    }
+
+    return ready;
+}
+
+void mloop_cleanup(struct MLoop *this) {
+    /* the X and server fds belong to their connections */
+    enum MLoopSource owned[] = { MLOOP_TIMER, MLOOP_SIGNAL };
+
+    unsigned int i;
+    for (i = 0; i < sizeof(owned) / sizeof(owned[0]); ++i) {
+        if (this->mFds[owned[i]].fd >= 0) {
+            close(this->mFds[owned[i]].fd);
+            this->mFds[owned[i]].fd = -1;
+        }
+    }
+}
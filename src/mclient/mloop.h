@@ -0,0 +1,90 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_LOOP_H
+#define M_LOOP_H
+
+#include <poll.h>
+#include <stdint.h>
+
+/*
+ * mclient's main loop waits on the X connection, the mflinger socket,
+ * a deadline timer and the shutdown signals all at once, so it can
+ * react to server messages and run timed work between X events.
+ *
+ * Call mloop_init() before any threads are started: SIGINT, SIGTERM and
+ * SIGUSR1 are blocked and only delivered through the loop, and threads
+ * inherit the signal mask of their creator.
+ *
+ * Xlib and mlib read ahead into their own queues whenever they wait for
+ * a reply, which leaves the fd idle with events still to handle. A
+ * source with a queued check set is ready while the check says so,
+ * without waiting on its fd.
+ */
+enum MLoopSource {
+    MLOOP_X,
+    MLOOP_SERVER,
+    MLOOP_TIMER,
+    MLOOP_SIGNAL,
+
+    MLOOP_NUM_SOURCES
+};
+
+#define MLOOP_READY(source) (1 << (source))
+
+/* @return the number of events already read from the source's fd */
+typedef int (*MLoopQueued)(void *arg);
+
+struct MLoop {
+    struct pollfd mFds[MLOOP_NUM_SOURCES];
+    MLoopQueued mQueued[MLOOP_NUM_SOURCES];
+    void *mQueuedArg[MLOOP_NUM_SOURCES];
+    uint64_t mDeadline;         /* monotonic ns, 0 = none */
+    int mSignal;                /* last signal received, 0 = none */
+};
+
+int mloop_init(struct MLoop *this);
+
+/**
+ * Start polling @param fd for input as @param source.
+ */
+void mloop_watch(struct MLoop *this, enum MLoopSource source, int fd);
+
+/**
+ * Have @param source count as ready while @param queued(@param arg)
+ * returns more than 0. NULL removes the check.
+ */
+void mloop_set_queued(struct MLoop *this, enum MLoopSource source,
+        MLoopQueued queued, void *arg);
+
+/**
+ * Fire MLOOP_TIMER at monotonic time @param deadline_ns (see
+ * monotonic_ns()), replacing any earlier deadline. 0 disarms.
+ */
+void mloop_set_deadline(struct MLoop *this, uint64_t deadline_ns);
+
+/**
+ * Block until at least one source is ready, or just check the fds if a
+ * source has events queued. The timer and signal sources are consumed
+ * here, the X and server fds are left for the caller to read.
+ *
+ * @return a mask of MLOOP_READY() bits, 0 if interrupted, -1 on error
+ */
+int mloop_wait(struct MLoop *this);
+
+void mloop_cleanup(struct MLoop *this);
+
+#endif // M_LOOP_H
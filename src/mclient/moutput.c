@@ -0,0 +1,309 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <X11/Xlib.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xrandr.h>
+
+#include "mlib.h"
+#include "mlog.h"
+#include "moutput.h"
+#include "ximage.h"
+
+/*
+ * Multi-display mode mirrors each active XRandR CRTC to its own
+ * mflinger display instead of mirroring the whole root window to one.
+ *
+ * Every output has a capture thread with a private X connection and
+ * XShm image covering just its CRTC. A frame is captured and copied on
+ * all threads at once, straight into buffers the main thread locked,
+ * and the main thread then posts them one after the other. So the
+ * expensive part scales across cores while the mflinger socket is
+ * still only ever used from the main thread. Outputs the damage didn't
+ * touch sit the frame out and keep what they last posted.
+ */
+
+static void *output_thread(void *arg) {
+    struct MOutput *out = arg;
+    struct MOutputs *all = out->mOutputs;
+
+    pthread_mutex_lock(&all->mLock);
+    for (;;) {
+        while (!all->mQuit && all->mFrame == out->mSeen) {
+            pthread_cond_wait(&all->mStart, &all->mLock);
+        }
+        if (all->mQuit) {
+            break;
+        }
+        out->mSeen = all->mFrame;
+        if (!out->mDirty) {
+            continue;
+        }
+        pthread_mutex_unlock(&all->mLock);
+
+        int err = 0;
+        if (!XShmGetImage(out->mXdpy, DefaultRootWindow(out->mXdpy),
+                out->mXimg, out->mRect.x, out->mRect.y, AllPlanes)) {
+            MLOGE("error calling XShmGetImage\n");
+            err = -1;
+        } else {
+            err = copy_ximg_to_buffer_mlocked(&out->mBuffer, out->mXimg);
+        }
+
+        pthread_mutex_lock(&all->mLock);
+        out->mResult = err;
+        if (--all->mBusy == 0) {
+            pthread_cond_signal(&all->mDone);
+        }
+    }
+    pthread_mutex_unlock(&all->mLock);
+
+    return NULL;
+}
+
+static void cleanup_output(struct MOutputs *this, struct MOutput *out) {
+    if (out->mXimg != NULL) {
+        xshm_cleanup(out->mXdpy, &out->mShminfo, out->mXimg);
+        out->mXimg = NULL;
+    }
+    if (out->mXdpy != NULL) {
+        XCloseDisplay(out->mXdpy);
+        out->mXdpy = NULL;
+    }
+
+    /* post whatever is locked so the buffer can go */
+    if (out->mBuffer.bits != NULL) {
+        MUnlockBuffer(this->mMdpy, &out->mBuffer);
+    }
+    MDestroyBuffer(this->mMdpy, &out->mBuffer);
+}
+
+static int start_output(struct MOutputs *this, struct MOutput *out,
+        const struct MRect *crtc, uint32_t display) {
+    memset(out, 0, sizeof(*out));
+    out->mOutputs = this;
+    out->mRect = *crtc;
+    out->mSeen = this->mFrame;
+    out->mDirty = 1;
+
+    out->mBuffer.width = crtc->width;
+    out->mBuffer.height = crtc->height;
+    out->mBuffer.display = display;
+    if (MCreateBuffer(this->mMdpy, &out->mBuffer) < 0) {
+        MLOGE("error creating buffer for display %u\n", display);
+        return -1;
+    }
+
+    /* XShm segments are attached per connection, so make it here */
+    out->mXdpy = XOpenDisplay(NULL);
+    if (out->mXdpy == NULL) {
+        MLOGE("error opening an X connection for display %u\n", display);
+        cleanup_output(this, out);
+        return -1;
+    }
+
+    int screen = DefaultScreen(out->mXdpy);
+    out->mXimg = xshm_create(out->mXdpy, &out->mShminfo,
+        DefaultVisual(out->mXdpy, screen), DefaultDepth(out->mXdpy, screen),
+        crtc->width, crtc->height);
+    if (out->mXimg == NULL) {
+        cleanup_output(this, out);
+        return -1;
+    }
+
+    if (pthread_create(&out->mThread, NULL, output_thread, out) != 0) {
+        MLOGE("error starting capture thread for display %u\n", display);
+        cleanup_output(this, out);
+        return -1;
+    }
+
+    MLOGI("display %u mirrors %ux%u+%d+%d\n", display,
+        crtc->width, crtc->height, crtc->x, crtc->y);
+    return 0;
+}
+
+int moutputs_init(struct MOutputs *this, Display *xdpy, MDisplay *mdpy) {
+    memset(this, 0, sizeof(*this));
+    this->mXdpy = xdpy;
+    this->mMdpy = mdpy;
+    pthread_mutex_init(&this->mLock, NULL);
+    pthread_cond_init(&this->mStart, NULL);
+    pthread_cond_init(&this->mDone, NULL);
+    return 0;
+}
+
+int moutputs_list_crtcs(Display *dpy, struct MRect *crtcs, int max) {
+    Window root = DefaultRootWindow(dpy);
+    XRRScreenResources *screenr = XRRGetScreenResourcesCurrent(dpy, root);
+    if (screenr == NULL) {
+        return 0;
+    }
+
+    RROutput primary = XRRGetOutputPrimary(dpy, root);
+
+    int i, j, count = 0;
+    for (i = 0; i < screenr->ncrtc && count < max; ++i) {
+        XRRCrtcInfo *crtc = XRRGetCrtcInfo(dpy, screenr, screenr->crtcs[i]);
+        if (crtc == NULL) {
+            continue;
+        }
+
+        if (crtc->mode != None && crtc->noutput > 0) {
+            struct MRect rect = { crtc->x, crtc->y, crtc->width, crtc->height };
+
+            int is_primary = 0;
+            for (j = 0; j < crtc->noutput; ++j) {
+                is_primary |= crtc->outputs[j] == primary;
+            }
+
+            /* the primary CRTC goes to the default display */
+            if (is_primary && count > 0) {
+                crtcs[count] = crtcs[0];
+                crtcs[0] = rect;
+            } else {
+                crtcs[count] = rect;
+            }
+            ++count;
+        }
+        XRRFreeCrtcInfo(crtc);
+    }
+
+    XRRFreeScreenResources(screenr);
+    return count;
+}
+
+int moutputs_sync(struct MOutputs *this) {
+    struct MRect crtcs[MOUTPUT_MAX];
+    int count = moutputs_list_crtcs(this->mXdpy, crtcs, MOUTPUT_MAX);
+
+    /* a single CRTC is what the root buffer is for */
+    MDisplayInfo displays[M_MAX_DISPLAYS];
+    if (count > 1) {
+        int ndisplays = MListDisplays(this->mMdpy, displays, M_MAX_DISPLAYS);
+        if (ndisplays < count) {
+            count = ndisplays;
+        }
+    }
+    if (count < 2) {
+        count = 0;
+    }
+
+    int i, same = count == this->mCount;
+    for (i = 0; same && i < count; ++i) {
+        same = memcmp(&crtcs[i], &this->mOutput[i].mRect,
+            sizeof(crtcs[i])) == 0;
+    }
+    if (same) {
+        return this->mCount;
+    }
+
+    moutputs_stop(this);
+    for (i = 0; i < count; ++i) {
+        if (start_output(this, &this->mOutput[i], &crtcs[i],
+                displays[i].id) < 0) {
+            MLOGE("can't mirror %d displays, falling back to one\n", count);
+            moutputs_stop(this);
+            break;
+        }
+        ++this->mCount;
+    }
+
+    return this->mCount;
+}
+
+void moutputs_damage(struct MOutputs *this, const struct MRect *rects,
+        int count) {
+    int i, j;
+    for (i = 0; i < this->mCount; ++i) {
+        struct MOutput *out = &this->mOutput[i];
+        for (j = 0; !out->mDirty && j < count; ++j) {
+            out->mDirty = rect_intersects(&out->mRect, &rects[j]);
+        }
+        if (count == 0) {
+            out->mDirty = 1;
+        }
+    }
+}
+
+int moutputs_render(struct MOutputs *this) {
+    int i, busy = 0, err = 0;
+    for (i = 0; i < this->mCount; ++i) {
+        struct MOutput *out = &this->mOutput[i];
+        if (!out->mDirty) {
+            continue;
+        }
+        if (out->mBuffer.bits == NULL &&
+                MLockBuffer(this->mMdpy, &out->mBuffer) < 0) {
+            MLOGE("MLockBuffer failed!\n");
+            return -1;
+        }
+        ++busy;
+    }
+    if (busy == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&this->mLock);
+    this->mBusy = busy;
+    ++this->mFrame;
+    pthread_cond_broadcast(&this->mStart);
+    while (this->mBusy > 0) {
+        pthread_cond_wait(&this->mDone, &this->mLock);
+    }
+    pthread_mutex_unlock(&this->mLock);
+
+    for (i = 0; i < this->mCount; ++i) {
+        struct MOutput *out = &this->mOutput[i];
+        if (!out->mDirty) {
+            continue;
+        }
+        if (out->mResult < 0) {
+            /* don't post a half-copied frame */
+            err = -1;
+        } else if (MSwapBuffer(this->mMdpy, &out->mBuffer) < 0) {
+            MLOGE("MSwapBuffer failed!\n");
+            err = -1;
+        } else {
+            out->mDirty = 0;
+        }
+    }
+
+    return err;
+}
+
+void moutputs_stop(struct MOutputs *this) {
+    if (this->mCount == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&this->mLock);
+    this->mQuit = 1;
+    pthread_cond_broadcast(&this->mStart);
+    pthread_mutex_unlock(&this->mLock);
+
+    int i;
+    for (i = 0; i < this->mCount; ++i) {
+        pthread_join(this->mOutput[i].mThread, NULL);
+        cleanup_output(this, &this->mOutput[i]);
+    }
+
+    this->mCount = 0;
+    this->mQuit = 0;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_OUTPUT_H
+#define M_OUTPUT_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/XShm.h>
+
+#include "mlib.h"
+#include "rect.h"
+
+#define MOUTPUT_MAX (M_MAX_DISPLAYS)
+
+struct MOutputs;
+
+/*
+ * One XRandR CRTC mirrored to one mflinger display.
+ */
+struct MOutput {
+    struct MOutputs *mOutputs;
+    pthread_t mThread;
+    Display *mXdpy;             /* private connection for the thread */
+    XImage *mXimg;
+    XShmSegmentInfo mShminfo;
+    MBuffer mBuffer;
+    struct MRect mRect;         /* CRTC area of the root window */
+    uint32_t mSeen;             /* last frame number captured */
+    int mDirty;                 /* damaged since it was last posted */
+    int mResult;                /* of the last capture */
+};
+
+struct MOutputs {
+    Display *mXdpy;
+    MDisplay *mMdpy;
+    struct MOutput mOutput[MOUTPUT_MAX];
+    int mCount;                 /* 0 = not active, the root buffer is used */
+
+    pthread_mutex_t mLock;
+    pthread_cond_t mStart;      /* mFrame changed or mQuit set */
+    pthread_cond_t mDone;       /* mBusy dropped to 0 */
+    uint32_t mFrame;
+    int mBusy;                  /* outputs still capturing mFrame */
+    int mQuit;
+};
+
+int moutputs_init(struct MOutputs *this, Display *xdpy, MDisplay *mdpy);
+
+/**
+ * Fill in up to @param max active CRTCs, the one driving the primary
+ * output first.
+ *
+ * @return number of CRTCs filled in
+ */
+int moutputs_list_crtcs(Display *dpy, struct MRect *crtcs, int max);
+
+/**
+ * Match active CRTCs up with mflinger displays and (re)start one
+ * capture thread per pair if there is more than one.
+ *
+ * @return number of outputs running, 0 = use the root buffer
+ */
+int moutputs_sync(struct MOutputs *this);
+
+/**
+ * Mark the outputs whose CRTC intersects one of the @param count rects
+ * in root window coordinates as damaged, or all of them if there are
+ * no rects to go by.
+ */
+void moutputs_damage(struct MOutputs *this, const struct MRect *rects,
+        int count);
+
+/**
+ * Capture every damaged output on its own thread and post them.
+ */
+int moutputs_render(struct MOutputs *this);
+
+void moutputs_stop(struct MOutputs *this);
+
+#endif // M_OUTPUT_H
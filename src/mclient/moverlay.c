@@ -0,0 +1,184 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+
+#include "mlib.h"
+#include "mlog.h"
+#include "moverlay.h"
+#include "util.h"
+#include "ximage.h"
+
+/*
+ * Video-region overlay.
+ *
+ * A video playing in part of the screen damages the same rectangle at
+ * a steady rate, and mirroring the whole root window means copying and
+ * posting every pixel of the screen for every video frame.
+ *
+ * Once the detector sees such a rectangle, it gets its own surface on
+ * top of the root buffer. Damage inside the rectangle then only
+ * re-captures the overlay and the root buffer is left alone; the part
+ * of the root buffer under the overlay goes stale, but nobody can see
+ * it. When the pattern ends the overlay is dropped and the root buffer
+ * is brought up to date again.
+ */
+
+static int render_overlay(struct MOverlay *this) {
+    if (MLockBuffer(this->mMdpy, &this->mBuffer) < 0) {
+        MLOGE("MLockBuffer failed!\n");
+        return -1;
+    }
+
+    const struct MRect *r = &this->mDetector.active_rect;
+    if (!XShmGetImage(this->mXdpy, DefaultRootWindow(this->mXdpy),
+            this->mXimg, r->x, r->y, AllPlanes)) {
+        MLOGE("error calling XShmGetImage\n");
+    }
+
+    copy_ximg_to_buffer_mlocked(&this->mBuffer, this->mXimg);
+
+    if (MUnlockBuffer(this->mMdpy, &this->mBuffer) < 0) {
+        MLOGE("MUnlockBuffer failed!\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int promote(struct MOverlay *this) {
+    const struct MRect *r = &this->mDetector.active_rect;
+    Display *dpy = this->mXdpy;
+    int screen = DefaultScreen(dpy);
+
+    memset(&this->mBuffer, 0, sizeof(this->mBuffer));
+    this->mBuffer.width = r->width;
+    this->mBuffer.height = r->height;
+    if (MCreateBuffer(this->mMdpy, &this->mBuffer) < 0) {
+        MLOGE("error creating overlay buffer\n");
+        return -1;
+    }
+
+    this->mXimg = xshm_create(dpy, &this->mShminfo,
+        DefaultVisual(dpy, screen), DefaultDepth(dpy, screen),
+        r->width, r->height);
+    if (this->mXimg == NULL) {
+        MLOGE("failed to create overlay xshm\n");
+        MDestroyBuffer(this->mMdpy, &this->mBuffer);
+        return -1;
+    }
+
+    /* damage rects are clipped to the root window so these are >= 0 */
+    MUpdateBuffer(this->mMdpy, &this->mBuffer, r->x, r->y);
+    MRestackBuffer(this->mMdpy, &this->mBuffer, OVERLAY_Z);
+
+    this->mActive = 1;
+    this->mActiveSince = monotonic_ms();
+    this->mStats.promotions++;
+
+    MLOGI("overlay promoted at (%d, %d) %ux%u\n",
+        r->x, r->y, r->width, r->height);
+    return 0;
+}
+
+static void demote(struct MOverlay *this) {
+    if (!this->mActive) {
+        return;
+    }
+
+    xshm_cleanup(this->mXdpy, &this->mShminfo, this->mXimg);
+    this->mXimg = NULL;
+
+    if (MDestroyBuffer(this->mMdpy, &this->mBuffer) < 0) {
+        MLOGE("error destroying overlay buffer\n");
+    }
+
+    this->mActive = 0;
+    this->mStats.ms_active += monotonic_ms() - this->mActiveSince;
+
+    MLOGI("overlay demoted: %u promotions, %llu frames, %llu ms active, "
+          "%lld bytes saved\n",
+        this->mStats.promotions,
+        (unsigned long long)this->mStats.frames,
+        (unsigned long long)this->mStats.ms_active,
+        (long long)this->mStats.bytes_saved);
+}
+
+int moverlay_init(struct MOverlay *this, Display *xdpy, MDisplay *mdpy) {
+    memset(this, 0, sizeof(*this));
+    this->mXdpy = xdpy;
+    this->mMdpy = mdpy;
+
+    int screen = DefaultScreen(xdpy);
+    overlay_detector_init(&this->mDetector,
+        XDisplayWidth(xdpy, screen), XDisplayHeight(xdpy, screen));
+    return 0;
+}
+
+int moverlay_on_damage(struct MOverlay *this,
+        const struct MRect *rects, int nrects, uint64_t root_bytes) {
+    int overlay_damaged, root_damaged;
+
+    enum OverlayAction action = overlay_detector_update(&this->mDetector,
+        rects, nrects, monotonic_ms(), &overlay_damaged, &root_damaged);
+
+    switch (action) {
+        case OVERLAY_PROMOTE:
+            if (promote(this) < 0) {
+                overlay_detector_reset(&this->mDetector);
+                return 1;
+            }
+            break;
+
+        case OVERLAY_DEMOTE:
+            demote(this);
+            return 1;
+
+        case OVERLAY_NONE:
+            break;
+    }
+
+    if (this->mActive && overlay_damaged) {
+        render_overlay(this);
+
+        uint64_t overlay_bytes =
+            (uint64_t)this->mBuffer.width * this->mBuffer.height * 4;
+        this->mStats.frames++;
+        this->mStats.bytes_saved +=
+            (int64_t)(root_damaged ? 0 : root_bytes) - (int64_t)overlay_bytes;
+    }
+
+    return root_damaged;
+}
+
+int moverlay_stop(struct MOverlay *this) {
+    int was_active = this->mActive;
+
+    demote(this);
+
+    /* the screen may have changed size */
+    int screen = DefaultScreen(this->mXdpy);
+    overlay_detector_init(&this->mDetector,
+        XDisplayWidth(this->mXdpy, screen),
+        XDisplayHeight(this->mXdpy, screen));
+
+    return was_active;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_OVERLAY_H
+#define M_OVERLAY_H
+
+#include <stdint.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/XShm.h>
+
+#include "mlib.h"
+#include "overlay_detector.h"
+#include "rect.h"
+
+/*
+ * The overlay sits right above the root buffer (z = 0)
+ * and below the cursor (z = M_MAX_Z).
+ */
+#define OVERLAY_Z (1)
+
+/* most damage rects looked at per frame, the rest count as root damage */
+#define OVERLAY_MAX_RECTS (32)
+
+struct MOverlayStats {
+    uint32_t promotions;
+    uint64_t frames;            /* overlay-only updates */
+    uint64_t ms_active;
+    int64_t bytes_saved;        /* vs. re-posting the whole root buffer */
+};
+
+struct MOverlay {
+    Display *mXdpy;
+    MDisplay *mMdpy;
+    MBuffer mBuffer;
+    XImage *mXimg;
+    XShmSegmentInfo mShminfo;
+    int mActive;
+    uint64_t mActiveSince;
+    struct OverlayDetector mDetector;
+    struct MOverlayStats mStats;
+};
+
+int moverlay_init(struct MOverlay *this, Display *xdpy, MDisplay *mdpy);
+
+/**
+ * Feed one frame of root window damage, promoting or demoting the
+ * overlay as needed and re-capturing it if it was damaged.
+ *
+ * @param root_bytes size of one root buffer post, for the stats
+ *
+ * @return 1 if the root buffer still has to be rendered, 0 otherwise
+ */
+int moverlay_on_damage(struct MOverlay *this,
+        const struct MRect *rects, int nrects, uint64_t root_bytes);
+
+/**
+ * Drop the overlay, e.g. on screen changes. The caller must
+ * re-render the root buffer if this returns 1.
+ */
+int moverlay_stop(struct MOverlay *this);
+
+#endif // M_OVERLAY_H
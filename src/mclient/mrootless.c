@@ -0,0 +1,557 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xcomposite.h>
+#include <X11/extensions/Xdamage.h>
+
+#include "mlib.h"
+#include "mlog.h"
+#include "mrootless.h"
+#include "ximage.h"
+
+/*
+ * Rootless mode mirrors every top-level X window to its own mflinger
+ * surface instead of mirroring the whole root window to one buffer.
+ *
+ * Top-level windows are redirected with XComposite so their contents
+ * stay intact when obscured, and each mapped window gets its own damage
+ * object and XShm image. Moving or restacking a window is then just a
+ * compositor transaction (MUpdateBuffer / MRestackBuffer) and only the
+ * window that actually changed gets re-captured.
+ *
+ * Surfaces of windows that are unmapped stay around (hidden) for when
+ * the window comes back, and are destroyed along with the window.
+ *
+ * Surfaces can't go to negative positions, so whatever part of a window
+ * is left of or above the screen is cropped off: its surface only
+ * covers the rest, captured from that far into the window.
+ *
+ * The window list mirrors the X stacking order, bottom-most first.
+ */
+
+static struct MWindow *find_window(struct MRootless *this, Window win) {
+    struct MWindow *w;
+    for (w = this->mWindows; w != NULL; w = w->mNext) {
+        if (w->mWin == win) {
+            return w;
+        }
+    }
+    return NULL;
+}
+
+static struct MWindow *find_window_by_damage(struct MRootless *this,
+        Damage damage) {
+    struct MWindow *w;
+    for (w = this->mWindows; w != NULL; w = w->mNext) {
+        if (w->mMapped && w->mDamage == damage) {
+            return w;
+        }
+    }
+    return NULL;
+}
+
+static void unlink_window(struct MRootless *this, struct MWindow *w) {
+    struct MWindow **link;
+    for (link = &this->mWindows; *link != NULL; link = &(*link)->mNext) {
+        if (*link == w) {
+            *link = w->mNext;
+            w->mNext = NULL;
+            return;
+        }
+    }
+}
+
+/**
+ * Put @param w directly above @param sibling, or at the bottom
+ * if @param sibling is None.
+ */
+static void place_above(struct MRootless *this, struct MWindow *w,
+        Window sibling) {
+    unlink_window(this, w);
+
+    struct MWindow *below = sibling == None ? NULL : find_window(this, sibling);
+    if (below == NULL) {
+        w->mNext = this->mWindows;
+        this->mWindows = w;
+    } else {
+        w->mNext = below->mNext;
+        below->mNext = w;
+    }
+}
+
+static void place_on_top(struct MRootless *this, struct MWindow *w) {
+    unlink_window(this, w);
+
+    struct MWindow **link = &this->mWindows;
+    while (*link != NULL) {
+        link = &(*link)->mNext;
+    }
+    *link = w;
+}
+
+/**
+ * Sync surface z-order with the window stacking order.
+ */
+static void restack(struct MRootless *this) {
+    int z = ROOTLESS_Z_BASE;
+    struct MWindow *w;
+    for (w = this->mWindows; w != NULL; w = w->mNext) {
+        if (!w->mHasSurface) {
+            continue;
+        }
+
+        /* stay below the cursor no matter how many windows there are */
+        int wz = z < M_MAX_Z ? z : M_MAX_Z - 1;
+        if (w->mZ != wz) {
+            if (MRestackBuffer(this->mMdpy, &w->mBuffer, wz) == 0) {
+                w->mZ = wz;
+            }
+        }
+        ++z;
+    }
+}
+
+/**
+ * Recompute the crop for the window position.
+ *
+ * @return 1 if it changed
+ */
+static int update_crop(struct MWindow *w) {
+    int crop_x = w->mX < 0 ? -w->mX : 0;
+    int crop_y = w->mY < 0 ? -w->mY : 0;
+    int changed = crop_x != w->mCropX || crop_y != w->mCropY;
+
+    w->mCropX = crop_x;
+    w->mCropY = crop_y;
+    return changed;
+}
+
+static int is_offscreen(const struct MWindow *w) {
+    return w->mWidth <= (uint32_t)w->mCropX ||
+           w->mHeight <= (uint32_t)w->mCropY;
+}
+
+/* an off-screen window keeps a 1x1 surface, hidden */
+static uint32_t surface_width(const struct MWindow *w) {
+    return is_offscreen(w) ? 1 : w->mWidth - w->mCropX;
+}
+
+static uint32_t surface_height(const struct MWindow *w) {
+    return is_offscreen(w) ? 1 : w->mHeight - w->mCropY;
+}
+
+static int acquire_surface(struct MRootless *this, struct MWindow *w) {
+    memset(&w->mBuffer, 0, sizeof(w->mBuffer));
+    w->mBuffer.width = surface_width(w);
+    w->mBuffer.height = surface_height(w);
+    if (MCreateBuffer(this->mMdpy, &w->mBuffer) < 0) {
+        MLOGE("error creating window buffer\n");
+        return -1;
+    }
+
+    /* new surfaces start out shown */
+    w->mHasSurface = 1;
+    w->mShown = 1;
+    w->mZ = -1;
+    return 0;
+}
+
+static void release_surface(struct MRootless *this, struct MWindow *w) {
+    if (!w->mHasSurface) {
+        return;
+    }
+
+    if (MDestroyBuffer(this->mMdpy, &w->mBuffer) < 0) {
+        MLOGE("error destroying window buffer\n");
+    }
+
+    w->mHasSurface = 0;
+}
+
+static void show_window(struct MRootless *this, struct MWindow *w) {
+    int shown = w->mMapped && !is_offscreen(w);
+    if (shown != w->mShown) {
+        MShowBuffer(this->mMdpy, &w->mBuffer, shown);
+        w->mShown = shown;
+    }
+}
+
+static void move_window(struct MRootless *this, struct MWindow *w) {
+    /* never negative, the crop takes care of that */
+    uint32_t xpos = w->mX + w->mCropX;
+    uint32_t ypos = w->mY + w->mCropY;
+
+    if (MUpdateBuffer(this->mMdpy, &w->mBuffer, xpos, ypos) < 0) {
+        MLOGE("error calling MUpdateBuffer\n");
+    }
+}
+
+static int render_window(struct MRootless *this, struct MWindow *w) {
+    if (!w->mMapped || w->mXimg == NULL || is_offscreen(w)) {
+        return 0;
+    }
+
+    /* a failed resize would overrun the buffer */
+    if (w->mBuffer.width != w->mXimg->width ||
+            w->mBuffer.height != w->mXimg->height) {
+        return -1;
+    }
+
+    if (MLockBuffer(this->mMdpy, &w->mBuffer) < 0) {
+        MLOGE("MLockBuffer failed!\n");
+        return -1;
+    }
+
+    if (!XShmGetImage(this->mXdpy, w->mWin, w->mXimg,
+            w->mCropX, w->mCropY, AllPlanes)) {
+        MLOGE("error calling XShmGetImage\n");
+    }
+
+    /* only ARGB visuals have meaningful alpha */
+    if (w->mDepth == 32) {
+        copy_ximg_to_buffer_mlocked(&w->mBuffer, w->mXimg);
+    } else {
+        copy_ximg_to_buffer_opaque_mlocked(&w->mBuffer, w->mXimg);
+    }
+
+    if (MUnlockBuffer(this->mMdpy, &w->mBuffer) < 0) {
+        MLOGE("MUnlockBuffer failed!\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int map_window(struct MRootless *this, struct MWindow *w) {
+    if (w->mMapped) {
+        return 0;
+    }
+
+    update_crop(w);
+    if (!w->mHasSurface) {
+        if (acquire_surface(this, w) < 0) {
+            return -1;
+        }
+    } else if (w->mBuffer.width != surface_width(w) ||
+               w->mBuffer.height != surface_height(w)) {
+        if (MResizeBuffer(this->mMdpy, &w->mBuffer,
+                surface_width(w), surface_height(w)) < 0) {
+            MLOGE("error resizing window buffer\n");
+        }
+    }
+
+    w->mXimg = xshm_create(this->mXdpy, &w->mShminfo,
+        w->mVisual, w->mDepth, surface_width(w), surface_height(w));
+    if (w->mXimg == NULL) {
+        MLOGE("failed to create window xshm\n");
+        return -1;
+    }
+
+    w->mDamage = XDamageCreate(this->mXdpy, w->mWin, XDamageReportNonEmpty);
+    w->mMapped = 1;
+
+    move_window(this, w);
+    restack(this);
+    render_window(this, w);
+    show_window(this, w);
+
+    return 0;
+}
+
+/**
+ * @param gone the X window no longer exists, so skip X cleanup
+ * that would only generate errors
+ */
+static void unmap_window(struct MRootless *this, struct MWindow *w, int gone) {
+    if (!w->mMapped) {
+        return;
+    }
+
+    if (!gone) {
+        XDamageDestroy(this->mXdpy, w->mDamage);
+    }
+    if (w->mXimg != NULL) {
+        xshm_cleanup(this->mXdpy, &w->mShminfo, w->mXimg);
+        w->mXimg = NULL;
+    }
+    w->mDamage = None;
+    w->mMapped = 0;
+
+    show_window(this, w);
+}
+
+static void remove_window(struct MRootless *this, struct MWindow *w,
+        int gone) {
+    unmap_window(this, w, gone);
+    release_surface(this, w);
+    unlink_window(this, w);
+    free(w);
+}
+
+static void resize_window(struct MRootless *this, struct MWindow *w) {
+    if (w->mXimg != NULL) {
+        xshm_cleanup(this->mXdpy, &w->mShminfo, w->mXimg);
+    }
+    w->mXimg = xshm_create(this->mXdpy, &w->mShminfo,
+        w->mVisual, w->mDepth, surface_width(w), surface_height(w));
+
+    if (MResizeBuffer(this->mMdpy, &w->mBuffer,
+            surface_width(w), surface_height(w)) < 0) {
+        MLOGE("error resizing window buffer\n");
+    }
+
+    render_window(this, w);
+}
+
+static struct MWindow *add_window(struct MRootless *this, Window win) {
+    XWindowAttributes attr;
+    if (!XGetWindowAttributes(this->mXdpy, win, &attr)) {
+        return NULL;
+    }
+
+    /* nothing to see here */
+    if (attr.class == InputOnly) {
+        return NULL;
+    }
+
+    struct MWindow *w = calloc(1, sizeof(*w));
+    if (w == NULL) {
+        return NULL;
+    }
+
+    w->mWin = win;
+    w->mVisual = attr.visual;
+    w->mDepth = attr.depth;
+    w->mX = attr.x + attr.border_width;
+    w->mY = attr.y + attr.border_width;
+    w->mWidth = attr.width;
+    w->mHeight = attr.height;
+    w->mZ = -1;
+
+    /* new windows are always created on top */
+    place_on_top(this, w);
+
+    if (attr.map_state == IsViewable) {
+        map_window(this, w);
+    }
+
+    return w;
+}
+
+static void configure_window(struct MRootless *this, struct MWindow *w,
+        XConfigureEvent *cev) {
+    uint32_t old_width = surface_width(w);
+    uint32_t old_height = surface_height(w);
+
+    w->mX = cev->x + cev->border_width;
+    w->mY = cev->y + cev->border_width;
+    w->mWidth = cev->width;
+    w->mHeight = cev->height;
+
+    int cropped = update_crop(w);
+    int resized = surface_width(w) != old_width ||
+                  surface_height(w) != old_height;
+
+    if (w->mMapped) {
+        if (resized) {
+            resize_window(this, w);
+        } else if (cropped) {
+            /* same size, but a different part of the window */
+            render_window(this, w);
+        }
+        move_window(this, w);
+        show_window(this, w);
+    }
+
+    place_above(this, w, cev->above);
+    restack(this);
+}
+
+int mrootless_init(struct MRootless *this, Display *xdpy, MDisplay *mdpy,
+        int xdamage_event_base) {
+    memset(this, 0, sizeof(*this));
+
+    int event_base, error_base;
+    if (!XCompositeQueryExtension(xdpy, &event_base, &error_base)) {
+        MLOGE("XComposite extension unavailable!\n");
+        return -1;
+    }
+
+    this->mXdpy = xdpy;
+    this->mMdpy = mdpy;
+    this->mXDamageEventBase = xdamage_event_base;
+    return 0;
+}
+
+int mrootless_start(struct MRootless *this) {
+    if (this->mXdpy == NULL) {
+        return -1;
+    }
+    if (this->mActive) {
+        return 0;
+    }
+
+    Display *dpy = this->mXdpy;
+    Window root = DefaultRootWindow(dpy);
+
+    /* don't let windows come and go between the query and the select */
+    XGrabServer(dpy);
+
+    XWindowAttributes root_attr;
+    XGetWindowAttributes(dpy, root, &root_attr);
+    XSelectInput(dpy, root, root_attr.your_event_mask | SubstructureNotifyMask);
+
+    XCompositeRedirectSubwindows(dpy, root, CompositeRedirectAutomatic);
+
+    Window root_ret, parent_ret;
+    Window *children = NULL;
+    unsigned int nchildren = 0;
+    if (XQueryTree(dpy, root, &root_ret, &parent_ret, &children, &nchildren)) {
+        /* children are returned bottom-most first */
+        unsigned int i;
+        for (i = 0; i < nchildren; ++i) {
+            add_window(this, children[i]);
+        }
+        if (children != NULL) {
+            XFree(children);
+        }
+    }
+
+    XUngrabServer(dpy);
+
+    this->mActive = 1;
+    restack(this);
+
+    MLOGI("rootless mode started\n");
+    return 0;
+}
+
+void mrootless_stop(struct MRootless *this) {
+    if (!this->mActive) {
+        return;
+    }
+
+    Display *dpy = this->mXdpy;
+    Window root = DefaultRootWindow(dpy);
+
+    while (this->mWindows != NULL) {
+        remove_window(this, this->mWindows, 0);
+    }
+
+    XCompositeUnredirectSubwindows(dpy, root, CompositeRedirectAutomatic);
+
+    XWindowAttributes root_attr;
+    XGetWindowAttributes(dpy, root, &root_attr);
+    XSelectInput(dpy, root, root_attr.your_event_mask & ~SubstructureNotifyMask);
+
+    this->mActive = 0;
+    MLOGI("rootless mode stopped\n");
+}
+
+int mrootless_on_event(struct MRootless *this, XEvent *ev) {
+    if (!this->mActive) {
+        return 0;
+    }
+
+    Window root = DefaultRootWindow(this->mXdpy);
+    struct MWindow *w;
+
+    if (ev->type == this->mXDamageEventBase + XDamageNotify) {
+        XDamageNotifyEvent *dmg = (XDamageNotifyEvent *)ev;
+        w = find_window_by_damage(this, dmg->damage);
+        if (w == NULL) {
+            return 0;
+        }
+
+        XDamageSubtract(this->mXdpy, dmg->damage, None, None);
+        render_window(this, w);
+        return 1;
+    }
+
+    switch (ev->type) {
+        case CreateNotify:
+            if (ev->xcreatewindow.parent == root &&
+                    find_window(this, ev->xcreatewindow.window) == NULL) {
+                add_window(this, ev->xcreatewindow.window);
+            }
+            return 1;
+
+        case DestroyNotify:
+            w = find_window(this, ev->xdestroywindow.window);
+            if (w != NULL) {
+                remove_window(this, w, 1);
+            }
+            return 1;
+
+        case MapNotify:
+            w = find_window(this, ev->xmap.window);
+            if (w != NULL) {
+                map_window(this, w);
+            }
+            return 1;
+
+        case UnmapNotify:
+            w = find_window(this, ev->xunmap.window);
+            if (w != NULL) {
+                unmap_window(this, w, 0);
+            }
+            return 1;
+
+        case ConfigureNotify:
+            if (ev->xconfigure.event != root) {
+                return 0;
+            }
+            w = find_window(this, ev->xconfigure.window);
+            if (w != NULL) {
+                configure_window(this, w, &ev->xconfigure);
+            }
+            return 1;
+
+        case ReparentNotify:
+            w = find_window(this, ev->xreparent.window);
+            if (ev->xreparent.parent == root) {
+                if (w == NULL) {
+                    add_window(this, ev->xreparent.window);
+                }
+            } else if (w != NULL) {
+                /* no longer a top-level window */
+                remove_window(this, w, 0);
+            }
+            return 1;
+
+        case CirculateNotify:
+            w = find_window(this, ev->xcirculate.window);
+            if (w != NULL) {
+                if (ev->xcirculate.place == PlaceOnTop) {
+                    place_on_top(this, w);
+                } else {
+                    place_above(this, w, None);
+                }
+                restack(this);
+            }
+            return 1;
+
+        default:
+            return 0;
+    }
+}
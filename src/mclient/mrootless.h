@@ -0,0 +1,80 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_ROOTLESS_H
+#define M_ROOTLESS_H
+
+#include <stdint.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xdamage.h>
+
+#include "mlib.h"
+
+/*
+ * Window surfaces are stacked above the root buffer (z = 0)
+ * and below the cursor (z = M_MAX_Z).
+ */
+#define ROOTLESS_Z_BASE (1)
+
+struct MWindow {
+    Window mWin;
+    Damage mDamage;
+    MBuffer mBuffer;
+    XImage *mXimg;
+    XShmSegmentInfo mShminfo;
+    Visual *mVisual;
+    int mDepth;
+    int mX;                     /* position of the window contents */
+    int mY;
+    uint32_t mWidth;
+    uint32_t mHeight;
+    int mCropX;                 /* columns left of the screen, not mirrored */
+    int mCropY;                 /* rows above the screen, not mirrored */
+    int mMapped;
+    int mHasSurface;
+    int mShown;                 /* last visibility sent to mflinger */
+    int mZ;                     /* last z sent to mflinger, -1 = none */
+    struct MWindow *mNext;      /* stacking order, bottom-most first */
+};
+
+struct MRootless {
+    Display *mXdpy;
+    MDisplay *mMdpy;
+    int mXDamageEventBase;
+    int mActive;
+    struct MWindow *mWindows;
+};
+
+int mrootless_init(struct MRootless *this, Display *xdpy, MDisplay *mdpy,
+        int xdamage_event_base);
+
+/**
+ * Redirect top-level windows and mirror each one to its own surface.
+ */
+int mrootless_start(struct MRootless *this);
+
+/**
+ * Hide all window surfaces and stop tracking windows.
+ */
+void mrootless_stop(struct MRootless *this);
+
+/**
+ * @return 1 if @param ev was consumed, 0 otherwise
+ */
+int mrootless_on_event(struct MRootless *this, XEvent *ev);
+
+#endif // M_ROOTLESS_H
@@ -0,0 +1,102 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "msession.h"
+#include "mlog.h"
+
+#define SESSION_FILE "mclient-session"
+
+static int session_path(char *path, size_t size) {
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    if (dir == NULL || dir[0] == '\0') {
+        return -1;
+    }
+    if (snprintf(path, size, "%s/" SESSION_FILE, dir) >= (int)size) {
+        return -1;
+    }
+    return 0;
+}
+
+int msession_load(MSession *session) {
+    char path[4096];
+    memset(session, 0, sizeof(*session));
+    if (session_path(path, sizeof(path)) < 0) {
+        return -1;
+    }
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        /* nothing saved, start a new session */
+        return 0;
+    }
+
+    unsigned long long token;
+    unsigned count;
+    if (fscanf(f, "%llx %u", &token, &count) == 2 &&
+            count <= M_SESSION_MAX_BUFFERS) {
+        uint32_t i;
+        session->token = token;
+        for (i = 0; i < count && fscanf(f, "%d", &session->ids[i]) == 1; ++i) {
+        }
+        session->count = i;
+    } else {
+        MLOGW("ignoring malformed %s\n", path);
+    }
+
+    fclose(f);
+    return 0;
+}
+
+int msession_save(const MSession *session) {
+    char path[4096], tmp[4096 + 4];
+    if (session_path(path, sizeof(path)) < 0) {
+        return -1;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    /* written aside and renamed, a crash mid-write keeps the old one */
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL) {
+        MLOGE("error opening %s\n", tmp);
+        return -1;
+    }
+
+    uint32_t i;
+    fprintf(f, "%llx %u", (unsigned long long)session->token, session->count);
+    for (i = 0; i < session->count; ++i) {
+        fprintf(f, " %d", session->ids[i]);
+    }
+    fprintf(f, "\n");
+
+    if (fclose(f) != 0 || rename(tmp, path) < 0) {
+        MLOGE("error saving session to %s\n", path);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+void msession_clear(void) {
+    char path[4096];
+    if (session_path(path, sizeof(path)) == 0) {
+        unlink(path);
+    }
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_SESSION_H
+#define M_SESSION_H
+
+#include <stdint.h>
+
+#include "mlib.h"
+
+/*
+ * Where mclient keeps its mflinger session, see MResumeSession(), so a
+ * restarted mclient takes the screen over right where the last one
+ * left it: $XDG_RUNTIME_DIR/mclient-session, a single line with the
+ * token and buffer ids. Without XDG_RUNTIME_DIR there is no session.
+ */
+
+/**
+ * @return 0 if sessions can be kept, with @param session zeroed if
+ * there is none saved, -1 otherwise
+ */
+int msession_load(MSession *session);
+
+int msession_save(const MSession *session);
+
+/**
+ * Forget the saved session, e.g. on a clean exit.
+ */
+void msession_clear(void);
+
+#endif // M_SESSION_H
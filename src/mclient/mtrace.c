@@ -0,0 +1,139 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "mlog.h"
+#include "mtrace.h"
+#include "util.h"
+
+/* mclient is usually killed rather than stopped, so flush regularly */
+#define FLUSH_INTERVAL_MS (1000)
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace_file;
+static uint64_t trace_start_ms;
+static uint64_t last_flush_ms;
+
+static int16_t clamp16(int32_t v) {
+    return v < INT16_MIN ? INT16_MIN : v > INT16_MAX ? INT16_MAX : v;
+}
+
+static uint16_t clampu16(uint32_t v) {
+    return v > UINT16_MAX ? UINT16_MAX : v;
+}
+
+int mtrace_start(const char *path, uint32_t screen_width,
+        uint32_t screen_height) {
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        MLOGE("error opening trace %s\n", path);
+        return -1;
+    }
+
+    struct MTraceHeader header;
+    memcpy(header.magic, MTRACE_MAGIC, sizeof(header.magic));
+    header.version = MTRACE_VERSION;
+    header.record_size = sizeof(struct MTraceRecord);
+    header.screen_width = screen_width;
+    header.screen_height = screen_height;
+    if (fwrite(&header, sizeof(header), 1, f) != 1) {
+        MLOGE("error writing trace header\n");
+        fclose(f);
+        return -1;
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    trace_start_ms = last_flush_ms = monotonic_ms();
+    __atomic_store_n(&trace_file, f, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&trace_lock);
+
+    MLOGI("recording damage trace to %s\n", path);
+    return 0;
+}
+
+void mtrace_stop(void) {
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file != NULL) {
+        fclose(trace_file);
+        __atomic_store_n(&trace_file, NULL, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void mtrace_record(enum MTraceType type, int32_t x, int32_t y,
+        uint32_t width, uint32_t height) {
+    /* cheap check so recording costs nothing when it is off */
+    if (__atomic_load_n(&trace_file, __ATOMIC_RELAXED) == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file != NULL) {
+        uint64_t now = monotonic_ms();
+
+        struct MTraceRecord record;
+        memset(&record, 0, sizeof(record));
+        record.time_ms = now - trace_start_ms;
+        record.type = type;
+        record.x = clamp16(x);
+        record.y = clamp16(y);
+        record.width = clampu16(width);
+        record.height = clampu16(height);
+
+        if (fwrite(&record, sizeof(record), 1, trace_file) != 1) {
+            MLOGE("error writing trace, stopping\n");
+            fclose(trace_file);
+            __atomic_store_n(&trace_file, NULL, __ATOMIC_RELAXED);
+        } else if (now - last_flush_ms >= FLUSH_INTERVAL_MS) {
+            fflush(trace_file);
+            last_flush_ms = now;
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+FILE *mtrace_open(const char *path, struct MTraceHeader *header_ret) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        MLOGE("error opening trace %s\n", path);
+        return NULL;
+    }
+
+    if (fread(header_ret, sizeof(*header_ret), 1, f) != 1 ||
+            memcmp(header_ret->magic, MTRACE_MAGIC,
+                sizeof(header_ret->magic)) != 0) {
+        MLOGE("%s is not a damage trace\n", path);
+        fclose(f);
+        return NULL;
+    }
+
+    if (header_ret->version != MTRACE_VERSION ||
+            header_ret->record_size != sizeof(struct MTraceRecord)) {
+        MLOGE("unsupported trace version %u\n", header_ret->version);
+        fclose(f);
+        return NULL;
+    }
+
+    return f;
+}
+
+int mtrace_next(FILE *trace, struct MTraceRecord *record_ret) {
+    return fread(record_ret, sizeof(*record_ret), 1, trace) == 1;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_TRACE_H
+#define M_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Damage trace recording.
+ *
+ * Set MCLIENT_TRACE=<path> to have mclient log every damage, screen
+ * and cursor event to a compact binary trace that bench/replay can
+ * run back through the capture pipeline.
+ *
+ * A trace is one MTraceHeader followed by fixed-size MTraceRecords,
+ * all in host byte order. Times are ms since recording started.
+ */
+#define MTRACE_MAGIC "MTRC"
+#define MTRACE_VERSION (1)
+
+enum MTraceType {
+    MTRACE_DAMAGE = 1,          /* x, y, width, height of the damage area */
+    MTRACE_SCREEN = 2,          /* new screen width, height */
+    MTRACE_CURSOR_POS = 3,      /* x, y of the pointer */
+    MTRACE_CURSOR_IMAGE = 4,    /* width, height of the new cursor image */
+};
+
+struct MTraceHeader {
+    char magic[4];
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t screen_width;
+    uint32_t screen_height;
+};
+
+struct MTraceRecord {
+    uint32_t time_ms;
+    uint8_t type;
+    uint8_t reserved[3];
+    int16_t x;
+    int16_t y;
+    uint16_t width;
+    uint16_t height;
+};
+
+/**
+ * Start recording to @param path. Recording is global and may be
+ * fed from any thread.
+ */
+int mtrace_start(const char *path, uint32_t screen_width,
+        uint32_t screen_height);
+void mtrace_stop(void);
+
+/**
+ * No-op unless recording.
+ */
+void mtrace_record(enum MTraceType type, int32_t x, int32_t y,
+        uint32_t width, uint32_t height);
+
+/**
+ * Open a trace for reading and validate its header.
+ *
+ * @return the open file positioned at the first record, or NULL
+ */
+FILE *mtrace_open(const char *path, struct MTraceHeader *header_ret);
+
+/**
+ * @return 1 if a record was read, 0 at the end of the trace
+ */
+int mtrace_next(FILE *trace, struct MTraceRecord *record_ret);
+
+#endif // M_TRACE_H
@@ -0,0 +1,129 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "overlay_detector.h"
+
+void overlay_detector_init(struct OverlayDetector *d,
+        uint32_t screen_width, uint32_t screen_height) {
+    memset(d, 0, sizeof(*d));
+    d->screen_width = screen_width;
+    d->screen_height = screen_height;
+}
+
+void overlay_detector_reset(struct OverlayDetector *d) {
+    overlay_detector_init(d, d->screen_width, d->screen_height);
+}
+
+/**
+ * Worth an overlay: big enough to matter, small enough that
+ * skipping the root buffer actually saves something.
+ */
+static int is_eligible(const struct OverlayDetector *d,
+        const struct MRect *r) {
+    uint64_t screen_area = (uint64_t)d->screen_width * d->screen_height;
+    return rect_area(r) >= OVERLAY_MIN_AREA &&
+           rect_area(r) * 4 <= screen_area * 3;
+}
+
+static enum OverlayAction update_candidate(struct OverlayDetector *d,
+        const struct MRect *rects, int nrects, uint64_t now_ms) {
+    const struct MRect *largest = NULL;
+    int hit = 0;
+
+    int i;
+    for (i = 0; i < nrects; ++i) {
+        if (d->hits > 0 && rect_near(&rects[i], &d->candidate,
+                OVERLAY_TOLERANCE_PX)) {
+            hit = 1;
+        }
+        if (largest == NULL || rect_area(&rects[i]) > rect_area(largest)) {
+            largest = &rects[i];
+        }
+    }
+
+    int expired = d->hits == 0 ||
+                  now_ms - d->last_hit_ms > OVERLAY_MAX_GAP_MS;
+
+    if (hit && !expired) {
+        d->hits++;
+        d->last_hit_ms = now_ms;
+    } else if (expired) {
+        /* start over with the biggest damage of this frame */
+        if (largest != NULL && is_eligible(d, largest)) {
+            d->candidate = *largest;
+            d->hits = 1;
+            d->last_hit_ms = now_ms;
+        } else {
+            d->hits = 0;
+        }
+    }
+
+    if (d->hits >= OVERLAY_PROMOTE_FRAMES) {
+        d->active = 1;
+        d->active_rect = d->candidate;
+        d->hits = 0;
+        return OVERLAY_PROMOTE;
+    }
+
+    return OVERLAY_NONE;
+}
+
+enum OverlayAction overlay_detector_update(struct OverlayDetector *d,
+        const struct MRect *rects, int nrects, uint64_t now_ms,
+        int *overlay_damaged_ret, int *root_damaged_ret) {
+    *overlay_damaged_ret = 0;
+    *root_damaged_ret = nrects > 0;
+
+    if (!d->active) {
+        enum OverlayAction action = update_candidate(d, rects, nrects, now_ms);
+        if (action == OVERLAY_PROMOTE) {
+            /* the root buffer is current, so only the overlay needs filling */
+            *overlay_damaged_ret = 1;
+        }
+        return action;
+    }
+
+    int inside = 0, outside = 0;
+
+    int i;
+    for (i = 0; i < nrects; ++i) {
+        if (rect_contains(&d->active_rect, &rects[i])) {
+            inside = 1;
+        } else if (rect_intersects(&d->active_rect, &rects[i])) {
+            /* something is drawn over the edge of the video */
+            overlay_detector_reset(d);
+            *root_damaged_ret = 1;
+            return OVERLAY_DEMOTE;
+        } else {
+            outside = 1;
+        }
+    }
+
+    if (inside) {
+        d->last_hit_ms = now_ms;
+    } else if (now_ms - d->last_hit_ms > OVERLAY_DEMOTE_MS) {
+        /* the video stopped, fold it back into the root buffer */
+        overlay_detector_reset(d);
+        *root_damaged_ret = 1;
+        return OVERLAY_DEMOTE;
+    }
+
+    *overlay_damaged_ret = inside;
+    *root_damaged_ret = outside;
+    return OVERLAY_NONE;
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_OVERLAY_DETECTOR_H
+#define M_OVERLAY_DETECTOR_H
+
+#include <stdint.h>
+
+#include "rect.h"
+
+/*
+ * Detects a rectangle that is damaged at a high, steady rate
+ * (usually a video) from the per-frame damage rectangles.
+ *
+ * A candidate is promoted after OVERLAY_PROMOTE_FRAMES hits in a row,
+ * each no more than OVERLAY_MAX_GAP_MS apart. An active overlay is
+ * demoted when it has not been hit for OVERLAY_DEMOTE_MS or when some
+ * damage straddles its edge (something is drawn over the video).
+ */
+#define OVERLAY_TOLERANCE_PX    (4)
+#define OVERLAY_PROMOTE_FRAMES  (24)
+#define OVERLAY_MAX_GAP_MS      (100)
+#define OVERLAY_DEMOTE_MS       (500)
+#define OVERLAY_MIN_AREA        (128 * 128)
+
+enum OverlayAction {
+    OVERLAY_NONE,
+    OVERLAY_PROMOTE,
+    OVERLAY_DEMOTE,
+};
+
+struct OverlayDetector {
+    uint32_t screen_width;
+    uint32_t screen_height;
+
+    struct MRect candidate;
+    int hits;
+    uint64_t last_hit_ms;
+
+    int active;
+    struct MRect active_rect;
+};
+
+void overlay_detector_init(struct OverlayDetector *d,
+        uint32_t screen_width, uint32_t screen_height);
+
+/**
+ * Feed one frame of damage.
+ *
+ * @param overlay_damaged_ret set if some damage falls inside the
+ * active overlay (including the one promoted by this call)
+ * @param root_damaged_ret set if the root buffer must be re-posted
+ *
+ * @return the transition the caller has to carry out
+ */
+enum OverlayAction overlay_detector_update(struct OverlayDetector *d,
+        const struct MRect *rects, int nrects, uint64_t now_ms,
+        int *overlay_damaged_ret, int *root_damaged_ret);
+
+/**
+ * Forget the active overlay and any candidate.
+ */
+void overlay_detector_reset(struct OverlayDetector *d);
+
+#endif // M_OVERLAY_DETECTOR_H
@@ -0,0 +1,430 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "pixel.h"
+
+/*
+ * The box filter splits each 32bpp pixel into two words holding two
+ * 8-bit channels each in 16-bit lanes (channels 0/2 and 1/3) and sums
+ * whole blocks at once. This is SIMD-within-a-register: it treats all
+ * four channels with two adds per pixel and the plain integer loops
+ * auto-vectorize on both NEON and SSE2 without any intrinsics.
+ *
+ * A 16-bit lane holds up to 257 channel values of 255, which is why
+ * the factor is capped at 16.
+ */
+#define LANE_MASK (0x00ff00ffu)
+
+static inline uint32_t lanes_lo(uint32_t p) {
+    return p & LANE_MASK;
+}
+
+static inline uint32_t lanes_hi(uint32_t p) {
+    return (p >> 8) & LANE_MASK;
+}
+
+static inline uint32_t lanes_div(uint32_t sum, uint32_t n, uint32_t shift) {
+    if (shift) {
+        return (sum >> shift) & LANE_MASK;
+    }
+    return (((sum >> 16) / n) << 16) | ((sum & 0xffff) / n);
+}
+
+static inline uint32_t lanes_pack(uint32_t lo, uint32_t hi) {
+    return lo | (hi << 8);
+}
+
+static void box_downsample_2x(uint8_t *dst, uint32_t dst_stride,
+        const uint8_t *src, uint32_t src_stride,
+        uint32_t dst_width, uint32_t dst_height) {
+    /* +2 per lane rounds to nearest when dividing by 4 */
+    const uint32_t bias = 0x00020002u;
+
+    uint32_t x, y;
+    for (y = 0; y < dst_height; ++y) {
+        const uint32_t *r0 = (const uint32_t *)(src + (2 * y) * src_stride);
+        const uint32_t *r1 = (const uint32_t *)(src + (2 * y + 1) * src_stride);
+        uint32_t *out = (uint32_t *)(dst + y * dst_stride);
+
+        for (x = 0; x < dst_width; ++x) {
+            uint32_t a = r0[2 * x], b = r0[2 * x + 1];
+            uint32_t c = r1[2 * x], d = r1[2 * x + 1];
+
+            uint32_t lo = lanes_lo(a) + lanes_lo(b) +
+                          lanes_lo(c) + lanes_lo(d) + bias;
+            uint32_t hi = lanes_hi(a) + lanes_hi(b) +
+                          lanes_hi(c) + lanes_hi(d) + bias;
+
+            out[x] = lanes_pack((lo >> 2) & LANE_MASK, (hi >> 2) & LANE_MASK);
+        }
+    }
+}
+
+static void box_downsample_nx(uint8_t *dst, uint32_t dst_stride,
+        const uint8_t *src, uint32_t src_stride,
+        uint32_t dst_width, uint32_t dst_height, uint32_t factor) {
+    const uint32_t n = factor * factor;
+    const uint32_t bias = (n / 2) | ((n / 2) << 16);
+
+    /* power-of-two blocks divide with a shift */
+    uint32_t shift = 0;
+    if ((n & (n - 1)) == 0) {
+        while ((1u << shift) < n) {
+            ++shift;
+        }
+    }
+
+    uint32_t x, y, bx, by;
+    for (y = 0; y < dst_height; ++y) {
+        uint32_t *out = (uint32_t *)(dst + y * dst_stride);
+
+        for (x = 0; x < dst_width; ++x) {
+            uint32_t lo = bias, hi = bias;
+
+            for (by = 0; by < factor; ++by) {
+                const uint32_t *row = (const uint32_t *)
+                    (src + (y * factor + by) * src_stride) + x * factor;
+                for (bx = 0; bx < factor; ++bx) {
+                    lo += lanes_lo(row[bx]);
+                    hi += lanes_hi(row[bx]);
+                }
+            }
+
+            out[x] = lanes_pack(lanes_div(lo, n, shift),
+                                lanes_div(hi, n, shift));
+        }
+    }
+}
+
+void box_downsample_32(uint8_t *dst, uint32_t dst_stride,
+        const uint8_t *src, uint32_t src_stride,
+        uint32_t dst_width, uint32_t dst_height, uint32_t factor) {
+    uint32_t y;
+    switch (factor) {
+        case 0:
+            break;
+
+        case 1:
+            for (y = 0; y < dst_height; ++y) {
+                memcpy(dst + y * dst_stride, src + y * src_stride,
+                    dst_width * 4);
+            }
+            break;
+
+        case 2:
+            box_downsample_2x(dst, dst_stride, src, src_stride,
+                dst_width, dst_height);
+            break;
+
+        default:
+            if (factor <= 16) {
+                box_downsample_nx(dst, dst_stride, src, src_stride,
+                    dst_width, dst_height, factor);
+            }
+            break;
+    }
+}
+
+void copy_opaque_32(void *dst, const void *src, uint32_t n) {
+    uint32_t *out = dst;
+    const uint32_t *in = src;
+
+    uint32_t i;
+    for (i = 0; i < n; ++i) {
+        out[i] = in[i] | 0xff000000u;
+    }
+}
+
+void copy_cursor_32(uint8_t *dst, uint32_t dst_stride,
+        uint32_t dst_width, uint32_t dst_height,
+        const unsigned long *src, uint32_t src_width, uint32_t src_height) {
+    /* clear out stale pixels */
+    memset(dst, 0, dst_height * dst_stride);
+
+    uint32_t width = src_width < dst_width ? src_width : dst_width;
+    uint32_t height = src_height < dst_height ? src_height : dst_height;
+
+    uint32_t x, y;
+    for (y = 0; y < height; ++y) {
+        const unsigned long *in = src + y * src_width;
+        uint32_t *out = (uint32_t *)(dst + y * dst_stride);
+
+        for (x = 0; x < width; ++x) {
+            uint32_t pixel = in[x];
+
+            /*
+             * Copy only if opaque pixel to avoid weird artifacts.
+             */
+            if ((pixel >> 24) == 0xff) {
+                out[x] = pixel;
+            }
+        }
+    }
+}
+
+/*
+ * The common layouts convert four pixels at a time with GCC vector
+ * extensions, which lower to SSE2 on x86 and NEON on ARM without tying
+ * the code to either. The per-pixel expressions are macros so the
+ * vector loop and the scalar tail share them.
+ */
+#define OPAQUE (0xff000000u)
+
+typedef uint32_t v4u32 __attribute__((vector_size(16)));
+typedef uint16_t v4u16 __attribute__((vector_size(8)));
+typedef uint8_t v16u8 __attribute__((vector_size(16)));
+
+/* 0xXXBBGGRR -> 0xffRRGGBB */
+#define SWIZZLE_32(p) \
+    (OPAQUE | (((p) & 0xff) << 16) | ((p) & 0xff00) | (((p) >> 16) & 0xff))
+
+/*
+ * Narrow channels are widened by repeating their top bits so that
+ * full intensity maps to 0xff rather than 0xf8.
+ */
+#define WIDEN_5(v) (((v) << 3) | ((v) >> 2))
+#define WIDEN_6(v) (((v) << 2) | ((v) >> 4))
+
+#define RGB_565(p) (OPAQUE | \
+    (WIDEN_5(((p) >> 11) & 0x1f) << 16) | \
+    (WIDEN_6(((p) >> 5) & 0x3f) << 8) | \
+    WIDEN_5((p) & 0x1f))
+
+#define RGB_555(p) (OPAQUE | \
+    (WIDEN_5(((p) >> 10) & 0x1f) << 16) | \
+    (WIDEN_5(((p) >> 5) & 0x1f) << 8) | \
+    WIDEN_5((p) & 0x1f))
+
+static void convert_copy_32(const struct PixelConverter *c,
+        void *dst, const void *src, uint32_t n) {
+    memcpy(dst, src, n * 4);
+}
+
+static void convert_swizzle_32(const struct PixelConverter *c,
+        void *dst, const void *src, uint32_t n) {
+    uint32_t *out = dst;
+    const uint32_t *in = src;
+
+    uint32_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        v4u32 p;
+        memcpy(&p, in + i, sizeof(p));
+        p = SWIZZLE_32(p);
+        memcpy(out + i, &p, sizeof(p));
+    }
+    for (; i < n; ++i) {
+        out[i] = SWIZZLE_32(in[i]);
+    }
+}
+
+static void convert_rgb_565(const struct PixelConverter *c,
+        void *dst, const void *src, uint32_t n) {
+    uint32_t *out = dst;
+    const uint16_t *in = src;
+
+    uint32_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        v4u16 half;
+        memcpy(&half, in + i, sizeof(half));
+        v4u32 p = __builtin_convertvector(half, v4u32);
+        p = RGB_565(p);
+        memcpy(out + i, &p, sizeof(p));
+    }
+    for (; i < n; ++i) {
+        uint32_t p = in[i];
+        out[i] = RGB_565(p);
+    }
+}
+
+static void convert_rgb_555(const struct PixelConverter *c,
+        void *dst, const void *src, uint32_t n) {
+    uint32_t *out = dst;
+    const uint16_t *in = src;
+
+    uint32_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        v4u16 half;
+        memcpy(&half, in + i, sizeof(half));
+        v4u32 p = __builtin_convertvector(half, v4u32);
+        p = RGB_555(p);
+        memcpy(out + i, &p, sizeof(p));
+    }
+    for (; i < n; ++i) {
+        uint32_t p = in[i];
+        out[i] = RGB_555(p);
+    }
+}
+
+/*
+ * Packed 24bpp spreads four pixels over 12 bytes. A 16-byte load
+ * followed by a byte shuffle lines them up as words, so the vector
+ * loop stops while a full 16 bytes are still left to read.
+ *
+ * Plain SSE2 has no byte shuffle and the emulated one is slower than
+ * the scalar loop, so x86 only takes the vector path with SSSE3.
+ */
+#if defined(__SSSE3__) || defined(__ARM_NEON)
+#define HAVE_BYTE_SHUFFLE (1)
+#else
+#define HAVE_BYTE_SHUFFLE (0)
+#endif
+
+static void convert_packed_24(void *dst, const void *src, uint32_t n,
+        v16u8 order, uint32_t r, uint32_t b) {
+    uint32_t *out = dst;
+    const uint8_t *in = src;
+
+    uint32_t i = 0;
+    for (; HAVE_BYTE_SHUFFLE && i + 6 <= n; i += 4) {
+        v16u8 bytes;
+        memcpy(&bytes, in + 3 * i, sizeof(bytes));
+        v4u32 p = (v4u32)__builtin_shuffle(bytes, order) | OPAQUE;
+        memcpy(out + i, &p, sizeof(p));
+    }
+    for (; i < n; ++i) {
+        out[i] = OPAQUE | ((uint32_t)in[3 * i + r] << 16) |
+                 ((uint32_t)in[3 * i + 1] << 8) | in[3 * i + b];
+    }
+}
+
+/* packed B, G, R bytes */
+static void convert_bgr_24(const struct PixelConverter *c,
+        void *dst, const void *src, uint32_t n) {
+    const v16u8 order = { 0, 1, 2, 0, 3, 4, 5, 0, 6, 7, 8, 0, 9, 10, 11, 0 };
+    convert_packed_24(dst, src, n, order, 2, 0);
+}
+
+/* packed R, G, B bytes */
+static void convert_rgb_24(const struct PixelConverter *c,
+        void *dst, const void *src, uint32_t n) {
+    const v16u8 order = { 2, 1, 0, 0, 5, 4, 3, 0, 8, 7, 6, 0, 11, 10, 9, 0 };
+    convert_packed_24(dst, src, n, order, 0, 2);
+}
+
+static inline uint32_t generic_channel(const struct PixelConverter *c,
+        uint32_t p, int i) {
+    uint32_t bits = c->bits[i];
+    uint32_t v = (p >> c->shift[i]) & ((1u << bits) - 1);
+    if (bits >= 8) {
+        return v >> (bits - 8);
+    }
+    return v * 255 / ((1u << bits) - 1);
+}
+
+/* any other TrueColor layout, one channel at a time */
+static void convert_generic(const struct PixelConverter *c,
+        void *dst, const void *src, uint32_t n) {
+    uint32_t *out = dst;
+    const uint8_t *in = src;
+
+    uint32_t i;
+    for (i = 0; i < n; ++i) {
+        uint32_t p;
+        switch (c->bytes_per_pixel) {
+            case 2:
+                p = ((const uint16_t *)in)[i];
+                break;
+            case 3:
+                p = in[3 * i] | (in[3 * i + 1] << 8) | (in[3 * i + 2] << 16);
+                break;
+            default:
+                p = ((const uint32_t *)in)[i];
+                break;
+        }
+        out[i] = OPAQUE | (generic_channel(c, p, 0) << 16) |
+                 (generic_channel(c, p, 1) << 8) | generic_channel(c, p, 2);
+    }
+}
+
+static const struct {
+    const char *name;
+    uint32_t bits_per_pixel;
+    uint32_t red_mask;
+    uint32_t green_mask;
+    uint32_t blue_mask;
+    pixel_convert_fn convert;
+} converters[] = {
+    { "bgrx8888", 32, 0xff0000, 0x00ff00, 0x0000ff, convert_copy_32 },
+    { "rgbx8888", 32, 0x0000ff, 0x00ff00, 0xff0000, convert_swizzle_32 },
+    { "bgr888",   24, 0xff0000, 0x00ff00, 0x0000ff, convert_bgr_24 },
+    { "rgb888",   24, 0x0000ff, 0x00ff00, 0xff0000, convert_rgb_24 },
+    { "rgb565",   16, 0xf800,   0x07e0,   0x001f,   convert_rgb_565 },
+    { "rgb555",   16, 0x7c00,   0x03e0,   0x001f,   convert_rgb_555 },
+};
+
+/**
+ * @return 0 if @param mask is one contiguous run of bits
+ */
+static int mask_layout(uint32_t mask, uint8_t *shift, uint8_t *bits) {
+    if (mask == 0) {
+        return -1;
+    }
+
+    uint32_t s = 0;
+    while (!(mask & (1u << s))) {
+        ++s;
+    }
+    uint32_t b = 0;
+    while (s + b < 32 && (mask & (1u << (s + b)))) {
+        ++b;
+    }
+    if ((mask >> s) != (b == 32 ? 0xffffffffu : (1u << b) - 1)) {
+        return -1;
+    }
+
+    *shift = s;
+    *bits = b;
+    return 0;
+}
+
+int pixel_converter_init(struct PixelConverter *c, uint32_t bits_per_pixel,
+        uint32_t red_mask, uint32_t green_mask, uint32_t blue_mask) {
+    memset(c, 0, sizeof(*c));
+    c->bits_per_pixel = bits_per_pixel;
+    c->red_mask = red_mask;
+    c->green_mask = green_mask;
+    c->blue_mask = blue_mask;
+    c->bytes_per_pixel = bits_per_pixel / 8;
+
+    if (bits_per_pixel != 16 && bits_per_pixel != 24 &&
+            bits_per_pixel != 32) {
+        return -1;
+    }
+
+    uint32_t i;
+    for (i = 0; i < sizeof(converters) / sizeof(converters[0]); ++i) {
+        if (converters[i].bits_per_pixel == bits_per_pixel &&
+                converters[i].red_mask == red_mask &&
+                converters[i].green_mask == green_mask &&
+                converters[i].blue_mask == blue_mask) {
+            c->name = converters[i].name;
+            c->convert = converters[i].convert;
+            c->identity = c->convert == convert_copy_32;
+            return 0;
+        }
+    }
+
+    if (mask_layout(red_mask, &c->shift[0], &c->bits[0]) < 0 ||
+            mask_layout(green_mask, &c->shift[1], &c->bits[1]) < 0 ||
+            mask_layout(blue_mask, &c->shift[2], &c->bits[2]) < 0) {
+        return -1;
+    }
+    c->name = "generic";
+    c->convert = convert_generic;
+    return 0;
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_PIXEL_H
+#define M_PIXEL_H
+
+#include <stdint.h>
+
+/*
+ * Pixel kernels that work on raw 32bpp rows.
+ *
+ * These have no X or mflinger dependencies so they can be unit tested
+ * and benchmarked on their own. Strides are in bytes.
+ */
+
+/**
+ * Box filter @param src down by an integer @param factor into @param dst.
+ *
+ * Every dst pixel is the per-channel average of a factor x factor block
+ * of src pixels, so src must be at least dst_width * factor wide and
+ * dst_height * factor tall. @param factor must be in [1, 16].
+ */
+void box_downsample_32(uint8_t *dst, uint32_t dst_stride,
+        const uint8_t *src, uint32_t src_stride,
+        uint32_t dst_width, uint32_t dst_height, uint32_t factor);
+
+/**
+ * Copy @param n pixels forcing the alpha byte (ARGB8888 word-order MSB)
+ * to 0xff.
+ */
+void copy_opaque_32(void *dst, const void *src, uint32_t n);
+
+/**
+ * Clear @param dst and copy the fully opaque pixels of an XFixes cursor
+ * image into it, clipped to dst_width x dst_height.
+ *
+ * XFixes hands out one ARGB8888 pixel per unsigned long.
+ */
+void copy_cursor_32(uint8_t *dst, uint32_t dst_stride,
+        uint32_t dst_width, uint32_t dst_height,
+        const unsigned long *src, uint32_t src_width, uint32_t src_height);
+
+//
+// X image -> surface format conversion
+//
+// Surfaces are BGRA_8888, i.e. 0xAARRGGBB words on a little-endian
+// host. That is what a depth 24/32 TrueColor X server hands out, but
+// 16bpp, packed 24bpp and RGB-ordered visuals need converting.
+//
+
+struct PixelConverter;
+
+typedef void (*pixel_convert_fn)(const struct PixelConverter *c,
+        void *dst, const void *src, uint32_t n);
+
+struct PixelConverter {
+    const char *name;
+    uint32_t bits_per_pixel;    /* source layout this was set up for */
+    uint32_t red_mask;
+    uint32_t green_mask;
+    uint32_t blue_mask;
+    uint32_t bytes_per_pixel;
+    int identity;               /* 1 = rows can be copied as they are */
+    pixel_convert_fn convert;
+
+    /* per-channel layout, only used by the generic converter */
+    uint8_t shift[3];
+    uint8_t bits[3];
+};
+
+/**
+ * Pick the converter for a TrueColor source layout.
+ *
+ * @return 0 on success, -1 if the layout can't be converted
+ * (e.g. 8bpp colormapped visuals)
+ */
+int pixel_converter_init(struct PixelConverter *c, uint32_t bits_per_pixel,
+        uint32_t red_mask, uint32_t green_mask, uint32_t blue_mask);
+
+/**
+ * Convert @param n source pixels into opaque surface pixels. The
+ * identity converter copies the pixels as they are, alpha byte included.
+ */
+static inline void pixel_convert(const struct PixelConverter *c,
+        void *dst, const void *src, uint32_t n) {
+    c->convert(c, dst, src, n);
+}
+
+#endif // M_PIXEL_H
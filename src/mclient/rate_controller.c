@@ -0,0 +1,103 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "rate_controller.h"
+
+void rate_controller_init(struct RateController *c, uint32_t budget,
+        uint64_t now, uint64_t cpu) {
+    memset(c, 0, sizeof(*c));
+    c->budget = budget;
+    c->window_start = now;
+    c->window_cpu = cpu;
+}
+
+uint64_t rate_controller_next_render(const struct RateController *c,
+        uint64_t now) {
+    if (c->interval == 0 || c->last_render == 0) {
+        return now;
+    }
+    return c->last_render + c->interval;
+}
+
+void rate_controller_on_render(struct RateController *c, uint64_t start,
+        uint64_t end) {
+    uint64_t cost = end > start ? end - start : 0;
+
+    /* same smoothing as the frame pacer */
+    if (c->render_cost == 0) {
+        c->render_cost = cost;
+    } else {
+        c->render_cost = c->render_cost - c->render_cost / 8 + cost / 8;
+    }
+
+    c->last_render = start;
+    ++c->window_frames;
+    ++c->frames;
+}
+
+int rate_controller_update(struct RateController *c, uint64_t now,
+        uint64_t cpu) {
+    uint64_t wall = now - c->window_start;
+    if (wall < RATE_CONTROLLER_WINDOW_NS) {
+        return 0;
+    }
+
+    uint64_t used = cpu - c->window_cpu;
+    uint32_t frames = c->window_frames;
+    c->cpu_percent = used * 100 / wall;
+    c->window_start = now;
+    c->window_cpu = cpu;
+    c->window_frames = 0;
+
+    if (c->budget == 0) {
+        return 0;
+    }
+
+    uint64_t interval = c->interval;
+    if (frames == 0) {
+        /* nothing to capture anymore, start over at full rate */
+        interval = 0;
+    } else if (c->cpu_percent > c->budget) {
+        /* how far apart frames costing this much fit the budget */
+        uint64_t fit = used / frames * 100 / c->budget;
+        interval = interval > 0 ? 2 * interval : RATE_CONTROLLER_MIN_INTERVAL_NS;
+        if (fit > interval) {
+            interval = fit;
+        }
+        if (interval > RATE_CONTROLLER_MAX_INTERVAL_NS) {
+            interval = RATE_CONTROLLER_MAX_INTERVAL_NS;
+        }
+    } else if (c->cpu_percent * 100 <
+            c->budget * RATE_CONTROLLER_RECOVER_PERCENT) {
+        interval -= interval / 4;
+        if (interval < RATE_CONTROLLER_MIN_INTERVAL_NS) {
+            interval = 0;
+        }
+    }
+
+    if (interval == c->interval) {
+        return 0;
+    }
+    if (interval > c->interval) {
+        ++c->throttles;
+    } else {
+        ++c->recoveries;
+    }
+    c->interval = interval;
+    return 1;
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_RATE_CONTROLLER_H
+#define M_RATE_CONTROLLER_H
+
+#include <stdint.h>
+
+/*
+ * Keeps mclient inside a CPU budget by capping how often captures may
+ * run, so a busy desktop can't pin a core and get the phone throttled.
+ *
+ * Every RATE_CONTROLLER_WINDOW_NS the CPU time used by the whole
+ * process is compared with the budget, a percentage of one core. Over
+ * budget, captures are spaced out to what the CPU time per frame says
+ * would fit, at least twice as far apart as before but never more than
+ * RATE_CONTROLLER_MAX_INTERVAL_NS. Well under budget the spacing
+ * shrinks by a quarter per window, and a window without any capture
+ * (the load went away) lifts the cap altogether.
+ *
+ * mclient logs every change and, on SIGUSR1 and exit, the counters.
+ *
+ * All times are ns, wall times on CLOCK_MONOTONIC.
+ */
+#define RATE_CONTROLLER_WINDOW_NS       (1000000000ull)
+#define RATE_CONTROLLER_MIN_INTERVAL_NS (4000000ull)     /* 250 fps */
+#define RATE_CONTROLLER_MAX_INTERVAL_NS (200000000ull)   /* 5 fps */
+
+/* back off when under this share of the budget, in percent */
+#define RATE_CONTROLLER_RECOVER_PERCENT (75)
+
+struct RateController {
+    uint32_t budget;            /* percent of one core, 0 = no cap */
+    uint64_t interval;          /* least time between captures, 0 = none */
+    uint64_t last_render;       /* start of the last capture */
+    uint64_t render_cost;       /* moving average, capture to post */
+
+    /* the window being measured */
+    uint64_t window_start;
+    uint64_t window_cpu;
+    uint32_t window_frames;
+
+    /* stats */
+    uint32_t cpu_percent;       /* over the last full window */
+    uint64_t frames;
+    uint64_t throttles;         /* times the interval went up */
+    uint64_t recoveries;        /* and down */
+};
+
+/**
+ * @param cpu process CPU time at @param now
+ */
+void rate_controller_init(struct RateController *c, uint32_t budget,
+        uint64_t now, uint64_t cpu);
+
+/**
+ * @return when the next capture may start, <= @param now if it can
+ * start right away
+ */
+uint64_t rate_controller_next_render(const struct RateController *c,
+        uint64_t now);
+
+/**
+ * A capture ran from @param start to @param end.
+ */
+void rate_controller_on_render(struct RateController *c, uint64_t start,
+        uint64_t end);
+
+/**
+ * Close the window if it is over, given process CPU time @param cpu
+ * at @param now.
+ *
+ * @return 1 if the interval changed, 0 otherwise
+ */
+int rate_controller_update(struct RateController *c, uint64_t now,
+        uint64_t cpu);
+
+#endif // M_RATE_CONTROLLER_H
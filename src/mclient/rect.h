@@ -0,0 +1,78 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_RECT_H
+#define M_RECT_H
+
+#include <stdint.h>
+
+/*
+ * Screen rectangle without any X dependencies so damage
+ * bookkeeping can be unit tested.
+ */
+struct MRect {
+    int32_t x;
+    int32_t y;
+    uint32_t width;
+    uint32_t height;
+};
+
+static inline uint64_t rect_area(const struct MRect *r) {
+    return (uint64_t)r->width * r->height;
+}
+
+/**
+ * @return 1 if @param inner lies completely within @param outer
+ */
+static inline int rect_contains(const struct MRect *outer,
+        const struct MRect *inner) {
+    return inner->x >= outer->x &&
+           inner->y >= outer->y &&
+           inner->x + (int64_t)inner->width <= outer->x + (int64_t)outer->width &&
+           inner->y + (int64_t)inner->height <= outer->y + (int64_t)outer->height;
+}
+
+static inline int rect_intersects(const struct MRect *a,
+        const struct MRect *b) {
+    return a->x < b->x + (int64_t)b->width &&
+           b->x < a->x + (int64_t)a->width &&
+           a->y < b->y + (int64_t)b->height &&
+           b->y < a->y + (int64_t)a->height;
+}
+
+/**
+ * @return 1 if every edge of @param a is within @param tolerance px
+ * of the same edge of @param b
+ */
+static inline int rect_near(const struct MRect *a, const struct MRect *b,
+        int32_t tolerance) {
+    int64_t d[4] = {
+        (int64_t)a->x - b->x,
+        (int64_t)a->y - b->y,
+        ((int64_t)a->x + a->width) - ((int64_t)b->x + b->width),
+        ((int64_t)a->y + a->height) - ((int64_t)b->y + b->height),
+    };
+
+    int i;
+    for (i = 0; i < 4; ++i) {
+        if (d[i] > tolerance || d[i] < -tolerance) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+#endif // M_RECT_H
@@ -0,0 +1,430 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mlog.h"
+#include "scroll_tracker.h"
+
+#define FNV_OFFSET  (0xcbf29ce484222325ull)
+#define FNV_PRIME   (0x100000001b3ull)
+
+/* map_rows entries that aren't a row */
+#define MAP_EMPTY   (0xffffffffu)
+#define MAP_DUP     (0xfffffffeu)
+
+int scroll_tracker_init(struct ScrollTracker *t,
+        uint32_t width, uint32_t height) {
+    memset(t, 0, sizeof(*t));
+    t->width = width;
+    t->height = height;
+    t->cols = (width + SCROLL_TRACKER_TILE_PX - 1) / SCROLL_TRACKER_TILE_PX;
+
+    /* at most half full, so probes stay short */
+    t->map_size = 16;
+    while (t->map_size < 2 * height) {
+        t->map_size *= 2;
+    }
+
+    size_t cells = (size_t)t->cols * height;
+    t->hashes = calloc(cells, sizeof(*t->hashes));
+    t->dirty = calloc(cells, sizeof(*t->dirty));
+    t->row_old = calloc(height, sizeof(*t->row_old));
+    t->row_new = calloc(height, sizeof(*t->row_new));
+    t->map_keys = calloc(t->map_size, sizeof(*t->map_keys));
+    t->map_rows = calloc(t->map_size, sizeof(*t->map_rows));
+    t->votes = calloc(2 * (size_t)height + 1, sizeof(*t->votes));
+    if ((cells > 0 && (t->hashes == NULL || t->dirty == NULL)) ||
+            (height > 0 && (t->row_old == NULL || t->row_new == NULL)) ||
+            t->map_keys == NULL || t->map_rows == NULL || t->votes == NULL) {
+        MLOGE("error allocating scroll tracker\n");
+        scroll_tracker_free(t);
+        return -1;
+    }
+    return 0;
+}
+
+void scroll_tracker_free(struct ScrollTracker *t) {
+    free(t->hashes);
+    free(t->dirty);
+    free(t->row_old);
+    free(t->row_new);
+    free(t->map_keys);
+    free(t->map_rows);
+    free(t->votes);
+    t->hashes = NULL;
+    t->dirty = NULL;
+    t->row_old = NULL;
+    t->row_new = NULL;
+    t->map_keys = NULL;
+    t->map_rows = NULL;
+    t->votes = NULL;
+    t->width = t->height = t->cols = 0;
+}
+
+void scroll_tracker_reset(struct ScrollTracker *t) {
+    t->hashed = 0;
+    t->pending.nrects = 0;
+    memset(t->slots, 0, sizeof(t->slots));
+}
+
+void scroll_tracker_damage(struct ScrollTracker *t,
+        const struct MRect *rects, int nrects) {
+    struct ScrollFrame *f = &t->pending;
+
+    int i;
+    for (i = 0; i < nrects; ++i) {
+        if (f->nrects < SCROLL_TRACKER_MAX_RECTS) {
+            f->rects[f->nrects++] = rects[i];
+            continue;
+        }
+
+        const struct MRect *r = &rects[i];
+        struct MRect *last = &f->rects[f->nrects - 1];
+        int64_t x2 = (int64_t)last->x + last->width;
+        int64_t y2 = (int64_t)last->y + last->height;
+        if ((int64_t)r->x + r->width > x2) {
+            x2 = (int64_t)r->x + r->width;
+        }
+        if ((int64_t)r->y + r->height > y2) {
+            y2 = (int64_t)r->y + r->height;
+        }
+        if (r->x < last->x) {
+            last->x = r->x;
+        }
+        if (r->y < last->y) {
+            last->y = r->y;
+        }
+        last->width = x2 - last->x;
+        last->height = y2 - last->y;
+    }
+}
+
+/**
+ * Clip @param r to the screen.
+ *
+ * @return 0 if nothing is left
+ */
+static int clip(const struct ScrollTracker *t, const struct MRect *r,
+        uint32_t *x0, uint32_t *y0, uint32_t *x1, uint32_t *y1) {
+    int64_t left = r->x < 0 ? 0 : r->x;
+    int64_t top = r->y < 0 ? 0 : r->y;
+    int64_t right = (int64_t)r->x + r->width;
+    int64_t bottom = (int64_t)r->y + r->height;
+    if (right > t->width) {
+        right = t->width;
+    }
+    if (bottom > t->height) {
+        bottom = t->height;
+    }
+    if (left >= right || top >= bottom) {
+        return 0;
+    }
+
+    *x0 = left;
+    *y0 = top;
+    *x1 = right;
+    *y1 = bottom;
+    return 1;
+}
+
+static uint64_t hash_bytes(const uint8_t *p, uint32_t n) {
+    uint64_t h = FNV_OFFSET;
+    uint32_t i;
+    for (i = 0; i + 4 <= n; i += 4) {
+        uint32_t word;
+        memcpy(&word, p + i, 4);
+        h = (h ^ word) * FNV_PRIME;
+    }
+    for (; i < n; ++i) {
+        h = (h ^ p[i]) * FNV_PRIME;
+    }
+    return h;
+}
+
+/**
+ * Hash every cell touched by rows [@param y0, @param y1) and columns
+ * [@param x0, @param x1).
+ */
+static void rehash(struct ScrollTracker *t, const uint8_t *pixels,
+        uint32_t bytes_per_line, uint32_t bytes_per_pixel,
+        uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1) {
+    uint32_t c0 = x0 / SCROLL_TRACKER_TILE_PX;
+    uint32_t c1 = (x1 + SCROLL_TRACKER_TILE_PX - 1) / SCROLL_TRACKER_TILE_PX;
+
+    uint32_t y, c;
+    for (y = y0; y < y1; ++y) {
+        const uint8_t *row = pixels + (size_t)y * bytes_per_line;
+        for (c = c0; c < c1; ++c) {
+            uint32_t left = c * SCROLL_TRACKER_TILE_PX;
+            uint32_t right = left + SCROLL_TRACKER_TILE_PX;
+            if (right > t->width) {
+                right = t->width;
+            }
+            t->hashes[(size_t)y * t->cols + c] = hash_bytes(
+                row + left * bytes_per_pixel, (right - left) * bytes_per_pixel);
+        }
+    }
+}
+
+static uint64_t hash_row(const struct ScrollTracker *t, uint32_t y,
+        uint32_t c0, uint32_t c1) {
+    const uint64_t *cells = &t->hashes[(size_t)y * t->cols];
+    uint64_t h = FNV_OFFSET;
+    uint32_t c;
+    for (c = c0; c < c1; ++c) {
+        h = (h ^ cells[c]) * FNV_PRIME;
+    }
+    return h;
+}
+
+static uint32_t map_find(const struct ScrollTracker *t, uint64_t key) {
+    uint32_t i = (uint32_t)(key ^ (key >> 32)) & (t->map_size - 1);
+    while (t->map_rows[i] != MAP_EMPTY && t->map_keys[i] != key) {
+        i = (i + 1) & (t->map_size - 1);
+    }
+    return i;
+}
+
+/**
+ * Find the longest run of rows in [@param y0, @param y1) that moved by
+ * the same distance within those rows, from t->row_old to t->row_new.
+ * Rows that hash the same as another row, like blank ones, can't say
+ * where they came from and don't vote for a distance.
+ *
+ * @return 1 if @param move was set
+ */
+static int match_rows(struct ScrollTracker *t, uint32_t y0, uint32_t y1,
+        struct ScrollMove *move) {
+    uint32_t y;
+    memset(t->map_rows, 0xff, t->map_size * sizeof(*t->map_rows));
+    for (y = y0; y < y1; ++y) {
+        uint32_t i = map_find(t, t->row_old[y]);
+        if (t->map_rows[i] == MAP_EMPTY) {
+            t->map_keys[i] = t->row_old[y];
+            t->map_rows[i] = y;
+        } else {
+            t->map_rows[i] = MAP_DUP;
+        }
+    }
+
+    /* votes are indexed by distance + height */
+    uint32_t best_votes = 0;
+    int32_t best_dy = 0;
+    int pass;
+    for (pass = 0; pass < 2; ++pass) {
+        for (y = y0; y < y1; ++y) {
+            uint32_t from = t->map_rows[map_find(t, t->row_new[y])];
+            if (from == MAP_EMPTY || from == MAP_DUP || from == y) {
+                continue;
+            }
+
+            uint32_t *votes = &t->votes[(int64_t)from - y + t->height];
+            if (pass == 1) {
+                /* leave them zeroed for next time */
+                *votes = 0;
+            } else if (++*votes > best_votes) {
+                best_votes = *votes;
+                best_dy = (int32_t)from - (int32_t)y;
+            }
+        }
+    }
+    if (best_votes < SCROLL_TRACKER_MIN_ROWS) {
+        return 0;
+    }
+
+    uint32_t run_start = 0, run_end = 0, start = y0;
+    for (y = y0; y <= y1; ++y) {
+        int64_t from = (int64_t)y + best_dy;
+        int same = y < y1 && from >= y0 && from < y1 &&
+                   t->row_new[y] == t->row_old[from];
+        if (!same) {
+            if (y - start > run_end - run_start) {
+                run_start = start;
+                run_end = y;
+            }
+            start = y + 1;
+        }
+    }
+    if (run_end - run_start < SCROLL_TRACKER_MIN_ROWS) {
+        return 0;
+    }
+
+    move->row_start = run_start;
+    move->row_end = run_end;
+    move->dy = best_dy;
+    return 1;
+}
+
+void scroll_tracker_on_capture(struct ScrollTracker *t,
+        const uint8_t *pixels, uint32_t bytes_per_line,
+        uint32_t bits_per_pixel) {
+    uint32_t bytes_per_pixel = bits_per_pixel / 8;
+    if (!t->hashed) {
+        rehash(t, pixels, bytes_per_line, bytes_per_pixel,
+            0, 0, t->width, t->height);
+        t->hashed = 1;
+        t->frame++;
+        t->base = t->frame;
+        t->pending.nrects = 0;
+        return;
+    }
+
+    struct ScrollFrame *f = &t->history[(t->frame + 1) % SCROLL_TRACKER_HISTORY];
+    *f = t->pending;
+    f->moved = 0;
+    t->pending.nrects = 0;
+
+    /* scrolling damages one big rect, only the biggest is worth a look */
+    uint32_t x0, y0, x1, y1;
+    uint64_t best_area = 0;
+    uint32_t c0 = 0, c1 = 0, row_start = 0, row_end = 0;
+    int i;
+    for (i = 0; i < f->nrects; ++i) {
+        if (!clip(t, &f->rects[i], &x0, &y0, &x1, &y1) ||
+                (uint64_t)(x1 - x0) * (y1 - y0) <= best_area) {
+            continue;
+        }
+        best_area = (uint64_t)(x1 - x0) * (y1 - y0);
+
+        /* only whole tiles, the rest of a tile may not have moved */
+        c0 = (x0 + SCROLL_TRACKER_TILE_PX - 1) / SCROLL_TRACKER_TILE_PX;
+        c1 = x1 == t->width ? t->cols : x1 / SCROLL_TRACKER_TILE_PX;
+        row_start = y0;
+        row_end = y1;
+    }
+    int candidate = c1 > c0 && row_end - row_start >= SCROLL_TRACKER_MIN_ROWS;
+
+    uint32_t y;
+    if (candidate) {
+        for (y = row_start; y < row_end; ++y) {
+            t->row_old[y] = hash_row(t, y, c0, c1);
+        }
+    }
+
+    for (i = 0; i < f->nrects; ++i) {
+        if (clip(t, &f->rects[i], &x0, &y0, &x1, &y1)) {
+            rehash(t, pixels, bytes_per_line, bytes_per_pixel,
+                x0, y0, x1, y1);
+        }
+    }
+
+    if (candidate) {
+        for (y = row_start; y < row_end; ++y) {
+            t->row_new[y] = hash_row(t, y, c0, c1);
+        }
+        if (match_rows(t, row_start, row_end, &f->move)) {
+            f->move.col_start = c0;
+            f->move.col_end = c1;
+            f->moved = 1;
+            t->scrolls++;
+            t->rows_moved += f->move.row_end - f->move.row_start;
+        }
+    }
+
+    t->frame++;
+}
+
+/**
+ * Move the rows of @param m in the buffer, and their dirty cells with
+ * them. Rows are walked away from where they come from so none is
+ * overwritten before it has moved.
+ */
+static void apply_move(struct ScrollTracker *t, const struct ScrollMove *m,
+        uint8_t *bits, uint32_t stride) {
+    uint32_t x0 = m->col_start * SCROLL_TRACKER_TILE_PX;
+    uint32_t x1 = m->col_end * SCROLL_TRACKER_TILE_PX;
+    if (x1 > t->width) {
+        x1 = t->width;
+    }
+    uint32_t bytes = (x1 - x0) * 4;
+    uint32_t cells = m->col_end - m->col_start;
+
+    uint32_t n, rows = m->row_end - m->row_start;
+    for (n = 0; n < rows; ++n) {
+        uint32_t y = m->dy > 0 ? m->row_start + n : m->row_end - 1 - n;
+        uint32_t from = y + m->dy;
+
+        /* different rows never overlap, the order takes care of the rest */
+        memcpy(bits + ((size_t)y * stride + x0) * 4,
+            bits + ((size_t)from * stride + x0) * 4, bytes);
+        memcpy(&t->dirty[(size_t)y * t->cols + m->col_start],
+            &t->dirty[(size_t)from * t->cols + m->col_start], cells);
+    }
+}
+
+static void mark_dirty(struct ScrollTracker *t, const struct ScrollFrame *f) {
+    int i;
+    for (i = 0; i < f->nrects; ++i) {
+        uint32_t x0, y0, x1, y1;
+        if (!clip(t, &f->rects[i], &x0, &y0, &x1, &y1)) {
+            continue;
+        }
+
+        uint32_t c0 = x0 / SCROLL_TRACKER_TILE_PX;
+        uint32_t c1 = (x1 + SCROLL_TRACKER_TILE_PX - 1) / SCROLL_TRACKER_TILE_PX;
+        uint32_t y, c;
+        for (y = y0; y < y1; ++y) {
+            int moved_row = f->moved &&
+                y >= f->move.row_start && y < f->move.row_end;
+            uint8_t *row = &t->dirty[(size_t)y * t->cols];
+            for (c = c0; c < c1; ++c) {
+                /* moved cells were checked to match the capture */
+                if (!moved_row || c < f->move.col_start ||
+                        c >= f->move.col_end) {
+                    row[c] = 1;
+                }
+            }
+        }
+    }
+}
+
+int scroll_tracker_update_buffer(struct ScrollTracker *t,
+        int slot, uint32_t generation, uint8_t *bits, uint32_t stride) {
+    const struct ScrollSlot *s = slot >= 0 && slot < M_BUFFER_SLOTS ?
+        &t->slots[slot] : NULL;
+    if (s == NULL || !s->valid || s->generation != generation ||
+            s->frame < t->base ||
+            t->frame - s->frame > SCROLL_TRACKER_HISTORY) {
+        t->full_copies++;
+        return -1;
+    }
+
+    memset(t->dirty, 0, (size_t)t->cols * t->height);
+    uint64_t frame;
+    for (frame = s->frame + 1; frame <= t->frame; ++frame) {
+        const struct ScrollFrame *f =
+            &t->history[frame % SCROLL_TRACKER_HISTORY];
+        if (f->moved) {
+            apply_move(t, &f->move, bits, stride);
+        }
+        mark_dirty(t, f);
+    }
+
+    t->partial_copies++;
+    return 0;
+}
+
+void scroll_tracker_filled(struct ScrollTracker *t,
+        int slot, uint32_t generation) {
+    if (slot < 0 || slot >= M_BUFFER_SLOTS) {
+        return;
+    }
+    t->slots[slot].valid = 1;
+    t->slots[slot].generation = generation;
+    t->slots[slot].frame = t->frame;
+}
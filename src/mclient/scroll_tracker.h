@@ -0,0 +1,146 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_SCROLL_TRACKER_H
+#define M_SCROLL_TRACKER_H
+
+#include <stdint.h>
+
+#include "mlib.h"
+#include "rect.h"
+
+/*
+ * Finds content that scrolled between two captures and keeps track of
+ * what each buffer queue slot holds, so a buffer can be brought up to
+ * date by moving its rows instead of copying the whole frame again.
+ *
+ * Every capture is hashed in cells of one row by SCROLL_TRACKER_TILE_PX
+ * columns, only where it was damaged. The rows of the biggest damaged
+ * rect, over the tiles it covers fully, are matched against the hashes
+ * of the capture before. If at least SCROLL_TRACKER_MIN_ROWS rows in a
+ * row moved by the same distance, that run is a move. Rows are equal
+ * if their hashes are, 64 bits make a false match unlikely enough.
+ *
+ * Buffers rotate, so the one locked next is usually a few frames old.
+ * The moves and damage of the last SCROLL_TRACKER_HISTORY frames are
+ * kept. A buffer from within that window replays the moves in place
+ * and only needs the cells that are left dirty copied in. Older
+ * buffers, and any after scroll_tracker_reset(), get a full copy.
+ *
+ * Moves are at most one per frame, vertical only, and pixels are
+ * BGRA_8888 in the buffer whatever the capture layout is.
+ */
+#define SCROLL_TRACKER_TILE_PX      (64)
+#define SCROLL_TRACKER_MIN_ROWS     (16)
+#define SCROLL_TRACKER_HISTORY      (8)
+#define SCROLL_TRACKER_MAX_RECTS    (32)
+
+struct ScrollMove {
+    uint32_t col_start;         /* tiles */
+    uint32_t col_end;
+    uint32_t row_start;         /* rows moved to */
+    uint32_t row_end;
+    int32_t dy;                 /* they come from dy rows further down */
+};
+
+struct ScrollFrame {
+    struct MRect rects[SCROLL_TRACKER_MAX_RECTS];
+    int nrects;
+    int moved;
+    struct ScrollMove move;
+};
+
+struct ScrollSlot {
+    int valid;
+    uint32_t generation;
+    uint64_t frame;             /* the capture the slot was filled from */
+};
+
+struct ScrollTracker {
+    uint32_t width;
+    uint32_t height;
+    uint32_t cols;              /* tiles across */
+
+    uint64_t *hashes;           /* rows x cols, of the last capture */
+    int hashed;                 /* 0 until a full capture was hashed */
+    uint8_t *dirty;             /* rows x cols, cells left to copy */
+
+    /* scratch for matching rows */
+    uint64_t *row_old;
+    uint64_t *row_new;
+    uint64_t *map_keys;
+    uint32_t *map_rows;
+    uint32_t map_size;
+    uint32_t *votes;
+
+    uint64_t frame;             /* captures so far */
+    uint64_t base;              /* oldest capture buffers can catch up from */
+    struct ScrollFrame pending; /* damage of the next capture */
+    struct ScrollFrame history[SCROLL_TRACKER_HISTORY];   /* frame % HISTORY */
+    struct ScrollSlot slots[M_BUFFER_SLOTS];
+
+    uint64_t scrolls;
+    uint64_t rows_moved;
+    uint64_t partial_copies;
+    uint64_t full_copies;
+};
+
+/**
+ * @return 0 on success, -1 if the tables can't be allocated
+ */
+int scroll_tracker_init(struct ScrollTracker *t,
+        uint32_t width, uint32_t height);
+
+void scroll_tracker_free(struct ScrollTracker *t);
+
+/**
+ * The screen changed in ways the damage didn't show. The next capture
+ * is hashed from scratch and every buffer gets a full copy.
+ */
+void scroll_tracker_reset(struct ScrollTracker *t);
+
+/**
+ * Add damage to the next capture. Past SCROLL_TRACKER_MAX_RECTS rects
+ * the last one grows to cover the rest.
+ */
+void scroll_tracker_damage(struct ScrollTracker *t,
+        const struct MRect *rects, int nrects);
+
+/**
+ * A new capture of the whole screen is in @param pixels: look for a
+ * move in its damage and rehash what was damaged.
+ */
+void scroll_tracker_on_capture(struct ScrollTracker *t,
+        const uint8_t *pixels, uint32_t bytes_per_line,
+        uint32_t bits_per_pixel);
+
+/**
+ * Bring the locked buffer in @param slot up to the newest capture as
+ * far as moves go. @param stride is in px. On success the cells still
+ * to be copied from the capture are set in t->dirty.
+ *
+ * @return 0 on success, -1 if the buffer needs a full copy
+ */
+int scroll_tracker_update_buffer(struct ScrollTracker *t,
+        int slot, uint32_t generation, uint8_t *bits, uint32_t stride);
+
+/**
+ * The buffer in @param slot now holds the newest capture.
+ */
+void scroll_tracker_filled(struct ScrollTracker *t,
+        int slot, uint32_t generation);
+
+#endif // M_SCROLL_TRACKER_H
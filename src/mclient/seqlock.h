@@ -0,0 +1,82 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_SEQLOCK_H
+#define M_SEQLOCK_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * Sequence lock for small bits of state that are read far more often
+ * than they are written.
+ *
+ * Readers never take a lock: they read the protected fields between
+ * seqlock_read_begin() and seqlock_read_retry() and try again if a
+ * writer got in the way. Writers bump the sequence to odd while they
+ * update and back to even when done. The mutex only serializes
+ * writers, so there can be more than one writer thread.
+ *
+ * The protected fields must be read and written with __atomic
+ * builtins (relaxed is enough), since readers race with writers by
+ * design and only find out afterwards.
+ *
+ *      uint32_t seq;
+ *      do {
+ *          seq = seqlock_read_begin(&lock);
+ *          x = __atomic_load_n(&state.x, __ATOMIC_RELAXED);
+ *          y = __atomic_load_n(&state.y, __ATOMIC_RELAXED);
+ *      } while (seqlock_read_retry(&lock, seq));
+ */
+struct SeqLock {
+    uint32_t mSeq;              /* odd while a write is in progress */
+    pthread_mutex_t mWriteLock;
+};
+
+#define SEQLOCK_INITIALIZER { 0, PTHREAD_MUTEX_INITIALIZER }
+
+static inline uint32_t seqlock_read_begin(const struct SeqLock *this) {
+    uint32_t seq;
+    while ((seq = __atomic_load_n(&this->mSeq, __ATOMIC_ACQUIRE)) & 1) {
+        /* a writer is mid-update, it only takes a few stores */
+    }
+    return seq;
+}
+
+/**
+ * @return non-zero if what was read since seqlock_read_begin()
+ * returned @param seq may be torn and has to be read again
+ */
+static inline int seqlock_read_retry(const struct SeqLock *this,
+        uint32_t seq) {
+    /* keep the field loads above the sequence load */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&this->mSeq, __ATOMIC_RELAXED) != seq;
+}
+
+static inline void seqlock_write_begin(struct SeqLock *this) {
+    pthread_mutex_lock(&this->mWriteLock);
+    __atomic_store_n(&this->mSeq, this->mSeq + 1, __ATOMIC_RELAXED);
+    /* keep the field stores below the odd sequence */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seqlock_write_end(struct SeqLock *this) {
+    __atomic_store_n(&this->mSeq, this->mSeq + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&this->mWriteLock);
+}
+
+#endif // M_SEQLOCK_H
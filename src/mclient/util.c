@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <time.h>
+
 #include "util.h"
 
 uint8_t argb8888_get_alpha(uint32_t pixel) {
@@ -24,3 +26,21 @@ uint8_t argb8888_get_alpha(uint32_t pixel) {
     return pixel_bytes[3];
 #endif
 }
+
+uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t process_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
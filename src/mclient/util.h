@@ -24,4 +24,19 @@
  */
 uint8_t argb8888_get_alpha(uint32_t pixel);
 
+/**
+ * Milliseconds on CLOCK_MONOTONIC, for measuring intervals.
+ */
+uint64_t monotonic_ms(void);
+
+/**
+ * Nanoseconds on CLOCK_MONOTONIC, same clock as mflinger's timestamps.
+ */
+uint64_t monotonic_ns(void);
+
+/**
+ * CPU time used by all of mclient's threads so far, in ns.
+ */
+uint64_t process_cpu_ns(void);
+
 #endif // M_UTIL_H
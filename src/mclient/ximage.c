@@ -0,0 +1,392 @@
+/*
+ * Copyright 2015-2016 Preetam J. D'Souza
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+
+#include "mlib.h"
+#include "mlog.h"
+#include "pixel.h"
+#include "ximage.h"
+
+/*
+ * XShm image lifecycle and XImage -> MBuffer copies.
+ *
+ * The *_mlocked copies expect @param buf to be locked with MLockBuffer.
+ * Rows go through the pixel converter for the image layout, so any
+ * TrueColor visual ends up as BGRA_8888 in the buffer.
+ */
+
+/*
+ * The converter for the last image layout seen and converted source
+ * rows for the box filter when rows aren't BGRA. Per thread, since
+ * multi-display capture copies on several threads at once.
+ */
+static __thread struct PixelConverter converter;
+static __thread uint32_t *scratch;
+static __thread uint32_t scratch_size;
+
+static const struct PixelConverter *get_converter(XImage *ximg) {
+    if (converter.convert != NULL &&
+            converter.bits_per_pixel == ximg->bits_per_pixel &&
+            converter.red_mask == ximg->red_mask &&
+            converter.green_mask == ximg->green_mask &&
+            converter.blue_mask == ximg->blue_mask) {
+        return &converter;
+    }
+
+    if (pixel_converter_init(&converter, ximg->bits_per_pixel,
+            ximg->red_mask, ximg->green_mask, ximg->blue_mask) < 0) {
+        MLOGE("can't convert %dbpp images with masks %lx/%lx/%lx\n",
+            ximg->bits_per_pixel,
+            ximg->red_mask, ximg->green_mask, ximg->blue_mask);
+        return NULL;
+    }
+
+    MLOGI("converting %dbpp depth %d images as %s\n",
+        ximg->bits_per_pixel, ximg->depth, converter.name);
+    return &converter;
+}
+
+static uint32_t *get_scratch(uint32_t pixels) {
+    if (pixels > scratch_size) {
+        uint32_t *grown = realloc(scratch, pixels * 4);
+        if (grown == NULL) {
+            MLOGE("out of memory for conversion rows\n");
+            return NULL;
+        }
+        scratch = grown;
+        scratch_size = pixels;
+    }
+    return scratch;
+}
+
+/**
+ * Convert and box filter @param out_rows buffer rows starting at
+ * @param out_row from image rows starting at @param src_row.
+ * @param width is in buffer pixels.
+ */
+static int convert_rows(MBuffer *buf, uint32_t out_row,
+        XImage *ximg, uint32_t src_row,
+        uint32_t width, uint32_t out_rows, uint32_t factor) {
+    const struct PixelConverter *c = get_converter(ximg);
+    if (c == NULL) {
+        return -1;
+    }
+
+    uint32_t buf_bytes_per_line = buf->stride * 4;
+    uint8_t *dst = (uint8_t *)buf->bits + out_row * buf_bytes_per_line;
+    const uint8_t *src = (uint8_t *)ximg->data +
+        src_row * ximg->bytes_per_line;
+
+    if (c->identity) {
+        /* a factor of 1 is a plain row copy */
+        box_downsample_32(dst, buf_bytes_per_line,
+            src, ximg->bytes_per_line, width, out_rows, factor);
+        return 0;
+    }
+
+    uint32_t y, by;
+    if (factor == 1) {
+        for (y = 0; y < out_rows; ++y) {
+            pixel_convert(c, dst + y * buf_bytes_per_line,
+                src + y * ximg->bytes_per_line, width);
+        }
+        return 0;
+    }
+
+    /* convert one block of rows at a time, then filter it */
+    uint32_t src_width = width * factor;
+    uint32_t *block = get_scratch(src_width * factor);
+    if (block == NULL) {
+        return -1;
+    }
+    for (y = 0; y < out_rows; ++y) {
+        for (by = 0; by < factor; ++by) {
+            pixel_convert(c, block + by * src_width,
+                src + (y * factor + by) * ximg->bytes_per_line, src_width);
+        }
+        box_downsample_32(dst + y * buf_bytes_per_line, buf_bytes_per_line,
+            (uint8_t *)block, src_width * 4, width, 1, factor);
+    }
+    return 0;
+}
+
+int copy_ximg_rows_to_buffer_mlocked(MBuffer *buf, XImage *ximg,
+         uint32_t row_start, uint32_t row_end) {
+    /* TODO ximg->xoffset? */
+    /* never write past the locked buffer */
+    uint32_t width = ximg->width < buf->width ? ximg->width : buf->width;
+    if (row_end > buf->height) {
+        row_end = buf->height;
+    }
+    if (row_start >= row_end) {
+        return 0;
+    }
+
+    return convert_rows(buf, row_start, ximg, row_start,
+        width, row_end - row_start, 1);
+}
+
+int copy_ximg_to_buffer_mlocked(MBuffer *buf, XImage *ximg) {
+    return copy_ximg_rows_to_buffer_mlocked(buf, ximg, 0, ximg->height);
+}
+
+int copy_ximg_rect_to_buffer_mlocked(MBuffer *buf, XImage *ximg,
+        uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+    const struct PixelConverter *c = get_converter(ximg);
+    if (c == NULL) {
+        return -1;
+    }
+
+    /* never write past the locked buffer */
+    uint32_t right = x + width, bottom = y + height;
+    if (right > buf->width) {
+        right = buf->width;
+    }
+    if (right > ximg->width) {
+        right = ximg->width;
+    }
+    if (bottom > buf->height) {
+        bottom = buf->height;
+    }
+    if (bottom > ximg->height) {
+        bottom = ximg->height;
+    }
+    if (x >= right || y >= bottom) {
+        return 0;
+    }
+
+    uint32_t buf_bytes_per_line = buf->stride * 4;
+    uint8_t *dst = (uint8_t *)buf->bits + y * buf_bytes_per_line + x * 4;
+    const uint8_t *src = (uint8_t *)ximg->data + y * ximg->bytes_per_line +
+        x * (ximg->bits_per_pixel / 8);
+
+    uint32_t row;
+    for (row = y; row < bottom; ++row) {
+        if (c->identity) {
+            memcpy(dst, src, (right - x) * 4);
+        } else {
+            pixel_convert(c, dst, src, right - x);
+        }
+        dst += buf_bytes_per_line;
+        src += ximg->bytes_per_line;
+    }
+    return 0;
+}
+
+int copy_ximg_to_buffer_opaque_mlocked(MBuffer *buf, XImage *ximg) {
+    const struct PixelConverter *c = get_converter(ximg);
+    if (c == NULL) {
+        return -1;
+    }
+    if (!c->identity) {
+        /* converted pixels always come out opaque */
+        return copy_ximg_to_buffer_mlocked(buf, ximg);
+    }
+
+    uint32_t buf_bytes_per_line = buf->stride * 4;
+    uint32_t width = ximg->width < buf->width ? ximg->width : buf->width;
+    uint32_t height = ximg->height < buf->height ? ximg->height : buf->height;
+    uint32_t y;
+
+    for (y = 0; y < height; ++y) {
+        copy_opaque_32(buf->bits + (y * buf_bytes_per_line),
+            (void *)ximg->data + (y * ximg->bytes_per_line),
+            width);
+    }
+
+    return 0;
+}
+
+/**
+ * Box filter the full XImage down into a buffer that is
+ * @param factor times smaller in each dimension.
+ */
+int downsample_ximg_to_buffer_mlocked(MBuffer *buf, XImage *ximg,
+        uint32_t factor) {
+    uint32_t width = ximg->width / factor;
+    uint32_t height = ximg->height / factor;
+
+    /* never write past the locked buffer */
+    if (width > buf->width) {
+        width = buf->width;
+    }
+    if (height > buf->height) {
+        height = buf->height;
+    }
+
+    return convert_rows(buf, 0, ximg, 0, width, height, factor);
+}
+
+int copy_ximg_band_to_buffer_mlocked(MBuffer *buf, XImage *band,
+        uint32_t src_row, uint32_t dst_row, uint32_t rows, uint32_t factor) {
+    uint32_t out_row = dst_row / factor;
+    if (out_row >= buf->height) {
+        return 0;
+    }
+
+    uint32_t out_rows = rows / factor;
+    if (out_rows > buf->height - out_row) {
+        out_rows = buf->height - out_row;
+    }
+    uint32_t width = band->width / factor;
+    if (width > buf->width) {
+        width = buf->width;
+    }
+
+    return convert_rows(buf, out_row, band, src_row, width, out_rows, factor);
+}
+
+uint32_t band_image_rows(uint32_t band_rows, uint32_t screen_height,
+        uint32_t factor) {
+    uint32_t rows = (band_rows + factor - 1) / factor * factor;
+    return rows < screen_height ? rows : screen_height;
+}
+
+int capture_banded_mlocked(Display *dpy, Window win, MBuffer *buf,
+        XImage *band, uint32_t height, uint32_t factor) {
+    int err = 0;
+
+    /* rows past the last whole block never make it into the buffer */
+    height -= height % factor;
+
+    uint32_t y = 0;
+    while (y < height) {
+        /*
+         * XShmGetImage() fails if the band hangs off the bottom, so the
+         * last band moves up and overlaps the one before it. Keeping its
+         * top a multiple of the factor keeps the box filter aligned.
+         */
+        uint32_t top = y;
+        if (top + band->height > height) {
+            top = band->height < height ? height - band->height : 0;
+            top -= top % factor;
+        }
+
+        if (!XShmGetImage(dpy, win, band, 0, top, AllPlanes)) {
+            MLOGE("error calling XShmGetImage\n");
+            err = -1;
+        }
+
+        uint32_t skip = y - top;
+        uint32_t rows = band->height - skip;
+        if (rows > height - y) {
+            rows = height - y;
+        }
+        copy_ximg_band_to_buffer_mlocked(buf, band, skip, y, rows, factor);
+
+        y += rows;
+    }
+
+    return err;
+}
+
+int cleanup_shm(const void *shmaddr, const int shmid) {
+    if (shmdt(shmaddr) < 0) {
+        MLOGE("error detaching shm: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (shmctl(shmid, IPC_RMID, 0) < 0) {
+        MLOGE("error destroying shm: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int xshm_cleanup(Display *dpy, XShmSegmentInfo *shminfo, XImage *ximg) {
+    int err = 0;
+    if (!XShmDetach(dpy, shminfo)) {
+        MLOGE("error detaching shm from X server\n");
+        err = -1;
+    }
+    XDestroyImage(ximg);
+
+    /* try to clean up shm even if X fails to detach to avoid leaks */
+    err |= cleanup_shm(shminfo->shmaddr, shminfo->shmid);
+
+    return err;
+}
+
+XImage *xshm_create(Display *dpy, XShmSegmentInfo *shminfo,
+        Visual *visual, int depth, uint32_t width, uint32_t height) {
+    /* create shared memory XImage structure */
+    XImage *ximg = XShmCreateImage(dpy,
+                    visual,
+                    depth,
+                    ZPixmap,
+                    NULL,
+                    shminfo,
+                    width,
+                    height);
+    if (ximg == NULL) {
+        MLOGE("error creating XShm Ximage\n");
+        return NULL;
+    }
+
+    //
+    // create a shared memory segment to store actual image data
+    //
+    shminfo->shmid = shmget(IPC_PRIVATE,
+             ximg->bytes_per_line * ximg->height, IPC_CREAT|0777);
+    if (shminfo->shmid < 0) {
+        MLOGE("error creating shm segment: %s\n", strerror(errno));
+        XDestroyImage(ximg);
+        return NULL;
+    }
+
+    shminfo->shmaddr = ximg->data = shmat(shminfo->shmid, NULL, 0);
+    if (shminfo->shmaddr == (void *)-1) {
+        MLOGE("error attaching shm segment: %s\n", strerror(errno));
+        shmctl(shminfo->shmid, IPC_RMID, 0);
+        ximg->data = NULL;
+        XDestroyImage(ximg);
+        return NULL;
+    }
+
+    shminfo->readOnly = False;
+
+    //
+    // inform server of shm
+    //
+    if (!XShmAttach(dpy, shminfo)) {
+        MLOGE("error calling XShmAttach\n");
+        XDestroyImage(ximg);
+        cleanup_shm(shminfo->shmaddr, shminfo->shmid);
+        return NULL;
+    }
+
+    return ximg;
+}
+
+XImage *xshm_init(Display *dpy, XShmSegmentInfo *shminfo, int screen) {
+    return xshm_create(dpy, shminfo,
+        DefaultVisual(dpy, screen),
+        DefaultDepth(dpy, screen),
+        XDisplayWidth(dpy, screen),
+        XDisplayHeight(dpy, screen));
+}
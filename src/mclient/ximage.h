@@ -0,0 +1,92 @@
+/*
+ * Copyright 2015-2016 Preetam J. D'Souza
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_XIMAGE_H
+#define M_XIMAGE_H
+
+#include <stdint.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/XShm.h>
+
+#include "mlib.h"
+
+int copy_ximg_rows_to_buffer_mlocked(MBuffer *buf, XImage *ximg,
+        uint32_t row_start, uint32_t row_end);
+int copy_ximg_to_buffer_mlocked(MBuffer *buf, XImage *ximg);
+
+/**
+ * Copy the @param width x @param height rect at (@param x, @param y)
+ * of the image to the same place in the locked buffer.
+ */
+int copy_ximg_rect_to_buffer_mlocked(MBuffer *buf, XImage *ximg,
+        uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+
+/**
+ * Same as copy_ximg_to_buffer_mlocked but forces every pixel opaque,
+ * for visuals without an alpha channel (e.g. depth 24 in 32bpp).
+ */
+int copy_ximg_to_buffer_opaque_mlocked(MBuffer *buf, XImage *ximg);
+
+int downsample_ximg_to_buffer_mlocked(MBuffer *buf, XImage *ximg,
+        uint32_t factor);
+
+//
+// Banded capture
+//
+// A band is a screen-wide XShm image only a few rows high. Capturing
+// through one band at a time keeps a band instead of a whole screen
+// resident, at the cost of one XShmGetImage() round trip per band.
+//
+
+/**
+ * Copy rows [src_row, src_row + rows) of @param band to screen row
+ * @param dst_row of the locked buffer, box filtering by @param factor
+ * (1 = plain copy). Rows and offsets are in screen pixels and must be
+ * multiples of @param factor.
+ */
+int copy_ximg_band_to_buffer_mlocked(MBuffer *buf, XImage *band,
+        uint32_t src_row, uint32_t dst_row, uint32_t rows, uint32_t factor);
+
+/**
+ * @return height of the band image for bands of @param band_rows,
+ * rounded up to a multiple of @param factor and at most the screen
+ */
+uint32_t band_image_rows(uint32_t band_rows, uint32_t screen_height,
+        uint32_t factor);
+
+/**
+ * Capture the top @param height rows of @param win into the locked
+ * buffer, one band at a time.
+ */
+int capture_banded_mlocked(Display *dpy, Window win, MBuffer *buf,
+        XImage *band, uint32_t height, uint32_t factor);
+
+int cleanup_shm(const void *shmaddr, const int shmid);
+int xshm_cleanup(Display *dpy, XShmSegmentInfo *shminfo, XImage *ximg);
+
+/**
+ * Create a width x height XShm image attached to the X server.
+ */
+XImage *xshm_create(Display *dpy, XShmSegmentInfo *shminfo,
+        Visual *visual, int depth, uint32_t width, uint32_t height);
+
+/**
+ * Screen-sized xshm_create() for the default visual.
+ */
+XImage *xshm_init(Display *dpy, XShmSegmentInfo *shminfo, int screen);
+
+#endif // M_XIMAGE_H
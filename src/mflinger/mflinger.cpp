@@ -19,6 +19,14 @@
 #include <string.h>
 #include <errno.h>
 
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -36,12 +44,20 @@
 
 #include <cutils/log.h>
 #include <utils/Errors.h>
+#include <utils/Timers.h>
 
 #include "mlib.h"
 #include "mlib-protocol.h"
+#include "mqueue.h"
+#include "mreceiver.h"
 
 #define DEBUG (0)
 
+#ifndef F_GET_SEALS
+#define F_GET_SEALS (1034)
+#define F_SEAL_SHRINK (0x0002)
+#endif
+
 using namespace android;
 
 /*
@@ -62,29 +78,282 @@ static const int DEFAULT_DISPLAY = 0;
 static const int DEFAULT_EXTERNAL_DISPLAY = 1;
 
 /*
- * Currently we only support a single client with
- * two surfaces that are usually:
- *      1. root window surface
- *      2. cursor sprite surface
+ * Displays clients can put surfaces on, by protocol display id.
+ * M_DEFAULT_DISPLAY stays the external display so single-display
+ * clients see no change. The built-in panel comes second and shows
+ * maru surfaces over Android's own layers.
+ */
+static const struct {
+    int builtin;        /* ISurfaceComposer::eDisplayId* */
+    int layerstack;
+} DISPLAYS[] = {
+    { ISurfaceComposer::eDisplayIdHdmi, DEFAULT_EXTERNAL_DISPLAY },
+    { ISurfaceComposer::eDisplayIdMain, DEFAULT_DISPLAY },
+};
+static const uint32_t NUM_DISPLAYS = sizeof(DISPLAYS) / sizeof(DISPLAYS[0]);
+
+/*
+ * Currently we only support a single client. It usually has
+ * a root window surface and a cursor sprite surface, plus
+ * short-lived surfaces in rootless mode (menus, tooltips...).
+ *
+ * Surfaces live in a slab of slots that grows on demand. Freed slots
+ * are recycled through a free list, and every slot has a generation
+ * that is bumped when it is freed. Buffer ids handed to clients encode
+ * both, so a lookup is a bounds check plus a generation compare and a
+ * stale id can never alias a newer surface in a recycled slot:
+ *
+ *      bit 31      always 0 (ids are positive, -1 = no buffer)
+ *      bits 30-16  slot generation, never 0
+ *      bits 15-0   slot index + 1
+ */
+static const int SURFACE_INDEX_BITS = 16;
+static const uint32_t SURFACE_INDEX_MASK = (1 << SURFACE_INDEX_BITS) - 1;
+static const uint32_t SURFACE_GENERATION_MASK = 0x7fff;
+static const uint32_t MAX_SURFACES = SURFACE_INDEX_MASK;
+
+/*
+ * Server-side blits fill whichever buffer the queue hands out next,
+ * usually one that missed the last few frames. The damage of the last
+ * BLIT_HISTORY blits is kept to catch such a buffer up, older buffers
+ * get the whole capture copied.
+ */
+static const int BLIT_HISTORY = 4;
+
+/* a buffer server-side blits went into, see blitBuffer() */
+/*
+ * What a buffer's fd refers to. A reallocated buffer's handle can land
+ * at the address of the one it replaced, its memory can't.
+ */
+struct mflinger_buffer_identity {
+    dev_t dev;
+    ino_t ino;
+};
+
+struct mflinger_blit_slot {
+    buffer_handle_t handle;     /* NULL = unused */
+    struct mflinger_buffer_identity identity;
+    uint64_t filled;            /* blit it was last filled by, 0 = unknown */
+};
+
+struct mflinger_surface {
+    sp<SurfaceControl> sc;      /* NULL while the slot is free */
+    uint32_t generation;
+    int32_t next_free;          /* free list link, -1 = end */
+    uint32_t width;             /* buffer size */
+    uint32_t height;
+    uint32_t scaled_width;      /* on-screen size, 0 = unscaled */
+    uint32_t scaled_height;
+    uint32_t display;           /* index into DISPLAYS */
+    int32_t xpos;               /* position in client (rotated) space */
+    int32_t ypos;
+
+    /*
+     * Gralloc buffers registered with the client, by client slot.
+     * BufferQueue hands out the same few buffers over and over, so
+     * the buffer handle and what its fd refers to identify a slot
+     * until the queue reallocates.
+     */
+    buffer_handle_t registered[M_BUFFER_SLOTS];
+    struct mflinger_buffer_identity registered_identity[M_BUFFER_SLOTS];
+    uint32_t registered_generation[M_BUFFER_SLOTS];
+    uint32_t next_generation;
+    uint32_t next_victim;       /* slot to reuse when all are taken */
+
+    uint32_t event_mask;        /* M_*_MASK events the client selected */
+
+    /*
+     * Locked for the client and not posted yet. Surface only locks
+     * once, so a client resuming the session gets this buffer again.
+     */
+    int locked;
+    ANativeWindow_Buffer locked_buffer;
+    buffer_handle_t locked_handle;
+
+    /* server-side blits, by blit % BLIT_HISTORY */
+    uint64_t blits;
+    struct mflinger_blit_slot blit_slots[M_BUFFER_SLOTS];
+    uint32_t next_blit_victim;
+    uint32_t blit_counts[BLIT_HISTORY];
+    MBlitRect blit_rects[BLIT_HISTORY][M_BLIT_MAX_RECTS];
+};
+
+/*
+ * The capture a client shared for server-side blits, mapped read-only.
+ * It is only good for the connection that shared it.
+ */
+struct mflinger_capture {
+    const uint8_t *pixels;      /* NULL = none shared */
+    size_t size;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;            /* in bytes */
+    const MBlitRect *rects;     /* the table behind the pixels */
+};
+
+/*
+ * M_SHARE_CAPTURE the way the reader thread queues it, with the fd
+ * taken out of the receiver so it travels with its request.
+ */
+struct mflinger_share_capture {
+    MShareCaptureRequest request;
+    int fd;
+};
+
+/*
+ * A post the client wants an M_FRAME_PRESENTED event for. SurfaceFlinger
+ * only knows the present time once the display fence signals, a frame
+ * or two after the post, so these are checked in between requests.
  */
-static const int MAX_SURFACES = 2;
+struct mflinger_pending_frame {
+    int32_t id;
+    uint64_t frame_number;
+    nsecs_t posted;
+};
+
+struct mflinger_display {
+    int connected;              /* 1 = last query succeeded */
+    uint32_t orientation;       /* M_ORIENTATION_* */
+    uint32_t panel_width;       /* display size before rotation */
+    uint32_t panel_height;
+    nsecs_t refresh_ns;         /* 0 = unknown */
+};
 
 struct mflinger_state {
     sp<SurfaceComposerClient> compositor;       /* SurfaceFlinger connection */
-    sp<SurfaceControl> surfaces[MAX_SURFACES];  /* surfaces alloc'd for clients */
+    std::vector<mflinger_surface> surfaces;     /* slab of surface slots */
+    int32_t free_head;                          /* first free slot, -1 = none */
     int num_surfaces;                           /* num of surfaces currently managed */
-    int layerstack;                             /* selects display for surfaces */
+    int32_t next_z;                             /* of the next new surface */
+    struct mflinger_display displays[M_MAX_DISPLAYS];
+    nsecs_t last_display_check;                 /* displays[] is a cache */
+    uint32_t changed_displays;                  /* bit per display, not sent yet */
+    uint32_t display_event_mask;                /* M_*_MASK the client selected */
+
+    std::vector<mflinger_pending_frame> pending_frames;
+    nsecs_t refresh_ns;                         /* display refresh period */
+    nsecs_t last_present;                       /* vsync anchor, 0 = none yet */
+
+    uint64_t session_token;                     /* 0 = client has no session */
+    nsecs_t session_expires;                    /* 0 = client still connected */
+
+    struct mflinger_capture capture;            /* for server-side blits */
 };
 
-static int32_t buffer_id_to_index(int32_t id) {
-    return id - 1;
+/* used until the display reports its refresh rate */
+static const nsecs_t DEFAULT_REFRESH_NS = 1000000000 / 60;
+
+/*
+ * How long cached display info is good for, and how often to look for
+ * display changes while the client has surfaces up or wants events.
+ */
+static const nsecs_t DISPLAY_CHECK_NS = 1000000000;
+
+/* give up on a present time after this many refresh periods and estimate */
+static const int PRESENT_TIMEOUT_PERIODS = 3;
+
+/**
+ * Forget all registered buffers, the client drops its mappings
+ * on its own whenever this happens (resize). What blits left in
+ * them is forgotten too.
+ */
+static void reset_buffer_slots(struct mflinger_surface *ms) {
+    int i;
+    for (i = 0; i < M_BUFFER_SLOTS; ++i) {
+        ms->registered[i] = NULL;
+        ms->blit_slots[i].handle = NULL;
+    }
+    ms->next_victim = 0;
+    ms->next_blit_victim = 0;
+    ms->blits = 0;
+}
+
+static int32_t make_buffer_id(uint32_t idx, uint32_t generation) {
+    return (int32_t)((generation << SURFACE_INDEX_BITS) | (idx + 1));
+}
+
+/**
+ * @return the live surface for @param id or NULL if the id is
+ * malformed, out of range or stale
+ */
+static struct mflinger_surface *lookup_surface(struct mflinger_state *state,
+        int32_t id) {
+    if (id <= 0) {
+        return NULL;
+    }
+
+    uint32_t idx = ((uint32_t)id & SURFACE_INDEX_MASK) - 1;
+    uint32_t generation = (uint32_t)id >> SURFACE_INDEX_BITS;
+    if (idx >= state->surfaces.size()) {
+        return NULL;
+    }
+
+    struct mflinger_surface *ms = &state->surfaces[idx];
+    if (ms->sc == NULL || ms->generation != generation) {
+        return NULL;
+    }
+    return ms;
+}
+
+/**
+ * @return index of a free slot, growing the slab if needed, or -1
+ */
+static int32_t alloc_slot(struct mflinger_state *state) {
+    if (state->free_head >= 0) {
+        int32_t idx = state->free_head;
+        state->free_head = state->surfaces[idx].next_free;
+        return idx;
+    }
+
+    if (state->surfaces.size() >= MAX_SURFACES) {
+        return -1;
+    }
+
+    mflinger_surface slot;
+    slot.generation = 1;
+    slot.next_free = -1;
+    slot.width = slot.height = 0;
+    slot.scaled_width = slot.scaled_height = 0;
+    slot.display = M_DEFAULT_DISPLAY;
+    slot.xpos = slot.ypos = 0;
+    slot.next_generation = 1;
+    slot.locked = 0;
+    reset_buffer_slots(&slot);
+    state->surfaces.push_back(slot);
+    return state->surfaces.size() - 1;
+}
+
+static void push_free_slot(struct mflinger_state *state, int32_t idx) {
+    state->surfaces[idx].next_free = state->free_head;
+    state->free_head = idx;
 }
 
-static int is_valid_idx(struct mflinger_state *state, int32_t idx) {
-    return (0 <= idx && idx < state->num_surfaces);
+static void free_slot(struct mflinger_state *state, int32_t idx) {
+    struct mflinger_surface *ms = &state->surfaces[idx];
+
+    /*
+     * this is a strong pointer so setting it
+     * to NULL will trigger dtor()
+     */
+    ms->sc = NULL;
+
+    /* invalidate outstanding ids, skipping 0 so ids stay non-zero */
+    ms->generation = (ms->generation + 1) & SURFACE_GENERATION_MASK;
+    if (ms->generation == 0) {
+        ms->generation = 1;
+    }
+
+    push_free_slot(state, idx);
+    --state->num_surfaces;
 }
 
-static int32_t get_layer(int32_t surface_idx) {
+static int32_t get_layer(int32_t z) {
+    if (z < 0) {
+        z = 0;
+    } else if (z > M_MAX_Z) {
+        z = M_MAX_Z;
+    }
+
     /*
      * Assign some really large number to make
      * sure maru surfaces are the topmost layers.
@@ -92,45 +361,278 @@ static int32_t get_layer(int32_t surface_idx) {
      * This is useful for debugging and showing on
      * the default display over Android layers.
      */
-    return 0x7ffffff0 + surface_idx;
+    return 0x7fff0000 + z;
 }
 
-static int assign_layerstack() {
-    return DEFAULT_EXTERNAL_DISPLAY;
+/*
+ * Surface geometry.
+ *
+ * Clients work in the rotated space the display reports: a w x h
+ * buffer is stretched to scaled_w x scaled_h (the compositor does the
+ * filtering, so a client can render at a fraction of the display
+ * resolution and still cover the whole panel) and placed at xpos, ypos.
+ * Rotating that onto the panel is folded into the same layer matrix,
+ * so clients keep copying upright rows and rotation costs no CPU.
+ *
+ * For a surface point (u, v) the panel point is
+ *
+ *   x = a * u + b * v + px
+ *   y = c * u + d * v + py
+ */
+static void set_position(SurfaceComposerClient::Transaction &t,
+        const struct mflinger_state *state,
+        const struct mflinger_surface *ms) {
+    const struct mflinger_display *md = &state->displays[ms->display];
+    float pw = md->panel_width, ph = md->panel_height;
+    float x = ms->xpos, y = ms->ypos;
+
+    switch (md->orientation) {
+        case M_ORIENTATION_90:
+            t.setPosition(ms->sc, pw - y, x);
+            break;
+        case M_ORIENTATION_180:
+            t.setPosition(ms->sc, pw - x, ph - y);
+            break;
+        case M_ORIENTATION_270:
+            t.setPosition(ms->sc, y, ph - x);
+            break;
+        default:
+            t.setPosition(ms->sc, x, y);
+            break;
+    }
 }
 
-static int getDisplayInfo(const int sockfd) {
-    /* no request args */
+/**
+ * Set the layer matrix for a @param w x @param h buffer, which may not
+ * be the size in @param ms yet (resize).
+ */
+static void set_matrix(SurfaceComposerClient::Transaction &t,
+        const struct mflinger_state *state,
+        const struct mflinger_surface *ms, uint32_t w, uint32_t h) {
+    float sx = 1.0f, sy = 1.0f;
+    if (ms->scaled_width && ms->scaled_height) {
+        sx = w ? (float)ms->scaled_width / w : 1.0f;
+        sy = h ? (float)ms->scaled_height / h : 1.0f;
+    }
+
+    float a, b, c, d;
+    switch (state->displays[ms->display].orientation) {
+        case M_ORIENTATION_90:
+            a = 0.0f; b = -sy; c = sx; d = 0.0f;
+            break;
+        case M_ORIENTATION_180:
+            a = -sx; b = 0.0f; c = 0.0f; d = -sy;
+            break;
+        case M_ORIENTATION_270:
+            a = 0.0f; b = sy; c = -sx; d = 0.0f;
+            break;
+        default:
+            a = sx; b = 0.0f; c = 0.0f; d = sy;
+            break;
+    }
+
+    /* setMatrix() takes dsdx, dtdx, dtdy, dsdy */
+    t.setMatrix(ms->sc, a, c, b, d);
+}
+
+static void set_geometry(SurfaceComposerClient::Transaction &t,
+        const struct mflinger_state *state,
+        const struct mflinger_surface *ms, uint32_t w, uint32_t h) {
+    set_matrix(t, state, ms, w, h);
+    set_position(t, state, ms);
+}
+
+/**
+ * Re-place the surfaces on @param display after its orientation
+ * changed. The buffers stay as they are, only the layer transforms
+ * change.
+ */
+static void reorient_surfaces(struct mflinger_state *state,
+        uint32_t display) {
+    SurfaceComposerClient::Transaction t;
+
+    size_t i;
+    for (i = 0; i < state->surfaces.size(); ++i) {
+        struct mflinger_surface *ms = &state->surfaces[i];
+        if (ms->sc != NULL && ms->display == display) {
+            set_geometry(t, state, ms, ms->width, ms->height);
+        }
+    }
+
+    if (NO_ERROR != t.apply()) {
+        ALOGE("compositor reorient transaction failed!");
+    }
+}
+
+/**
+ * Send a reply to the client, passing @param fd along unless it is -1.
+ *
+ * The header, payload and fd go out in a single sendmsg() so an event
+ * can never end up in the middle of a reply.
+ */
+static int send_reply(const int sockfd,
+            const void *data, const int data_len,
+            const int fd) {
+    struct msghdr msg = {0}; // 0 initializer
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } u;
+    int *fdptr;
+
+    MMessageHeader header;
+    header.type = M_REPLY;
+
+    /* 
+     * >= 1 byte of nonacillary data must be sent
+     * in the same sendmsg() call to pass fds
+     */
+    struct iovec iov[2];
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = data_len;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    if (fd >= 0) {
+        msg.msg_control = u.buf;
+        msg.msg_controllen = sizeof(u.buf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+
+        fdptr = (int *) CMSG_DATA(cmsg);
+        memcpy(fdptr, &fd, sizeof(int));
+    }
+
+    if (sendmsg(sockfd, &msg, 0) < 0) {
+        ALOGE("Failed to sendmsg: %s", strerror(errno));
+        return -1;
+    }
 
+    return 0;
+}
+
+/**
+ * Query @param display and pick up hotplug, size, refresh rate and
+ * orientation changes, re-placing its surfaces if it turned.
+ */
+static void query_display(struct mflinger_state *state, uint32_t display) {
+    struct mflinger_display *md = &state->displays[display];
     DisplayInfo dinfo_ext;
     status_t check;
 
     /* undefined display marker */
     dinfo_ext.w = dinfo_ext.h = 0;
+    dinfo_ext.orientation = 0;
+    dinfo_ext.fps = 0;
 
     sp<IBinder> dpy_ext = SurfaceComposerClient::getBuiltInDisplay(
-            ISurfaceComposer::eDisplayIdHdmi);
+            DISPLAYS[display].builtin);
     check = SurfaceComposerClient::getDisplayInfo(dpy_ext, &dinfo_ext);
-    // If we use Android cast with virtual display, the get display info will failed.
-    // We will use valid meaningful default display info at last to give user a normal
-    // experience. 1280 x 720 is good enough for most of cases.
-    // We should support get virtual display info later.
-    if (NO_ERROR != check) {
+    int connected = NO_ERROR == check;
+    if (display != M_DEFAULT_DISPLAY) {
+        /* extra displays are simply not listed until they show up */
+    } else if (NO_ERROR != check && md->panel_width > 0) {
+        /* the default display never goes away, keep what it last was */
+        return;
+    } else if (NO_ERROR != check) {
+        // If we use Android cast with virtual display, the get display info will failed.
+        // We will use valid meaningful default display info at last to give user a normal
+        // experience. 1280 x 720 is good enough for most of cases.
+        // We should support get virtual display info later.
         ALOGW("getDisplayInfo() for eDisplayIdHdmi failed!");
         dinfo_ext.w = 1280;
         dinfo_ext.h = 720;
+        connected = 1;
         ALOGW("Use default display size 1280 x 720 for at last.");
     }
 
-    ALOGD_IF(DEBUG, "HDMI DisplayInfo dump");
+    ALOGD_IF(DEBUG, "display %u DisplayInfo dump", display);
     ALOGD_IF(DEBUG, "     display w x h = %d x %d", dinfo_ext.w, dinfo_ext.h);
     ALOGD_IF(DEBUG, "     display orientation = %d", dinfo_ext.orientation);
 
+    /* DisplayState::eOrientation* values match M_ORIENTATION_* */
+    uint32_t orientation = dinfo_ext.orientation & 3;
+    nsecs_t refresh_ns = dinfo_ext.fps > 0 ?
+        (nsecs_t)(1000000000.0f / dinfo_ext.fps) : md->refresh_ns;
+    int turned = orientation != md->orientation ||
+                 (uint32_t)dinfo_ext.w != md->panel_width ||
+                 (uint32_t)dinfo_ext.h != md->panel_height;
+    if (turned || connected != md->connected || refresh_ns != md->refresh_ns) {
+        state->changed_displays |= 1u << display;
+    }
+    md->connected = connected;
+    md->orientation = orientation;
+    md->panel_width = dinfo_ext.w;
+    md->panel_height = dinfo_ext.h;
+    md->refresh_ns = refresh_ns;
+
+    if (display == M_DEFAULT_DISPLAY && refresh_ns > 0) {
+        /* frame pacing follows the default display */
+        state->refresh_ns = refresh_ns;
+    }
+
+    if (turned && state->num_surfaces > 0) {
+        ALOGI("display %u is now %ux%u orientation %u, re-placing surfaces",
+            display, md->panel_width, md->panel_height, orientation);
+        reorient_surfaces(state, display);
+    }
+}
+
+static void query_displays(struct mflinger_state *state) {
+    uint32_t i;
+    for (i = 0; i < NUM_DISPLAYS; ++i) {
+        query_display(state, i);
+    }
+    state->last_display_check = systemTime(SYSTEM_TIME_MONOTONIC);
+}
+
+/**
+ * Bring the cached display info up to date if it is older than
+ * DISPLAY_CHECK_NS, so SurfaceFlinger is asked at most once a period
+ * however often the client asks us.
+ */
+static void refresh_displays(struct mflinger_state *state) {
+    if (state->last_display_check == 0 ||
+            systemTime(SYSTEM_TIME_MONOTONIC) - state->last_display_check >=
+            DISPLAY_CHECK_NS) {
+        query_displays(state);
+    }
+}
+
+/**
+ * Notice a display that turned or was plugged in while a client is
+ * connected, even if the client never asks: its surfaces would be
+ * sideways until then, and a subscribed client wants to know.
+ */
+static void check_display(struct mflinger_state *state) {
+    if (state->num_surfaces > 0 || state->display_event_mask != 0) {
+        refresh_displays(state);
+    }
+}
+
+static void fill_display_info(const struct mflinger_display *md,
+        MGetDisplayInfoResponse *info) {
+    int sideways = md->orientation == M_ORIENTATION_90 ||
+                   md->orientation == M_ORIENTATION_270;
+    info->width = sideways ? md->panel_height : md->panel_width;
+    info->height = sideways ? md->panel_width : md->panel_height;
+    info->orientation = md->orientation;
+}
+
+static int getDisplayInfo(const int sockfd, struct mflinger_state *state) {
+    /* no request args */
+
+    refresh_displays(state);
+
     MGetDisplayInfoResponse response;
-    response.width = dinfo_ext.w;
-    response.height = dinfo_ext.h;
+    fill_display_info(&state->displays[M_DEFAULT_DISPLAY], &response);
 
-    if (write(sockfd, &response, sizeof(response)) < 0) {
+    if (send_reply(sockfd, &response, sizeof(response), -1) < 0) {
         ALOGE("[getDisplayInfo] Failed to write response: %s", strerror(errno));
         return -1;
     }
@@ -138,19 +640,47 @@ static int getDisplayInfo(const int sockfd) {
     return 0;
 }
 
-static int createSurface(struct mflinger_state *state,
-            uint32_t w, uint32_t h) {
+/**
+ * Displays are listed in id order and stop at the first one that
+ * isn't connected, so ids stay valid as long as nothing unplugs.
+ */
+static int listDisplays(const int sockfd, struct mflinger_state *state) {
+    refresh_displays(state);
+
+    MListDisplaysResponse response;
+    memset(&response, 0, sizeof(response));
+    while (response.count < NUM_DISPLAYS &&
+            state->displays[response.count].connected) {
+        fill_display_info(&state->displays[response.count],
+            &response.displays[response.count]);
+        ++response.count;
+    }
+
+    if (send_reply(sockfd, &response, sizeof(response), -1) < 0) {
+        ALOGE("[listDisplays] Failed to write response: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
 
-    if (state->num_surfaces >= MAX_SURFACES) {
+/**
+ * @return id of the new surface or -1 on failure
+ */
+static int32_t createSurface(struct mflinger_state *state,
+            uint32_t w, uint32_t h, uint32_t display) {
+    if (display >= NUM_DISPLAYS) {
+        ALOGE("no display %u!", display);
         return -1;
     }
 
-    /* lazy init the layerstack when the first surface is created */
-    if (state->layerstack < 0) {
-        state->layerstack = assign_layerstack();
+    int32_t idx = alloc_slot(state);
+    if (idx < 0) {
+        ALOGE("out of surface slots!");
+        return -1;
     }
 
-    String8 name = String8::format("maru %d", state->num_surfaces);
+    String8 name = String8::format("maru %d", idx);
     sp<SurfaceControl> surface = state->compositor->createSurface(
                                 name,
                                 w, h,
@@ -158,48 +688,71 @@ static int createSurface(struct mflinger_state *state,
                                 0);
     if (surface == NULL || !surface->isValid()) {
         ALOGE("compositor->createSurface() failed!");
+        push_free_slot(state, idx);
         return -1;
     }
 
+    /* never the z of a surface that is still there */
+    if (state->num_surfaces == 0) {
+        state->next_z = 0;
+    }
+    int32_t z = state->next_z;
+
+    struct mflinger_surface *ms = &state->surfaces[idx];
+    ms->sc = surface;
+    ms->width = w;
+    ms->height = h;
+    ms->scaled_width = ms->scaled_height = 0;
+    ms->display = display;
+    ms->xpos = ms->ypos = 0;
+
     //
     // Display the surface on the screen
     //
-    status_t ret = SurfaceComposerClient::Transaction{}
-        .setLayer(surface, get_layer(state->num_surfaces))
-        .setLayerStack(surface, state->layerstack)
-        .show(surface)
-        .apply();
+    SurfaceComposerClient::Transaction t;
+    t.setLayer(surface, get_layer(z))
+        .setLayerStack(surface, DISPLAYS[display].layerstack)
+        .show(surface);
+    set_geometry(t, state, ms, w, h);
 
-    if (NO_ERROR != ret) {
+    if (NO_ERROR != t.apply()) {
         ALOGE("compositor transaction failed!");
+        ms->sc = NULL;
+        push_free_slot(state, idx);
         return -1;
     }
 
-    state->surfaces[(state->num_surfaces)++] = surface;
+    reset_buffer_slots(ms);
+    ms->event_mask = 0;
+    ms->locked = 0;
+    ++state->num_surfaces;
+    if (state->next_z < M_MAX_Z) {
+        ++state->next_z;
+    }
 
-    return 0;
+    /* cheap to keep around and needed for M_FRAME_PRESENTED */
+    surface->getSurface()->enableFrameTimestamps(true);
+
+    return make_buffer_id(idx, ms->generation);
 }
 
-static int createBuffer(const int sockfd, struct mflinger_state *state) {
-    int n;
-    MCreateBufferRequest request;
-    n = read(sockfd, &request, sizeof(request));
-    ALOGD_IF(DEBUG, "[C] n: %d", n);
+static int createBuffer(const int sockfd, struct mflinger_state *state,
+        const MCreateBufferRequest *request) {
     ALOGD_IF(DEBUG, "[C] requested dims = (%lux%lu)", 
-        (unsigned long)request.width, (unsigned long)request.height);
+        (unsigned long)request->width, (unsigned long)request->height);
 
     ALOGD_IF(DEBUG, "[C] 1 -- num_surfaces = %d", state->num_surfaces);
 
-    n = createSurface(state,
-         request.width, request.height);
+    int32_t id = createSurface(state,
+         request->width, request->height, request->display);
 
     ALOGD_IF(DEBUG, "[C] 2 -- num_surfaces = %d", state->num_surfaces);
 
     MCreateBufferResponse response;
-    response.id = n ? -1 : state->num_surfaces;
-    response.result = n ? -1 : 0;
+    response.id = id;
+    response.result = id < 0 ? -1 : 0;
 
-    if (write(sockfd, &response, sizeof(response)) < 0) {
+    if (send_reply(sockfd, &response, sizeof(response), -1) < 0) {
         ALOGE("[C] Failed to write response: %s", strerror(errno));
         return -1;
     }
@@ -207,28 +760,24 @@ static int createBuffer(const int sockfd, struct mflinger_state *state) {
     return 0;
 }
 
-static int updateBuffer(const int sockfd, struct mflinger_state *state) {
-    int n;
-    MUpdateBufferRequest request;
-    n = read(sockfd, &request, sizeof(request));
-    ALOGD_IF(DEBUG, "[updateBuffer] n: %d", n);
-    ALOGD_IF(DEBUG, "[updateBuffer] requested id = %d", request.id);
+static int updateBuffer(const int sockfd, struct mflinger_state *state,
+        const MUpdateBufferRequest *request) {
+    ALOGD_IF(DEBUG, "[updateBuffer] requested id = %d", request->id);
     ALOGD_IF(DEBUG, "[updateBuffer] requested pos = (%d, %d)",
-        request.xpos, request.ypos);
+        request->xpos, request->ypos);
 
-    int32_t idx = buffer_id_to_index(request.id);
-    if (!is_valid_idx(state, idx)) {
-        ALOGW("ignoring update request for invalid surface id: %d\n", idx);
+    struct mflinger_surface *ms = lookup_surface(state, request->id);
+    if (ms == NULL) {
+        ALOGW("ignoring update request for invalid surface id: %d\n", request->id);
         return -1;
     }
 
-    sp<SurfaceControl> sc = state->surfaces[idx];
-
-    status_t ret = SurfaceComposerClient::Transaction{}
-        .setPosition(sc, request.xpos, request.ypos)
-        .apply();
+    ms->xpos = request->xpos;
+    ms->ypos = request->ypos;
 
-    if (NO_ERROR != ret) {
+    SurfaceComposerClient::Transaction t;
+    set_position(t, state, ms);
+    if (NO_ERROR != t.apply()) {
         ALOGE("compositor transaction failed!");
         return -1;
     }
@@ -236,33 +785,35 @@ static int updateBuffer(const int sockfd, struct mflinger_state *state) {
     return 0;
 }
 
-static int resizeBuffer(const int sockfd, struct mflinger_state *state) {
-    int n;
-    MResizeBufferRequest request;
-    n = read(sockfd, &request, sizeof(request));
-    ALOGD_IF(DEBUG, "[resizeBuffer] requested width = %d", request.width);
-    ALOGD_IF(DEBUG, "[resizeBuffer] requested height = %d", request.height);
+static int resizeBuffer(const int sockfd, struct mflinger_state *state,
+        const MResizeBufferRequest *request) {
+    ALOGD_IF(DEBUG, "[resizeBuffer] requested width = %d", request->width);
+    ALOGD_IF(DEBUG, "[resizeBuffer] requested height = %d", request->height);
 
-    int32_t idx = buffer_id_to_index(request.id);
-    if (!is_valid_idx(state, idx)) {
-        ALOGW("ignoring resize request for invalid surface id: %d\n", idx);
-        return -1;
-    }
+    MResizeBufferResponse response;
+    response.result = -1;
 
-    sp<SurfaceControl> sc = state->surfaces[idx];
+    struct mflinger_surface *ms = lookup_surface(state, request->id);
+    if (ms != NULL) {
+        SurfaceComposerClient::Transaction t;
+        t.setSize(ms->sc, request->width, request->height);
 
-    status_t ret = SurfaceComposerClient::Transaction{}
-        .setSize(sc, request.width, request.height)
-        .apply();
+        /* keep filling the same on-screen area with the new buffer size */
+        set_matrix(t, state, ms, request->width, request->height);
 
-    MResizeBufferResponse response;
-    response.result = 0;
-    if (NO_ERROR != ret) {
-        ALOGE("compositor resize transaction failed!");
-        response.result = -1;
+        if (NO_ERROR == t.apply()) {
+            ms->width = request->width;
+            ms->height = request->height;
+            reset_buffer_slots(ms);
+            response.result = 0;
+        } else {
+            ALOGE("compositor resize transaction failed!");
+        }
+    } else {
+        ALOGW("ignoring resize request for invalid surface id: %d\n", request->id);
     }
 
-    if (write(sockfd, &response, sizeof(response)) < 0) {
+    if (send_reply(sockfd, &response, sizeof(response), -1) < 0) {
         ALOGE("Failed to write resizeBuffer response: %s",
                 strerror(errno));
         return -1;
@@ -271,127 +822,993 @@ static int resizeBuffer(const int sockfd, struct mflinger_state *state) {
     return 0;
 }
 
-static int sendfd(const int sockfd,
-            void *data, const int data_len,
-            const int fd) {
-    struct msghdr msg = {0}; // 0 initializer
-    struct cmsghdr *cmsg;
-    //int bufferFd = 1;
-    union {
-        char buf[CMSG_SPACE(sizeof(int))];
-        struct cmsghdr align;
-    } u;
-    int *fdptr;
+static int scaleBuffer(const int sockfd, struct mflinger_state *state,
+        const MScaleBufferRequest *request) {
+    ALOGD_IF(DEBUG, "[scaleBuffer] requested id = %d", request->id);
+    ALOGD_IF(DEBUG, "[scaleBuffer] requested dims = (%ux%u)",
+        request->width, request->height);
 
-    /* 
-     * >= 1 byte of nonacillary data must be sent
-     * in the same sendmsg() call to pass fds
-     */
-    struct iovec iov;
-    iov.iov_base = data;
-    iov.iov_len = data_len;
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
-
-    msg.msg_control = u.buf;
-    msg.msg_controllen = sizeof(u.buf);
-    cmsg = CMSG_FIRSTHDR(&msg);
-    cmsg->cmsg_level = SOL_SOCKET;
-    cmsg->cmsg_type = SCM_RIGHTS;
-    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
-
-    fdptr = (int *) CMSG_DATA(cmsg);
-    memcpy(fdptr, &fd, sizeof(int));
+    MScaleBufferResponse response;
+    response.result = -1;
 
-    if (sendmsg(sockfd, &msg, 0) < 0) {
-        ALOGE("Failed to sendmsg: %s", strerror(errno));
+    struct mflinger_surface *ms = lookup_surface(state, request->id);
+    if (ms != NULL) {
+        uint32_t old_width = ms->scaled_width;
+        uint32_t old_height = ms->scaled_height;
+        ms->scaled_width = request->width;
+        ms->scaled_height = request->height;
+
+        SurfaceComposerClient::Transaction t;
+        set_matrix(t, state, ms, ms->width, ms->height);
+
+        if (NO_ERROR == t.apply()) {
+            response.result = 0;
+        } else {
+            ALOGE("compositor scale transaction failed!");
+            ms->scaled_width = old_width;
+            ms->scaled_height = old_height;
+        }
+    } else {
+        ALOGW("ignoring scale request for invalid surface id: %d\n", request->id);
+    }
+
+    if (send_reply(sockfd, &response, sizeof(response), -1) < 0) {
+        ALOGE("Failed to write scaleBuffer response: %s",
+                strerror(errno));
         return -1;
     }
 
-    return 0;
+    return response.result;
 }
 
-static int lockBuffer(const int sockfd, struct mflinger_state *state) {
-    int n;
-    MLockBufferRequest request;
-    n = read(sockfd, &request, sizeof(request));
-    ALOGD_IF(DEBUG, "[L] n: %d", n);
-    ALOGD_IF(DEBUG, "[L] requested id = %d", request.id);
-    int32_t idx = buffer_id_to_index(request.id);
+static int restackBuffer(const int sockfd, struct mflinger_state *state,
+        const MRestackBufferRequest *request) {
+    ALOGD_IF(DEBUG, "[restackBuffer] requested id = %d, z = %d",
+        request->id, request->z);
 
-    MLockBufferResponse response;
-    response.result = -1;
+    struct mflinger_surface *ms = lookup_surface(state, request->id);
+    if (ms == NULL) {
+        ALOGW("ignoring restack request for invalid surface id: %d\n", request->id);
+        return -1;
+    }
 
-    if (0 <= idx && idx < state->num_surfaces) {
-        sp<SurfaceControl> sc = state->surfaces[idx];
-        sp<Surface> s = sc->getSurface();
+    status_t ret = SurfaceComposerClient::Transaction{}
+        .setLayer(ms->sc, get_layer(request->z))
+        .apply();
 
-        ANativeWindow_Buffer outBuffer;
-        buffer_handle_t handle;
-        status_t err = s->lockWithHandle(&outBuffer, &handle, NULL);
-        if (err != 0) {
-            ALOGE("failed to lock buffer");
-        } else if (handle->numFds < 1) {
-            ALOGE("buffer handle does not have any fds");
-        } else {
-            /* all is well */
-            response.buffer.width = outBuffer.width;
-            response.buffer.height = outBuffer.height;
-            response.buffer.stride = outBuffer.stride;
-            response.buffer.bits = NULL;
-            response.result = 0;
+    if (NO_ERROR != ret) {
+        ALOGE("compositor transaction failed!");
+        return -1;
+    }
 
-            return sendfd(sockfd, (void *)&response,
-                sizeof(response), handle->data[0]);
-        }
-    } else {
-        ALOGE("Invalid buffer id: %d\n", request.id);
-    }    
+    return 0;
+}
 
-    if (write(sockfd, &response, sizeof(response)) < 0) {
-        ALOGE("[L] Failed to write response: %s", strerror(errno));
+static int showBuffer(const int sockfd, struct mflinger_state *state,
+        const MShowBufferRequest *request) {
+    ALOGD_IF(DEBUG, "[showBuffer] requested id = %d, shown = %u",
+        request->id, request->shown);
+
+    struct mflinger_surface *ms = lookup_surface(state, request->id);
+    if (ms == NULL) {
+        ALOGW("ignoring show request for invalid surface id: %d\n", request->id);
+        return -1;
     }
-    return -1;
-}
 
-static int unlockAndPostBuffer(const int sockfd,
-            struct mflinger_state *state) {
-    int n;
-    MUnlockBufferRequest request;
-    n = read(sockfd, &request, sizeof(request));
-    ALOGD_IF(DEBUG, "[U] n: %d", n);
-    ALOGD_IF(DEBUG, "[U] requested id = %d", request.id);
-    int32_t idx = buffer_id_to_index(request.id);
-
-    if (0 <= idx && idx < state->num_surfaces) {
-        sp<SurfaceControl> sc = state->surfaces[idx];
-        sp<Surface> s = sc->getSurface();
+    sp<SurfaceControl> sc = ms->sc;
 
-        return s->unlockAndPost();
+    SurfaceComposerClient::Transaction t;
+    if (request->shown) {
+        t.show(sc);
     } else {
-        ALOGE("Invalid buffer id: %d\n", request.id);
+        t.hide(sc);
     }
 
-    /* TODO return failure to client? */
+    if (NO_ERROR != t.apply()) {
+        ALOGE("compositor transaction failed!");
+        return -1;
+    }
 
-    return -1;
+    return 0;
 }
 
-static void purge_surfaces(struct mflinger_state *state) {
-    for (; state->num_surfaces > 0; --state->num_surfaces) {
-        /*
-         * these are strong pointers so setting them
-         * to NULL will trigger dtor()
-         */
-        state->surfaces[state->num_surfaces - 1] = NULL;
+static struct mflinger_buffer_identity get_buffer_identity(
+        buffer_handle_t handle) {
+    struct mflinger_buffer_identity identity;
+    memset(&identity, 0, sizeof(identity));
+
+    struct stat st;
+    if (handle->numFds < 1) {
+        /* caught where the fd is needed */
+    } else if (fstat(handle->data[0], &st) < 0) {
+        ALOGE("Failed to stat buffer fd: %s", strerror(errno));
+    } else {
+        identity.dev = st.st_dev;
+        identity.ino = st.st_ino;
+    }
+    return identity;
+}
+
+static int same_buffer_identity(const struct mflinger_buffer_identity *a,
+        const struct mflinger_buffer_identity *b) {
+    return a->dev == b->dev && a->ino == b->ino;
+}
+
+/**
+ * Find the client slot of @param handle, or pick one to register it in.
+ * A handle registered before for other memory gets its slot again.
+ *
+ * @return 1 if the buffer is new to the client and has to be sent
+ * along, 0 if it is already registered
+ */
+static int find_buffer_slot(struct mflinger_surface *ms,
+        buffer_handle_t handle, int32_t *slot_ret) {
+    struct mflinger_buffer_identity identity = get_buffer_identity(handle);
+    int32_t slot = -1;
+    int i;
+    for (i = 0; i < M_BUFFER_SLOTS; ++i) {
+        if (ms->registered[i] != handle) {
+            continue;
+        }
+        if (same_buffer_identity(&ms->registered_identity[i], &identity)) {
+            *slot_ret = i;
+            return 0;
+        }
+        ALOGD_IF(DEBUG, "[L] buffer in slot %d was reallocated", i);
+        slot = i;
+    }
+
+    for (i = 0; slot < 0 && i < M_BUFFER_SLOTS; ++i) {
+        if (ms->registered[i] == NULL) {
+            slot = i;
+        }
+    }
+    if (slot < 0) {
+        /* the queue outgrew the table, recycle slots in turn */
+        slot = ms->next_victim;
+        ms->next_victim = (ms->next_victim + 1) % M_BUFFER_SLOTS;
+    }
+
+    ms->registered[slot] = handle;
+    ms->registered_identity[slot] = identity;
+    ms->registered_generation[slot] = ms->next_generation++;
+    *slot_ret = slot;
+    return 1;
+}
+
+/**
+ * @return the blit slot of @param handle, which might have to be
+ * taken from another buffer first
+ */
+static struct mflinger_blit_slot *find_blit_slot(struct mflinger_surface *ms,
+        buffer_handle_t handle) {
+    struct mflinger_buffer_identity identity = get_buffer_identity(handle);
+    int i;
+    for (i = 0; i < M_BUFFER_SLOTS; ++i) {
+        struct mflinger_blit_slot *slot = &ms->blit_slots[i];
+        if (slot->handle != handle) {
+            continue;
+        }
+        if (!same_buffer_identity(&slot->identity, &identity)) {
+            /* reallocated, nothing blitted before is in it */
+            slot->identity = identity;
+            slot->filled = 0;
+        }
+        return slot;
+    }
+
+    struct mflinger_blit_slot *slot = NULL;
+    for (i = 0; i < M_BUFFER_SLOTS && slot == NULL; ++i) {
+        if (ms->blit_slots[i].handle == NULL) {
+            slot = &ms->blit_slots[i];
+        }
+    }
+    if (slot == NULL) {
+        slot = &ms->blit_slots[ms->next_blit_victim];
+        ms->next_blit_victim = (ms->next_blit_victim + 1) % M_BUFFER_SLOTS;
+    }
+
+    slot->handle = handle;
+    slot->identity = identity;
+    slot->filled = 0;
+    return slot;
+}
+
+static void forget_blit_slot(struct mflinger_surface *ms,
+        buffer_handle_t handle) {
+    int i;
+    for (i = 0; i < M_BUFFER_SLOTS; ++i) {
+        if (ms->blit_slots[i].handle == handle) {
+            ms->blit_slots[i].filled = 0;
+        }
+    }
+}
+
+/**
+ * Lock the next buffer of @param ms (NULL = invalid id) and send it
+ * to the client, or send a failure response. The buffer fd is only
+ * sent the first time the client sees a buffer. A buffer that is
+ * still locked, from a client that went away, is sent again.
+ */
+static int sendLockedBuffer(const int sockfd, struct mflinger_surface *ms) {
+    MLockBufferResponse response;
+    memset(&response, 0, sizeof(response));
+    response.result = -1;
+
+    if (ms != NULL) {
+        sp<SurfaceControl> sc = ms->sc;
+        sp<Surface> s = sc->getSurface();
+
+        status_t err = 0;
+        if (!ms->locked) {
+            err = s->lockWithHandle(&ms->locked_buffer, &ms->locked_handle,
+                NULL);
+            ms->locked = err == 0;
+        }
+
+        ANativeWindow_Buffer outBuffer = ms->locked_buffer;
+        buffer_handle_t handle = ms->locked_handle;
+        if (err != 0) {
+            ALOGE("failed to lock buffer");
+        } else if (handle->numFds < 1) {
+            ALOGE("buffer handle does not have any fds");
+        } else {
+            /* all is well */
+            int32_t slot;
+            int is_new = find_buffer_slot(ms, handle, &slot);
+
+            /* whatever a blit left in it, the client draws over it now */
+            forget_blit_slot(ms, handle);
+
+            response.width = outBuffer.width;
+            response.height = outBuffer.height;
+            response.stride = outBuffer.stride;
+            response.slot = slot;
+            response.generation = ms->registered_generation[slot];
+            response.has_fd = is_new;
+            response.result = 0;
+
+            ALOGD_IF(DEBUG && is_new, "[L] registering buffer in slot %d", slot);
+            return send_reply(sockfd, &response, sizeof(response),
+                is_new ? handle->data[0] : -1);
+        }
+    }
+
+    if (send_reply(sockfd, &response, sizeof(response), -1) < 0) {
+        ALOGE("[L] Failed to write response: %s", strerror(errno));
+    }
+    return -1;
+}
+
+/**
+ * Queue @param ms's current buffer and remember the frame if the
+ * client wants to know when it is presented.
+ */
+static status_t post_surface(struct mflinger_state *state,
+        struct mflinger_surface *ms, int32_t id) {
+    sp<Surface> s = ms->sc->getSurface();
+    uint64_t frame_number = s->getNextFrameNumber();
+
+    status_t err = s->unlockAndPost();
+    ms->locked = 0;
+    if (err == NO_ERROR && (ms->event_mask & M_FRAME_PRESENTED_MASK)) {
+        mflinger_pending_frame frame;
+        frame.id = id;
+        frame.frame_number = frame_number;
+        frame.posted = systemTime(SYSTEM_TIME_MONOTONIC);
+        state->pending_frames.push_back(frame);
+    }
+    return err;
+}
+
+/**
+ * @return the first vsync after @param t, extrapolated from the last
+ * measured present time if there is one
+ */
+static nsecs_t next_vsync(const struct mflinger_state *state, nsecs_t t) {
+    if (state->last_present == 0 || t < state->last_present) {
+        return t + state->refresh_ns;
+    }
+    nsecs_t periods = (t - state->last_present) / state->refresh_ns + 1;
+    return state->last_present + periods * state->refresh_ns;
+}
+
+static int send_event(const int sockfd, const MEvent *ev, size_t size) {
+    if (write(sockfd, ev, size) < 0) {
+        ALOGE("Failed to write event: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Send M_FRAME_PRESENTED for every pending frame that made it to the
+ * display. Frames without a present time after PRESENT_TIMEOUT_PERIODS
+ * (dropped, or timestamps unsupported) get a vsync estimate instead:
+ * SurfaceFlinger latches at the first vsync after the post and the
+ * frame is on screen one vsync later.
+ */
+static void send_presented(const int sockfd, struct mflinger_state *state) {
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+
+    std::vector<mflinger_pending_frame>::iterator it =
+        state->pending_frames.begin();
+    while (it != state->pending_frames.end()) {
+        struct mflinger_surface *ms = lookup_surface(state, it->id);
+        if (ms == NULL) {
+            /* destroyed in the meantime */
+            it = state->pending_frames.erase(it);
+            continue;
+        }
+
+        nsecs_t present = -1;
+        status_t err = ms->sc->getSurface()->getFrameTimestamps(
+            it->frame_number, NULL, NULL, NULL, NULL, NULL, NULL,
+            &present, NULL, NULL);
+
+        MEvent ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.frame.type = M_FRAME_PRESENTED;
+        ev.frame.__id = it->id;
+        ev.frame.refresh_ns = state->refresh_ns;
+
+        if (err == NO_ERROR && present > 0) {
+            state->last_present = present;
+            ev.frame.present_ns = present;
+        } else if (err != NO_ERROR || now - it->posted >
+                PRESENT_TIMEOUT_PERIODS * state->refresh_ns) {
+            ev.frame.present_ns = next_vsync(state, it->posted) +
+                state->refresh_ns;
+            ev.frame.estimated = 1;
+        } else {
+            /* the present fence hasn't signaled yet */
+            ++it;
+            continue;
+        }
+
+        send_event(sockfd, &ev, sizeof(ev.frame));
+        it = state->pending_frames.erase(it);
+    }
+}
+
+/**
+ * Send M_DISPLAY_CHANGED for every display that changed since the
+ * last call, if the client selected for it.
+ */
+static void send_display_changes(const int sockfd,
+        struct mflinger_state *state) {
+    uint32_t i;
+    for (i = 0; state->changed_displays != 0 && i < NUM_DISPLAYS; ++i) {
+        if (!(state->changed_displays & (1u << i))) {
+            continue;
+        }
+        state->changed_displays &= ~(1u << i);
+        if (!(state->display_event_mask & M_DISPLAY_CHANGED_MASK)) {
+            continue;
+        }
+
+        const struct mflinger_display *md = &state->displays[i];
+        MGetDisplayInfoResponse info;
+        fill_display_info(md, &info);
+
+        MEvent ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.display.type = M_DISPLAY_CHANGED;
+        ev.display.display = i;
+        ev.display.connected = md->connected;
+        ev.display.width = info.width;
+        ev.display.height = info.height;
+        ev.display.orientation = info.orientation;
+        ev.display.refresh_ns = md->refresh_ns;
+
+        ALOGI("display %u changed: %ux%u orientation %u, %s",
+            i, info.width, info.height, info.orientation,
+            md->connected ? "connected" : "disconnected");
+        send_event(sockfd, &ev, sizeof(ev.display));
+    }
+}
+
+static int lockBuffer(const int sockfd, struct mflinger_state *state,
+        const MLockBufferRequest *request) {
+    ALOGD_IF(DEBUG, "[L] requested id = %d", request->id);
+    struct mflinger_surface *ms = lookup_surface(state, request->id);
+    if (ms == NULL) {
+        ALOGE("Invalid buffer id: %d\n", request->id);
+    }
+
+    /* the client lost these, e.g. mapping them failed */
+    int i;
+    for (i = 0; ms != NULL && i < M_BUFFER_SLOTS; ++i) {
+        if ((request->unmapped & (1u << i)) && ms->registered[i] != NULL) {
+            ALOGD_IF(DEBUG, "[L] client has no mapping for slot %d", i);
+            ms->registered[i] = NULL;
+        }
+    }
+
+    return sendLockedBuffer(sockfd, ms);
+}
+
+static int unlockAndPostBuffer(const int sockfd,
+            struct mflinger_state *state,
+            const MUnlockBufferRequest *request) {
+    ALOGD_IF(DEBUG, "[U] requested id = %d", request->id);
+    struct mflinger_surface *ms = lookup_surface(state, request->id);
+
+    if (ms != NULL) {
+        return post_surface(state, ms, request->id);
+    } else {
+        ALOGE("Invalid buffer id: %d\n", request->id);
+    }
+
+    /* TODO return failure to client? */
+
+    return -1;
+}
+
+static int swapBuffer(const int sockfd, struct mflinger_state *state,
+        const MSwapBufferRequest *request) {
+    ALOGD_IF(DEBUG, "[S] requested id = %d", request->id);
+    struct mflinger_surface *ms = lookup_surface(state, request->id);
+    if (ms == NULL) {
+        ALOGE("Invalid buffer id: %d\n", request->id);
+        return sendLockedBuffer(sockfd, NULL);
+    }
+
+    if (post_surface(state, ms, request->id) != NO_ERROR) {
+        ALOGE("failed to post buffer");
+    }
+
+    return sendLockedBuffer(sockfd, ms);
+}
+
+static void unshare_capture(struct mflinger_state *state) {
+    struct mflinger_capture *capture = &state->capture;
+    if (capture->pixels != NULL) {
+        munmap((void *)capture->pixels, capture->size);
+    }
+    memset(capture, 0, sizeof(*capture));
+}
+
+static int shareCapture(const int sockfd, struct mflinger_state *state,
+        const struct mflinger_share_capture *share) {
+    const MShareCaptureRequest *request = &share->request;
+    ALOGD_IF(DEBUG, "[shareCapture] %ux%u stride %u size %u",
+        request->width, request->height, request->stride, request->size);
+
+    unshare_capture(state);
+
+    MShareCaptureResponse response;
+    response.result = -1;
+
+    /*
+     * Never map past the end of the memory, touching that is SIGBUS.
+     * Without the seal the client could still shrink it afterwards.
+     */
+    uint64_t needed = (uint64_t)request->stride * request->height +
+        M_BLIT_MAX_RECTS * sizeof(MBlitRect);
+    struct stat st;
+    int seals;
+    if (share->fd < 0) {
+        ALOGE("capture shared without an fd");
+    } else if (request->width == 0 || request->height == 0 ||
+            request->stride < request->width * 4 || needed > request->size) {
+        ALOGE("bad capture layout %ux%u stride %u size %u", request->width,
+            request->height, request->stride, request->size);
+    } else if (fstat(share->fd, &st) < 0 || (uint64_t)st.st_size < needed) {
+        ALOGE("capture memory is smaller than its layout");
+    } else if ((seals = fcntl(share->fd, F_GET_SEALS)) < 0 ||
+            !(seals & F_SEAL_SHRINK)) {
+        ALOGE("capture memory isn't sealed against shrinking");
+    } else {
+        void *pixels = mmap(NULL, needed, PROT_READ, MAP_SHARED, share->fd, 0);
+        if (pixels == MAP_FAILED) {
+            ALOGE("Failed to map capture: %s", strerror(errno));
+        } else {
+            struct mflinger_capture *capture = &state->capture;
+            capture->pixels = (const uint8_t *)pixels;
+            capture->size = needed;
+            capture->width = request->width;
+            capture->height = request->height;
+            capture->stride = request->stride;
+            capture->rects = (const MBlitRect *)(capture->pixels +
+                (size_t)request->stride * request->height);
+            response.result = 0;
+        }
+    }
+    if (share->fd >= 0) {
+        /* the mapping holds its own reference */
+        close(share->fd);
+    }
+
+    return send_reply(sockfd, &response, sizeof(response), -1);
+}
+
+/**
+ * Copy @param r, clipped to the capture and the buffer, from the
+ * capture into @param buffer.
+ */
+static void blit_rect(const struct mflinger_capture *capture,
+        const ANativeWindow_Buffer *buffer, const MBlitRect *r) {
+    int64_t left = r->x < 0 ? 0 : r->x;
+    int64_t top = r->y < 0 ? 0 : r->y;
+    int64_t right = (int64_t)r->x + r->width;
+    int64_t bottom = (int64_t)r->y + r->height;
+    int64_t width = capture->width < (uint32_t)buffer->width ?
+        capture->width : buffer->width;
+    int64_t height = capture->height < (uint32_t)buffer->height ?
+        capture->height : buffer->height;
+    if (right > width) {
+        right = width;
+    }
+    if (bottom > height) {
+        bottom = height;
+    }
+    if (left >= right || top >= bottom) {
+        return;
+    }
+
+    size_t dst_stride = (size_t)buffer->stride * 4;
+    size_t bytes = (right - left) * 4;
+    const uint8_t *src = capture->pixels + top * capture->stride + left * 4;
+    uint8_t *dst = (uint8_t *)buffer->bits + top * dst_stride + left * 4;
+    int64_t y;
+    for (y = top; y < bottom; ++y) {
+        memcpy(dst, src, bytes);
+        src += capture->stride;
+        dst += dst_stride;
+    }
+}
+
+/**
+ * Copy the damage from the shared capture into the next buffer and
+ * post it. A buffer filled by one of the last BLIT_HISTORY blits only
+ * gets the damage it missed since, any other buffer all of it.
+ */
+static int blitBuffer(const int sockfd, struct mflinger_state *state,
+        const MBlitBufferRequest *request) {
+    ALOGD_IF(DEBUG, "[B] requested id = %d, %u rects",
+        request->id, request->count);
+
+    MBlitBufferResponse response;
+    response.result = -1;
+
+    struct mflinger_surface *ms = lookup_surface(state, request->id);
+    const struct mflinger_capture *capture = &state->capture;
+    status_t err = 0;
+    if (ms == NULL) {
+        ALOGE("Invalid buffer id: %d\n", request->id);
+    } else if (capture->pixels == NULL) {
+        ALOGE("no capture shared to blit from");
+    } else if (request->count > M_BLIT_MAX_RECTS) {
+        ALOGE("too many blit rects: %u", request->count);
+    } else {
+        if (!ms->locked) {
+            err = ms->sc->getSurface()->lockWithHandle(&ms->locked_buffer,
+                &ms->locked_handle, NULL);
+            ms->locked = err == 0;
+        }
+        if (err != 0) {
+            ALOGE("failed to lock buffer");
+        } else {
+            /* the client may rewrite the table once it has the response */
+            uint64_t blit = ++ms->blits;
+            uint32_t h = blit % BLIT_HISTORY;
+            ms->blit_counts[h] = request->count;
+            memcpy(ms->blit_rects[h], capture->rects,
+                request->count * sizeof(MBlitRect));
+
+            struct mflinger_blit_slot *slot =
+                find_blit_slot(ms, ms->locked_handle);
+            if (slot->filled == 0 || blit - slot->filled > BLIT_HISTORY) {
+                MBlitRect all = { 0, 0, capture->width, capture->height };
+                blit_rect(capture, &ms->locked_buffer, &all);
+            } else {
+                uint64_t b;
+                uint32_t i;
+                for (b = slot->filled + 1; b <= blit; ++b) {
+                    h = b % BLIT_HISTORY;
+                    for (i = 0; i < ms->blit_counts[h]; ++i) {
+                        blit_rect(capture, &ms->locked_buffer,
+                            &ms->blit_rects[h][i]);
+                    }
+                }
+            }
+            slot->filled = blit;
+            response.result = 0;
+        }
+    }
+
+    /* done with the capture, let the client get on with the next one */
+    send_reply(sockfd, &response, sizeof(response), -1);
+
+    if (response.result == 0 && post_surface(state, ms, request->id) != NO_ERROR) {
+        ALOGE("failed to post buffer");
+        return -1;
+    }
+    return response.result;
+}
+
+static int destroyBuffer(const int sockfd, struct mflinger_state *state,
+        const MDestroyBufferRequest *request) {
+    ALOGD_IF(DEBUG, "[destroyBuffer] requested id = %d", request->id);
+
+    struct mflinger_surface *ms = lookup_surface(state, request->id);
+    if (ms == NULL) {
+        ALOGW("ignoring destroy request for invalid surface id: %d\n", request->id);
+        return -1;
+    }
+
+    free_slot(state, ms - &state->surfaces[0]);
+    return 0;
+}
+
+static int selectEvents(const int sockfd, struct mflinger_state *state,
+        const MSelectEventsRequest *request) {
+    ALOGD_IF(DEBUG, "[selectEvents] id = %d mask = 0x%x",
+        request->id, request->mask);
+
+    struct mflinger_surface *ms = lookup_surface(state, request->id);
+    if (ms == NULL) {
+        ALOGW("ignoring select events request for invalid surface id: %d\n",
+            request->id);
+        return -1;
+    }
+
+    ms->event_mask = request->mask;
+    return 0;
+}
+
+/**
+ * Changes from before the call are already in what the client gets
+ * back from getDisplayInfo() and listDisplays(), so they aren't sent.
+ */
+static int selectDisplayEvents(const int sockfd, struct mflinger_state *state,
+        const MSelectDisplayEventsRequest *request) {
+    ALOGD_IF(DEBUG, "[selectDisplayEvents] mask = 0x%x", request->mask);
+
+    refresh_displays(state);
+    state->changed_displays = 0;
+    state->display_event_mask = request->mask;
+    return 0;
+}
+
+static void purge_surfaces(struct mflinger_state *state) {
+    int32_t idx;
+    for (idx = 0; idx < (int32_t)state->surfaces.size(); ++idx) {
+        if (state->surfaces[idx].sc != NULL) {
+            free_slot(state, idx);
+        }
     }
 }
 
 static void reset_state(struct mflinger_state *state) {
     purge_surfaces(state);
+    state->pending_frames.clear();
+    state->display_event_mask = 0;
+    state->session_token = 0;
+}
+
+/**
+ * The client went away without ending its session. Leave its surfaces
+ * on screen as they are for M_SESSION_GRACE_MS, but forget everything
+ * that was only good for this connection.
+ */
+static void keep_session(struct mflinger_state *state) {
+    size_t idx;
+    for (idx = 0; idx < state->surfaces.size(); ++idx) {
+        struct mflinger_surface *ms = &state->surfaces[idx];
+        if (ms->sc != NULL) {
+            /* the next client has no mappings */
+            reset_buffer_slots(ms);
+            ms->event_mask = 0;
+        }
+    }
+    state->pending_frames.clear();
+    state->display_event_mask = 0;
+    state->session_expires = systemTime(SYSTEM_TIME_MONOTONIC) +
+        ms2ns(M_SESSION_GRACE_MS);
+
+    ALOGI("Keeping %d surfaces for %d ms", state->num_surfaces,
+        M_SESSION_GRACE_MS);
+}
+
+static void drop_session(struct mflinger_state *state) {
+    purge_surfaces(state);
+    state->session_token = 0;
+    state->session_expires = 0;
+}
 
-    /* look for new displays for the next client */
-    state->layerstack = -1;
+/**
+ * @return a token for a new session, never 0
+ */
+static uint64_t new_session_token() {
+    uint64_t token = 0;
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        if (read(fd, &token, sizeof(token)) != sizeof(token)) {
+            token = 0;
+        }
+        close(fd);
+    }
+    if (token == 0) {
+        /* it only has to tell sessions apart */
+        token = (uint64_t)systemTime(SYSTEM_TIME_MONOTONIC) ^
+            ((uint64_t)getpid() << 32);
+    }
+    return token != 0 ? token : 1;
+}
+
+static int resumeSession(const int sockfd, struct mflinger_state *state,
+        const MResumeSessionRequest *request) {
+    uint64_t token = ((uint64_t)request->token_hi << 32) | request->token_lo;
+    uint32_t count = request->count < M_SESSION_MAX_BUFFERS ?
+        request->count : M_SESSION_MAX_BUFFERS;
+    ALOGD_IF(DEBUG, "[resumeSession] %u buffers", count);
+
+    int resumed = token != 0 && token == state->session_token;
+    uint32_t i;
+    if (resumed && state->session_expires != 0) {
+        /* whatever the new client doesn't take back goes */
+        int32_t idx;
+        for (idx = 0; idx < (int32_t)state->surfaces.size(); ++idx) {
+            struct mflinger_surface *ms = &state->surfaces[idx];
+            if (ms->sc == NULL) {
+                continue;
+            }
+            for (i = 0; i < count &&
+                    lookup_surface(state, request->ids[i]) != ms; ++i) {
+            }
+            if (i == count) {
+                free_slot(state, idx);
+            }
+        }
+    } else if (!resumed) {
+        if (state->session_expires != 0) {
+            drop_session(state);
+        }
+        state->session_token = new_session_token();
+    }
+    state->session_expires = 0;
+
+    MResumeSessionResponse response;
+    memset(&response, 0, sizeof(response));
+    response.token = state->session_token;
+    for (i = 0; resumed && i < count; ++i) {
+        struct mflinger_surface *ms = lookup_surface(state, request->ids[i]);
+        if (ms != NULL) {
+            response.resumed |= 1u << i;
+            response.buffers[i].width = ms->width;
+            response.buffers[i].height = ms->height;
+            response.buffers[i].display = ms->display;
+        }
+    }
+
+    ALOGI("%s session, %d surfaces", resumed ? "Resumed" : "New",
+        state->num_surfaces);
+    if (send_reply(sockfd, &response, sizeof(response), -1) < 0) {
+        ALOGE("Failed to write resumeSession response: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int endSession(const int sockfd, struct mflinger_state *state) {
+    ALOGD_IF(DEBUG, "[endSession]");
+    state->session_token = 0;
+    return 0;
+}
+
+static void dispatch(const int cfd, struct mflinger_state *state,
+        const uint32_t op, const void *payload) {
+    ALOGD_IF(DEBUG, "op: %u", op);
+
+    /* a client that doesn't resume the session first doesn't want it */
+    if (state->session_expires != 0 && op != M_RESUME_SESSION) {
+        ALOGI("Session not resumed, dropping %d surfaces",
+            state->num_surfaces);
+        drop_session(state);
+    }
+
+    switch (op) {
+        case M_GET_DISPLAY_INFO:
+            ALOGD_IF(DEBUG, "Get display info request!");
+            getDisplayInfo(cfd, state);
+            break;
+
+        case M_LIST_DISPLAYS:
+            ALOGD_IF(DEBUG, "List displays request!");
+            listDisplays(cfd, state);
+            break;
+
+        case M_CREATE_BUFFER:
+            ALOGD_IF(DEBUG, "Create buffer request!");
+            createBuffer(cfd, state, (const MCreateBufferRequest *)payload);
+            break;
+
+        case M_UPDATE_BUFFER:
+            ALOGD_IF(DEBUG, "Update buffer request!");
+            updateBuffer(cfd, state, (const MUpdateBufferRequest *)payload);
+            break;
+
+        case M_RESIZE_BUFFER:
+            ALOGD_IF(DEBUG, "Resize buffer request!");
+            resizeBuffer(cfd, state, (const MResizeBufferRequest *)payload);
+            break;
+
+        case M_SCALE_BUFFER:
+            ALOGD_IF(DEBUG, "Scale buffer request!");
+            scaleBuffer(cfd, state, (const MScaleBufferRequest *)payload);
+            break;
+
+        case M_RESTACK_BUFFER:
+            ALOGD_IF(DEBUG, "Restack buffer request!");
+            restackBuffer(cfd, state, (const MRestackBufferRequest *)payload);
+            break;
+
+        case M_SHOW_BUFFER:
+            ALOGD_IF(DEBUG, "Show buffer request!");
+            showBuffer(cfd, state, (const MShowBufferRequest *)payload);
+            break;
+
+        case M_DESTROY_BUFFER:
+            ALOGD_IF(DEBUG, "Destroy buffer request!");
+            destroyBuffer(cfd, state, (const MDestroyBufferRequest *)payload);
+            break;
+
+        case M_LOCK_BUFFER:
+            ALOGD_IF(DEBUG, "Lock buffer request!");
+            lockBuffer(cfd, state, (const MLockBufferRequest *)payload);
+            break;
+
+        case M_UNLOCK_AND_POST_BUFFER:
+            ALOGD_IF(DEBUG, "Unlock and post buffer request!");
+            unlockAndPostBuffer(cfd, state,
+                (const MUnlockBufferRequest *)payload);
+            break;
+
+        case M_SWAP_BUFFER:
+            ALOGD_IF(DEBUG, "Swap buffer request!");
+            swapBuffer(cfd, state, (const MSwapBufferRequest *)payload);
+            break;
+
+        case M_SELECT_EVENTS:
+            ALOGD_IF(DEBUG, "Select events request!");
+            selectEvents(cfd, state, (const MSelectEventsRequest *)payload);
+            break;
+
+        case M_SELECT_DISPLAY_EVENTS:
+            ALOGD_IF(DEBUG, "Select display events request!");
+            selectDisplayEvents(cfd, state,
+                (const MSelectDisplayEventsRequest *)payload);
+            break;
+
+        case M_RESUME_SESSION:
+            ALOGD_IF(DEBUG, "Resume session request!");
+            resumeSession(cfd, state, (const MResumeSessionRequest *)payload);
+            break;
+
+        case M_END_SESSION:
+            ALOGD_IF(DEBUG, "End session request!");
+            endSession(cfd, state);
+            break;
+
+        case M_SHARE_CAPTURE:
+            ALOGD_IF(DEBUG, "Share capture request!");
+            shareCapture(cfd, state,
+                (const struct mflinger_share_capture *)payload);
+            break;
+
+        case M_BLIT_BUFFER:
+            ALOGD_IF(DEBUG, "Blit buffer request!");
+            blitBuffer(cfd, state, (const MBlitBufferRequest *)payload);
+            break;
+
+        /*
+         * WATCH OUT! Every message has to go out in a single
+         * write() or sendmsg() (see send_reply()), otherwise
+         * the client can't tell replies and events apart.
+         */
+    }
+}
+
+/*
+ * The socket is read on a thread of its own, which only parses
+ * requests and queues them up. Everything else, compositor calls and
+ * whatever is sent back, happens on the serve() thread in request
+ * order. A slow transaction then no longer stops the socket from being
+ * drained, and replies can't get out of order since there is a single
+ * writer. Buffer fds are sent from the thread that holds the buffers.
+ */
+struct mflinger_reader {
+    struct MReceiver *receiver;
+    struct MQueue *queue;
+};
+
+/**
+ * Queue an M_SHARE_CAPTURE along with the fd that came with it.
+ */
+static void queue_share_capture(struct mflinger_reader *reader,
+        const void *payload) {
+    struct mflinger_share_capture share;
+    memcpy(&share.request, payload, sizeof(share.request));
+    share.fd = mreceiver_take_fd(reader->receiver);
+    if (mqueue_push(reader->queue, M_SHARE_CAPTURE,
+            &share, sizeof(share)) < 0) {
+        ALOGE("Request %u too big to queue", M_SHARE_CAPTURE);
+        if (share.fd >= 0) {
+            close(share.fd);
+        }
+    }
+}
+
+static void *read_requests(void *arg) {
+    struct mflinger_reader *reader = (struct mflinger_reader *)arg;
+
+    /*
+     * Drain everything the client has sent with one recv() and queue
+     * all complete requests from the buffer. A burst of cursor
+     * updates then costs one syscall instead of two per request.
+     */
+    do {
+        int n = mreceiver_fill(reader->receiver);
+        if (n < 0) {
+            ALOGE("Failed to read from socket: %s", strerror(errno));
+            break;
+        } else if (n == 0) {
+            ALOGE("Client closed connection.");
+            break;
+        }
+
+        uint32_t op;
+        const void *payload;
+        int ret;
+        while ((ret = mreceiver_next(reader->receiver, &op, &payload)) > 0) {
+            /*
+             * The first request decides whether a kept session is
+             * resumed, so it can't be overtaken by a move.
+             */
+            int first = reader->receiver->requests == 1;
+            if (op == M_SHARE_CAPTURE) {
+                queue_share_capture(reader, payload);
+            } else if ((first ?
+                    mqueue_push_in_order(reader->queue, op, payload,
+                        mreceiver_request_size(op)) :
+                    mqueue_push(reader->queue, op, payload,
+                        mreceiver_request_size(op))) < 0) {
+                ALOGE("Request %u too big to queue", op);
+            }
+        }
+        mqueue_wake(reader->queue);
+
+        if (ret < 0) {
+            /* without a size we can't find the next request */
+            ALOGE("Unrecognized request %u, dropping client", op);
+            break;
+        }
+    } while (1);
+
+    /* whatever was queued before still runs */
+    mqueue_push(reader->queue, M_QUEUE_HANGUP, NULL, 0);
+    mqueue_wake(reader->queue);
+    return NULL;
+}
+
+/**
+ * Apply the position updates that skipped the queue. They go through
+ * dispatch() like any other request, but only once the first request
+ * settled the session: moves can't come before it.
+ */
+static void move_surfaces(const int cfd, struct mflinger_state *state,
+        struct MQueue *queue) {
+    if (state->session_expires != 0) {
+        return;
+    }
+
+    MUpdateBufferRequest positions[M_QUEUE_POSITIONS];
+    int i, n = mqueue_take_positions(queue, positions);
+    for (i = 0; i < n; ++i) {
+        dispatch(cfd, state, M_UPDATE_BUFFER, &positions[i]);
+    }
 }
 
 static void serve(const int sockfd, struct mflinger_state *state) {
@@ -401,6 +1818,18 @@ static void serve(const int sockfd, struct mflinger_state *state) {
 
     ALOGD_IF(DEBUG, "Listening for client requests...");
 
+    /* surfaces kept for a client that went away only wait so long */
+    if (state->session_expires != 0) {
+        nsecs_t left = state->session_expires -
+            systemTime(SYSTEM_TIME_MONOTONIC);
+        struct pollfd pfd = { sockfd, POLLIN, 0 };
+        if (left <= 0 || poll(&pfd, 1, ns2ms(left) + 1) == 0) {
+            ALOGI("Session expired, dropping %d surfaces",
+                state->num_surfaces);
+            drop_session(state);
+        }
+    }
+
     t = sizeof(remote);
     cfd = accept(sockfd, (struct sockaddr *)&remote, &t);
     if (cfd < 0) {
@@ -408,81 +1837,95 @@ static void serve(const int sockfd, struct mflinger_state *state) {
         return;
     }
 
-    do {
-        int n;
-        uint32_t buf;
-        n = read(cfd, &buf, sizeof(buf));
+    static struct MReceiver receiver;
+    mreceiver_init(&receiver, cfd);
 
-        if (n < 0) {
-            ALOGE("Failed to read from socket: %s", strerror(errno));
+    static struct MQueue queue;
+    if (mqueue_init(&queue) < 0) {
+        ALOGE("Failed to set up request queue: %s", strerror(errno));
+        close(cfd);
+        return;
+    }
 
-            // client hung up with unread data
-            if (errno == -ECONNRESET) {
-                break;
-            }
-        } else if (n == 0) {
-            ALOGE("Client closed connection.");
-            break;
+    struct mflinger_reader reader = { &receiver, &queue };
+    pthread_t reader_thread;
+    if (pthread_create(&reader_thread, NULL, read_requests, &reader) != 0) {
+        ALOGE("Failed to start reader thread");
+        mqueue_destroy(&queue);
+        close(cfd);
+        return;
+    }
+
+    int hangup = 0;
+    while (!hangup) {
+        /*
+         * Wake up every quarter refresh while frames wait for their
+         * present time, the client schedules its next capture off it.
+         * Otherwise only wake up to check the displays.
+         */
+        int timeout_ms = -1;
+        if (!state->pending_frames.empty()) {
+            timeout_ms = state->refresh_ns / 4000000 + 1;
+        } else if (state->num_surfaces > 0 || state->display_event_mask != 0) {
+            timeout_ms = DISPLAY_CHECK_NS / 1000000;
         }
 
-        ALOGD_IF(DEBUG, "n: %d", n);
-        ALOGD_IF(DEBUG, "buf: %d", buf);
-        switch (buf) {
-            case M_GET_DISPLAY_INFO:
-                ALOGD_IF(DEBUG, "Get display info request!");
-                getDisplayInfo(cfd);
-                break;
-
-            case M_CREATE_BUFFER:
-                ALOGD_IF(DEBUG, "Create buffer request!");
-                createBuffer(cfd, state);
-                break;
-
-            case M_UPDATE_BUFFER:
-                ALOGD_IF(DEBUG, "Update buffer request!");
-                updateBuffer(cfd, state);
-                break;
-
-            case M_RESIZE_BUFFER:
-                ALOGD_IF(DEBUG, "Resize buffer request!");
-                resizeBuffer(cfd, state);
-                break;
-
-            case M_LOCK_BUFFER:
-                ALOGD_IF(DEBUG, "Lock buffer request!");
-                lockBuffer(cfd, state);
-                break;
-
-            case M_UNLOCK_AND_POST_BUFFER:
-                ALOGD_IF(DEBUG, "Unlock and post buffer request!");
-                unlockAndPostBuffer(cfd, state);
-                break;
-
-            default:
-                ALOGW("Unrecognized request");
-                /*
-                 * WATCH OUT! Using write() AND sendmsg() at the
-                 * same time to send a reply can result in mixed up
-                 * order on the client-side when calling recvmsg() 
-                 * and parsing the main data buffer.
-                 * Basically, don't mix calls to write() and writev().
-                 */
-                // if (write(cfd, ACK, strlen(ACK) + 1) < 0) {
-                //     ALOGE("Failed to write socket ACK: %s", strerror(errno));
-                // }
-                break;
+        if (mqueue_wait(&queue, timeout_ms)) {
+            /* moves go first, and again whenever more come in */
+            move_surfaces(cfd, state, &queue);
+
+            struct MQueuedRequest request;
+            while (mqueue_pop(&queue, &request)) {
+                if (request.op == M_QUEUE_HANGUP) {
+                    hangup = 1;
+                    break;
+                }
+                dispatch(cfd, state, request.op, request.payload);
+                move_surfaces(cfd, state, &queue);
+            }
         }
-    } while (1);
 
-    reset_state(state);
+        send_presented(cfd, state);
+        check_display(state);
+        send_display_changes(cfd, state);
+    }
+
+    pthread_join(reader_thread, NULL);
+    move_surfaces(cfd, state, &queue);
+    mreceiver_release(&receiver);
+    unshare_capture(state);
+
+    ALOGI("Client served %llu requests with %llu reads, "
+        "%llu moves coalesced, %llu waits for the compositor",
+        (unsigned long long)receiver.requests,
+        (unsigned long long)receiver.syscalls,
+        (unsigned long long)queue.coalesced,
+        (unsigned long long)queue.full_waits);
+    mqueue_destroy(&queue);
+
+    if (state->session_token != 0 && state->num_surfaces > 0) {
+        keep_session(state);
+    } else {
+        reset_state(state);
+    }
     close(cfd);
 }
 
 int main() {
 
     struct mflinger_state state;
+    state.free_head = -1;
     state.num_surfaces = 0;
-    state.layerstack = -1;
+    state.next_z = 0;
+    memset(state.displays, 0, sizeof(state.displays));
+    state.last_display_check = 0;
+    state.changed_displays = 0;
+    state.display_event_mask = 0;
+    state.refresh_ns = DEFAULT_REFRESH_NS;
+    state.last_present = 0;
+    state.session_token = 0;
+    state.session_expires = 0;
+    memset(&state.capture, 0, sizeof(state.capture));
 
     //
     // Establish a connection with SurfaceFlinger
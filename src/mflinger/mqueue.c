@@ -0,0 +1,209 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+#include "mqueue.h"
+
+int mqueue_init(struct MQueue *q) {
+    q->head = q->tail = 0;
+    q->producer_waiting = 0;
+    q->num_positions = 0;
+    q->ring_moves_end = 0;
+    q->coalesced = q->full_waits = 0;
+    pthread_mutex_init(&q->position_lock, NULL);
+
+    q->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    q->space_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (q->wake_fd < 0 || q->space_fd < 0) {
+        mqueue_destroy(q);
+        return -1;
+    }
+    return 0;
+}
+
+void mqueue_destroy(struct MQueue *q) {
+    if (q->wake_fd >= 0) {
+        close(q->wake_fd);
+        q->wake_fd = -1;
+    }
+    if (q->space_fd >= 0) {
+        close(q->space_fd);
+        q->space_fd = -1;
+    }
+    pthread_mutex_destroy(&q->position_lock);
+}
+
+static void signal_fd(int fd) {
+    uint64_t one = 1;
+    while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR) {
+    }
+}
+
+/**
+ * Wait for @param fd to be signaled and reset it.
+ *
+ * @return 1 if it was, 0 on timeout
+ */
+static int wait_fd(int fd, int timeout_ms) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    int ready;
+    do {
+        ready = poll(&pfd, 1, timeout_ms);
+    } while (ready < 0 && errno == EINTR);
+    if (ready <= 0) {
+        return 0;
+    }
+
+    uint64_t count;
+    while (read(fd, &count, sizeof(count)) < 0 && errno == EINTR) {
+    }
+    return 1;
+}
+
+/**
+ * Keep only the newest position of each buffer.
+ *
+ * @return 0 if @param request is taken care of, -1 if the fast lane
+ * is full
+ */
+static int push_position(struct MQueue *q, const MUpdateBufferRequest *request) {
+    int ret = -1;
+    pthread_mutex_lock(&q->position_lock);
+
+    uint32_t i;
+    for (i = 0; i < q->num_positions; ++i) {
+        if (q->positions[i].id == request->id) {
+            q->positions[i] = *request;
+            ++q->coalesced;
+            ret = 0;
+            break;
+        }
+    }
+    if (ret < 0 && q->num_positions < M_QUEUE_POSITIONS) {
+        q->positions[q->num_positions] = *request;
+        __atomic_store_n(&q->num_positions, q->num_positions + 1,
+            __ATOMIC_RELAXED);
+        ret = 0;
+    }
+
+    pthread_mutex_unlock(&q->position_lock);
+    return ret;
+}
+
+/**
+ * @return 1 if a move pushed through the ring hasn't been popped yet
+ */
+static int moves_in_ring(const struct MQueue *q) {
+    return (int32_t)(q->ring_moves_end -
+        __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) > 0;
+}
+
+int mqueue_push(struct MQueue *q, uint32_t op, const void *payload,
+        int size) {
+    if (op == M_UPDATE_BUFFER && size == sizeof(MUpdateBufferRequest) &&
+            !moves_in_ring(q)) {
+        MUpdateBufferRequest request;
+        memcpy(&request, payload, sizeof(request));
+        if (push_position(q, &request) == 0) {
+            return 0;
+        }
+    }
+    return mqueue_push_in_order(q, op, payload, size);
+}
+
+int mqueue_push_in_order(struct MQueue *q, uint32_t op, const void *payload,
+        int size) {
+    if (size < 0 || size > M_QUEUE_MAX_PAYLOAD) {
+        return -1;
+    }
+
+    /*
+     * Full. Make sure the consumer is working on it, then sleep until
+     * it pops something. The flag is set before the last look at the
+     * ring and read after every pop, so one of the two sides sees the
+     * other.
+     */
+    while (q->tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) ==
+            M_QUEUE_SIZE) {
+        ++q->full_waits;
+        mqueue_wake(q);
+        __atomic_store_n(&q->producer_waiting, 1, __ATOMIC_SEQ_CST);
+        if (q->tail - __atomic_load_n(&q->head, __ATOMIC_SEQ_CST) ==
+                M_QUEUE_SIZE) {
+            wait_fd(q->space_fd, -1);
+        }
+        __atomic_store_n(&q->producer_waiting, 0, __ATOMIC_RELAXED);
+    }
+
+    struct MQueuedRequest *slot = &q->ring[q->tail & (M_QUEUE_SIZE - 1)];
+    slot->op = op;
+    if (size > 0) {
+        memcpy(slot->payload, payload, size);
+    }
+    if (op == M_UPDATE_BUFFER) {
+        q->ring_moves_end = q->tail + 1;
+    }
+    __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void mqueue_wake(struct MQueue *q) {
+    signal_fd(q->wake_fd);
+}
+
+int mqueue_pop(struct MQueue *q, struct MQueuedRequest *req) {
+    if (__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == q->head) {
+        return 0;
+    }
+
+    *req = q->ring[q->head & (M_QUEUE_SIZE - 1)];
+    __atomic_store_n(&q->head, q->head + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&q->producer_waiting, __ATOMIC_SEQ_CST)) {
+        signal_fd(q->space_fd);
+    }
+    return 1;
+}
+
+int mqueue_take_positions(struct MQueue *q,
+        MUpdateBufferRequest *positions) {
+    /* the common case, nobody moved anything */
+    if (__atomic_load_n(&q->num_positions, __ATOMIC_RELAXED) == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&q->position_lock);
+    int n = q->num_positions;
+    memcpy(positions, q->positions, n * sizeof(positions[0]));
+    __atomic_store_n(&q->num_positions, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&q->position_lock);
+    return n;
+}
+
+int mqueue_wait(struct MQueue *q, int timeout_ms) {
+    if (__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) != q->head ||
+            __atomic_load_n(&q->num_positions, __ATOMIC_RELAXED) != 0) {
+        return 1;
+    }
+    return wait_fd(q->wake_fd, timeout_ms);
+}
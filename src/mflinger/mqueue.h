@@ -0,0 +1,139 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_QUEUE_H
+#define M_QUEUE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "mlib.h"
+#include "mlib-protocol.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Hands requests from mflinger's socket thread to the thread that
+ * talks to SurfaceFlinger, so a slow compositor call doesn't stop the
+ * socket from being read.
+ *
+ * Requests go through a single-producer single-consumer ring, in
+ * order and without locks. Position updates (M_UPDATE_BUFFER) take a
+ * fast lane instead: only the newest position per buffer is kept, and
+ * the consumer applies them before the next request in the ring, so a
+ * burst of cursor moves behind a slow transaction costs one move. That
+ * reordering is safe, since nothing else depends on a buffer's position
+ * and a client only learns an id from the M_CREATE_BUFFER reply, so a
+ * move never overtakes the creation of the buffer it names. It may
+ * overtake a destroy, which makes it a no-op.
+ *
+ * With M_QUEUE_POSITIONS buffers already waiting to move, updates go
+ * through the ring as usual. Moves of a buffer must not overtake each
+ * other, so once one went through the ring, all moves follow it there
+ * until the consumer has popped it.
+ *
+ * The consumer sleeps on wake_fd when it runs dry. The producer sleeps
+ * on space_fd when the ring is full.
+ */
+#define M_QUEUE_SIZE            (256)       /* power of two */
+#define M_QUEUE_MAX_PAYLOAD     (60)
+#define M_QUEUE_POSITIONS       (8)
+
+/* not an opcode: the socket thread is done, nothing comes after it */
+#define M_QUEUE_HANGUP          (0)
+
+struct MQueuedRequest {
+    uint32_t op;
+    uint8_t payload[M_QUEUE_MAX_PAYLOAD];
+};
+
+struct MQueue {
+    struct MQueuedRequest ring[M_QUEUE_SIZE];
+    uint32_t head;              /* next to pop, written by the consumer */
+    uint32_t tail;              /* next to push, written by the producer */
+    int producer_waiting;
+    int wake_fd;
+    int space_fd;
+
+    pthread_mutex_t position_lock;
+    MUpdateBufferRequest positions[M_QUEUE_POSITIONS];
+    uint32_t num_positions;
+    uint32_t ring_moves_end;    /* tail after the last move in the ring */
+
+    /* stats */
+    uint64_t coalesced;         /* position updates never applied */
+    uint64_t full_waits;        /* times the producer had to wait */
+};
+
+/**
+ * @return 0 on success, -1 if the eventfds can't be created
+ */
+int mqueue_init(struct MQueue *q);
+
+void mqueue_destroy(struct MQueue *q);
+
+/**
+ * Producer: queue a request with @param size bytes of @param payload,
+ * waiting for room if the ring is full. The consumer isn't woken up
+ * until mqueue_wake().
+ *
+ * @return 0 on success, -1 if the payload is too big
+ */
+int mqueue_push(struct MQueue *q, uint32_t op, const void *payload,
+        int size);
+
+/**
+ * Producer: like mqueue_push(), but a position update goes through the
+ * ring too, so nothing pushed after it can be applied first.
+ */
+int mqueue_push_in_order(struct MQueue *q, uint32_t op, const void *payload,
+        int size);
+
+/**
+ * Producer: wake the consumer up for everything pushed so far.
+ */
+void mqueue_wake(struct MQueue *q);
+
+/**
+ * Consumer: take the oldest request in the ring without blocking.
+ *
+ * @return 1 if @param req was filled in, 0 if the ring is empty
+ */
+int mqueue_pop(struct MQueue *q, struct MQueuedRequest *req);
+
+/**
+ * Consumer: take the waiting position updates, at most
+ * M_QUEUE_POSITIONS of them.
+ *
+ * @return how many were written to @param positions
+ */
+int mqueue_take_positions(struct MQueue *q, MUpdateBufferRequest *positions);
+
+/**
+ * Consumer: wait up to @param timeout_ms (-1 = forever) for something
+ * to do.
+ *
+ * @return 1 if there is, 0 on timeout
+ */
+int mqueue_wait(struct MQueue *q, int timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // M_QUEUE_H
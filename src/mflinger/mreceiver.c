@@ -0,0 +1,159 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "mlib.h"
+#include "mlib-protocol.h"
+#include "mreceiver.h"
+
+void mreceiver_init(struct MReceiver *r, int fd) {
+    r->fd = fd;
+    r->head = r->tail = 0;
+    r->syscalls = r->requests = 0;
+    r->num_fds = 0;
+}
+
+void mreceiver_release(struct MReceiver *r) {
+    int fd;
+    while ((fd = mreceiver_take_fd(r)) >= 0) {
+        close(fd);
+    }
+}
+
+int mreceiver_request_size(uint32_t op) {
+    switch (op) {
+        /* empty struct, spelled out since C and C++ disagree on its size */
+        case M_GET_DISPLAY_INFO:        return 0;
+        case M_CREATE_BUFFER:           return sizeof(MCreateBufferRequest);
+        case M_UPDATE_BUFFER:           return sizeof(MUpdateBufferRequest);
+        case M_LOCK_BUFFER:             return sizeof(MLockBufferRequest);
+        case M_UNLOCK_AND_POST_BUFFER:  return sizeof(MUnlockBufferRequest);
+        case M_RESIZE_BUFFER:           return sizeof(MResizeBufferRequest);
+        case M_SCALE_BUFFER:            return sizeof(MScaleBufferRequest);
+        case M_RESTACK_BUFFER:          return sizeof(MRestackBufferRequest);
+        case M_SHOW_BUFFER:             return sizeof(MShowBufferRequest);
+        case M_DESTROY_BUFFER:          return sizeof(MDestroyBufferRequest);
+        case M_SWAP_BUFFER:             return sizeof(MSwapBufferRequest);
+        case M_SELECT_EVENTS:           return sizeof(MSelectEventsRequest);
+        case M_LIST_DISPLAYS:           return sizeof(MListDisplaysRequest);
+        case M_SELECT_DISPLAY_EVENTS:   return sizeof(MSelectDisplayEventsRequest);
+        case M_RESUME_SESSION:          return sizeof(MResumeSessionRequest);
+        case M_END_SESSION:             return 0;
+        case M_SHARE_CAPTURE:           return sizeof(MShareCaptureRequest);
+        case M_BLIT_BUFFER:             return sizeof(MBlitBufferRequest);
+        default:                        return -1;
+    }
+}
+
+int mreceiver_fill(struct MReceiver *r) {
+    /* move a partial request to the front to make room behind it */
+    if (r->head > 0) {
+        memmove(r->buf, r->buf + r->head, r->tail - r->head);
+        r->tail -= r->head;
+        r->head = 0;
+    }
+
+    struct msghdr msgh;
+    struct iovec iov;
+    union {
+        char buf[CMSG_SPACE(M_RECEIVER_MAX_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    ssize_t n;
+    do {
+        memset(&msgh, 0, sizeof(msgh));
+        iov.iov_base = r->buf + r->tail;
+        iov.iov_len = sizeof(r->buf) - r->tail;
+        msgh.msg_iov = &iov;
+        msgh.msg_iovlen = 1;
+        msgh.msg_control = control.buf;
+        msgh.msg_controllen = sizeof(control.buf);
+
+        r->syscalls++;
+        n = recvmsg(r->fd, &msgh, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+
+    if (n <= 0) {
+        return n;
+    }
+    r->tail += n;
+
+    struct cmsghdr *cmsg;
+    for (cmsg = CMSG_FIRSTHDR(&msgh); cmsg != NULL;
+            cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+
+        int i, count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < count; ++i) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (r->num_fds < M_RECEIVER_MAX_FDS) {
+                r->fds[r->num_fds++] = fd;
+            } else {
+                /* no request takes that many, the client is confused */
+                close(fd);
+            }
+        }
+    }
+    return n;
+}
+
+int mreceiver_take_fd(struct MReceiver *r) {
+    if (r->num_fds == 0) {
+        return -1;
+    }
+
+    int fd = r->fds[0];
+    memmove(r->fds, r->fds + 1, (r->num_fds - 1) * sizeof(int));
+    r->num_fds--;
+    return fd;
+}
+
+int mreceiver_next(struct MReceiver *r, uint32_t *op_ret,
+        const void **payload_ret) {
+    uint32_t avail = r->tail - r->head;
+
+    MRequestHeader header;
+    if (avail < sizeof(header)) {
+        return 0;
+    }
+    memcpy(&header, r->buf + r->head, sizeof(header));
+
+    *op_ret = header.op;
+    int size = mreceiver_request_size(header.op);
+    if (size < 0) {
+        return -1;
+    }
+    if (avail < sizeof(header) + size) {
+        return 0;
+    }
+
+    *payload_ret = r->buf + r->head + sizeof(header);
+    r->head += sizeof(header) + size;
+    r->requests++;
+    return 1;
+}
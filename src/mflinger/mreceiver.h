@@ -0,0 +1,100 @@
+/*
+ * Copyright 2016 The Maru OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_RECEIVER_H
+#define M_RECEIVER_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Buffered request reader for the server side of a connection.
+ *
+ * Instead of one read() for the opcode and another for the payload,
+ * the receiver pulls in everything the socket has with a single recv()
+ * and hands out complete requests straight from its buffer until it
+ * runs dry. A request split across reads stays in the buffer until the
+ * rest of it arrives.
+ *
+ * Requests are framed by the payload size of their opcode, see
+ * mreceiver_request_size().
+ *
+ * Fds that come along (M_SHARE_CAPTURE) are kept in arrival order
+ * until the request they belong to takes them, see mreceiver_take_fd().
+ */
+#define M_RECEIVER_SIZE (4096)
+#define M_RECEIVER_MAX_FDS (4)
+
+struct MReceiver {
+    int fd;
+    uint32_t head;              /* start of the first unparsed byte */
+    uint32_t tail;              /* end of received data */
+    uint64_t syscalls;          /* recv() calls made */
+    uint64_t requests;          /* requests handed out */
+    int fds[M_RECEIVER_MAX_FDS];
+    uint32_t num_fds;
+    uint8_t buf[M_RECEIVER_SIZE];
+};
+
+void mreceiver_init(struct MReceiver *r, int fd);
+
+/**
+ * Close any fds nobody took.
+ */
+void mreceiver_release(struct MReceiver *r);
+
+/**
+ * @return payload size of requests with opcode @param op,
+ * or -1 for an unknown opcode
+ */
+int mreceiver_request_size(uint32_t op);
+
+/**
+ * Receive whatever the socket has with a single recv(), blocking if it
+ * has nothing yet.
+ *
+ * @return bytes received, 0 if the peer hung up, -1 on error
+ */
+int mreceiver_fill(struct MReceiver *r);
+
+/**
+ * Take the next complete request out of the buffer.
+ *
+ * @param payload_ret points into the receiver and is only valid
+ * until the next mreceiver_fill()
+ *
+ * @return 1 if a request was returned, 0 if more data is needed,
+ * -1 if the stream is corrupt (unknown opcode, left in @param op_ret)
+ */
+int mreceiver_next(struct MReceiver *r, uint32_t *op_ret,
+        const void **payload_ret);
+
+/**
+ * Take the oldest fd received, for a request that carries one. It is
+ * the caller's to close from then on.
+ *
+ * @return the fd, or -1 if none came
+ */
+int mreceiver_take_fd(struct MReceiver *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // M_RECEIVER_H
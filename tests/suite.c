@@ -1,8 +1,34 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #include "../src/mclient/util.h"
+#include "../src/mclient/pixel.h"
+#include "../src/mclient/rect.h"
+#include "../src/mclient/frame_pacer.h"
+#include "../src/mclient/cursor_predictor.h"
+#include "../src/mclient/damage_stats.h"
+#include "../src/mclient/rate_controller.h"
+#include "../src/mclient/scroll_tracker.h"
+#include "../src/mclient/overlay_detector.h"
+#include "../src/mclient/mloop.h"
+#include "../src/mclient/msession.h"
+#include "../src/mclient/mcursor_cache.h"
+#include "../src/mclient/mtrace.h"
+#include "../src/mflinger/mqueue.h"
+#include "../src/mflinger/mreceiver.h"
+#include "mlib.h"
+#include "mlib-protocol.h"
 
 static void test_argb8888_get_alpha() {
     /* ARGB8888 is from MSB to LSB */
@@ -17,8 +43,1392 @@ static void test_argb8888_get_alpha() {
     }
 }
 
+static void test_box_downsample_32() {
+    /* 4x2 source, rows padded to 5 px */
+    uint32_t src[2][5] = {
+        { 0x00000000, 0x04040404, 0xff000000, 0xff0000ff, 0xdeadbeef },
+        { 0x02020202, 0x02020202, 0xff0000ff, 0xff000000, 0xdeadbeef },
+    };
+    uint32_t dst[2] = { 0 };
+
+    box_downsample_32((uint8_t *)dst, sizeof(dst),
+        (uint8_t *)src, sizeof(src[0]), 2, 1, 2);
+    assert(dst[0] == 0x02020202);
+    assert(dst[1] == 0xff000080);
+
+    /* 3x3 blocks take the non power-of-two path */
+    uint32_t big[3][3];
+    int x, y;
+    for (y = 0; y < 3; ++y) {
+        for (x = 0; x < 3; ++x) {
+            big[y][x] = (y * 3 + x) * 0x01010101;
+        }
+    }
+    box_downsample_32((uint8_t *)dst, sizeof(dst),
+        (uint8_t *)big, sizeof(big[0]), 1, 1, 3);
+    assert(dst[0] == 0x04040404);
+}
+
+static void test_copy_cursor_32() {
+    unsigned long cursor[2 * 3] = {
+        0xff112233, 0x80445566, 0xffaabbcc,
+        0x00000000, 0xff010203, 0xffffffff,
+    };
+    uint32_t dst[2][2];
+    memset(dst, 0xee, sizeof(dst));
+
+    /* 3 px wide cursor clipped to a 2x2 buffer */
+    copy_cursor_32((uint8_t *)dst, sizeof(dst[0]), 2, 2, cursor, 3, 2);
+    assert(dst[0][0] == 0xff112233);
+    assert(dst[0][1] == 0);
+    assert(dst[1][0] == 0);
+    assert(dst[1][1] == 0xff010203);
+}
+
+static void test_pixel_converter() {
+    struct PixelConverter c;
+    uint32_t out[2];
+
+    /* the X default layout is already the surface format */
+    assert(pixel_converter_init(&c, 32, 0xff0000, 0xff00, 0xff) == 0);
+    assert(c.identity);
+    uint32_t bgrx[2] = { 0x00123456, 0x80abcdef };
+    pixel_convert(&c, out, bgrx, 2);
+    assert(out[0] == 0x00123456 && out[1] == 0x80abcdef);
+
+    assert(pixel_converter_init(&c, 32, 0xff, 0xff00, 0xff0000) == 0);
+    assert(!c.identity);
+    uint32_t rgbx[1] = { 0x00563412 };
+    pixel_convert(&c, out, rgbx, 1);
+    assert(out[0] == 0xff123456);
+
+    uint8_t bgr[6] = { 0x56, 0x34, 0x12, 0xff, 0x00, 0x80 };
+    assert(pixel_converter_init(&c, 24, 0xff0000, 0xff00, 0xff) == 0);
+    pixel_convert(&c, out, bgr, 2);
+    assert(out[0] == 0xff123456 && out[1] == 0xff8000ff);
+
+    uint8_t rgb[3] = { 0x12, 0x34, 0x56 };
+    assert(pixel_converter_init(&c, 24, 0xff, 0xff00, 0xff0000) == 0);
+    pixel_convert(&c, out, rgb, 1);
+    assert(out[0] == 0xff123456);
+
+    /* narrow channels widen to the full range */
+    uint16_t rgb565[2] = { 0xffff, 0xf800 };
+    assert(pixel_converter_init(&c, 16, 0xf800, 0x07e0, 0x001f) == 0);
+    pixel_convert(&c, out, rgb565, 2);
+    assert(out[0] == 0xffffffff && out[1] == 0xffff0000);
+
+    uint16_t rgb555[1] = { 0x03e0 };
+    assert(pixel_converter_init(&c, 16, 0x7c00, 0x03e0, 0x001f) == 0);
+    pixel_convert(&c, out, rgb555, 1);
+    assert(out[0] == 0xff00ff00);
+
+    /* 10 bits per channel takes the generic path */
+    uint32_t x2r10g10b10[1] = { (0x3ffu << 20) | (0x200 << 10) | 0x004 };
+    assert(pixel_converter_init(&c, 32,
+        0x3ff00000, 0x000ffc00, 0x000003ff) == 0);
+    pixel_convert(&c, out, x2r10g10b10, 1);
+    assert(out[0] == 0xffff8001);
+
+    /* colormapped and gapped masks can't be converted */
+    assert(pixel_converter_init(&c, 8, 0, 0, 0) < 0);
+    assert(pixel_converter_init(&c, 32, 0xff00ff, 0xff00, 0xff) < 0);
+}
+
+static void test_rect() {
+    struct MRect outer = { 10, 10, 100, 100 };
+    struct MRect inner = { 20, 20, 10, 10 };
+    struct MRect edge = { 100, 100, 20, 20 };
+    struct MRect away = { 110, 0, 10, 10 };
+
+    assert(rect_contains(&outer, &inner));
+    assert(!rect_contains(&outer, &edge));
+    assert(rect_intersects(&outer, &edge));
+    assert(!rect_intersects(&outer, &away));
+
+    struct MRect jitter = { 13, 8, 97, 103 };
+    assert(rect_near(&outer, &jitter, 4));
+    assert(!rect_near(&outer, &jitter, 2));
+}
+
+static void test_overlay_detector() {
+    struct OverlayDetector d;
+    overlay_detector_init(&d, 1920, 1080);
+
+    struct MRect video = { 480, 270, 960, 540 };
+    struct MRect clock = { 1800, 0, 120, 30 };
+    struct MRect menu = { 400, 200, 200, 200 };
+    int overlay_damaged, root_damaged;
+    uint64_t t = 1000;
+
+    /* a steady 30 fps video gets promoted */
+    int i;
+    enum OverlayAction action = OVERLAY_NONE;
+    for (i = 0; i < OVERLAY_PROMOTE_FRAMES; ++i, t += 33) {
+        action = overlay_detector_update(&d, &video, 1, t,
+            &overlay_damaged, &root_damaged);
+    }
+    assert(action == OVERLAY_PROMOTE);
+    assert(overlay_damaged);
+
+    /* video frames no longer touch the root buffer */
+    action = overlay_detector_update(&d, &video, 1, t,
+        &overlay_damaged, &root_damaged);
+    assert(action == OVERLAY_NONE && overlay_damaged && !root_damaged);
+
+    struct MRect both[2] = { video, clock };
+    t += 33;
+    action = overlay_detector_update(&d, both, 2, t,
+        &overlay_damaged, &root_damaged);
+    assert(action == OVERLAY_NONE && overlay_damaged && root_damaged);
+
+    /* a menu drawn across the video edge demotes right away */
+    t += 33;
+    action = overlay_detector_update(&d, &menu, 1, t,
+        &overlay_damaged, &root_damaged);
+    assert(action == OVERLAY_DEMOTE && root_damaged);
+
+    /* a pause longer than the gap starts the count over */
+    for (i = 0; i < OVERLAY_PROMOTE_FRAMES - 1; ++i, t += 33) {
+        overlay_detector_update(&d, &video, 1, t,
+            &overlay_damaged, &root_damaged);
+    }
+    t += OVERLAY_MAX_GAP_MS + 1;
+    action = overlay_detector_update(&d, &video, 1, t,
+        &overlay_damaged, &root_damaged);
+    assert(action == OVERLAY_NONE && d.hits == 1);
+
+    /* once the video stops the overlay times out */
+    for (i = 0; i < OVERLAY_PROMOTE_FRAMES; ++i) {
+        t += 33;
+        overlay_detector_update(&d, &video, 1, t,
+            &overlay_damaged, &root_damaged);
+    }
+    assert(d.active);
+    t += OVERLAY_DEMOTE_MS + 1;
+    action = overlay_detector_update(&d, &clock, 1, t,
+        &overlay_damaged, &root_damaged);
+    assert(action == OVERLAY_DEMOTE && !d.active);
+
+    /* full-screen damage is not worth an overlay */
+    struct MRect screen = { 0, 0, 1920, 1080 };
+    for (i = 0; i < 2 * OVERLAY_PROMOTE_FRAMES; ++i, t += 16) {
+        action = overlay_detector_update(&d, &screen, 1, t,
+            &overlay_damaged, &root_damaged);
+        assert(action == OVERLAY_NONE);
+    }
+}
+
+#define SCROLL_TEST_WIDTH   (256)
+#define SCROLL_TEST_HEIGHT  (200)
+
+/**
+ * A page of unique rows scrolled down by @param offset rows, from
+ * column @param left on. The columns before it don't scroll.
+ */
+static void draw_page(uint32_t *img, uint32_t left, int offset) {
+    uint32_t x, y;
+    for (y = 0; y < SCROLL_TEST_HEIGHT; ++y) {
+        for (x = 0; x < SCROLL_TEST_WIDTH; ++x) {
+            uint32_t row = x < left ? y : y + offset;
+            img[y * SCROLL_TEST_WIDTH + x] = 0xff000000 | (row << 9) | x;
+        }
+    }
+}
+
+/**
+ * Bring @param buf up to @param img like mclient does.
+ *
+ * @return dirty cells copied, -1 for a full copy
+ */
+static int scroll_copy(struct ScrollTracker *t, int slot, uint32_t generation,
+        uint32_t *buf, const uint32_t *img) {
+    int copied = 0;
+    if (scroll_tracker_update_buffer(t, slot, generation, (uint8_t *)buf,
+            SCROLL_TEST_WIDTH) < 0) {
+        memcpy(buf, img, SCROLL_TEST_WIDTH * SCROLL_TEST_HEIGHT * 4);
+        copied = -1;
+    } else {
+        uint32_t y, c;
+        for (y = 0; y < t->height; ++y) {
+            for (c = 0; c < t->cols; ++c) {
+                if (t->dirty[y * t->cols + c]) {
+                    uint32_t x = c * SCROLL_TRACKER_TILE_PX;
+                    memcpy(&buf[y * SCROLL_TEST_WIDTH + x],
+                        &img[y * SCROLL_TEST_WIDTH + x],
+                        SCROLL_TRACKER_TILE_PX * 4);
+                    ++copied;
+                }
+            }
+        }
+    }
+    scroll_tracker_filled(t, slot, generation);
+    return copied;
+}
+
+static void test_scroll_tracker() {
+    static uint32_t img[SCROLL_TEST_WIDTH * SCROLL_TEST_HEIGHT];
+    static uint32_t bufs[2][SCROLL_TEST_WIDTH * SCROLL_TEST_HEIGHT];
+    const size_t size = sizeof(img);
+    const uint32_t bpl = SCROLL_TEST_WIDTH * 4;
+    struct MRect all = { 0, 0, SCROLL_TEST_WIDTH, SCROLL_TEST_HEIGHT };
+
+    struct ScrollTracker t;
+    assert(scroll_tracker_init(&t, SCROLL_TEST_WIDTH, SCROLL_TEST_HEIGHT) == 0);
+    assert(t.cols == 4);
+
+    /* nothing to go on yet, both buffers get everything */
+    draw_page(img, 0, 0);
+    scroll_tracker_on_capture(&t, (uint8_t *)img, bpl, 32);
+    assert(scroll_copy(&t, 0, 7, bufs[0], img) == -1);
+    assert(scroll_copy(&t, 1, 9, bufs[1], img) == -1);
+
+    /* scrolled 10 rows: the rest moves, only the new rows are copied */
+    draw_page(img, 0, 10);
+    scroll_tracker_damage(&t, &all, 1);
+    scroll_tracker_on_capture(&t, (uint8_t *)img, bpl, 32);
+    assert(t.scrolls == 1);
+    const struct ScrollFrame *f = &t.history[t.frame % SCROLL_TRACKER_HISTORY];
+    assert(f->moved && f->move.dy == 10);
+    assert(f->move.row_start == 0 && f->move.row_end == SCROLL_TEST_HEIGHT - 10);
+    assert(f->move.col_start == 0 && f->move.col_end == 4);
+    assert(scroll_copy(&t, 0, 7, bufs[0], img) == 10 * 4);
+    assert(memcmp(bufs[0], img, size) == 0);
+
+    /* the other buffer is two scrolls behind */
+    draw_page(img, 0, 15);
+    scroll_tracker_damage(&t, &all, 1);
+    scroll_tracker_on_capture(&t, (uint8_t *)img, bpl, 32);
+    assert(t.scrolls == 2);
+    assert(scroll_copy(&t, 1, 9, bufs[1], img) == 15 * 4);
+    assert(memcmp(bufs[1], img, size) == 0);
+
+    /* a reallocated slot has to start over */
+    assert(scroll_tracker_update_buffer(&t, 0, 8, (uint8_t *)bufs[0],
+        SCROLL_TEST_WIDTH) < 0);
+
+    /* new content that didn't come from anywhere is just copied */
+    struct MRect corner = { 0, 0, 100, 50 };
+    uint32_t y;
+    for (y = 0; y < 50; ++y) {
+        memset(&img[y * SCROLL_TEST_WIDTH], y, 100 * 4);
+    }
+    scroll_tracker_damage(&t, &corner, 1);
+    scroll_tracker_on_capture(&t, (uint8_t *)img, bpl, 32);
+    assert(t.scrolls == 2);
+    assert(scroll_copy(&t, 1, 9, bufs[1], img) == 50 * 2);
+    assert(memcmp(bufs[1], img, size) == 0);
+
+    /* the first buffer still has to catch up on the last scroll too */
+    assert(scroll_copy(&t, 0, 7, bufs[0], img) == 5 * 4 + 50 * 2);
+    assert(memcmp(bufs[0], img, size) == 0);
+
+    /* after a reset nobody can catch up */
+    scroll_tracker_reset(&t);
+    draw_page(img, 64, 20);
+    scroll_tracker_on_capture(&t, (uint8_t *)img, bpl, 32);
+    assert(scroll_copy(&t, 1, 9, bufs[1], img) == -1);
+
+    /* only part of the screen scrolls back up */
+    struct MRect right = { 64, 0, SCROLL_TEST_WIDTH - 64, SCROLL_TEST_HEIGHT };
+    draw_page(img, 64, 12);
+    scroll_tracker_damage(&t, &right, 1);
+    scroll_tracker_on_capture(&t, (uint8_t *)img, bpl, 32);
+    f = &t.history[t.frame % SCROLL_TRACKER_HISTORY];
+    assert(f->moved && f->move.dy == -8);
+    assert(f->move.col_start == 1 && f->move.col_end == 4);
+    assert(f->move.row_start == 8 && f->move.row_end == SCROLL_TEST_HEIGHT);
+    assert(scroll_copy(&t, 1, 9, bufs[1], img) == 8 * 3);
+    assert(memcmp(bufs[1], img, size) == 0);
+
+    scroll_tracker_free(&t);
+}
+
+static void test_damage_stats() {
+    struct DamageStats s;
+    assert(damage_stats_init(&s, 200, 100) == 0);
+    assert(s.cols == 4 && s.rows == 2);
+
+    /* one small rect in the top left tile, twice in the same frame */
+    struct MRect small = { 10, 10, 20, 10 };
+    damage_stats_add(&s, &small, 1, 1);
+    damage_stats_add(&s, &small, 1, 1);
+    damage_stats_end_frame(&s);
+    assert(s.frames == 1 && s.small_frames == 1 && s.rects == 2);
+    assert(s.tile_frames[0] == 1 && s.tile_area[0] == 400);
+    assert(s.rects_per_frame[1] == 1);
+    assert(s.rect_area[7] == 2);           /* 200 px */
+
+    /* nothing damaged, no frame */
+    damage_stats_end_frame(&s);
+    assert(s.frames == 1);
+
+    /* the whole screen and then some, merged down from 40 rects */
+    struct MRect all = { -10, -10, 300, 300 };
+    damage_stats_add(&s, &all, 1, 40);
+    damage_stats_end_frame(&s);
+    assert(s.frames == 2 && s.small_frames == 1 && s.rects == 42);
+    assert(s.frame_area[DAMAGE_STATS_AREA_BUCKETS - 1] == 1);
+    assert(s.rects_per_frame[5] == 1);
+    assert(s.tile_frames[0] == 2 && s.tile_frames[7] == 1);
+    assert(s.tile_area[0] == 400 + 64 * 64);
+    assert(s.tile_area[7] == (200 - 3 * 64) * (100 - 64));
+
+    char prefix[] = "/tmp/damage-stats-test-XXXXXX";
+    int fd = mkstemp(prefix);
+    assert(fd >= 0);
+    close(fd);
+    assert(damage_stats_write(&s, prefix) == 0);
+
+    /* one byte per tile, brightest where damage was most frequent */
+    char path[64];
+    snprintf(path, sizeof(path), "%s.pgm", prefix);
+    FILE *f = fopen(path, "rb");
+    assert(f != NULL);
+    char pgm[64];
+    size_t n = fread(pgm, 1, sizeof(pgm), f);
+    fclose(f);
+    const char *header = "P5\n4 2\n255\n";
+    assert(n == strlen(header) + 8);
+    assert(memcmp(pgm, header, strlen(header)) == 0);
+    assert((uint8_t)pgm[strlen(header)] == 255);
+    assert((uint8_t)pgm[strlen(header) + 7] == 127);
+    unlink(path);
+
+    snprintf(path, sizeof(path), "%s.json", prefix);
+    f = fopen(path, "r");
+    assert(f != NULL);
+    char json[4096];
+    n = fread(json, 1, sizeof(json) - 1, f);
+    json[n] = '\0';
+    fclose(f);
+    assert(strstr(json, "\"frames\": 2,") != NULL);
+    assert(strstr(json, "\"small_fraction\": 0.5000,") != NULL);
+    assert(strstr(json, "\"tile_frames\": [2, 1, 1, 1, 1, 1, 1, 1]") != NULL);
+    unlink(path);
+    unlink(prefix);
+
+    damage_stats_free(&s);
+}
+
+static void test_mtrace() {
+    char path[] = "/tmp/mtrace-test-XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+
+    assert(mtrace_start(path, 1920, 1080) == 0);
+    mtrace_record(MTRACE_DAMAGE, 10, 20, 300, 400);
+    mtrace_record(MTRACE_CURSOR_POS, -5, 70000, 0, 0);
+    mtrace_stop();
+
+    /* not recording any more */
+    mtrace_record(MTRACE_DAMAGE, 0, 0, 1, 1);
+
+    struct MTraceHeader header;
+    FILE *trace = mtrace_open(path, &header);
+    assert(trace != NULL);
+    assert(header.screen_width == 1920 && header.screen_height == 1080);
+
+    struct MTraceRecord rec;
+    assert(mtrace_next(trace, &rec));
+    assert(rec.type == MTRACE_DAMAGE);
+    assert(rec.x == 10 && rec.y == 20);
+    assert(rec.width == 300 && rec.height == 400);
+
+    /* out-of-range values are clamped, not wrapped */
+    assert(mtrace_next(trace, &rec));
+    assert(rec.type == MTRACE_CURSOR_POS);
+    assert(rec.x == -5 && rec.y == INT16_MAX);
+
+    assert(!mtrace_next(trace, &rec));
+    fclose(trace);
+    unlink(path);
+}
+
+static void test_mreceiver() {
+    int sv[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+    struct MReceiver receiver;
+    mreceiver_init(&receiver, sv[1]);
+
+    struct {
+        MRequestHeader header;
+        MUpdateBufferRequest request;
+    } update = { { M_UPDATE_BUFFER }, { 7, 10, 20 } };
+    MRequestHeader info = { M_GET_DISPLAY_INFO };
+
+    /* two whole requests and the start of a third in one go */
+    uint8_t bytes[2 * sizeof(update) + 6];
+    memcpy(bytes, &update, sizeof(update));
+    memcpy(bytes + sizeof(update), &update, sizeof(update));
+    memcpy(bytes + 2 * sizeof(update), &update, 6);
+    assert(write(sv[0], bytes, sizeof(bytes)) == sizeof(bytes));
+
+    uint32_t op;
+    const void *payload;
+    assert(mreceiver_fill(&receiver) == sizeof(bytes));
+    assert(mreceiver_next(&receiver, &op, &payload) == 1);
+    assert(op == M_UPDATE_BUFFER);
+    assert(((const MUpdateBufferRequest *)payload)->ypos == 20);
+    assert(mreceiver_next(&receiver, &op, &payload) == 1);
+    assert(mreceiver_next(&receiver, &op, &payload) == 0);
+
+    /* the rest of the split request, then one without a payload */
+    assert(write(sv[0], (uint8_t *)&update + 6, sizeof(update) - 6) > 0);
+    assert(write(sv[0], &info, sizeof(info)) == sizeof(info));
+    while (receiver.tail - receiver.head < sizeof(update) + sizeof(info)) {
+        assert(mreceiver_fill(&receiver) > 0);
+    }
+    assert(mreceiver_next(&receiver, &op, &payload) == 1);
+    assert(op == M_UPDATE_BUFFER);
+    assert(((const MUpdateBufferRequest *)payload)->id == 7);
+    assert(mreceiver_next(&receiver, &op, &payload) == 1);
+    assert(op == M_GET_DISPLAY_INFO);
+    assert(receiver.requests == 4);
+
+    /* garbage can't be framed */
+    uint32_t bogus = 0xdeadbeef;
+    assert(write(sv[0], &bogus, sizeof(bogus)) == sizeof(bogus));
+    assert(mreceiver_fill(&receiver) == sizeof(bogus));
+    assert(mreceiver_next(&receiver, &op, &payload) == -1);
+    assert(op == 0xdeadbeef);
+
+    /* hang up */
+    close(sv[0]);
+    assert(mreceiver_fill(&receiver) == 0);
+    close(sv[1]);
+}
+
+/**
+ * Queue a reply as mflinger would send it, with @param fd
+ * attached unless it is -1.
+ */
+static void send_reply(int sock_fd, const void *data, int len, int fd) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } u;
+    MMessageHeader header = { M_REPLY };
+    struct iovec iov[2] = {
+        { &header, sizeof(header) },
+        { (void *)data, len },
+    };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    if (fd >= 0) {
+        msg.msg_control = u.buf;
+        msg.msg_controllen = sizeof(u.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    assert(sendmsg(sock_fd, &msg, 0) == (ssize_t)sizeof(header) + len);
+}
+
+static void test_buffer_slots() {
+    int sv[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    MDisplay dpy = { sv[0] };
+
+    char path[] = "/tmp/mslot-test-XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    unlink(path);
+    assert(ftruncate(fd, 16 * 16 * 4) == 0);
+
+    /* M_CREATE_BUFFER resets the slot table */
+    MCreateBufferResponse created = { 1, 0 };
+    send_reply(sv[1], &created, sizeof(created), -1);
+    MBuffer buf;
+    memset(&buf, 0xa5, sizeof(buf));
+    buf.width = buf.height = 16;
+    assert(MCreateBuffer(&dpy, &buf) == 0);
+    assert(buf.bits == NULL && buf.__slots[0].bits == NULL);
+
+    /* first lock registers the slot */
+    MLockBufferResponse response;
+    memset(&response, 0, sizeof(response));
+    response.width = response.height = response.stride = 16;
+    response.slot = 2;
+    response.generation = 1;
+    response.has_fd = 1;
+    send_reply(sv[1], &response, sizeof(response), fd);
+    assert(MLockBuffer(&dpy, &buf) == 0);
+    assert(buf.bits == buf.__slots[2].bits && buf.bits != NULL);
+    ((uint32_t *)buf.bits)[0] = 0xdeadbeef;
+    void *mapping = buf.bits;
+    assert(MUnlockBuffer(&dpy, &buf) >= 0);
+    assert(buf.bits == NULL);
+
+    /* then no fd, same mapping */
+    response.has_fd = 0;
+    send_reply(sv[1], &response, sizeof(response), -1);
+    assert(MSwapBuffer(&dpy, &buf) == 0);
+    assert(buf.bits == mapping);
+    assert(((uint32_t *)buf.bits)[0] == 0xdeadbeef);
+
+    /* a slot that was never registered or is out of date can't lock */
+    response.slot = 3;
+    send_reply(sv[1], &response, sizeof(response), -1);
+    assert(MSwapBuffer(&dpy, &buf) < 0 && buf.bits == NULL);
+    response.slot = 2;
+    response.generation = 2;
+    send_reply(sv[1], &response, sizeof(response), -1);
+    assert(MLockBuffer(&dpy, &buf) < 0 && buf.bits == NULL);
+    assert(buf.__slots[2].bits == NULL);
+
+    /* a resize drops every mapping */
+    MResizeBufferResponse resized = { 0 };
+    send_reply(sv[1], &resized, sizeof(resized), -1);
+    assert(MResizeBuffer(&dpy, &buf, 8, 8) == 0);
+    assert(buf.__slots[2].bits == NULL);
+
+    /* a mapping that failed is asked for again with the next lock */
+    char junk[256];
+    while (recv(sv[1], junk, sizeof(junk), MSG_DONTWAIT) > 0) {
+        /* requests so far */
+    }
+    int pipe_fds[2];
+    assert(pipe(pipe_fds) == 0);
+    response.slot = 1;
+    response.generation = 3;
+    response.has_fd = 1;
+    send_reply(sv[1], &response, sizeof(response), pipe_fds[0]);
+    assert(MLockBuffer(&dpy, &buf) < 0 && buf.__slots[1].bits == NULL);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+
+    struct {
+        MRequestHeader header;
+        MLockBufferRequest request;
+    } packet;
+    assert(recv(sv[1], &packet, sizeof(packet), 0) == sizeof(packet));
+    response.generation = 4;
+    send_reply(sv[1], &response, sizeof(response), fd);
+    assert(MLockBuffer(&dpy, &buf) == 0 && buf.bits == buf.__slots[1].bits);
+    assert(recv(sv[1], &packet, sizeof(packet), 0) == sizeof(packet));
+    assert(packet.header.op == M_LOCK_BUFFER);
+    assert(packet.request.unmapped & (1u << 1));
+
+    close(fd);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void test_server_blit() {
+    int sv[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    MDisplay dpy = { sv[0] };
+
+    struct MReceiver receiver;
+    mreceiver_init(&receiver, sv[1]);
+    assert(mreceiver_take_fd(&receiver) == -1);
+
+    /* the capture goes over with its fd */
+    MShareCaptureResponse shared = { 0 };
+    send_reply(sv[1], &shared, sizeof(shared), -1);
+    MCapture capture = { 8, 4 };
+    assert(MShareCapture(&dpy, &capture) == 0);
+    assert(capture.bits != NULL && capture.fd >= 0 && capture.stride == 8);
+
+    uint32_t op;
+    const void *payload;
+    assert(mreceiver_fill(&receiver) > 0);
+    assert(mreceiver_next(&receiver, &op, &payload) == 1);
+    assert(op == M_SHARE_CAPTURE);
+    MShareCaptureRequest request;
+    memcpy(&request, payload, sizeof(request));
+    assert(request.width == 8 && request.height == 4);
+    assert(request.stride == 32);
+    assert(request.size == 32 * 4 + M_BLIT_MAX_RECTS * sizeof(MBlitRect));
+
+    int fd = mreceiver_take_fd(&receiver);
+    assert(fd >= 0);
+    assert(mreceiver_take_fd(&receiver) == -1);
+    const uint8_t *server = mmap(NULL, request.size, PROT_READ, MAP_SHARED,
+        fd, 0);
+    assert(server != MAP_FAILED);
+
+    /* sealed, neither side can cut it short under the other */
+    assert(ftruncate(fd, 32) < 0 && errno == EPERM);
+    assert(ftruncate(capture.fd, 32) < 0 && errno == EPERM);
+    close(fd);
+    const MBlitRect *table = (const MBlitRect *)(server + 32 * 4);
+
+    /* what the client draws and the rects are what the server sees */
+    ((uint32_t *)capture.bits)[9] = 0xdeadbeef;
+    MBlitRect rects[M_BLIT_MAX_RECTS + 1] = {
+        { 1, 1, 2, 2 }, { 5, 0, 3, 1 },
+    };
+    MBlitBufferResponse blitted = { 0 };
+    send_reply(sv[1], &blitted, sizeof(blitted), -1);
+    MBuffer buf = { 8, 4, 0, NULL };
+    buf.__id = 3;
+    assert(MBlitBuffer(&dpy, &buf, &capture, rects, 2) == 0);
+    assert(mreceiver_fill(&receiver) > 0);
+    assert(mreceiver_next(&receiver, &op, &payload) == 1);
+    assert(op == M_BLIT_BUFFER);
+    MBlitBufferRequest blit;
+    memcpy(&blit, payload, sizeof(blit));
+    assert(blit.id == 3 && blit.count == 2);
+    assert(((const uint32_t *)server)[9] == 0xdeadbeef);
+    assert(table[0].x == 1 && table[1].x == 5 && table[1].width == 3);
+
+    /* too many rects make one bounding box */
+    int i;
+    for (i = 2; i < M_BLIT_MAX_RECTS + 1; ++i) {
+        rects[i] = rects[0];
+    }
+    rects[M_BLIT_MAX_RECTS].y = 3;
+    send_reply(sv[1], &blitted, sizeof(blitted), -1);
+    assert(MBlitBuffer(&dpy, &buf, &capture, rects, M_BLIT_MAX_RECTS + 1) == 0);
+    assert(mreceiver_fill(&receiver) > 0);
+    assert(mreceiver_next(&receiver, &op, &payload) == 1);
+    memcpy(&blit, payload, sizeof(blit));
+    assert(blit.count == 1);
+    assert(table[0].x == 1 && table[0].y == 0);
+    assert(table[0].width == 7 && table[0].height == 5);
+
+    /* a failed blit says so, a locked buffer can't be blitted into */
+    blitted.result = -1;
+    send_reply(sv[1], &blitted, sizeof(blitted), -1);
+    assert(MBlitBuffer(&dpy, &buf, &capture, rects, 1) < 0);
+    buf.bits = capture.bits;
+    assert(MBlitBuffer(&dpy, &buf, &capture, rects, 1) < 0);
+    buf.bits = NULL;
+
+    /* nor can nothing, the table stays as it was */
+    assert(MBlitBuffer(&dpy, &buf, &capture, rects, 0) < 0);
+    assert(MBlitBuffer(&dpy, &buf, &capture, rects, -1) < 0);
+    assert(memcmp(&table[0], &rects[0], sizeof(rects[0])) == 0);
+
+    /* the server can refuse a capture */
+    MCapture refused = { 8, 4 };
+    shared.result = -1;
+    send_reply(sv[1], &shared, sizeof(shared), -1);
+    assert(MShareCapture(&dpy, &refused) < 0);
+    assert(refused.bits == NULL && refused.fd == -1);
+
+    /* fds nobody took are closed */
+    assert(mreceiver_fill(&receiver) > 0);
+    assert(receiver.num_fds == 1);
+    mreceiver_release(&receiver);
+    assert(receiver.num_fds == 0);
+
+    MFreeCapture(&capture);
+    assert(capture.bits == NULL && capture.fd == -1);
+    munmap((void *)server, request.size);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+#define CURSOR_STRESS_ITERS (200000)
+
+static XFixesCursorImage stress_cursors[2];
+static int stress_done;
+
+/* main thread side: swap cursor images */
+static void *stress_set_cur(void *arg) {
+    int i;
+    for (i = 0; i < CURSOR_STRESS_ITERS; ++i) {
+        cursor_cache_set_cur(&stress_cursors[i & 1]);
+    }
+    return NULL;
+}
+
+/* motion thread side: move the cursor, always to (i, 2i + 1) */
+static void *stress_set_pos(void *arg) {
+    int i;
+    for (i = 0; i < CURSOR_STRESS_ITERS; ++i) {
+        cursor_cache_set_last_pos(i, 2 * i + 1);
+    }
+    return NULL;
+}
+
+static void *stress_get_state(void *arg) {
+    uint64_t *reads = arg;
+    struct CursorState state;
+    while (!__atomic_load_n(&stress_done, __ATOMIC_ACQUIRE)) {
+        cursor_cache_get_state(&state);
+        if (state.image != NULL) {
+            /* hotspot and serial belong to the image */
+            assert(state.serial == state.image->cursor_serial);
+            assert(state.xhot == state.image->xhot);
+            assert(state.yhot == state.image->yhot);
+        }
+        assert((state.x == -1 && state.y == -1) || state.y == 2 * state.x + 1);
+        ++*reads;
+    }
+    return NULL;
+}
+
+#define QUEUE_STRESS_ITERS (200000)
+#define QUEUE_STRESS_MOVERS (3)
+
+static void *stress_push(void *arg) {
+    struct MQueue *q = arg;
+    int32_t i;
+    for (i = 0; i < QUEUE_STRESS_ITERS; ++i) {
+        MLockBufferRequest lock = { i };
+        assert(mqueue_push(q, M_LOCK_BUFFER, &lock, sizeof(lock)) == 0);
+
+        MUpdateBufferRequest move = { 1000 + i % QUEUE_STRESS_MOVERS, i, 0 };
+        assert(mqueue_push(q, M_UPDATE_BUFFER, &move, sizeof(move)) == 0);
+        if (i % 64 == 0) {
+            mqueue_wake(q);
+        }
+    }
+    assert(mqueue_push(q, M_QUEUE_HANGUP, NULL, 0) == 0);
+    mqueue_wake(q);
+    return NULL;
+}
+
+static void test_mqueue() {
+    struct MQueue q;
+    assert(mqueue_init(&q) == 0);
+
+    /* nothing to do yet */
+    assert(mqueue_wait(&q, 0) == 0);
+
+    MLockBufferRequest lock = { 1 };
+    MSwapBufferRequest swap = { 2 };
+    MUpdateBufferRequest move = { 5, 10, 20 };
+    assert(mqueue_push(&q, M_LOCK_BUFFER, &lock, sizeof(lock)) == 0);
+    assert(mqueue_push(&q, M_UPDATE_BUFFER, &move, sizeof(move)) == 0);
+    move.xpos = 11;
+    assert(mqueue_push(&q, M_UPDATE_BUFFER, &move, sizeof(move)) == 0);
+    move.id = 6;
+    assert(mqueue_push(&q, M_UPDATE_BUFFER, &move, sizeof(move)) == 0);
+    assert(mqueue_push(&q, M_SWAP_BUFFER, &swap, sizeof(swap)) == 0);
+    assert(mqueue_push(&q, M_GET_DISPLAY_INFO, NULL, 0) == 0);
+    assert(mqueue_wait(&q, 0) == 1);
+
+    /* moves skip the line, only the newest per buffer */
+    MUpdateBufferRequest positions[M_QUEUE_POSITIONS];
+    assert(mqueue_take_positions(&q, positions) == 2);
+    assert(positions[0].id == 5 && positions[0].xpos == 11);
+    assert(positions[0].ypos == 20);
+    assert(positions[1].id == 6 && positions[1].xpos == 11);
+    assert(q.coalesced == 1);
+    assert(mqueue_take_positions(&q, positions) == 0);
+
+    /* everything else in order */
+    struct MQueuedRequest req;
+    assert(mqueue_pop(&q, &req) == 1 && req.op == M_LOCK_BUFFER);
+    assert(((MLockBufferRequest *)req.payload)->id == 1);
+    assert(mqueue_pop(&q, &req) == 1 && req.op == M_SWAP_BUFFER);
+    assert(((MSwapBufferRequest *)req.payload)->id == 2);
+    assert(mqueue_pop(&q, &req) == 1 && req.op == M_GET_DISPLAY_INFO);
+    assert(mqueue_pop(&q, &req) == 0);
+
+    /* with the fast lane full, moves wait their turn */
+    int i;
+    for (i = 0; i <= M_QUEUE_POSITIONS; ++i) {
+        move.id = 100 + i;
+        assert(mqueue_push(&q, M_UPDATE_BUFFER, &move, sizeof(move)) == 0);
+    }
+    assert(mqueue_take_positions(&q, positions) == M_QUEUE_POSITIONS);
+
+    /* and later moves can't overtake them through the emptied lane */
+    move.xpos = 12;
+    assert(mqueue_push(&q, M_UPDATE_BUFFER, &move, sizeof(move)) == 0);
+    assert(mqueue_take_positions(&q, positions) == 0);
+    assert(mqueue_pop(&q, &req) == 1 && req.op == M_UPDATE_BUFFER);
+    assert(((MUpdateBufferRequest *)req.payload)->id ==
+        100 + M_QUEUE_POSITIONS);
+    assert(((MUpdateBufferRequest *)req.payload)->xpos == 11);
+    assert(mqueue_pop(&q, &req) == 1 && req.op == M_UPDATE_BUFFER);
+    assert(((MUpdateBufferRequest *)req.payload)->xpos == 12);
+
+    /* until the ring is past them */
+    assert(mqueue_push(&q, M_UPDATE_BUFFER, &move, sizeof(move)) == 0);
+    assert(mqueue_take_positions(&q, positions) == 1);
+
+    /* unless they have to stay in order */
+    move.id = 200;
+    assert(mqueue_push_in_order(&q, M_UPDATE_BUFFER, &move,
+        sizeof(move)) == 0);
+    assert(mqueue_take_positions(&q, positions) == 0);
+    assert(mqueue_pop(&q, &req) == 1 && req.op == M_UPDATE_BUFFER);
+    assert(((MUpdateBufferRequest *)req.payload)->id == 200);
+
+    uint8_t big[M_QUEUE_MAX_PAYLOAD + 1] = { 0 };
+    assert(mqueue_push(&q, M_LOCK_BUFFER, big, sizeof(big)) < 0);
+    assert(mqueue_push(&q, M_UPDATE_BUFFER, big, sizeof(big)) < 0);
+
+    /* a fast producer against a consumer that keeps falling behind */
+    mqueue_destroy(&q);
+    assert(mqueue_init(&q) == 0);
+    pthread_t producer;
+    assert(pthread_create(&producer, NULL, stress_push, &q) == 0);
+
+    int32_t next = 0;
+    int32_t last_x[QUEUE_STRESS_MOVERS] = { -1, -1, -1 };
+    int hangup = 0;
+    while (!hangup) {
+        assert(mqueue_wait(&q, 1000) == 1);
+
+        int n = mqueue_take_positions(&q, positions);
+        for (i = 0; i < n; ++i) {
+            int mover = positions[i].id - 1000;
+            assert(mover >= 0 && mover < QUEUE_STRESS_MOVERS);
+            assert((int32_t)positions[i].xpos > last_x[mover]);
+            last_x[mover] = positions[i].xpos;
+        }
+
+        while (mqueue_pop(&q, &req)) {
+            if (req.op == M_QUEUE_HANGUP) {
+                hangup = 1;
+                break;
+            }
+            assert(req.op == M_LOCK_BUFFER);
+            assert(((MLockBufferRequest *)req.payload)->id == next);
+            ++next;
+        }
+    }
+    pthread_join(producer, NULL);
+    assert(next == QUEUE_STRESS_ITERS);
+
+    /* the last move of each buffer made it */
+    int n = mqueue_take_positions(&q, positions);
+    for (i = 0; i < n; ++i) {
+        last_x[positions[i].id - 1000] = positions[i].xpos;
+    }
+    for (i = 0; i < QUEUE_STRESS_MOVERS; ++i) {
+        int32_t last = QUEUE_STRESS_ITERS - 1;
+        assert(last_x[i] == last - (last - i) % QUEUE_STRESS_MOVERS);
+    }
+    mqueue_destroy(&q);
+}
+
+static void test_cursor_state() {
+    int i;
+    for (i = 0; i < 2; ++i) {
+        stress_cursors[i].cursor_serial = 100 + i;
+        stress_cursors[i].xhot = 3 + i;
+        stress_cursors[i].yhot = 7 + i;
+    }
+
+    struct CursorState state;
+    cursor_cache_get_state(&state);
+    assert(state.image == NULL && state.x == -1 && state.y == -1);
+
+    uint64_t reads[2] = { 0, 0 };
+    pthread_t writers[2], readers[2];
+    for (i = 0; i < 2; ++i) {
+        assert(pthread_create(&readers[i], NULL, stress_get_state,
+            &reads[i]) == 0);
+    }
+    assert(pthread_create(&writers[0], NULL, stress_set_cur, NULL) == 0);
+    assert(pthread_create(&writers[1], NULL, stress_set_pos, NULL) == 0);
+    for (i = 0; i < 2; ++i) {
+        pthread_join(writers[i], NULL);
+    }
+    __atomic_store_n(&stress_done, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < 2; ++i) {
+        pthread_join(readers[i], NULL);
+        assert(reads[i] > 0);
+    }
+
+    /* both writers' last updates made it */
+    cursor_cache_get_state(&state);
+    assert(state.image == &stress_cursors[(CURSOR_STRESS_ITERS - 1) & 1]);
+    assert(state.x == CURSOR_STRESS_ITERS - 1);
+    assert(cursor_cache_get_cur() == state.image);
+
+    cursor_cache_set_cur(NULL);
+    cursor_cache_set_last_pos(-1, -1);
+}
+
+static int queued_events(void *arg) {
+    return *(int *)arg;
+}
+
+static void test_mloop() {
+    struct MLoop loop;
+    assert(mloop_init(&loop) == 0);
+
+    mloop_set_deadline(&loop, monotonic_ns() + 10000000);
+    assert(loop.mDeadline != 0);
+    assert(mloop_wait(&loop) == MLOOP_READY(MLOOP_TIMER));
+    assert(loop.mDeadline == 0);
+
+    /* blocked, so this only shows up on the signalfd */
+    raise(SIGTERM);
+    assert(mloop_wait(&loop) == MLOOP_READY(MLOOP_SIGNAL));
+    assert(loop.mSignal == SIGTERM);
+
+    int sv[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    mloop_watch(&loop, MLOOP_SERVER, sv[0]);
+    close(sv[1]);
+    assert(mloop_wait(&loop) & MLOOP_READY(MLOOP_SERVER));
+    close(sv[0]);
+
+    /* an event already read off an idle fd doesn't wait for the fd */
+    int queued = 1;
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    mloop_watch(&loop, MLOOP_X, sv[0]);
+    mloop_watch(&loop, MLOOP_SERVER, -1);
+    mloop_set_queued(&loop, MLOOP_X, queued_events, &queued);
+    mloop_set_deadline(&loop, monotonic_ns() + 5000000000ull);
+    uint64_t start = monotonic_ns();
+    assert(mloop_wait(&loop) == MLOOP_READY(MLOOP_X));
+    assert(monotonic_ns() - start < 1000000000ull);
+
+    queued = 0;
+    mloop_set_deadline(&loop, monotonic_ns() + 10000000);
+    assert(mloop_wait(&loop) == MLOOP_READY(MLOOP_TIMER));
+    close(sv[0]);
+    close(sv[1]);
+
+    mloop_cleanup(&loop);
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+}
+
+static void send_frame_event(int sock_fd, uint64_t present_ns) {
+    MFramePresentedEvent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = M_FRAME_PRESENTED;
+    ev.present_ns = present_ns;
+    ev.refresh_ns = 16666667;
+    assert(write(sock_fd, &ev, sizeof(ev)) == sizeof(ev));
+}
+
+static void test_events() {
+    int sv[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    MDisplay dpy;
+    memset(&dpy, 0, sizeof(dpy));
+    dpy.sock_fd = sv[0];
+
+    assert(MPending(&dpy) == 0);
+
+    /* an event ahead of a reply is queued up for later */
+    send_frame_event(sv[1], 1000);
+    MGetDisplayInfoResponse info = { 1080, 1920, M_ORIENTATION_90 };
+    send_reply(sv[1], &info, sizeof(info), -1);
+    MDisplayInfo dpy_info;
+    assert(MGetDisplayInfo(&dpy, &dpy_info) == 0);
+    assert(dpy_info.width == 1080);
+    assert(dpy_info.orientation == M_ORIENTATION_90);
+
+    /* the socket is drained, only the queue knows about it */
+    struct pollfd pfd = { sv[0], POLLIN, 0 };
+    assert(poll(&pfd, 1, 0) == 0);
+    assert(MEventsQueued(&dpy) == 1);
+    assert(MPending(&dpy) == 1);
+
+    MEvent ev;
+    assert(MNextEvent(&dpy, &ev) == 0);
+    assert(ev.type == M_FRAME_PRESENTED);
+    assert(ev.frame.present_ns == 1000);
+    assert(ev.frame.refresh_ns == 16666667);
+    assert(MPending(&dpy) == 0);
+    assert(MEventsQueued(&dpy) == 0);
+
+    /* nobody listening, so the oldest events go */
+    uint64_t i;
+    for (i = 0; i < M_EVENT_QUEUE_SIZE + 4; ++i) {
+        send_frame_event(sv[1], i);
+    }
+    assert(MPending(&dpy) == M_EVENT_QUEUE_SIZE);
+    assert(MNextEvent(&dpy, &ev) == 0 && ev.frame.present_ns == 4);
+
+    close(sv[1]);
+    assert(MPending(&dpy) < 0);
+    close(sv[0]);
+}
+
+static void test_display_events() {
+    int sv[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    MDisplay dpy;
+    memset(&dpy, 0, sizeof(dpy));
+    dpy.sock_fd = sv[0];
+
+    assert(MSelectDisplayEvents(&dpy, M_DISPLAY_CHANGED_MASK) == 0);
+    struct {
+        MRequestHeader header;
+        MSelectDisplayEventsRequest request;
+    } packet;
+    assert(recv(sv[1], &packet, sizeof(packet), 0) == sizeof(packet));
+    assert(packet.header.op == M_SELECT_DISPLAY_EVENTS);
+    assert(packet.request.mask == M_DISPLAY_CHANGED_MASK);
+
+    /* mixed in with frame events, each one is read in full */
+    MDisplayChangedEvent changed;
+    memset(&changed, 0, sizeof(changed));
+    changed.type = M_DISPLAY_CHANGED;
+    changed.display = 1;
+    changed.connected = 1;
+    changed.width = 720;
+    changed.height = 1280;
+    changed.orientation = M_ORIENTATION_270;
+    changed.refresh_ns = 33333333;
+    assert(write(sv[1], &changed, sizeof(changed)) == sizeof(changed));
+    send_frame_event(sv[1], 2000);
+    assert(MPending(&dpy) == 2);
+
+    MEvent ev;
+    assert(MNextEvent(&dpy, &ev) == 0);
+    assert(ev.type == M_DISPLAY_CHANGED);
+    assert(ev.display.display == 1 && ev.display.connected == 1);
+    assert(ev.display.width == 720 && ev.display.height == 1280);
+    assert(ev.display.orientation == M_ORIENTATION_270);
+    assert(ev.display.refresh_ns == 33333333);
+    assert(MNextEvent(&dpy, &ev) == 0 && ev.frame.present_ns == 2000);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void test_list_displays() {
+    int sv[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    MDisplay dpy;
+    memset(&dpy, 0, sizeof(dpy));
+    dpy.sock_fd = sv[0];
+
+    MListDisplaysResponse list;
+    memset(&list, 0, sizeof(list));
+    list.count = 2;
+    list.displays[0].width = 1920;
+    list.displays[1].width = 1080;
+    list.displays[1].orientation = M_ORIENTATION_270;
+    send_reply(sv[1], &list, sizeof(list), -1);
+
+    /* the count is what the server has, even if it doesn't all fit */
+    MDisplayInfo info[M_MAX_DISPLAYS];
+    memset(info, 0xff, sizeof(info));
+    assert(MListDisplays(&dpy, info, 1) == 2);
+    assert(info[0].id == M_DEFAULT_DISPLAY && info[0].width == 1920);
+    assert(info[1].id == 0xffffffff);
+
+    send_reply(sv[1], &list, sizeof(list), -1);
+    assert(MListDisplays(&dpy, info, M_MAX_DISPLAYS) == 2);
+    assert(info[1].id == 1 && info[1].width == 1080);
+    assert(info[1].orientation == M_ORIENTATION_270);
+
+    /* the display travels with the create request */
+    MBuffer buf = { 0 };
+    buf.width = buf.height = 16;
+    buf.display = 1;
+    MCreateBufferResponse created = { 7, 0 };
+    send_reply(sv[1], &created, sizeof(created), -1);
+    assert(MCreateBuffer(&dpy, &buf) == 0);
+
+    uint8_t req[64];
+    ssize_t n = recv(sv[1], req, sizeof(req), 0);
+    assert(n >= (ssize_t)sizeof(MCreateBufferRequest));
+    MCreateBufferRequest create;
+    memcpy(&create, req + n - sizeof(create), sizeof(create));
+    assert(create.display == 1);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void test_session() {
+    int sv[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    MDisplay dpy;
+    memset(&dpy, 0, sizeof(dpy));
+    dpy.sock_fd = sv[0];
+
+    MBuffer root = { 0 }, cursor = { 0 };
+    MBuffer *bufs[2] = { &root, &cursor };
+    struct {
+        MRequestHeader header;
+        MResumeSessionRequest request;
+    } packet;
+
+    /* nothing to resume, the server hands out a token */
+    MSession session;
+    memset(&session, 0, sizeof(session));
+    MResumeSessionResponse response;
+    memset(&response, 0, sizeof(response));
+    response.token = 0x123456789abcdefull;
+    send_reply(sv[1], &response, sizeof(response), -1);
+    assert(MResumeSession(&dpy, &session, bufs, 2) == 0);
+    assert(session.token == 0x123456789abcdefull);
+    assert(recv(sv[1], &packet, sizeof(packet), 0) == sizeof(packet));
+    assert(packet.header.op == M_RESUME_SESSION);
+    assert(packet.request.token_lo == 0 && packet.request.token_hi == 0);
+    assert(packet.request.count == 0);
+
+    root.__id = 7;
+    cursor.__id = 9;
+    MUpdateSession(&session, bufs, 2);
+    assert(session.count == 2);
+    assert(session.ids[0] == 7 && session.ids[1] == 9);
+
+    /* survives a restart through XDG_RUNTIME_DIR */
+    char dir[] = "/tmp/session-test-XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    setenv("XDG_RUNTIME_DIR", dir, 1);
+    MSession loaded;
+    assert(msession_load(&loaded) == 0 && loaded.token == 0);
+    assert(msession_save(&session) == 0);
+    assert(msession_load(&loaded) == 0);
+    assert(loaded.token == session.token && loaded.count == 2);
+    assert(loaded.ids[0] == 7 && loaded.ids[1] == 9);
+
+    /* only the root buffer is still there */
+    MBuffer new_root = { 0 }, new_cursor = { 0 };
+    new_cursor.width = 24;
+    bufs[0] = &new_root;
+    bufs[1] = &new_cursor;
+    response.resumed = 1 << 0;
+    response.buffers[0].width = 1920;
+    response.buffers[0].height = 1080;
+    response.buffers[0].display = 1;
+    send_reply(sv[1], &response, sizeof(response), -1);
+    assert(MResumeSession(&dpy, &loaded, bufs, 2) == 1);
+    assert(recv(sv[1], &packet, sizeof(packet), 0) == sizeof(packet));
+    assert(packet.request.token_lo == 0x89abcdef);
+    assert(packet.request.token_hi == 0x01234567);
+    assert(packet.request.count == 2);
+    assert(packet.request.ids[0] == 7 && packet.request.ids[1] == 9);
+    assert(new_root.__id == 7 && new_root.bits == NULL);
+    assert(new_root.width == 1920 && new_root.height == 1080);
+    assert(new_root.display == 1);
+    assert(new_cursor.__id == 0 && new_cursor.width == 24);
+
+    /* a session file with more ids than buffers only asks for those */
+    MSession edited = loaded;
+    edited.count = M_SESSION_MAX_BUFFERS;
+    response.resumed = (1u << M_SESSION_MAX_BUFFERS) - 1;
+    send_reply(sv[1], &response, sizeof(response), -1);
+    MBuffer *one[1] = { &new_root };
+    assert(MResumeSession(&dpy, &edited, one, 1) == 1);
+    assert(recv(sv[1], &packet, sizeof(packet), 0) == sizeof(packet));
+    assert(packet.request.count == 1);
+
+    /* a server that can't keep sessions */
+    response.token = 0;
+    send_reply(sv[1], &response, sizeof(response), -1);
+    assert(MResumeSession(&dpy, &loaded, bufs, 2) < 0);
+    assert(recv(sv[1], &packet, sizeof(packet), 0) == sizeof(packet));
+    assert(loaded.token == 0x123456789abcdefull);
+
+    assert(MEndSession(&dpy) == 0);
+    MRequestHeader header;
+    assert(recv(sv[1], &header, sizeof(header), 0) == sizeof(header));
+    assert(header.op == M_END_SESSION);
+
+    msession_clear();
+    assert(msession_load(&loaded) == 0 && loaded.token == 0);
+    assert(rmdir(dir) == 0);
+    unsetenv("XDG_RUNTIME_DIR");
+    assert(msession_load(&loaded) < 0);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/**
+ * Run a @param frames capture window that uses @param cpu_ms, captures
+ * evenly spread, and close it.
+ */
+static int rate_window(struct RateController *c, uint64_t *now,
+        uint64_t *cpu, uint32_t frames, uint64_t cpu_ms) {
+    uint32_t i;
+    for (i = 0; i < frames; ++i) {
+        uint64_t start = *now + i * (RATE_CONTROLLER_WINDOW_NS / frames);
+        rate_controller_on_render(c, start, start + 2000000);
+    }
+    *now += RATE_CONTROLLER_WINDOW_NS;
+    *cpu += cpu_ms * 1000000;
+    return rate_controller_update(c, *now, *cpu);
+}
+
+static void test_rate_controller() {
+    const uint64_t ms = 1000000;
+    uint64_t now = 1000 * ms, cpu = 0;
+    struct RateController c;
+
+    /* no limit: nothing is held back, but CPU use is still measured */
+    rate_controller_init(&c, 0, now, cpu);
+    assert(rate_controller_next_render(&c, now) == now);
+    assert(rate_window(&c, &now, &cpu, 100, 900) == 0);
+    assert(c.cpu_percent == 90 && c.interval == 0);
+    assert(rate_controller_next_render(&c, now) == now);
+
+    rate_controller_init(&c, 50, now, cpu);
+
+    /* the window isn't over yet */
+    assert(rate_controller_update(&c, now + 500 * ms, cpu + 900 * ms) == 0);
+
+    /* 80% at 8 ms a frame, 16 ms apart fits 50% */
+    assert(rate_window(&c, &now, &cpu, 100, 800) == 1);
+    assert(c.cpu_percent == 80 && c.interval == 16 * ms);
+    assert(c.throttles == 1 && c.frames == 100);
+    assert(c.render_cost == 2 * ms);
+    assert(rate_controller_next_render(&c, now) == c.last_render + 16 * ms);
+
+    /* right at the budget, stay put */
+    assert(rate_window(&c, &now, &cpu, 60, 500) == 0);
+    assert(c.interval == 16 * ms);
+
+    /* well under, back off a quarter */
+    assert(rate_window(&c, &now, &cpu, 30, 200) == 1);
+    assert(c.interval == 12 * ms && c.recoveries == 1);
+
+    /* way over, but never below 5 fps */
+    assert(rate_window(&c, &now, &cpu, 10, 1000) == 1);
+    assert(c.interval == RATE_CONTROLLER_MAX_INTERVAL_NS);
+    assert(rate_window(&c, &now, &cpu, 5, 1000) == 0);
+    assert(c.throttles == 2);
+
+    /* over budget with cheap frames still at least doubles */
+    rate_controller_init(&c, 50, now, cpu);
+    assert(rate_window(&c, &now, &cpu, 100, 600) == 1);
+    assert(c.interval == 12 * ms);
+    assert(rate_window(&c, &now, &cpu, 50, 600) == 1);
+    assert(c.interval == 24 * ms);
+
+    /* nothing captured, the load is gone */
+    assert(rate_window(&c, &now, &cpu, 0, 10) == 1);
+    assert(c.interval == 0 && c.recoveries == 1);
+
+    /* creeping back under the minimum lifts the cap too */
+    c.interval = RATE_CONTROLLER_MIN_INTERVAL_NS + 1;
+    assert(rate_window(&c, &now, &cpu, 100, 100) == 1);
+    assert(c.interval == 0);
+}
+
+static void test_frame_pacer() {
+    const uint64_t ms = 1000000;
+    const uint64_t refresh = 16 * ms;
+    struct FramePacer p;
+    frame_pacer_init(&p);
+
+    /* no feedback, no waiting */
+    assert(frame_pacer_next_render(&p, 5 * ms) == 5 * ms);
+    frame_pacer_on_render(&p, 5 * ms, 7 * ms);
+    assert(frame_pacer_next_render(&p, 8 * ms) == 8 * ms);
+
+    /* first feedback: vsyncs at 100 + k * 16 ms, renders cost 2 ms */
+    frame_pacer_on_present(&p, 100 * ms, refresh);
+    assert(frame_pacer_next_render(&p, 105 * ms) == 116 * ms - 3 * ms);
+    assert(frame_pacer_next_render(&p, 114 * ms) == 132 * ms - 3 * ms);
+
+    /* nothing new until the posted frame is presented or given up on */
+    frame_pacer_on_render(&p, 113 * ms, 115 * ms);
+    assert(frame_pacer_next_render(&p, 120 * ms) ==
+        115 * ms + FRAME_PACER_LOST_PERIODS * refresh);
+    frame_pacer_on_present(&p, 132 * ms, refresh);
+    assert(frame_pacer_next_render(&p, 133 * ms) == 148 * ms - 3 * ms);
+    assert(p.frames == 2 && p.lost == 0);
+
+    /* a frame that never shows up */
+    frame_pacer_on_render(&p, 145 * ms, 147 * ms);
+    uint64_t give_up = frame_pacer_next_render(&p, 150 * ms);
+    assert(give_up == 147 * ms + FRAME_PACER_LOST_PERIODS * refresh);
+    assert(frame_pacer_next_render(&p, give_up) <= give_up + refresh);
+    frame_pacer_on_render(&p, give_up, give_up + 2 * ms);
+    assert(p.lost == 1);
+}
+
+static void test_cursor_predictor() {
+    struct CursorPredictor p;
+    cursor_predictor_init(&p);
+    int x, y;
+
+    /* one sample, nothing to extrapolate */
+    cursor_predictor_add(&p, 1000, 10, 100);
+    cursor_predictor_predict(&p, 16, &x, &y);
+    assert(x == 10 && y == 100);
+
+    /* steady 1 px/ms to the right */
+    cursor_predictor_add(&p, 1008, 18, 100);
+    cursor_predictor_add(&p, 1016, 26, 100);
+    cursor_predictor_add(&p, 1024, 34, 100);
+    cursor_predictor_predict(&p, 16, &x, &y);
+    assert(x == 50 && y == 100);
+    cursor_predictor_predict(&p, 0, &x, &y);
+    assert(x == 34 && y == 100);
+
+    /* two events in the same ms count as one */
+    cursor_predictor_add(&p, 1032, 41, 100);
+    cursor_predictor_add(&p, 1032, 42, 100);
+    assert(p.count == CURSOR_PREDICTOR_HISTORY);
+    cursor_predictor_predict(&p, 8, &x, &y);
+    assert(x == 50);
+
+    /* turning around drops the old motion */
+    cursor_predictor_add(&p, 1040, 38, 100);
+    assert(p.count == 2);
+    cursor_predictor_predict(&p, 16, &x, &y);
+    assert(x == 30 && y == 100);
+
+    /* so does stopping for a while, and the clock going backwards */
+    cursor_predictor_add(&p, 1040 + CURSOR_PREDICTOR_MAX_GAP_MS + 1, 50, 60);
+    assert(p.count == 1);
+    cursor_predictor_add(&p, 500, 50, 60);
+    assert(p.count == 1);
+
+    /* never more than CURSOR_PREDICTOR_MAX_PX ahead */
+    cursor_predictor_init(&p);
+    cursor_predictor_add(&p, 0, 500, 500);
+    cursor_predictor_add(&p, 8, 420, 500);
+    cursor_predictor_predict(&p, 16, &x, &y);
+    assert(x == 420 - CURSOR_PREDICTOR_MAX_PX && y == 500);
+
+    /* speeding up leads further than the velocity alone... */
+    cursor_predictor_init(&p);
+    cursor_predictor_add(&p, 0, 0, 0);
+    cursor_predictor_add(&p, 8, 8, 0);
+    cursor_predictor_add(&p, 16, 24, 0);
+    cursor_predictor_add(&p, 24, 48, 0);
+    cursor_predictor_predict(&p, 8, &x, &y);
+    assert(x > 48 + 20 && x <= 48 + 40 && y == 0);
+
+    /* ...but slowing down only ever stops it */
+    cursor_predictor_init(&p);
+    cursor_predictor_add(&p, 0, 0, 0);
+    cursor_predictor_add(&p, 8, 20, 0);
+    cursor_predictor_add(&p, 16, 30, 0);
+    cursor_predictor_add(&p, 24, 32, 0);
+    cursor_predictor_predict(&p, 16, &x, &y);
+    assert(x >= 32 && x <= 32 + 12);
+}
+
 int main() {
     test_argb8888_get_alpha();
+    test_box_downsample_32();
+    test_copy_cursor_32();
+    test_pixel_converter();
+    test_rect();
+    test_overlay_detector();
+    test_mtrace();
+    test_damage_stats();
+    test_scroll_tracker();
+    test_mreceiver();
+    test_mqueue();
+    test_buffer_slots();
+    test_server_blit();
+    test_mloop();
+    test_cursor_state();
+    test_events();
+    test_display_events();
+    test_list_displays();
+    test_session();
+    test_frame_pacer();
+    test_rate_controller();
+    test_cursor_predictor();
 
     printf("All tests passed.\n");
     return 0;